@@ -3,10 +3,97 @@
 ///////////////////////////////////////////////////////////////////////////////
 // Renderer
 
+// Integrator used by the renderer: PathIntegrator, ReSTIRIntegrator, GuidedIntegrator, BDPTIntegrator, CachedIntegrator
+// or IrradianceCacheIntegrator
+#define PBR_ACTIVE_INTEGRATOR PathIntegrator
+
 #define PBR_MAX_RECURSION_DEPTH 4
 #define PBR_SAMPLES_PER_PIXEL 8
 
+// Rays traced one by one are accumulated in square tiles of this many pixels across, a power of
+// two, with the pixels of a tile in rows or along a Morton curve (TileOrder::Rows or ::Morton).
+// 0 to accumulate in rows of the image.
+#define PBR_TILE_SIZE 16
+#define PBR_TILE_ORDER TileOrder::Rows
+
+// Seed of the random numbers of a render, 0 for a new one each time. A render with the same seed,
+// scene and settings gives the same image.
+#define PBR_SEED 0
+
+// Radiance returned by paths that reach PBR_MAX_RECURSION_DEPTH
+#define PBR_TERMINAL_RADIANCE PBR_COLOR_WHITE
+
+// Next-event estimation: sample a light at each bounce and combine it with BRDF sampling through MIS
+#define PBR_LIGHT_SAMPLING 1
+
+// How a light is picked for next-event estimation: LightSelection::Uniform, ::Power or ::BVH
+#define PBR_LIGHT_SELECTION LightSelection::BVH
+
+// Probability of sampling the environment instead of an actor for next-event estimation
+#define PBR_ENVIRONMENT_LIGHT_PROBABILITY 0.5
+
+// MIS weights: 1 for the power heuristic (beta = 2), 0 for the balance heuristic
+#define PBR_MIS_POWER_HEURISTIC 1
+
+// ReSTIR direct lighting (ReSTIRIntegrator): light samples per pixel per pass and how they are
+// picked, reuse of the previous pass' reservoirs (their M capped at HISTORY_LIMIT * CANDIDATES)
+// and of neighbouring pixels within RADIUS pixels
+#define PBR_RESTIR_CANDIDATES 32
+#define PBR_RESTIR_CANDIDATE_SELECTION LightSelection::Power
+#define PBR_RESTIR_TEMPORAL_REUSE 1
+#define PBR_RESTIR_HISTORY_LIMIT 20
+#define PBR_RESTIR_SPATIAL_NEIGHBOURS 4
+#define PBR_RESTIR_SPATIAL_RADIUS 16
+
+// Path guiding (GuidedIntegrator): probability of sampling the BRDF instead of the learned
+// distribution, the spatial split threshold (times sqrt(spp) of the iteration), the share of a
+// quadtree's energy above which a direction quadrant is split, and how many vertices per path
+// record radiance
+#define PBR_GUIDING_BRDF_FRACTION 0.5
+#define PBR_GUIDING_SPATIAL_THRESHOLD 12000
+#define PBR_GUIDING_DIRECTIONAL_THRESHOLD 0.01
+#define PBR_GUIDING_MAX_VERTICES 16
+
+// Caustic photons (PathIntegrator): photons emitted from the lights towards mirrors and clear
+// glass before rendering (0 leaves caustics to path tracing, 250000 is a good start), the memory
+// budget of the stored photons, and how many of the nearest photons within a radius estimate the
+// irradiance at one in PBR_CAUSTIC_IRRADIANCE_STRIDE of them. The first diffuse hit of each path
+// looks up the nearest. Off by default: on the Cornell box they cost more time than they save.
+#define PBR_CAUSTIC_PHOTONS 0
+#define PBR_CAUSTIC_MEMORY_MB 64
+#define PBR_CAUSTIC_GATHER_COUNT 64
+#define PBR_CAUSTIC_GATHER_RADIUS 0.25
+#define PBR_CAUSTIC_IRRADIANCE_STRIDE 4
+
+// Radiance cache (CachedIntegrator): side of the world-space cells that diffuse light is averaged
+// over, slots of the hash table (40 bytes each), samples a slot needs before paths end there and
+// how many of them its mean keeps the weight of, the depth of the first vertex that may end its
+// path at the cache (2 after the second bounce) and the fraction of paths traced in full to fill it
+#define PBR_RADIANCE_CACHE_CELL_SIZE 0.1
+#define PBR_RADIANCE_CACHE_ENTRIES (1 << 17)
+#define PBR_RADIANCE_CACHE_MIN_SAMPLES 8
+#define PBR_RADIANCE_CACHE_HISTORY 1024
+#define PBR_RADIANCE_CACHE_QUERY_DEPTH 2
+#define PBR_RADIANCE_CACHE_UPDATE_FRACTION 0.0625
+
+// Irradiance cache (IrradianceCacheIntegrator): Ward's error limit of the records used (which also
+// spaces them), the rings of the stratified hemisphere of a record (pi times as many sectors), and
+// the smallest and largest radius of a record in scene units. Records seen from the camera also
+// cover at least PBR_IRRADIANCE_CACHE_MIN_PIXELS pixels, so their number follows the resolution.
+#define PBR_IRRADIANCE_CACHE_ERROR 0.2
+#define PBR_IRRADIANCE_CACHE_THETAS 16
+#define PBR_IRRADIANCE_CACHE_MIN_RADIUS 0.05
+#define PBR_IRRADIANCE_CACHE_MAX_RADIUS 2.0
+#define PBR_IRRADIANCE_CACHE_MIN_PIXELS 3
+
+// Ray differentials: follow the footprint of camera rays to pick texture mip levels. Bounces off
+// lobes that are not deltas widen it by at least PBR_DIFFUSE_CONE_SPREAD radians (GGX alpha for
+// rough metal and glass).
+#define PBR_RAY_DIFFERENTIALS 1
+#define PBR_DIFFUSE_CONE_SPREAD 0.2
+
 #define PBR_STRATIFIED_SAMPLE 1
+// 1 logs once per render, 2 also every pass and checkpoint
 #define PBR_DEBUG_LEVEL 1
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -31,12 +118,65 @@
 
 #define PBR_BACKGROUND_COLOR PBR_COLOR_BLACK
 
+// Lat-long Radiance HDR image lighting the scene instead of PBR_BACKGROUND_COLOR, empty for none
+#define PBR_ENVIRONMENT_MAP ""
+
+// Textures: side of a tile in texels for new tiled texture files, and the size and number of
+// independently locked shards of the tile cache
+#define PBR_TEXTURE_TILE_SIZE 64
+#define PBR_TEXTURE_CACHE_SIZE_MB 256
+#define PBR_TEXTURE_CACHE_SHARDS 16
+
 ///////////////////////////////////////////////////////////////////////////////
 // Output
 
 #define PBR_OUTPUT_IMAGE_COLUMNS 1280
 #define PBR_OUTPUT_IMAGE_ROWS    720
+
+// Rectangles of the image to render again, { col, row, cols, rows } from the lower left, e.g.
+// { { 600, 300, 64, 64 } }, into the earlier render read from PBR_OUTPUT_HDR_NAME. It needs the same
+// camera and settings, and the outputs are written again. Empty to render the whole image.
+#define PBR_CROP_REGIONS {}
+
+// Linear HDR image, .pfm or .exr, and the image tonemapped to 8-bit PNG. Empty to skip either.
+#define PBR_OUTPUT_HDR_NAME "out.exr"
 #define PBR_OUTPUT_IMAGE_NAME "out.png"
+
+// Tonemapping of the PNG: exposure in stops, the curve (Tonemap::Clamp, ::Filmic or ::ACES) and
+// whether to dither the 8-bit steps
+#define PBR_POST_EXPOSURE 0.0
+#define PBR_POST_TONEMAP Tonemap::Clamp
+#define PBR_POST_DITHER 1
+
+// Rows of the PNG deflated together, strips are encoded in parallel and as soon as they are rendered
+#define PBR_PNG_STRIP_ROWS 64
+
+// Denoising of the render (see Denoiser), guided by what the camera rays hit first, sampled this
+// many times per pixel. The denoised image goes to its own HDR and PNG outputs (empty to skip
+// either), the outputs above keep the render as it is.
+#define PBR_DENOISE 0
+#define PBR_DENOISE_FEATURE_SAMPLES 4
+#define PBR_OUTPUT_DENOISED_HDR_NAME "out.denoised.exr"
+#define PBR_OUTPUT_DENOISED_IMAGE_NAME "out.denoised.png"
+
+// Iterations of the filter, and how fast a tap's weight falls with the difference of luminance (in
+// standard deviations of the noise), normal (a power of the cosine) and depth (in pixel-to-pixel changes)
+#define PBR_DENOISE_ITERATIONS 5
+#define PBR_DENOISE_SIGMA_LUMINANCE 6.0
+#define PBR_DENOISE_NORMAL_POWER 128.0
+#define PBR_DENOISE_SIGMA_DEPTH 1.0
+
+// Light of each group of lights, direct and indirect, for pbr-relight to rescale without rendering
+// again (see LightPathBuffers). Empty to skip. Groups are the emitting actors and the environment,
+// or the emissive materials and the environment. PBR_TERMINAL_RADIANCE and the caches are not from
+// any group and keep their brightness.
+#define PBR_OUTPUT_LIGHT_PATHS_NAME ""
+#define PBR_LIGHT_GROUPS_BY_MATERIAL 0
+
+// State of the render, saved between passes at most this often, for pbr --resume to continue it
+// after it is stopped (see Checkpoint). Removed once the render is written. Empty to skip.
+#define PBR_CHECKPOINT_NAME "out.checkpoint"
+#define PBR_CHECKPOINT_INTERVAL_SECONDS 60.0
 #define PBR_USE_THREADS 1
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,77 @@
+#include "alias_table.h"
+
+namespace pbr
+{
+    void AliasTable::build(const std::vector<double>& weights)
+    {
+        bins.clear();
+
+        double total = 0;
+        for (double w : weights) total += w;
+        if (!(total > 0)) return;
+
+        size_t n = weights.size();
+        bins.resize(n);
+
+        // Split the bins into those below and above the average
+        std::vector<size_t> small, large;
+        std::vector<double> scaled(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            bins[i].pmf = weights[i] / total;
+            scaled[i] = bins[i].pmf * n;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+
+        // Fill each small bin with the excess of a large one
+        while (!small.empty() && !large.empty())
+        {
+            size_t s = small.back(); small.pop_back();
+            size_t l = large.back(); large.pop_back();
+
+            bins[s].q = scaled[s];
+            bins[s].alias = l;
+
+            scaled[l] = (scaled[l] + scaled[s]) - 1;
+            (scaled[l] < 1 ? small : large).push_back(l);
+        }
+
+        // What is left is (up to rounding) exactly full
+        for (size_t i : large) bins[i] = { 1, bins[i].pmf, i };
+        for (size_t i : small) bins[i] = { 1, bins[i].pmf, i };
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("core::AliasTable")
+    {
+        std::vector<double> weights { 1, 0, 3, 0.5, 5.5 };
+        AliasTable table(weights);
+        REQUIRE(table.size() == weights.size());
+
+        CHECK(table.pmf(0) == doctest::Approx(0.1));
+        CHECK(table.pmf(1) == 0);
+        CHECK(table.pmf(4) == doctest::Approx(0.55));
+
+        // Sweep u over [0, 1) and compare the frequencies with the pmf
+        constexpr int N = 100000;
+        std::vector<int> counts(weights.size());
+        int pmf_mismatches = 0;
+        for (int i = 0; i < N; ++i)
+        {
+            double pmf;
+            size_t index = table.sample((i + 0.5) / N, pmf);
+            if (pmf != table.pmf(index)) ++pmf_mismatches;
+            counts[index]++;
+        }
+        CHECK(pmf_mismatches == 0);
+        for (size_t i = 0; i < weights.size(); ++i)
+        {
+            CHECK(counts[i] / double(N) == doctest::Approx(table.pmf(i)).epsilon(1e-3));
+        }
+
+        CHECK(AliasTable(std::vector<double> { 0, 0 }).empty());
+    }
+}
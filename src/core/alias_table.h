@@ -0,0 +1,57 @@
+#pragma once
+
+#include "base.h"
+
+namespace pbr
+{
+    /*!
+    * @brief Discrete distribution with O(1) sampling (Walker/Vose alias method)
+    *
+    * Each of the n bins holds a probability q and an alias. A sample picks a bin uniformly and
+    * returns the bin itself with probability q, otherwise its alias.
+    */
+    class AliasTable
+    {
+    public:
+        AliasTable() = default;
+        explicit AliasTable(const std::vector<double>& weights) { build(weights); }
+
+        /** Build the table from non-negative weights. All-zero weights give an empty table. */
+        void build(const std::vector<double>& weights);
+
+        /*!
+        * @brief Sample an index
+        *
+        * @param u Uniform random number in [0, 1)
+        * @param out_pmf Probability of the returned index
+        * @return size_t Sampled index
+        */
+        size_t sample(double u, double& out_pmf) const
+        {
+            double scaled = u * bins.size();
+            size_t index = std::min(static_cast<size_t>(scaled), bins.size() - 1);
+            double coin = scaled - index;
+
+            const Bin& bin = bins[index];
+            size_t result = coin < bin.q ? index : bin.alias;
+            out_pmf = bins[result].pmf;
+            return result;
+        }
+
+        /** Probability of sampling an index. */
+        double pmf(size_t index) const { return bins[index].pmf; }
+
+        size_t size() const { return bins.size(); }
+        bool empty() const { return bins.empty(); }
+
+    private:
+        struct Bin
+        {
+            double q;
+            double pmf;
+            size_t alias;
+        };
+
+        std::vector<Bin> bins;
+    };
+}
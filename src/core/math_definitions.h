@@ -66,6 +66,12 @@ namespace pbr
         {
             return (x == other.x) && (y == other.y) && (z == other.z);
         }
+
+        /** Component by axis index: 0 for x, 1 for y, 2 for z. */
+        inline Type operator[](int axis) const
+        {
+            return axis == 0 ? x : axis == 1 ? y : z;
+        }
     };
 
     struct Point2D
@@ -86,6 +92,13 @@ namespace pbr
         Direction direction;
     };
 
+    /** Rays offset by one pixel in x and y (or along the edges of a cone), followed next to a ray to size its footprint. */
+    struct RayDifferential
+    {
+        Point rx_origin, ry_origin;
+        Direction rx_direction, ry_direction;
+    };
+
     struct Basis
     {
         Vec u, v, w;
@@ -137,6 +150,85 @@ namespace pbr
         return (x < min) ? min : (x > max) ? max : x;
     }
 
+    /** Component-wise minimum of two vectors. */
+    inline Vec vmin(const Vec& a, const Vec& b)
+    {
+        return { std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z) };
+    }
+
+    /** Component-wise maximum of two vectors. */
+    inline Vec vmax(const Vec& a, const Vec& b)
+    {
+        return { std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z) };
+    }
+
+    /** Axis-aligned bounding box. A default constructed box is empty. */
+    struct Bounds
+    {
+        Vec min { PBR_INF };
+        Vec max { -PBR_INF };
+
+        bool empty() const { return min.x > max.x; }
+
+        void extend(const Vec& p)
+        {
+            min = vmin(min, p);
+            max = vmax(max, p);
+        }
+
+        void extend(const Bounds& b)
+        {
+            min = vmin(min, b.min);
+            max = vmax(max, b.max);
+        }
+
+        Vec diagonal() const { return max - min; }
+        Vec center() const { return (min + max) * 0.5; }
+
+        double surface_area() const
+        {
+            Vec d = diagonal();
+            return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+        }
+
+        /** Index of the longest axis. */
+        int max_axis() const
+        {
+            Vec d = diagonal();
+            return (d.x > d.y && d.x > d.z) ? 0 : (d.y > d.z ? 1 : 2);
+        }
+
+        static Bounds around_sphere(const Vec& center, double radius)
+        {
+            return { center - Vec { radius }, center + Vec { radius } };
+        }
+    };
+
+    /** Build an orthonormal basis with w along the unit vector n (Duff et al. 2017, no singularity at the poles). */
+    inline Basis make_basis(const Vec& n)
+    {
+        double sign = std::copysign(1.0, n.z);
+        double a = -1.0 / (sign + n.z);
+        double b = n.x * n.y * a;
+        return {
+            Vec { 1 + sign * n.x * n.x * a, sign * b, -sign * n.x },
+            Vec { b, sign + n.y * n.y * a, -n.y },
+            n
+        };
+    }
+
+    /** Express a world-space vector in the coordinates of a basis. */
+    inline Vec to_local(const Basis& b, const Vec& v)
+    {
+        return { dot(v, b.u), dot(v, b.v), dot(v, b.w) };
+    }
+
+    /** Express a vector given in the coordinates of a basis in world space. */
+    inline Vec to_world(const Basis& b, const Vec& v)
+    {
+        return b.u * v.x + b.v * v.y + b.w * v.z;
+    }
+
     inline std::pair<double, double> to_polar_hemisphere(const Vec& direction, const Vec& zaxis)
     {
         // Generate basis for normal
@@ -162,6 +254,20 @@ namespace pbr
     // Random
     ///////////////////////////////////////////////////////////////////////////////
 
+    /*!
+    * @brief Seed of one of the independent sequences drawn from a seed
+    *
+    * Mixes the two with the SplitMix64 finalizer, so that neighbouring streams (the tiles of a pass,
+    * the chunks of photons) get unrelated seeds.
+    */
+    inline uint64_t stream_seed(uint64_t seed, uint64_t stream)
+    {
+        uint64_t z = seed + (stream + 1) * 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
     struct UniformRNG
     {
         inline double sample()
@@ -195,14 +301,19 @@ namespace pbr
             };
         }
 
+        /** Seeded from the system, different every time */
         UniformRNG()
-            : dist(0.0, 1.0)
+            : gen(std::random_device {}()), dist(0.0, 1.0)
+        {
+        }
+
+        /** The same sequence for the same seed, see stream_seed() */
+        explicit UniformRNG(uint64_t seed)
+            : gen(static_cast<std::mt19937::result_type>(seed ^ (seed >> 32))), dist(0.0, 1.0)
         {
-            gen = std::mt19937(rd());
         }
 
     private:
-        std::random_device rd;
         std::mt19937 gen;
         std::uniform_real_distribution<> dist;
     };
@@ -216,6 +327,25 @@ namespace pbr
         CHECK(PBR_INF == 1e20);
     }
 
+    TEST_CASE("math::make_basis")
+    {
+        for (Vec n : { Vec { 0, 1, 0 }, Vec { 0, 0, -1 }, normalize(Vec { 1, -2, 3 }) })
+        {
+            Basis b = make_basis(n);
+            CHECK(dot(b.u, b.v) == doctest::Approx(0));
+            CHECK(dot(b.u, b.w) == doctest::Approx(0));
+            CHECK(dot(b.v, b.w) == doctest::Approx(0));
+            CHECK(b.u.len() == doctest::Approx(1));
+            CHECK(b.v.len() == doctest::Approx(1));
+
+            Vec v { 0.3, -0.5, 0.7 };
+            Vec round_trip = to_world(b, to_local(b, v));
+            CHECK(round_trip.x == doctest::Approx(v.x));
+            CHECK(round_trip.y == doctest::Approx(v.y));
+            CHECK(round_trip.z == doctest::Approx(v.z));
+        }
+    }
+
     TEST_CASE("math::to_polar_hemisphere")
     {
         Vec normal { 0., 1., 0. };
@@ -0,0 +1,156 @@
+#include "checkpoint.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+namespace pbr
+{
+    /** Start of a checkpoint file, then a version that changes with the layout */
+    static constexpr char MAGIC[8] = { 'P', 'B', 'R', 'C', 'H', 'K', 'P', 'T' };
+    static constexpr uint32_t VERSION = 1;
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // File: the magic and version, rows, columns, tile size, tile order and passes
+    // as uint32, the seed as uint64, the sums of each pixel as 3 doubles, then
+    // the sample count of each pixel as uint32, all little-endian.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    void Checkpoint::write(const std::string& path) const
+    {
+        const std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary);
+            if (!out) throw std::runtime_error("Cannot write checkpoint " + temporary);
+
+            auto put = [&](auto value) { out.write(reinterpret_cast<const char*>(&value), sizeof value); };
+            out.write(MAGIC, sizeof MAGIC);
+            put(VERSION);
+            put(static_cast<uint32_t>(sums.rows()));
+            put(static_cast<uint32_t>(sums.cols()));
+            put(static_cast<uint32_t>(tile_size));
+            put(static_cast<uint32_t>(tile_order));
+            put(static_cast<uint32_t>(passes));
+            put(seed);
+            for (const Colorf& sum : sums.pixels())
+            {
+                for (int c = 0; c < 3; ++c) put(sum[c]);
+            }
+            out.write(reinterpret_cast<const char*>(counts.data()), counts.size() * sizeof(uint32_t));
+            if (!out.flush()) throw std::runtime_error("Cannot write checkpoint " + temporary);
+        }
+
+        if (std::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("Cannot replace checkpoint " + path);
+        }
+    }
+
+    Checkpoint Checkpoint::read(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) throw std::runtime_error("Cannot read checkpoint " + path);
+
+        auto get = [&](auto& value) {
+            if (!in.read(reinterpret_cast<char*>(&value), sizeof value)) throw std::runtime_error("Truncated checkpoint " + path);
+        };
+        char magic[sizeof MAGIC];
+        uint32_t version, rows, cols, tile_size, tile_order, passes;
+        if (!in.read(magic, sizeof magic) || std::memcmp(magic, MAGIC, sizeof MAGIC) != 0)
+        {
+            throw std::runtime_error("Not a checkpoint " + path);
+        }
+        get(version);
+        if (version != VERSION) throw std::runtime_error("Unsupported checkpoint version " + path);
+        get(rows);
+        get(cols);
+        get(tile_size);
+        get(tile_order);
+        get(passes);
+
+        // The header has to fit the file before the pixels are allocated: a seed, then 3 doubles and a count per pixel
+        const auto start = in.tellg();
+        in.seekg(0, std::ios::end);
+        const uint64_t remaining = static_cast<uint64_t>(in.tellg() - start);
+        in.seekg(start);
+        constexpr uint64_t PIXEL_SIZE = 3 * sizeof(double) + sizeof(uint32_t);
+        const auto limit = static_cast<uint32_t>(std::numeric_limits<int>::max());
+        if (rows > limit || cols > limit || tile_size > limit || passes > limit || tile_order > static_cast<uint32_t>(TileOrder::Morton) ||
+            remaining < sizeof(uint64_t) || (remaining - sizeof(uint64_t)) % PIXEL_SIZE != 0 ||
+            (remaining - sizeof(uint64_t)) / PIXEL_SIZE != (uint64_t) rows * cols)
+        {
+            throw std::runtime_error("Not a checkpoint " + path);
+        }
+
+        Checkpoint checkpoint(static_cast<int>(rows), static_cast<int>(cols));
+        checkpoint.tile_size = static_cast<int>(tile_size);
+        checkpoint.tile_order = static_cast<TileOrder>(tile_order);
+        checkpoint.passes = static_cast<int>(passes);
+        get(checkpoint.seed);
+        for (Colorf& sum : checkpoint.sums.pixels())
+        {
+            double rgb[3];
+            get(rgb);
+            sum = Colorf { rgb[0], rgb[1], rgb[2] };
+        }
+        if (!in.read(reinterpret_cast<char*>(checkpoint.counts.data()), checkpoint.counts.size() * sizeof(uint32_t)))
+        {
+            throw std::runtime_error("Truncated checkpoint " + path);
+        }
+        return checkpoint;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("film::Checkpoint")
+    {
+        // Everything written is read back
+        Checkpoint saved(3, 4);
+        for (int i = 0; i < 12; ++i)
+        {
+            saved.sums[i] = Colorf { i * 0.1, -i / 3., 1e-300 * i };
+            saved.counts[i] = 5 + i;
+        }
+        saved.tile_size = 8;
+        saved.tile_order = TileOrder::Morton;
+        saved.seed = 0x0123456789abcdefull;
+        saved.passes = 17;
+
+        const std::string path = (std::filesystem::temp_directory_path() / "pbr_test_checkpoint.ckpt").string();
+        saved.write(path);
+        Checkpoint read = Checkpoint::read(path);
+        CHECK(read.sums.rows() == 3);
+        CHECK(read.sums.cols() == 4);
+        CHECK(std::memcmp(read.sums.pixels().data(), saved.sums.pixels().data(), 12 * sizeof(Colorf)) == 0);
+        CHECK(read.counts == saved.counts);
+        CHECK(read.tile_size == 8);
+        CHECK(read.tile_order == TileOrder::Morton);
+        CHECK(read.seed == saved.seed);
+        CHECK(read.passes == 17);
+
+        // A header that does not fit the file is refused before anything is allocated
+        for (size_t offset : { 12, 16 })
+        {
+            std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(offset);
+            const uint32_t huge = 65535;
+            file.write(reinterpret_cast<const char*>(&huge), sizeof huge);
+        }
+        CHECK_THROWS_WITH(Checkpoint::read(path), ("Not a checkpoint " + path).c_str());
+        {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            file.write(MAGIC, sizeof MAGIC);
+            file.write(reinterpret_cast<const char*>(&VERSION), sizeof VERSION);
+        }
+        CHECK_THROWS_WITH(Checkpoint::read(path), ("Truncated checkpoint " + path).c_str());
+
+        std::remove(path.c_str());
+        CHECK_THROWS(Checkpoint::read(path));
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "framebuffer.h"
+#include "tiled_framebuffer.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pbr
+{
+    /*!
+    * @brief State of a render between two passes, to continue it after it is stopped
+    *
+    * Every tile (or row) of every pass draws its random numbers from a sequence of the render's
+    * seed, so the seed and the passes done are all there is of the sampler, and a render continued
+    * from a checkpoint gives the same image, bit for bit, as one that was never stopped. That holds
+    * for the same scene, integrator and settings, which the checkpoint does not record beyond the
+    * layout of the accumulation.
+    */
+    struct Checkpoint
+    {
+        /** Sums of the samples of each pixel, kept in double so adding the next passes rounds the same */
+        Framebuffer sums;
+
+        /** Samples in each pixel's sum, row-major */
+        std::vector<uint32_t> counts;
+
+        /** Tiles the samples were accumulated in, 0 for rows, and the order of their pixels */
+        int tile_size = 0;
+        TileOrder tile_order = TileOrder::Rows;
+
+        /** Seed of the render */
+        uint64_t seed = 0;
+
+        /** Passes done, the first one left to render */
+        int passes = 0;
+
+        Checkpoint(int rows, int cols)
+            : sums(rows, cols), counts((size_t) rows * cols)
+        {
+        }
+
+        /*!
+        * @brief Save to a file, throws if it cannot be written
+        *
+        * The checkpoint is written next to the file then renamed over it, so a render stopped while
+        * saving leaves the previous checkpoint whole.
+        *
+        * @param path File to write
+        */
+        void write(const std::string& path) const;
+
+        /** Read a checkpoint saved by write(), throws if the file cannot be read or holds something else. */
+        static Checkpoint read(const std::string& path);
+    };
+}
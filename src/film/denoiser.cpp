@@ -0,0 +1,404 @@
+#include "denoiser.h"
+#include "postprocess.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+namespace pbr
+{
+    /** Taps of the kernel along each axis, 3 wide, so an iteration takes 8 taps besides the center */
+    static constexpr int KERNEL_RADIUS = 1;
+    static constexpr float KERNEL[2 * KERNEL_RADIUS + 1] = { 1.f / 4, 1.f / 2, 1.f / 4 };
+
+    /** Added to the albedo before dividing by it, so black surfaces keep their radiance */
+    static constexpr float ALBEDO_EPSILON = 1e-3f;
+
+    /** Added to the scales of the differences, so that flat areas do not divide by 0 */
+    static constexpr float SCALE_EPSILON = 1e-6f;
+
+    /** Rows and columns around a pixel that the first estimate of its noise is taken from */
+    static constexpr int VARIANCE_RADIUS = 2;
+
+    /** Steps between the taps of the 3x3 passes that average the error of the filtered image */
+    static constexpr int BLEND_STEPS[3] = { 1, 2, 4 };
+
+    /** A channel of an image, row-major. */
+    using Plane = std::vector<float>;
+
+    /*!
+    * @brief e^x for x <= 0, within 3e-6 relative, branchless so that it vectorizes
+    *
+    * 2^(x log2 e) from the exponent bits of the nearest integer power and a Taylor polynomial of
+    * the fraction that is left, in [-0.5, 0.5]. Below e^-87 it gives 0.
+    */
+    static inline float exp_negative(float x)
+    {
+        float t = std::max(x * 1.44269504f, -126.f);
+        int whole = static_cast<int>(t - 0.5f);
+        float f = t - static_cast<float>(whole);
+        float fraction = 1 + f * (0.693147181f + f * (0.240226507f + f * (0.0555041087f + f * (0.00961812911f + f * 0.00133335581f))));
+        int32_t bits = (whole + 127) << 23;
+        float power;
+        std::memcpy(&power, &bits, sizeof(float));
+        return x > -87.f ? power * fraction : 0.f;
+    }
+
+    static inline float luminance(float r, float g, float b)
+    {
+        return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    }
+
+    /** Pointers to the features of a row, offset to a column. */
+    struct Geometry
+    {
+        const float *nx, *ny, *nz, *depth;
+
+        Geometry(const Plane normal[3], const Plane& depth, size_t offset)
+            : nx(normal[0].data() + offset), ny(normal[1].data() + offset), nz(normal[2].data() + offset),
+              depth(depth.data() + offset)
+        {
+        }
+    };
+
+    /*!
+    * @brief Exponent of the weight of a tap from how much its normal and depth differ from the center's
+    *
+    * e^(-power (1 - cos)) is close to cos^power, and takes a single exponential with the other weights.
+    */
+    static inline float geometry_difference(const Geometry& p, const Geometry& q, int col, float power, float depth_scale)
+    {
+        float cosine = std::max(p.nx[col] * q.nx[col] + p.ny[col] * q.ny[col] + p.nz[col] * q.nz[col], 0.f);
+        return power * (1 - cosine) + std::abs(p.depth[col] - q.depth[col]) * depth_scale;
+    }
+
+    /*!
+    * @brief Means of two planes over the pixels around each, weighted by how alike their features are
+    *
+    * Only the surfaces that will be blurred together count, so the noise is not overestimated
+    * where the image has edges. The taps are radius rows and columns around, step pixels apart.
+    */
+    static void local_means(const Plane& a, const Plane& b, const Plane normal[3], const Plane& depth, const Plane& depth_scale,
+        float power, int rows, int cols, int radius, int step, Plane& mean_a, Plane& mean_b)
+    {
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+        for (int row = 0; row < rows; ++row)
+        {
+            const size_t p = (size_t) row * cols;
+            const Geometry center(normal, depth, p);
+            const float* scale = depth_scale.data() + p;
+
+            std::vector<float> sum_w(cols, 1.f), sum_a(a.data() + p, a.data() + p + cols), sum_b(b.data() + p, b.data() + p + cols);
+
+            for (int ky = -radius; ky <= radius; ++ky)
+            {
+                int qrow = row + ky * step;
+                if (qrow < 0 || qrow >= rows) continue;
+
+                for (int kx = -radius; kx <= radius; ++kx)
+                {
+                    if (kx == 0 && ky == 0) continue;
+
+                    const int dx = kx * step;
+                    const int first = std::max(0, -dx), last = std::min(cols, cols - dx);
+                    const float inverse_distance = 1 / (step * std::sqrt(static_cast<float>(kx * kx + ky * ky)));
+                    const size_t q = (size_t) qrow * cols + dx;
+                    const Geometry tap(normal, depth, q);
+                    const float *qa = a.data() + q, *qb = b.data() + q;
+
+#pragma omp simd
+                    for (int col = first; col < last; ++col)
+                    {
+                        float w = exp_negative(-geometry_difference(center, tap, col, power, scale[col] * inverse_distance));
+                        sum_w[col] += w;
+                        sum_a[col] += w * qa[col];
+                        sum_b[col] += w * qb[col];
+                    }
+                }
+            }
+
+#pragma omp simd
+            for (int col = 0; col < cols; ++col)
+            {
+                mean_a[p + col] = sum_a[col] / sum_w[col];
+                mean_b[p + col] = sum_b[col] / sum_w[col];
+            }
+        }
+    }
+
+    /*!
+    * @brief Change of depth from a pixel to the next, the smaller of the two sides along each axis
+    *
+    * Taking the smaller side keeps the depth of the background from counting at silhouettes.
+    */
+    static Plane depth_gradient(const Plane& depth, int rows, int cols)
+    {
+        Plane gradient(depth.size());
+        auto at = [&](int row, int col) { return depth[(size_t) std::clamp(row, 0, rows - 1) * cols + std::clamp(col, 0, cols - 1)]; };
+
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+        for (int row = 0; row < rows; ++row)
+        {
+            for (int col = 0; col < cols; ++col)
+            {
+                float z = at(row, col);
+                float dx = std::min(std::abs(at(row, col + 1) - z), std::abs(z - at(row, col - 1)));
+                float dy = std::min(std::abs(at(row + 1, col) - z), std::abs(z - at(row - 1, col)));
+                gradient[(size_t) row * cols + col] = std::max(dx, dy);
+            }
+        }
+        return gradient;
+    }
+
+    void Denoiser::apply(Framebuffer& image, const FeatureBuffers& features) const
+    {
+        const int rows = image.rows(), cols = image.cols();
+        const size_t size = (size_t) rows * cols;
+
+        // Float planes: the radiance divided by the albedo, the albedo, the normal and the depth
+        Plane color[3], albedo[3], normal[3], depth(size);
+        for (int c = 0; c < 3; ++c)
+        {
+            color[c].resize(size);
+            albedo[c].resize(size);
+            normal[c].resize(size);
+        }
+
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+        for (int64_t i = 0; i < (int64_t) size; ++i)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                albedo[c][i] = static_cast<float>(features.albedo[i][c]) + ALBEDO_EPSILON;
+                color[c][i] = static_cast<float>(image[i][c]) / albedo[c][i];
+                normal[c][i] = static_cast<float>(features.normal[i][c]);
+            }
+            depth[i] = static_cast<float>(features.depth[i]);
+        }
+
+        const auto sigma_l = static_cast<float>(sigma_luminance);
+        const auto power = static_cast<float>(normal_power);
+
+        // Scales of the differences are kept inverted, so that the taps multiply
+        Plane depth_scale = depth_gradient(depth, rows, cols);
+        for (float& s : depth_scale) s = 1 / (static_cast<float>(sigma_depth) * s + SCALE_EPSILON);
+        Plane luma_scale(size);
+
+        // The noise of the render, from the variance of its samples or else from the spread of the luminance
+        Plane luma(size), squares(size), mean(size), variance(size);
+        if (features.variance.size() == size)
+        {
+            for (size_t i = 0; i < size; ++i)
+            {
+                float a = luminance(albedo[0][i], albedo[1][i], albedo[2][i]);
+                squares[i] = features.variance[i] / (a * a);
+            }
+            local_means(squares, squares, normal, depth, depth_scale, power, rows, cols, VARIANCE_RADIUS, 1, variance, mean);
+        }
+        else
+        {
+            for (size_t i = 0; i < size; ++i)
+            {
+                luma[i] = luminance(color[0][i], color[1][i], color[2][i]);
+                squares[i] = luma[i] * luma[i];
+            }
+            local_means(luma, squares, normal, depth, depth_scale, power, rows, cols, VARIANCE_RADIUS, 1, mean, variance);
+            for (size_t i = 0; i < size; ++i) variance[i] = std::max(variance[i] - mean[i] * mean[i], 0.f);
+        }
+        const Plane noise = variance;
+        const Plane render[3] = { color[0], color[1], color[2] };
+
+        Plane filtered[3] = { Plane(size), Plane(size), Plane(size) };
+        Plane filtered_variance(size);
+
+        for (int iteration = 0; iteration < iterations; ++iteration)
+        {
+            const int step = 1 << iteration;
+
+            for (size_t i = 0; i < size; ++i)
+            {
+                luma[i] = luminance(color[0][i], color[1][i], color[2][i]);
+                luma_scale[i] = 1 / (sigma_l * std::sqrt(variance[i]) + SCALE_EPSILON);
+            }
+
+#if PBR_USE_THREADS
+#pragma omp parallel for schedule(dynamic)
+#endif
+            for (int row = 0; row < rows; ++row)
+            {
+                const size_t p = (size_t) row * cols;
+                const float *pr = color[0].data() + p, *pg = color[1].data() + p, *pb = color[2].data() + p;
+                const Geometry here(normal, depth, p);
+                const float *pl = luma.data() + p, *pzs = depth_scale.data() + p, *pls = luma_scale.data() + p;
+
+                // The center tap has a weight of 1 before the kernel's
+                const float center = KERNEL[KERNEL_RADIUS] * KERNEL[KERNEL_RADIUS];
+                std::vector<float> sum_r(cols), sum_g(cols), sum_b(cols), sum_w(cols, center), sum_v(cols);
+                for (int col = 0; col < cols; ++col)
+                {
+                    sum_r[col] = center * pr[col];
+                    sum_g[col] = center * pg[col];
+                    sum_b[col] = center * pb[col];
+                    sum_v[col] = center * center * variance[p + col];
+                }
+
+                for (int ky = -KERNEL_RADIUS; ky <= KERNEL_RADIUS; ++ky)
+                {
+                    int qrow = row + ky * step;
+                    if (qrow < 0 || qrow >= rows) continue;
+
+                    for (int kx = -KERNEL_RADIUS; kx <= KERNEL_RADIUS; ++kx)
+                    {
+                        if (kx == 0 && ky == 0) continue;
+
+                        // Taps that fall outside the image are left out
+                        const int dx = kx * step;
+                        const int first = std::max(0, -dx), last = std::min(cols, cols - dx);
+                        const float h = KERNEL[ky + KERNEL_RADIUS] * KERNEL[kx + KERNEL_RADIUS];
+                        const float inverse_distance = 1 / (step * std::sqrt(static_cast<float>(kx * kx + ky * ky)));
+
+                        const size_t q = (size_t) qrow * cols + dx;
+                        const float *qr = color[0].data() + q, *qg = color[1].data() + q, *qb = color[2].data() + q;
+                        const Geometry tap(normal, depth, q);
+                        const float *ql = luma.data() + q, *qv = variance.data() + q;
+
+#pragma omp simd
+                        for (int col = first; col < last; ++col)
+                        {
+                            float difference = geometry_difference(here, tap, col, power, pzs[col] * inverse_distance)
+                                + std::abs(pl[col] - ql[col]) * pls[col];
+                            float w = h * exp_negative(-difference);
+
+                            sum_r[col] += w * qr[col];
+                            sum_g[col] += w * qg[col];
+                            sum_b[col] += w * qb[col];
+                            sum_w[col] += w;
+                            sum_v[col] += w * w * qv[col];
+                        }
+                    }
+                }
+
+                // The variance of a weighted mean, sum w^2 var / (sum w)^2
+#pragma omp simd
+                for (int col = 0; col < cols; ++col)
+                {
+                    float inverse = 1 / sum_w[col];
+                    filtered[0][p + col] = sum_r[col] * inverse;
+                    filtered[1][p + col] = sum_g[col] * inverse;
+                    filtered[2][p + col] = sum_b[col] * inverse;
+                    filtered_variance[p + col] = sum_v[col] * inverse * inverse;
+                }
+            }
+
+            for (int c = 0; c < 3; ++c) std::swap(color[c], filtered[c]);
+            std::swap(variance, filtered_variance);
+        }
+
+        // Blend back into the render by the share of the noise in the estimated error of each, where the
+        // filtered image's is its squared difference from the render less the noise. Both are averaged
+        // over a few passes that reach further each time, as the difference of a pixel alone is as noisy
+        // as the render.
+        for (size_t i = 0; i < size; ++i)
+        {
+            float difference = luminance(color[0][i], color[1][i], color[2][i]) - luminance(render[0][i], render[1][i], render[2][i]);
+            mean[i] = difference * difference;
+        }
+        variance = noise;
+        for (int step : BLEND_STEPS)
+        {
+            std::swap(squares, mean);
+            std::swap(luma, variance);
+            local_means(squares, luma, normal, depth, depth_scale, power, rows, cols, 1, step, mean, variance);
+        }
+
+        // Put the albedo back
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+        for (int64_t i = 0; i < (int64_t) size; ++i)
+        {
+            float error = std::max(mean[i] - variance[i], 0.f);
+            float filtered_share = variance[i] / (variance[i] + error + SCALE_EPSILON);
+            float rgb[3];
+            for (int c = 0; c < 3; ++c) rgb[c] = (render[c][i] + filtered_share * (color[c][i] - render[c][i])) * albedo[c][i];
+            image[i] = Colorf { rgb[0], rgb[1], rgb[2] };
+        }
+    }
+
+    double psnr(const Framebuffer& image, const Framebuffer& reference)
+    {
+        double sum = 0;
+        for (size_t i = 0; i < image.pixels().size(); ++i)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                double d = encode_srgb(static_cast<float>(image[i][c])) - encode_srgb(static_cast<float>(reference[i][c]));
+                sum += d * d;
+            }
+        }
+        double mse = sum / (3 * image.pixels().size());
+        return mse > 0 ? 10 * std::log10(1 / mse) : PBR_INF;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("film::Denoiser")
+    {
+        // The left half faces the camera and is dark, the right half faces sideways and is bright
+        constexpr int ROWS = 32, COLS = 32;
+        FeatureBuffers features(ROWS, COLS);
+        Framebuffer reference(ROWS, COLS), image(ROWS, COLS);
+        std::mt19937 gen(7);
+        std::uniform_real_distribution<> noise(-0.1, 0.1);
+        for (int row = 0; row < ROWS; ++row)
+        {
+            for (int col = 0; col < COLS; ++col)
+            {
+                size_t i = (size_t) row * COLS + col;
+                bool right = col >= COLS / 2;
+                features.albedo[i] = Colorf { 0.5 };
+                features.normal[i] = right ? Vec { 1, 0, 0 } : Vec { 0, 0, 1 };
+                features.depth[i] = 1;
+                reference[i] = Colorf { right ? 0.8 : 0.1 };
+                image[i] = reference[i] + Colorf { noise(gen), noise(gen), noise(gen) };
+            }
+        }
+
+        CHECK(psnr(reference, reference) == PBR_INF);
+
+        double noisy = psnr(image, reference);
+        Denoiser().apply(image, features);
+        CHECK(psnr(image, reference) > noisy + 6);
+
+        // The edge between the halves is kept
+        for (int row = 0; row < ROWS; ++row)
+        {
+            CHECK(image[row * COLS + COLS / 2 - 1].x < 0.15);
+            CHECK(image[row * COLS + COLS / 2].x > 0.75);
+        }
+
+        // Light that the features do not show, stripes a column wide, under little noise of a known
+        // variance, is not blurred away. The variance of the luminance takes the squares of the weights.
+        std::uniform_real_distribution<> faint(-0.01, 0.01);
+        const float faint_variance = luminance(0.2126f, 0.7152f, 0.0722f) * 0.02f * 0.02f / 12;
+        features.variance.resize((size_t) ROWS * COLS);
+        for (size_t i = 0; i < reference.pixels().size(); ++i)
+        {
+            reference[i] = Colorf { i % 2 ? 0.52 : 0.48 };
+            image[i] = reference[i] + Colorf { faint(gen), faint(gen), faint(gen) };
+            features.variance[i] = faint_variance;
+        }
+        noisy = psnr(image, reference);
+        Denoiser().apply(image, features);
+        CHECK(psnr(image, reference) >= noisy);
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "framebuffer.h"
+#include <config.h>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Edge-avoiding à-trous denoiser
+    //   Dammertz et al. 2010, "Edge-avoiding À-Trous wavelet transform for fast
+    //   global illumination filtering"
+    //   Schied et al. 2017, "Spatiotemporal variance-guided filtering", for the
+    //   weights on the luminance and the depth
+    //
+    // The radiance is divided by the albedo of the first hit, so textures are
+    // kept, and the rest is blurred by a 3x3 kernel whose taps spread
+    // twice as far at each iteration. Each tap is weighted down by how much the
+    // normal and the depth differ from the center pixel's, and by how much the
+    // luminance does relative to the noise around the center pixel. The noise
+    // is the variance of the samples of the pixels around it, or without it the
+    // spread of their luminance, and is filtered along with the image.
+    //
+    // The spread of the luminance also counts the detail of the image, and the
+    // filter gets rid of some of it, which costs more than the noise it removes
+    // once there is little noise left. So the filtered image is blended back
+    // into the render, by pixel, by how its error compares with the noise: its
+    // difference from the render, less the noise, estimates its squared error,
+    // once both are averaged over the pixels around it.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** What the camera rays of each pixel see first, averaged over the pixel. */
+    struct FeatureBuffers
+    {
+        /** Reflectance of the surface, white where the ray escapes or finds an emitter */
+        Framebuffer albedo;
+
+        /** Surface normal facing the camera, the reversed ray direction where the ray escapes */
+        Framebuffer normal;
+
+        /** Distance along the ray, 0 where it escapes */
+        std::vector<double> depth;
+
+        /** Variance of the mean luminance of each pixel over its samples, from the render (see Renderer::variance), empty if not known */
+        std::vector<float> variance;
+
+        FeatureBuffers(int rows, int cols)
+            : albedo(rows, cols), normal(rows, cols), depth((size_t) rows * cols)
+        {
+        }
+    };
+
+    /*!
+    * @brief Removes the noise of a render, guided by its feature buffers
+    *
+    * Works on float planes of the image. Rows are split between threads, and each tap of the
+    * kernel is applied to a whole row at a time, in branchless loops that the compiler turns into
+    * SIMD.
+    */
+    class Denoiser
+    {
+    public:
+        /** Iterations of the filter, the kernel spans 2^iterations + 1 pixels at the last one */
+        int iterations = PBR_DENOISE_ITERATIONS;
+
+        /** Luminance difference at which a tap's weight falls to 1/e, in standard deviations of the noise */
+        double sigma_luminance = PBR_DENOISE_SIGMA_LUMINANCE;
+
+        /** Power of the cosine between the normals that weights a tap, taken as e^(-power (1 - cos)) */
+        double normal_power = PBR_DENOISE_NORMAL_POWER;
+
+        /** Depth difference at which a tap's weight falls to 1/e, in changes of depth from one pixel to the next */
+        double sigma_depth = PBR_DENOISE_SIGMA_DEPTH;
+
+        /*!
+        * @brief Denoise an image in place
+        *
+        * @param image Mean radiance of each pixel
+        * @param features Feature buffers of the same size
+        */
+        void apply(Framebuffer& image, const FeatureBuffers& features) const;
+    };
+
+    /*!
+    * @brief Peak signal-to-noise ratio of an image against a reference, in dB
+    *
+    * Both images are clamped to [0, 1] and sRGB encoded first, so the error is measured as it is
+    * seen.
+    */
+    double psnr(const Framebuffer& image, const Framebuffer& reference);
+}
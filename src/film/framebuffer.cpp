@@ -0,0 +1,354 @@
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+namespace pbr
+{
+    static std::ofstream open_image(const std::string& path)
+    {
+        std::ofstream out(path, std::ios::binary);
+        if (!out) throw std::runtime_error("Cannot write image " + path);
+        return out;
+    }
+
+    void Framebuffer::write_pfm(const std::string& path) const
+    {
+        std::ofstream out = open_image(path);
+
+        // A negative scale marks little-endian floats, rows go bottom to top like ours
+        out << "PF\n" << _cols << " " << _rows << "\n-1.0\n";
+
+        std::vector<float> row(_cols * 3);
+        for (int r = 0; r < _rows; ++r)
+        {
+            for (int c = 0; c < _cols; ++c)
+            {
+                const Colorf& color = _data[(size_t) r * _cols + c];
+                row[c * 3 + 0] = static_cast<float>(color.x);
+                row[c * 3 + 1] = static_cast<float>(color.y);
+                row[c * 3 + 2] = static_cast<float>(color.z);
+            }
+            out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+        }
+        if (!out.flush()) throw std::runtime_error("Cannot write image " + path);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // OpenEXR
+    //   "OpenEXR File Layout", the single-part scanline form: magic and version,
+    //   a header of named attributes, a table of offsets to the scanlines, and the
+    //   scanlines, each holding its channels one after the other in name order.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Little-endian bytes of an EXR file, built in memory. */
+    struct ExrBuffer
+    {
+        std::vector<char> bytes;
+
+        template <class T>
+        void put(T value)
+        {
+            const char* p = reinterpret_cast<const char*>(&value);
+            bytes.insert(bytes.end(), p, p + sizeof(T));
+        }
+
+        void put_string(const char* s) { bytes.insert(bytes.end(), s, s + std::strlen(s) + 1); }
+
+        void put_attribute(const char* name, const char* type, int32_t size)
+        {
+            put_string(name);
+            put_string(type);
+            put<int32_t>(size);
+        }
+    };
+
+    void Framebuffer::write_exr(const std::string& path) const
+    {
+        constexpr int32_t FLOAT = 2;
+        constexpr int CHANNELS = 3;
+
+        ExrBuffer header;
+        header.put<uint32_t>(20000630);
+        header.put<uint32_t>(2);
+
+        // Channels sorted by name, each a name, pixel type, pLinear, reserved bytes and sampling
+        const char* names[CHANNELS] = { "B", "G", "R" };
+        header.put_attribute("channels", "chlist", CHANNELS * 18 + 1);
+        for (const char* name : names)
+        {
+            header.put_string(name);
+            header.put<int32_t>(FLOAT);
+            header.put<uint32_t>(0);
+            header.put<int32_t>(1);
+            header.put<int32_t>(1);
+        }
+        header.put<char>(0);
+
+        header.put_attribute("compression", "compression", 1);
+        header.put<uint8_t>(0);
+        for (const char* window : { "dataWindow", "displayWindow" })
+        {
+            header.put_attribute(window, "box2i", 16);
+            header.put<int32_t>(0);
+            header.put<int32_t>(0);
+            header.put<int32_t>(_cols - 1);
+            header.put<int32_t>(_rows - 1);
+        }
+        header.put_attribute("lineOrder", "lineOrder", 1);
+        header.put<uint8_t>(0);
+        header.put_attribute("pixelAspectRatio", "float", 4);
+        header.put<float>(1);
+        header.put_attribute("screenWindowCenter", "v2f", 8);
+        header.put<float>(0);
+        header.put<float>(0);
+        header.put_attribute("screenWindowWidth", "float", 4);
+        header.put<float>(1);
+        header.put<char>(0);
+
+        // One scanline per chunk, y grows downwards so the top row comes first
+        auto line_size = static_cast<int32_t>(_cols * CHANNELS * sizeof(float));
+        auto chunk_size = static_cast<uint64_t>(2 * sizeof(int32_t) + line_size);
+        auto first = static_cast<uint64_t>(header.bytes.size() + _rows * sizeof(uint64_t));
+        for (int y = 0; y < _rows; ++y) header.put<uint64_t>(first + y * chunk_size);
+
+        std::ofstream out = open_image(path);
+        out.write(header.bytes.data(), header.bytes.size());
+
+        ExrBuffer line;
+        for (int y = 0; y < _rows; ++y)
+        {
+            line.bytes.clear();
+            line.put<int32_t>(y);
+            line.put<int32_t>(line_size);
+
+            const Colorf* row = &_data[(size_t) (_rows - 1 - y) * _cols];
+            for (int c = 0; c < _cols; ++c) line.put(static_cast<float>(row[c].z));
+            for (int c = 0; c < _cols; ++c) line.put(static_cast<float>(row[c].y));
+            for (int c = 0; c < _cols; ++c) line.put(static_cast<float>(row[c].x));
+            out.write(line.bytes.data(), line.bytes.size());
+        }
+        if (!out.flush()) throw std::runtime_error("Cannot write image " + path);
+    }
+
+    void Framebuffer::write(const std::string& path) const
+    {
+        auto ends_with = [&](const char* extension) {
+            size_t n = std::strlen(extension);
+            return path.size() >= n && path.compare(path.size() - n, n, extension) == 0;
+        };
+
+        if (ends_with(".pfm")) write_pfm(path);
+        else if (ends_with(".exr")) write_exr(path);
+        else throw std::runtime_error("Unknown HDR image format " + path);
+    }
+
+    /** Reads the little-endian values of an EXR file in memory, throws past its end. */
+    struct ExrReader
+    {
+        const std::vector<char>& bytes;
+        const std::string& path;
+        size_t at = 0;
+
+        template <class T>
+        T get()
+        {
+            if (at + sizeof(T) > bytes.size()) throw std::runtime_error("Truncated image " + path);
+            T value;
+            std::memcpy(&value, bytes.data() + at, sizeof value);
+            at += sizeof value;
+            return value;
+        }
+
+        std::string get_string()
+        {
+            const char* begin = bytes.data() + std::min(at, bytes.size());
+            const char* end = std::find(begin, bytes.data() + bytes.size(), '\0');
+            if (end == bytes.data() + bytes.size()) throw std::runtime_error("Truncated image " + path);
+            at += end - begin + 1;
+            return std::string(begin, end);
+        }
+    };
+
+    static Framebuffer read_exr(const std::string& path, const std::vector<char>& bytes)
+    {
+        constexpr int32_t FLOAT = 2;
+        const std::runtime_error unsupported("Only uncompressed float RGB scanline EXR images can be read " + path);
+
+        ExrReader in { bytes, path };
+        in.get<uint32_t>();
+        if (in.get<uint32_t>() != 2) throw unsupported;
+
+        std::vector<std::string> channels;
+        int compression = -1;
+        int32_t window[4] = { 0, 0, -1, -1 };
+        for (std::string name = in.get_string(); !name.empty(); name = in.get_string())
+        {
+            in.get_string();
+            auto size = in.get<int32_t>();
+            size_t next = in.at + size;
+            if (name == "channels")
+            {
+                for (std::string channel = in.get_string(); !channel.empty(); channel = in.get_string())
+                {
+                    auto type = in.get<int32_t>();
+                    in.get<uint32_t>();
+                    auto x_sampling = in.get<int32_t>(), y_sampling = in.get<int32_t>();
+                    if (type != FLOAT || x_sampling != 1 || y_sampling != 1) throw unsupported;
+                    channels.push_back(channel);
+                }
+            }
+            else if (name == "compression")
+            {
+                compression = in.get<uint8_t>();
+            }
+            else if (name == "dataWindow")
+            {
+                for (int32_t& bound : window) bound = in.get<int32_t>();
+            }
+            in.at = next;
+        }
+        if (channels != std::vector<std::string> { "B", "G", "R" } || compression != 0) throw unsupported;
+
+        const int cols = window[2] - window[0] + 1, rows = window[3] - window[1] + 1;
+        if (cols <= 0 || rows <= 0) throw std::runtime_error("Empty image " + path);
+        std::vector<uint64_t> offsets(rows);
+        for (uint64_t& offset : offsets) offset = in.get<uint64_t>();
+
+        // Scanlines hold the B, G then R of each pixel, top row first
+        Framebuffer image(rows, cols);
+        for (uint64_t offset : offsets)
+        {
+            in.at = offset;
+            int y = in.get<int32_t>() - window[1];
+            if (y < 0 || y >= rows || in.get<int32_t>() != static_cast<int32_t>(cols * 3 * sizeof(float))) throw unsupported;
+            Colorf* row = &image[(size_t) (rows - 1 - y) * cols];
+            for (int c = 0; c < cols; ++c) row[c].z = in.get<float>();
+            for (int c = 0; c < cols; ++c) row[c].y = in.get<float>();
+            for (int c = 0; c < cols; ++c) row[c].x = in.get<float>();
+        }
+        return image;
+    }
+
+    static uint32_t swap_bytes(uint32_t v)
+    {
+        return (v >> 24) | ((v >> 8) & 0x0000ff00u) | ((v << 8) & 0x00ff0000u) | (v << 24);
+    }
+
+    static Framebuffer read_pfm(const std::string& path, std::ifstream& in)
+    {
+        std::string magic;
+        int cols = 0, rows = 0;
+        double scale = 0;
+        in >> magic >> cols >> rows >> scale;
+        if (!in || magic != "PF" || cols <= 0 || rows <= 0 || scale == 0) throw std::runtime_error("Not an RGB PFM image " + path);
+        in.get();
+
+        // A positive scale marks big-endian floats
+        Framebuffer image(rows, cols);
+        std::vector<uint32_t> row(cols * 3);
+        for (int r = 0; r < rows; ++r)
+        {
+            if (!in.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(uint32_t))) throw std::runtime_error("Truncated image " + path);
+            for (int c = 0; c < cols; ++c)
+            {
+                float rgb[3];
+                for (int k = 0; k < 3; ++k)
+                {
+                    uint32_t bits = scale > 0 ? swap_bytes(row[c * 3 + k]) : row[c * 3 + k];
+                    std::memcpy(&rgb[k], &bits, sizeof bits);
+                }
+                image[(size_t) r * cols + c] = Colorf { rgb[0], rgb[1], rgb[2] };
+            }
+        }
+        return image;
+    }
+
+    Framebuffer Framebuffer::read(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) throw std::runtime_error("Cannot read image " + path);
+
+        char magic[4] = {};
+        in.read(magic, sizeof magic);
+        if (std::memcmp(magic, "\x76\x2f\x31\x01", 4) == 0)
+        {
+            in.seekg(0);
+            std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            return read_exr(path, bytes);
+        }
+        in.clear();
+        in.seekg(0);
+        return read_pfm(path, in);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("film::Framebuffer")
+    {
+        // Values past 1 survive both formats, bottom row first in PFM and top row first in EXR
+        Framebuffer image(2, 3);
+        for (int i = 0; i < 6; ++i) image[i] = Colorf { 10. * i, 0.5, -1. };
+
+        auto read = [](const std::string& path) {
+            std::ifstream in(path, std::ios::binary);
+            std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            std::remove(path.c_str());
+            return bytes;
+        };
+        auto float_at = [](const std::vector<char>& bytes, size_t offset) {
+            float value;
+            std::memcpy(&value, bytes.data() + offset, sizeof value);
+            return value;
+        };
+
+        const std::string base = (std::filesystem::temp_directory_path() / "pbr_test_framebuffer").string();
+        std::string path = base + ".pfm";
+        image.write(path);
+        std::vector<char> pfm = read(path);
+        std::string header = "PF\n3 2\n-1.0\n";
+        REQUIRE(pfm.size() == header.size() + 6 * 3 * sizeof(float));
+        CHECK(std::string(pfm.begin(), pfm.begin() + header.size()) == header);
+        CHECK(float_at(pfm, header.size() + 4 * 3 * sizeof(float)) == 40.f);
+        CHECK(float_at(pfm, header.size() + 5 * 3 * sizeof(float) + 2 * sizeof(float)) == -1.f);
+
+        path = base + ".exr";
+        image.write(path);
+        std::vector<char> exr = read(path);
+        REQUIRE(exr.size() > 8);
+        CHECK(std::memcmp(exr.data(), "\x76\x2f\x31\x01\x02\0\0\0", 8) == 0);
+
+        // The offset table follows the header, the first scanline holds the top row: B, G then R of each pixel
+        uint64_t first;
+        std::memcpy(&first, exr.data() + exr.size() - 2 * (8 + 3 * 3 * sizeof(float)) - 2 * sizeof(uint64_t), sizeof first);
+        CHECK(first == exr.size() - 2 * (8 + 3 * 3 * sizeof(float)));
+        int32_t y;
+        std::memcpy(&y, exr.data() + first, sizeof y);
+        CHECK(y == 0);
+        CHECK(float_at(exr, first + 8) == -1.f);
+        CHECK(float_at(exr, first + 8 + 3 * sizeof(float)) == 0.5f);
+        CHECK(float_at(exr, first + 8 + 6 * sizeof(float)) == 30.f);
+
+        CHECK_THROWS(image.write(base + ".png"));
+
+        // Both formats read back as written
+        for (std::string name : { base + ".pfm", base + ".exr" })
+        {
+            image.write(name);
+            Framebuffer back = Framebuffer::read(name);
+            std::remove(name.c_str());
+            REQUIRE(back.rows() == 2);
+            REQUIRE(back.cols() == 3);
+            bool same = true;
+            for (int i = 0; i < 6; ++i) same = same && back[i].x == image[i].x && back[i].y == image[i].y && back[i].z == image[i].z;
+            CHECK(same);
+        }
+        CHECK_THROWS(Framebuffer::read(base + ".exr"));
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <materials/radiometry.h>
+
+#include <string>
+#include <vector>
+
+namespace pbr
+{
+    /** Rectangle of pixels of an image, from its lower left pixel */
+    struct PixelRect
+    {
+        int col;
+        int row;
+        int cols;
+        int rows;
+    };
+
+    /*!
+    * @brief Linear RGB image in floating point, as rendered
+    *
+    * Keeps the full range of the radiance, so renders can be written losslessly, merged or
+    * tonemapped later. Rows are stored bottom to top, like the images the renderer writes.
+    */
+    class Framebuffer
+    {
+    public:
+        Framebuffer(int rows, int cols)
+            : _rows(rows), _cols(cols), _data((size_t) rows * cols)
+        {
+        }
+
+        int rows() const { return _rows; }
+        int cols() const { return _cols; }
+
+        Colorf& operator[](size_t index) { return _data[index]; }
+        const Colorf& operator[](size_t index) const { return _data[index]; }
+
+        /** Row-major pixels, cols * rows */
+        std::vector<Colorf>& pixels() { return _data; }
+        const std::vector<Colorf>& pixels() const { return _data; }
+
+        /*!
+        * @brief Write as a Portable Float Map, little-endian 32-bit float RGB
+        *
+        * @param path File to write
+        */
+        void write_pfm(const std::string& path) const;
+
+        /*!
+        * @brief Write as an OpenEXR image, uncompressed 32-bit float RGB scanlines
+        *
+        * @param path File to write
+        */
+        void write_exr(const std::string& path) const;
+
+        /** Write as PFM or EXR, by the extension of the path. */
+        void write(const std::string& path) const;
+
+        /** Read an image as write() writes it: a PFM, or an uncompressed float RGB EXR. Throws for other files. */
+        static Framebuffer read(const std::string& path);
+
+    private:
+        int _rows;
+        int _cols;
+        std::vector<Colorf> _data;
+    };
+}
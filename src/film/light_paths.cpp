@@ -0,0 +1,228 @@
+#include "light_paths.h"
+#include <scene/scene.h>
+#include <lights/light.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+namespace pbr
+{
+    /** Start of a light path file, then a version that changes with the layout */
+    static constexpr char MAGIC[8] = { 'P', 'B', 'R', 'L', 'I', 'G', 'H', 'T' };
+    static constexpr uint32_t VERSION = 1;
+
+    LightPathBuffers::LightPathBuffers(int rows, int cols, std::vector<LightGroup> groups)
+        : _rows(rows), _cols(cols), _groups(std::move(groups))
+    {
+        _data.resize((size_t) rows * cols * components() * 3);
+    }
+
+    LightPathBuffers::LightPathBuffers(const Scene& scene, int rows, int cols, bool by_material)
+        : _rows(rows), _cols(cols)
+    {
+        _actor_groups.assign(scene.geometry.size(), NO_GROUP);
+
+        // Emitters sharing a material share its group
+        std::vector<uint32_t> material_groups(scene.materials.size(), NO_GROUP);
+        for (size_t actor : scene.lights)
+        {
+            MaterialId material = scene.material_ids[actor];
+            uint32_t& group = by_material ? material_groups[material] : _actor_groups[actor];
+            if (group == NO_GROUP)
+            {
+                group = static_cast<uint32_t>(_groups.size());
+                std::string name = by_material ? "material" + std::to_string(material) : "light" + std::to_string(actor);
+                _groups.push_back({ name, scene.materials[material].emission });
+            }
+            _actor_groups[actor] = group;
+        }
+
+        if (scene.environment.emits())
+        {
+            _environment_group = static_cast<uint32_t>(_groups.size());
+            _groups.push_back({ "environment", PBR_COLOR_WHITE });
+        }
+
+        _data.resize((size_t) rows * cols * components() * 3);
+    }
+
+    size_t LightPathBuffers::component(size_t light, bool direct) const
+    {
+        if (_from_file) throw std::runtime_error("Light path buffers read from a file do not know the groups of the actors");
+        uint32_t group = light == ENVIRONMENT_LIGHT ? _environment_group : _actor_groups[light];
+        return group == NO_GROUP ? residual() : 2 * group + (direct ? 0 : 1);
+    }
+
+    void LightPathBuffers::clear()
+    {
+        std::fill(_data.begin(), _data.end(), 0.f);
+    }
+
+    void LightPathBuffers::average(int samples)
+    {
+        const float inverse = 1.f / samples;
+        for (float& value : _data) value *= inverse;
+    }
+
+    void LightPathBuffers::combine(const std::vector<Colorf>& scales, Framebuffer& out, bool direct, bool indirect) const
+    {
+        if (scales.size() != _groups.size()) throw std::runtime_error("Expected a scale for each of the light groups");
+        if (out.rows() != _rows || out.cols() != _cols) throw std::runtime_error("Light path buffers and image differ in size");
+
+        // One factor per float of a pixel, 0 for the parts left out
+        const size_t count = components();
+        std::vector<float> factors(count * 3, 0.f);
+        for (size_t group = 0; group < _groups.size(); ++group)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                if (direct) factors[(2 * group) * 3 + c] = static_cast<float>(scales[group][c]);
+                if (indirect) factors[(2 * group + 1) * 3 + c] = static_cast<float>(scales[group][c]);
+            }
+        }
+        if (indirect) std::fill_n(factors.begin() + residual() * 3, 3, 1.f);
+
+        const int64_t pixels = (int64_t) _rows * _cols;
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+        for (int64_t i = 0; i < pixels; ++i)
+        {
+            const float* p = pixel(i);
+            float r = 0, g = 0, b = 0;
+            for (size_t k = 0; k < count * 3; k += 3)
+            {
+                r += factors[k] * p[k];
+                g += factors[k + 1] * p[k + 1];
+                b += factors[k + 2] * p[k + 2];
+            }
+            out[i] = Colorf { r, g, b };
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // File: the magic and version, rows, columns and groups as uint32, each
+    // group's name (length then bytes) and emission (3 floats), then the
+    // components of each pixel, little-endian floats.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    void LightPathBuffers::write(const std::string& path) const
+    {
+        std::ofstream out(path, std::ios::binary);
+        if (!out) throw std::runtime_error("Cannot write light paths " + path);
+
+        auto put = [&](auto value) { out.write(reinterpret_cast<const char*>(&value), sizeof value); };
+        out.write(MAGIC, sizeof MAGIC);
+        put(VERSION);
+        put(static_cast<uint32_t>(_rows));
+        put(static_cast<uint32_t>(_cols));
+        put(static_cast<uint32_t>(_groups.size()));
+        for (const LightGroup& group : _groups)
+        {
+            put(static_cast<uint32_t>(group.name.size()));
+            out.write(group.name.data(), group.name.size());
+            for (int c = 0; c < 3; ++c) put(static_cast<float>(group.emission[c]));
+        }
+        out.write(reinterpret_cast<const char*>(_data.data()), _data.size() * sizeof(float));
+        if (!out) throw std::runtime_error("Cannot write light paths " + path);
+    }
+
+    LightPathBuffers LightPathBuffers::read(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) throw std::runtime_error("Cannot read light paths " + path);
+
+        auto get = [&](auto& value) {
+            if (!in.read(reinterpret_cast<char*>(&value), sizeof value)) throw std::runtime_error("Truncated light paths " + path);
+        };
+        char magic[sizeof MAGIC];
+        uint32_t version, rows, cols, count;
+        if (!in.read(magic, sizeof magic) || std::memcmp(magic, MAGIC, sizeof MAGIC) != 0)
+        {
+            throw std::runtime_error("Not a light path file " + path);
+        }
+        get(version);
+        if (version != VERSION) throw std::runtime_error("Unsupported light path file version " + path);
+        get(rows);
+        get(cols);
+        get(count);
+
+        std::vector<LightGroup> groups(count);
+        for (LightGroup& group : groups)
+        {
+            uint32_t length;
+            get(length);
+            group.name.resize(length);
+            if (!in.read(&group.name[0], length)) throw std::runtime_error("Truncated light paths " + path);
+            float emission[3];
+            get(emission);
+            group.emission = Colorf { emission[0], emission[1], emission[2] };
+        }
+
+        LightPathBuffers buffers(static_cast<int>(rows), static_cast<int>(cols), std::move(groups));
+        buffers._from_file = true;
+        if (!in.read(reinterpret_cast<char*>(buffers._data.data()), buffers._data.size() * sizeof(float)))
+        {
+            throw std::runtime_error("Truncated light paths " + path);
+        }
+        return buffers;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("film::LightPathBuffers")
+    {
+        // A floor and a ceiling lit by two lights of the same material
+        Scene scene;
+        auto white = scene.add_material({ Colorf { 0.8 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+        auto light = scene.add_material({ PBR_COLOR_BLACK, Colorf { 4 }, BRDFType::Diffuse });
+        scene.add_actor(white, { Vec { 0, -1000, 0 }, 1000 });
+        scene.add_actor(white, { Vec { 0, 1004, 0 }, 1000 });
+        scene.add_actor(white, { Vec { 0, 1, 0 }, 1 });
+        scene.add_actor(light, { Vec { -2, 3, 0 }, 0.5 });
+        scene.add_actor(light, { Vec { 2, 3, 0 }, 0.5 });
+
+        LightPathBuffers buffers(scene, 2, 2);
+        REQUIRE(buffers.groups().size() == 2);
+        CHECK(buffers.groups()[1].name == "light4");
+        CHECK(buffers.component(0, true) == buffers.residual());
+        CHECK(buffers.component(4, false) == 3);
+        CHECK(LightPathBuffers(scene, 2, 2, true).groups().size() == 1);
+
+        LightPathBuffers::add(buffers.pixel(1), buffers.component(3, true), Colorf { 1 });
+        LightPathBuffers::add(buffers.pixel(1), buffers.component(3, false), Colorf { 2 });
+        LightPathBuffers::add(buffers.pixel(1), buffers.component(4, false), Colorf { 4 });
+        LightPathBuffers::add(buffers.pixel(1), buffers.residual(), Colorf { 8 });
+        LightPathBuffers::add(buffers.pixel(1), buffers.residual(), Colorf { 8 });
+        buffers.average(2);
+
+        // The file keeps everything, each group is scaled on its own and the residual stays as rendered
+        const std::string path = (std::filesystem::temp_directory_path() / "pbr_test_light_paths.lpb").string();
+        buffers.write(path);
+        LightPathBuffers saved = LightPathBuffers::read(path);
+        std::remove(path.c_str());
+        REQUIRE(saved.groups().size() == 2);
+        CHECK(saved.groups()[0].emission.x == 4);
+        CHECK_THROWS(saved.component(3, true));
+
+        Framebuffer all(2, 2), direct(2, 2), indirect(2, 2), scaled(2, 2);
+        saved.combine({ PBR_COLOR_WHITE, PBR_COLOR_WHITE }, all);
+        saved.combine({ PBR_COLOR_WHITE, PBR_COLOR_WHITE }, direct, true, false);
+        saved.combine({ PBR_COLOR_WHITE, PBR_COLOR_WHITE }, indirect, false, true);
+        saved.combine({ PBR_COLOR_BLACK, Colorf { 3 } }, scaled);
+        CHECK(all[1].y == 11.5);
+        CHECK(direct[1].y == 0.5);
+        CHECK(indirect[1].y == 11);
+        CHECK(scaled[1].y == 14);
+        CHECK(all[0].y == 0);
+
+        CHECK_THROWS(saved.combine({ PBR_COLOR_WHITE }, all));
+        CHECK_THROWS(LightPathBuffers::read(path));
+    }
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "framebuffer.h"
+#include <config.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pbr
+{
+    struct Scene;
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // Light path buffers, for relighting without rendering again
+    //
+    // Every path carries the light of a single emitter, in proportion to that
+    // emitter's emission. The radiance of each group of emitters is kept apart,
+    // and split into direct light (emitters seen from the camera, or lighting
+    // the first hit) and indirect light (after more bounces). Scaling the
+    // buffers of a group by a color and summing them all gives the image the
+    // scene would render with the group's emission scaled by that color. Light
+    // that is not traced back to one emitter (terminal radiance, the caches
+    // and the caustic photons) goes to a residual buffer, kept as rendered.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Emitters whose light is kept together. */
+    struct LightGroup
+    {
+        std::string name;
+
+        /** Emission of the group as rendered, white for the environment */
+        Colorf emission;
+    };
+
+    /*!
+    * @brief Radiance of each pixel split by light group, direct and indirect
+    *
+    * The components of a pixel are the direct and indirect light of each group, then the residual,
+    * as 32-bit float RGB next to each other, so a sample adds to a single cache line and
+    * recombining streams through the buffers once.
+    */
+    class LightPathBuffers
+    {
+    public:
+        /*!
+        * @brief Buffers for the lights of a scene
+        *
+        * @param scene Scene to be rendered
+        * @param rows Rows of the image
+        * @param cols Columns of the image
+        * @param by_material One group per emissive material instead of one per emitting actor. The
+        * environment is a group of its own either way.
+        */
+        LightPathBuffers(const Scene& scene, int rows, int cols, bool by_material = PBR_LIGHT_GROUPS_BY_MATERIAL);
+
+        /** Read buffers saved by write(), throws if the file cannot be read or holds something else. */
+        static LightPathBuffers read(const std::string& path);
+
+        int rows() const { return _rows; }
+        int cols() const { return _cols; }
+        const std::vector<LightGroup>& groups() const { return _groups; }
+
+        /** Components of each pixel, the direct and indirect light of each group then the residual */
+        size_t components() const { return 2 * _groups.size() + 1; }
+
+        /** Component that light from an actor, or ENVIRONMENT_LIGHT, goes to. Throws for buffers read from a file, which do not know the actors. */
+        size_t component(size_t light, bool direct) const;
+
+        size_t residual() const { return 2 * _groups.size(); }
+
+        /** Components of a pixel, in row-major order like a Framebuffer */
+        float* pixel(size_t index) { return _data.data() + index * components() * 3; }
+        const float* pixel(size_t index) const { return _data.data() + index * components() * 3; }
+
+        /** Add light to a component of a pixel. */
+        static void add(float* pixel, size_t component, const Colorf& radiance)
+        {
+            float* c = pixel + component * 3;
+            c[0] += static_cast<float>(radiance.x);
+            c[1] += static_cast<float>(radiance.y);
+            c[2] += static_cast<float>(radiance.z);
+        }
+
+        /** Clear all components, before rendering. */
+        void clear();
+
+        /** Divide the sums by the samples per pixel, after rendering. */
+        void average(int samples);
+
+        /*!
+        * @brief Sum the buffers into an image, with the emission of each group scaled
+        *
+        * @param scales Factor of each group's emission, white keeps it as rendered
+        * @param out Image of the same size
+        * @param direct Include the direct light
+        * @param indirect Include the indirect light and the residual
+        */
+        void combine(const std::vector<Colorf>& scales, Framebuffer& out, bool direct = true, bool indirect = true) const;
+
+        /** Save to a file, throws if it cannot be written. */
+        void write(const std::string& path) const;
+
+    private:
+        static constexpr uint32_t NO_GROUP = ~uint32_t(0);
+
+        int _rows;
+        int _cols;
+        std::vector<LightGroup> _groups;
+
+        /** Group of each actor, NO_GROUP for those that do not emit, and of the environment */
+        std::vector<uint32_t> _actor_groups;
+        uint32_t _environment_group = NO_GROUP;
+
+        /** Built by read(), without the groups of the actors */
+        bool _from_file = false;
+
+        std::vector<float> _data;
+
+        LightPathBuffers(int rows, int cols, std::vector<LightGroup> groups);
+    };
+}
@@ -0,0 +1,743 @@
+#include "png.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <stdexcept>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Deflate with the fixed Huffman codes
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Bits of the hash of 4 bytes, a pixel, that starts the chains of earlier positions */
+    static constexpr int HASH_BITS = 17;
+
+    /** Earlier positions tried for a match, and the farthest they can be */
+    static constexpr int MAX_CHAIN = 16;
+    static constexpr size_t WINDOW = 32768;
+
+    /** Matches are searched from 4 bytes, which the fixed codes always store in fewer bits than literals */
+    static constexpr int MIN_MATCH = 4;
+    static constexpr int MAX_MATCH = 258;
+
+    static constexpr uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51,
+        59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static constexpr uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+        5, 5, 5, 5, 0 };
+    static constexpr uint16_t DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+        513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static constexpr uint8_t DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10,
+        10, 11, 11, 12, 12, 13, 13 };
+
+    static uint32_t reverse_bits(uint32_t code, int bits)
+    {
+        uint32_t reversed = 0;
+        for (int i = 0; i < bits; ++i) reversed |= ((code >> i) & 1) << (bits - 1 - i);
+        return reversed;
+    }
+
+    /** Codes of the fixed Huffman tables, bit-reversed to be written least significant bit first */
+    struct FixedCodes
+    {
+        uint16_t symbol[288];
+        uint8_t symbol_bits[288];
+        uint8_t distance[30];
+
+        /** Length code of each match length, and distance code of each distance up to 256, then of each 128 above */
+        uint8_t length_code[MAX_MATCH + 1];
+        uint8_t near_distance_code[256];
+        uint8_t far_distance_code[256];
+
+        FixedCodes()
+        {
+            for (int s = 0; s < 288; ++s)
+            {
+                int bits = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+                int code = s < 144 ? 0x30 + s : s < 256 ? 0x190 + s - 144 : s < 280 ? s - 256 : 0xc0 + s - 280;
+                symbol[s] = static_cast<uint16_t>(reverse_bits(code, bits));
+                symbol_bits[s] = static_cast<uint8_t>(bits);
+            }
+            for (int d = 0; d < 30; ++d) distance[d] = static_cast<uint8_t>(reverse_bits(d, 5));
+
+            for (int c = 0; c < 29; ++c)
+            {
+                for (int length = LENGTH_BASE[c]; length < LENGTH_BASE[c] + (1 << LENGTH_EXTRA[c]) && length <= MAX_MATCH; ++length)
+                {
+                    length_code[length] = static_cast<uint8_t>(c);
+                }
+            }
+            for (int c = 0; c < 30; ++c)
+            {
+                for (int d = DISTANCE_BASE[c]; d < DISTANCE_BASE[c] + (1 << DISTANCE_EXTRA[c]); ++d)
+                {
+                    if (d <= 256) near_distance_code[d - 1] = static_cast<uint8_t>(c);
+                    else far_distance_code[(d - 1) >> 7] = static_cast<uint8_t>(c);
+                }
+            }
+        }
+    };
+
+    static const FixedCodes& fixed_codes()
+    {
+        static const FixedCodes codes;
+        return codes;
+    }
+
+    /** Bits packed least significant first, as deflate reads them. */
+    struct BitWriter
+    {
+        std::vector<uint8_t>& out;
+        uint64_t buffer = 0;
+        int count = 0;
+
+        void put(uint32_t bits, int n)
+        {
+            buffer |= static_cast<uint64_t>(bits) << count;
+            count += n;
+            if (count >= 32)
+            {
+                for (int i = 0; i < 4; ++i) out.push_back(static_cast<uint8_t>(buffer >> (8 * i)));
+                buffer >>= 32;
+                count -= 32;
+            }
+        }
+
+        /** Pad with zeros to a whole byte. */
+        void align()
+        {
+            for (; count > 0; count -= 8, buffer >>= 8) out.push_back(static_cast<uint8_t>(buffer));
+            count = 0;
+            buffer = 0;
+        }
+    };
+
+    static uint32_t load4(const uint8_t* p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, 4);
+        return v;
+    }
+
+    static uint32_t hash4(const uint8_t* p)
+    {
+        return (load4(p) * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    /*!
+    * @brief Deflate data as one block with the fixed codes, and pad it with an empty stored block
+    *
+    * Neither block is final, so the output can be followed by more blocks of the same stream.
+    * Matches are greedy, from the chains of earlier positions with the same hash.
+    */
+    static void deflate_strip(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+    {
+        const FixedCodes& codes = fixed_codes();
+        BitWriter bits { out };
+
+        // Not final, fixed Huffman codes
+        bits.put(2, 3);
+
+        std::vector<int32_t> head(size_t(1) << HASH_BITS, -1);
+        std::vector<int32_t> chain(size);
+        auto insert = [&](size_t i) {
+            uint32_t h = hash4(data + i);
+            chain[i] = head[h];
+            head[h] = static_cast<int32_t>(i);
+        };
+
+        size_t i = 0;
+        while (i < size)
+        {
+            size_t best = 0, best_distance = 0;
+            if (i + MIN_MATCH <= size)
+            {
+                size_t limit = std::min<size_t>(MAX_MATCH, size - i);
+                int32_t candidate = head[hash4(data + i)];
+                for (int tries = 0; candidate >= 0 && i - candidate <= WINDOW && tries < MAX_CHAIN; ++tries)
+                {
+                    // Only candidates that start alike and reach past the best so far are compared in full
+                    const uint8_t* a = data + candidate;
+                    const uint8_t* b = data + i;
+                    if (load4(a) != load4(b) || (best > 0 && (best >= limit || a[best] != b[best])))
+                    {
+                        candidate = chain[candidate];
+                        continue;
+                    }
+                    size_t length = MIN_MATCH;
+                    while (length < limit && a[length] == b[length]) ++length;
+                    if (length > best)
+                    {
+                        best = length;
+                        best_distance = i - candidate;
+                        if (length == limit) break;
+                    }
+                    candidate = chain[candidate];
+                }
+                insert(i);
+            }
+
+            if (best >= MIN_MATCH)
+            {
+                int l = codes.length_code[best];
+                bits.put(codes.symbol[257 + l], codes.symbol_bits[257 + l]);
+                if (LENGTH_EXTRA[l]) bits.put(static_cast<uint32_t>(best - LENGTH_BASE[l]), LENGTH_EXTRA[l]);
+
+                int d = best_distance <= 256 ? codes.near_distance_code[best_distance - 1] : codes.far_distance_code[(best_distance - 1) >> 7];
+                bits.put(codes.distance[d], 5);
+                if (DISTANCE_EXTRA[d]) bits.put(static_cast<uint32_t>(best_distance - DISTANCE_BASE[d]), DISTANCE_EXTRA[d]);
+
+                for (size_t j = i + 1; j < i + best && j + MIN_MATCH <= size; ++j) insert(j);
+                i += best;
+            }
+            else
+            {
+                bits.put(codes.symbol[data[i]], codes.symbol_bits[data[i]]);
+                ++i;
+            }
+        }
+
+        // End of block, then an empty stored block that is not final: 3 zero bits, zeros to the byte, then LEN and NLEN
+        bits.put(codes.symbol[256], codes.symbol_bits[256]);
+        bits.put(0, 3);
+        bits.align();
+        const uint8_t empty[] = { 0x00, 0x00, 0xff, 0xff };
+        out.insert(out.end(), empty, empty + 4);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // Checksums
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static constexpr uint32_t ADLER_MOD = 65521;
+
+    static uint32_t adler32(const uint8_t* data, size_t size)
+    {
+        uint32_t a = 1, b = 0;
+        while (size > 0)
+        {
+            // Largest run whose sums cannot overflow before the modulo
+            size_t n = std::min<size_t>(size, 5552);
+            for (size_t i = 0; i < n; ++i)
+            {
+                a += data[i];
+                b += a;
+            }
+            a %= ADLER_MOD;
+            b %= ADLER_MOD;
+            data += n;
+            size -= n;
+        }
+        return (b << 16) | a;
+    }
+
+    /** Adler-32 of two runs of data joined, from the checksum of each and the size of the second, as zlib's adler32_combine. */
+    static uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size)
+    {
+        uint64_t remainder = second_size % ADLER_MOD;
+        uint64_t a = (first & 0xffff) + (second & 0xffff) + ADLER_MOD - 1;
+        uint64_t b = (remainder * (first & 0xffff)) % ADLER_MOD + (first >> 16) + (second >> 16) + ADLER_MOD - remainder;
+        return static_cast<uint32_t>(((b % ADLER_MOD) << 16) | (a % ADLER_MOD));
+    }
+
+    /** CRC-32 of PNG chunks, four bytes at a time through four tables (slicing-by-4) */
+    static uint32_t crc32(const uint8_t* data, size_t size)
+    {
+        static const std::vector<uint32_t> tables = [] {
+            std::vector<uint32_t> t(4 * 256);
+            for (uint32_t n = 0; n < 256; ++n)
+            {
+                uint32_t c = n;
+                for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            for (uint32_t n = 0; n < 256; ++n)
+            {
+                for (int k = 1; k < 4; ++k) t[k * 256 + n] = t[t[(k - 1) * 256 + n] & 0xff] ^ (t[(k - 1) * 256 + n] >> 8);
+            }
+            return t;
+        }();
+        const uint32_t* t = tables.data();
+
+        uint32_t crc = 0xffffffffu;
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4)
+        {
+            crc ^= data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | (static_cast<uint32_t>(data[i + 3]) << 24);
+            crc = t[768 + (crc & 0xff)] ^ t[512 + ((crc >> 8) & 0xff)] ^ t[256 + ((crc >> 16) & 0xff)] ^ t[crc >> 24];
+        }
+        for (; i < size; ++i) crc = t[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return crc ^ 0xffffffffu;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // PNG
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static void put_u32(std::vector<uint8_t>& out, uint32_t value)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<uint8_t>(value >> shift));
+    }
+
+    /** Start a chunk, its length is filled in by end_chunk(). */
+    static void begin_chunk(std::vector<uint8_t>& out, const char* type)
+    {
+        put_u32(out, 0);
+        out.insert(out.end(), type, type + 4);
+    }
+
+    /** Fill in the length of the chunk that starts at begin and append its CRC. */
+    static void end_chunk(std::vector<uint8_t>& out, size_t begin)
+    {
+        auto length = static_cast<uint32_t>(out.size() - begin - 8);
+        for (int i = 0; i < 4; ++i) out[begin + i] = static_cast<uint8_t>(length >> (24 - 8 * i));
+        put_u32(out, crc32(out.data() + begin + 4, length + 4));
+    }
+
+    /** Paeth's predictor, of the left, above and upper left bytes the closest to left + above - corner. */
+    static uint8_t paeth(int left, int above, int corner)
+    {
+        int pa = std::abs(above - corner), pb = std::abs(left - corner), pc = std::abs(left + above - 2 * corner);
+        int nearest = pb <= pc ? above : corner;
+        return static_cast<uint8_t>(pa <= pb && pa <= pc ? left : nearest);
+    }
+
+    /*!
+    * @brief Filter rows for deflate, each with the filter whose output has the smallest sum of magnitudes
+    *
+    * The first row can only use the filters that do not look above it, so the rows can be
+    * decoded after any other strip.
+    *
+    * @param pixels Rows of the strip, bottom to top
+    * @param rows Rows
+    * @param cols Columns
+    * @return std::vector<uint8_t> Rows top to bottom, each a filter type followed by its bytes
+    */
+    static std::vector<uint8_t> filter_rows(const Colori* pixels, int rows, int cols)
+    {
+        constexpr int BPP = sizeof(Colori);
+        constexpr int FILTERS = 5;
+        const size_t stride = (size_t) cols * BPP;
+
+        std::vector<uint8_t> out((stride + 1) * rows);
+        std::vector<uint8_t> candidates[FILTERS];
+        for (auto& c : candidates) c.resize(stride);
+
+        for (int r = 0; r < rows; ++r)
+        {
+            const auto* row = reinterpret_cast<const uint8_t*>(pixels + (size_t) (rows - 1 - r) * cols);
+            const auto* above = r > 0 ? row + stride : nullptr;
+
+            // Each filter in its own loop, the first pixel has nothing on its left
+            uint8_t* none = candidates[0].data();
+            uint8_t* sub = candidates[1].data();
+            std::memcpy(none, row, stride);
+            std::memcpy(sub, row, BPP);
+            for (size_t i = BPP; i < stride; ++i) sub[i] = static_cast<uint8_t>(row[i] - row[i - BPP]);
+
+            if (above)
+            {
+                uint8_t* up = candidates[2].data();
+                uint8_t* average = candidates[3].data();
+                uint8_t* predicted = candidates[4].data();
+                for (size_t i = 0; i < stride; ++i) up[i] = static_cast<uint8_t>(row[i] - above[i]);
+                for (size_t i = 0; i < BPP; ++i)
+                {
+                    average[i] = static_cast<uint8_t>(row[i] - (above[i] >> 1));
+                    predicted[i] = static_cast<uint8_t>(row[i] - above[i]);
+                }
+                for (size_t i = BPP; i < stride; ++i)
+                {
+                    average[i] = static_cast<uint8_t>(row[i] - ((row[i - BPP] + above[i]) >> 1));
+                    predicted[i] = static_cast<uint8_t>(row[i] - paeth(row[i - BPP], above[i], above[i - BPP]));
+                }
+            }
+
+            int best = 0;
+            uint64_t best_cost = ~uint64_t(0);
+            for (int f = 0; f < (above ? FILTERS : 2); ++f)
+            {
+                uint64_t cost = 0;
+                for (uint8_t v : candidates[f]) cost += std::abs(static_cast<int8_t>(v));
+                if (cost < best_cost)
+                {
+                    best = f;
+                    best_cost = cost;
+                }
+            }
+
+            uint8_t* dest = out.data() + r * (stride + 1);
+            dest[0] = static_cast<uint8_t>(best);
+            std::memcpy(dest + 1, candidates[best].data(), stride);
+        }
+        return out;
+    }
+
+    PngWriter::PngWriter(const std::string& path, int rows, int cols, int strip_rows)
+        : out(path, std::ios::binary), path(path), rows(rows), cols(cols), strip_rows(strip_rows),
+          strips((rows + strip_rows - 1) / strip_rows)
+    {
+        if (!out) throw std::runtime_error("Cannot write image " + path);
+
+        for (size_t s = 0; s < strips.size(); ++s) strips[s].missing = strip_count(s);
+
+        // 8-bit RGBA, deflate, adaptive filters, not interlaced
+        std::vector<uint8_t> header = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        begin_chunk(header, "IHDR");
+        put_u32(header, cols);
+        put_u32(header, rows);
+        header.insert(header.end(), { 8, 6, 0, 0, 0 });
+        end_chunk(header, 8);
+        out.write(reinterpret_cast<const char*>(header.data()), header.size());
+    }
+
+    int PngWriter::strip_first(size_t strip) const
+    {
+        return rows - std::min(rows, static_cast<int>(strip + 1) * strip_rows);
+    }
+
+    int PngWriter::strip_count(size_t strip) const
+    {
+        return std::min(rows, static_cast<int>(strip + 1) * strip_rows) - static_cast<int>(strip) * strip_rows;
+    }
+
+    void PngWriter::write_rows(int first, int count, const Colori* pixels)
+    {
+        while (count > 0)
+        {
+            size_t index = (rows - 1 - first) / strip_rows;
+            int begin = strip_first(index);
+            int size = strip_count(index);
+            int n = std::min(count, begin + size - first);
+
+            // A whole strip is deflated straight from the rows given
+            if (first == begin && n == size)
+            {
+                encode(index, pixels);
+            }
+            else
+            {
+                Strip& strip = strips[index];
+                bool complete;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (strip.pixels.empty()) strip.pixels.resize((size_t) size * cols);
+                    std::copy(pixels, pixels + (size_t) n * cols, strip.pixels.begin() + (size_t) (first - begin) * cols);
+                    strip.missing -= n;
+                    complete = strip.missing == 0;
+                }
+                if (complete) encode(index, strip.pixels.data());
+            }
+
+            first += n;
+            count -= n;
+            pixels += (size_t) n * cols;
+        }
+    }
+
+    void PngWriter::encode(size_t index, const Colori* pixels)
+    {
+        std::vector<uint8_t> filtered = filter_rows(pixels, strip_count(index), cols);
+
+        std::vector<uint8_t> chunk;
+        chunk.reserve(filtered.size() / 2 + 64);
+        begin_chunk(chunk, "IDAT");
+
+        // The zlib header: deflate with a 32K window, no dictionary, check bits
+        if (index == 0) chunk.insert(chunk.end(), { 0x78, 0x01 });
+        deflate_strip(filtered.data(), filtered.size(), chunk);
+        end_chunk(chunk, 0);
+        uint32_t checksum = adler32(filtered.data(), filtered.size());
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Strip& strip = strips[index];
+        strip.chunk = std::move(chunk);
+        strip.adler = checksum;
+        strip.size = filtered.size();
+        strip.done = true;
+        std::vector<Colori>().swap(strip.pixels);
+
+        for (; next < strips.size() && strips[next].done; ++next)
+        {
+            Strip& ready = strips[next];
+            out.write(reinterpret_cast<const char*>(ready.chunk.data()), ready.chunk.size());
+            adler = adler32_combine(adler, ready.adler, ready.size);
+            std::vector<uint8_t>().swap(ready.chunk);
+        }
+    }
+
+    void PngWriter::finish()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (next != strips.size()) throw std::runtime_error("Rows missing from image " + path);
+
+        // A final empty stored block and the checksum of the stream
+        std::vector<uint8_t> end;
+        begin_chunk(end, "IDAT");
+        end.insert(end.end(), { 0x01, 0x00, 0x00, 0xff, 0xff });
+        put_u32(end, adler);
+        end_chunk(end, 0);
+
+        size_t iend = end.size();
+        begin_chunk(end, "IEND");
+        end_chunk(end, iend);
+
+        out.write(reinterpret_cast<const char*>(end.data()), end.size());
+        out.close();
+        if (!out) throw std::runtime_error("Cannot write image " + path);
+    }
+
+    void write_png(const std::string& path, int rows, int cols, const Colori* pixels)
+    {
+        PngWriter writer(path, rows, cols);
+
+        // Strips in order from the top, so few wait for the ones before them
+        int strips = (rows + PBR_PNG_STRIP_ROWS - 1) / PBR_PNG_STRIP_ROWS;
+#if PBR_USE_THREADS
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int s = 0; s < strips; ++s)
+        {
+            int end = rows - s * PBR_PNG_STRIP_ROWS;
+            int first = std::max(0, end - PBR_PNG_STRIP_ROWS);
+            writer.write_rows(first, end - first, pixels + (size_t) first * cols);
+        }
+
+        writer.finish();
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static std::vector<uint8_t> read_file(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        return { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+    }
+
+    /** Bits read least significant first, as deflate packs them, throws past the end. */
+    struct BitReader
+    {
+        const std::vector<uint8_t>& in;
+        size_t position = 0;
+
+        uint32_t get(int count)
+        {
+            uint32_t value = 0;
+            for (int i = 0; i < count; ++i, ++position)
+            {
+                if (position / 8 >= in.size()) throw std::runtime_error("Truncated deflate stream");
+                value |= ((in[position / 8] >> (position % 8)) & 1u) << i;
+            }
+            return value;
+        }
+
+        /** A Huffman code, sent from its most significant bit */
+        uint32_t get_code(int count)
+        {
+            uint32_t code = 0;
+            for (int i = 0; i < count; ++i) code = (code << 1) | get(1);
+            return code;
+        }
+    };
+
+    /** Inflate a zlib stream of stored and fixed Huffman blocks, the ones written here, and check its Adler-32. */
+    static std::vector<uint8_t> inflate(const std::vector<uint8_t>& in)
+    {
+        if (in.size() < 6 || (in[0] & 0x0f) != 8 || ((in[0] << 8) | in[1]) % 31 != 0) throw std::runtime_error("Not a zlib stream");
+
+        std::vector<uint8_t> out;
+        BitReader bits { in, 16 };
+        for (bool final = false; !final;)
+        {
+            final = bits.get(1);
+            uint32_t type = bits.get(2);
+            if (type == 0)
+            {
+                bits.position = (bits.position + 7) & ~size_t(7);
+                uint32_t length = bits.get(16);
+                if ((length ^ bits.get(16)) != 0xffff) throw std::runtime_error("Corrupt stored block");
+                for (uint32_t i = 0; i < length; ++i) out.push_back(static_cast<uint8_t>(bits.get(8)));
+                continue;
+            }
+            if (type != 1) throw std::runtime_error("Unexpected deflate block type");
+
+            while (true)
+            {
+                // Fixed codes: 256-279 in 7 bits, 0-143 and 280-287 in 8, 144-255 in 9
+                uint32_t code = bits.get_code(7), symbol;
+                if (code <= 23) symbol = 256 + code;
+                else if ((code = (code << 1) | bits.get(1)) < 192) symbol = code - 48;
+                else if (code < 200) symbol = 280 + code - 192;
+                else symbol = 144 + ((code << 1) | bits.get(1)) - 400;
+
+                if (symbol < 256)
+                {
+                    out.push_back(static_cast<uint8_t>(symbol));
+                    continue;
+                }
+                if (symbol == 256) break;
+                if (symbol > 285) throw std::runtime_error("Corrupt length code");
+
+                size_t length = LENGTH_BASE[symbol - 257] + bits.get(LENGTH_EXTRA[symbol - 257]);
+                uint32_t d = bits.get_code(5);
+                if (d >= 30) throw std::runtime_error("Corrupt distance code");
+                size_t distance = DISTANCE_BASE[d] + bits.get(DISTANCE_EXTRA[d]);
+                if (distance > out.size()) throw std::runtime_error("Distance before the stream");
+                for (size_t i = 0; i < length; ++i) out.push_back(out[out.size() - distance]);
+            }
+        }
+
+        size_t end = (bits.position + 7) / 8;
+        if (end + 4 > in.size()) throw std::runtime_error("Truncated zlib stream");
+        uint32_t checksum = (uint32_t(in[end]) << 24) | (in[end + 1] << 16) | (in[end + 2] << 8) | in[end + 3];
+        if (checksum != adler32(out.data(), out.size())) throw std::runtime_error("Adler-32 mismatch");
+        return out;
+    }
+
+    /*!
+    * @brief Decode an 8-bit RGBA PNG, checking the CRC of every chunk
+    *
+    * @return std::vector<uint8_t> RGBA bytes of the rows, top to bottom
+    */
+    static std::vector<uint8_t> read_png(const std::vector<uint8_t>& file, int& rows, int& cols)
+    {
+        auto u32 = [&](size_t at) { return (uint32_t(file[at]) << 24) | (file[at + 1] << 16) | (file[at + 2] << 8) | file[at + 3]; };
+
+        std::vector<uint8_t> stream;
+        for (size_t at = 8; at + 12 <= file.size();)
+        {
+            uint32_t length = u32(at);
+            if (at + 12 + length > file.size()) throw std::runtime_error("Truncated chunk");
+            if (u32(at + 8 + length) != crc32(file.data() + at + 4, length + 4)) throw std::runtime_error("Chunk CRC mismatch");
+
+            const uint8_t* data = file.data() + at + 8;
+            if (std::memcmp(file.data() + at + 4, "IHDR", 4) == 0)
+            {
+                cols = static_cast<int>(u32(at + 8));
+                rows = static_cast<int>(u32(at + 12));
+                if (data[8] != 8 || data[9] != 6 || data[12] != 0) throw std::runtime_error("Not 8-bit RGBA");
+            }
+            else if (std::memcmp(file.data() + at + 4, "IDAT", 4) == 0)
+            {
+                stream.insert(stream.end(), data, data + length);
+            }
+            at += 12 + length;
+        }
+
+        std::vector<uint8_t> filtered = inflate(stream);
+        constexpr int BPP = 4;
+        const size_t stride = (size_t) cols * BPP;
+        if (filtered.size() != (stride + 1) * rows) throw std::runtime_error("Image data of the wrong size");
+
+        std::vector<uint8_t> pixels(stride * rows);
+        for (int r = 0; r < rows; ++r)
+        {
+            uint8_t type = filtered[r * (stride + 1)];
+            const uint8_t* line = filtered.data() + r * (stride + 1) + 1;
+            uint8_t* row = pixels.data() + r * stride;
+            const uint8_t* above = r > 0 ? row - stride : nullptr;
+            for (size_t i = 0; i < stride; ++i)
+            {
+                int left = i >= BPP ? row[i - BPP] : 0;
+                int up = above ? above[i] : 0;
+                int corner = above && i >= BPP ? above[i - BPP] : 0;
+                switch (type)
+                {
+                case 0: row[i] = line[i]; break;
+                case 1: row[i] = static_cast<uint8_t>(line[i] + left); break;
+                case 2: row[i] = static_cast<uint8_t>(line[i] + up); break;
+                case 3: row[i] = static_cast<uint8_t>(line[i] + ((left + up) >> 1)); break;
+                case 4: row[i] = static_cast<uint8_t>(line[i] + paeth(left, up, corner)); break;
+                default: throw std::runtime_error("Unknown filter type");
+                }
+            }
+        }
+        return pixels;
+    }
+
+    /** RGBA bytes of pixels given bottom row first, as a PNG holds them */
+    static std::vector<uint8_t> png_bytes(const std::vector<Colori>& pixels, int rows, int cols)
+    {
+        std::vector<uint8_t> bytes;
+        for (int r = rows - 1; r >= 0; --r)
+        {
+            for (int c = 0; c < cols; ++c)
+            {
+                Colori color = pixels[(size_t) r * cols + c];
+                for (int shift = 0; shift < 32; shift += 8) bytes.push_back(static_cast<uint8_t>(color >> shift));
+            }
+        }
+        return bytes;
+    }
+
+    TEST_CASE("film::PngWriter")
+    {
+        // The checksums of the strips combine into that of the whole stream
+        const uint8_t text[] = "independent strips of one zlib stream";
+        CHECK(adler32_combine(adler32(text, 11), adler32(text + 11, 26), 26) == adler32(text, 37));
+        CHECK(crc32(reinterpret_cast<const uint8_t*>("IEND"), 4) == 0xae426082u);
+
+        constexpr int ROWS = 45, COLS = 31;
+        std::vector<Colori> pixels(ROWS * COLS);
+        for (int i = 0; i < ROWS * COLS; ++i) pixels[i] = 0xff000000u | ((i / COLS * 5) << 16) | ((i % COLS * 8) << 8) | (i * 7919 % 251);
+
+        // Rows streamed in any order give the same file as the whole image
+        const std::filesystem::path temp = std::filesystem::temp_directory_path();
+        const std::string whole = (temp / "pbr_test_whole.png").string(), streamed = (temp / "pbr_test_streamed.png").string();
+        {
+            PngWriter writer(whole, ROWS, COLS, 8);
+            writer.write_rows(0, ROWS, pixels.data());
+            writer.finish();
+        }
+        {
+            PngWriter writer(streamed, ROWS, COLS, 8);
+            for (int row = 0; row < ROWS; ++row)
+            {
+                int shuffled = row * 17 % ROWS;
+                writer.write_rows(shuffled, 1, pixels.data() + shuffled * COLS);
+            }
+            writer.finish();
+        }
+
+        std::vector<uint8_t> file = read_file(whole);
+        REQUIRE(file.size() > 8 + 25 + 12);
+        CHECK(std::memcmp(file.data(), "\x89PNG\r\n\x1a\n", 8) == 0);
+        CHECK(std::memcmp(file.data() + file.size() - 8, "IEND", 4) == 0);
+        CHECK(file == read_file(streamed));
+
+        // The file decodes to the pixels written
+        int rows = 0, cols = 0;
+        std::vector<uint8_t> decoded = read_png(file, rows, cols), expected = png_bytes(pixels, ROWS, COLS);
+        CHECK(rows == ROWS);
+        CHECK(cols == COLS);
+        CHECK(decoded == expected);
+
+        // Also with long runs and matches far back, over strips of the default height
+        constexpr int WIDE = 300, TALL = 70;
+        std::vector<Colori> wide(WIDE * TALL);
+        for (int i = 0; i < WIDE * TALL; ++i)
+        {
+            int col = i % WIDE, row = i / WIDE;
+            wide[i] = col < 100 ? 0xff204060u : col < 200 ? 0xff000000u | (row % 3 * 0x010101u) : 0xff000000u | (i * 2654435761u >> 8);
+        }
+        write_png(whole, TALL, WIDE, wide.data());
+        decoded = read_png(read_file(whole), rows, cols);
+        expected = png_bytes(wide, TALL, WIDE);
+        CHECK(rows == TALL);
+        CHECK(cols == WIDE);
+        CHECK(decoded == expected);
+
+        // Unfinished images are refused
+        PngWriter unfinished(streamed, ROWS, COLS, 8);
+        unfinished.write_rows(0, ROWS - 1, pixels.data());
+        CHECK_THROWS(unfinished.finish());
+
+        std::remove(whole.c_str());
+        std::remove(streamed.c_str());
+    }
+}
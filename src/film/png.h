@@ -0,0 +1,104 @@
+#pragma once
+
+#include <materials/radiometry.h>
+#include <config.h>
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // PNG in independent strips
+    //   RFC 1950/1951 (zlib, deflate), PNG specification 1.2
+    //
+    // The image is cut into strips of rows, and each strip is filtered and
+    // deflated on its own, without looking at the rows above it. A strip ends
+    // with an empty stored block, which pads it to a byte without ending the
+    // stream, so the strips join into one valid zlib stream, as pigz does. Each
+    // strip is written as its own IDAT chunk, and a last chunk ends the stream
+    // with its Adler-32, combined from those of the strips.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /*!
+    * @brief Writes a PNG as its strips are finished
+    *
+    * Rows can be added from several threads and in any order. The thread that completes a strip
+    * deflates it, and strips go to the file in order, those finished early waiting in memory for
+    * the ones before them. Only the rows of unfinished strips are kept.
+    */
+    class PngWriter
+    {
+    public:
+        /*!
+        * @brief Start the file, throws if it cannot be written
+        *
+        * @param path File to write
+        * @param rows Rows of the image
+        * @param cols Columns of the image
+        * @param strip_rows Rows deflated together, fewer compress worse but spread over more threads
+        */
+        PngWriter(const std::string& path, int rows, int cols, int strip_rows = PBR_PNG_STRIP_ROWS);
+
+        PngWriter(const PngWriter&) = delete;
+        PngWriter& operator=(const PngWriter&) = delete;
+
+        /*!
+        * @brief Add finished rows. Thread-safe, each row must be added once.
+        *
+        * @param first First row, counted from the bottom like a Framebuffer
+        * @param count Rows
+        * @param pixels Opaque RGBA pixels of the rows (R in the low byte), count * cols of them
+        */
+        void write_rows(int first, int count, const Colori* pixels);
+
+        /** End the stream and the file, throws if some rows were not added. */
+        void finish();
+
+    private:
+        struct Strip
+        {
+            /** Rows added so far, bottom to top like the image */
+            std::vector<Colori> pixels;
+            int missing = 0;
+
+            /** IDAT chunk, once deflated */
+            std::vector<uint8_t> chunk;
+            uint32_t adler = 1;
+            size_t size = 0;
+            bool done = false;
+        };
+
+        std::ofstream out;
+        std::string path;
+        int rows;
+        int cols;
+        int strip_rows;
+
+        std::mutex mutex;
+        std::vector<Strip> strips;
+
+        /** First strip not yet in the file, and the Adler-32 of those before it */
+        size_t next = 0;
+        uint32_t adler = 1;
+
+        /** Rows of a strip, bottom to top like the image */
+        int strip_first(size_t strip) const;
+        int strip_count(size_t strip) const;
+
+        /** Filter and deflate a strip from its pixels, then write it and any strips after it that are waiting. */
+        void encode(size_t strip, const Colori* pixels);
+    };
+
+    /*!
+    * @brief Write an image as a PNG, deflating its strips in parallel
+    *
+    * @param path File to write
+    * @param rows Rows of the image
+    * @param cols Columns of the image
+    * @param pixels Opaque RGBA pixels, bottom row first
+    */
+    void write_png(const std::string& path, int rows, int cols, const Colori* pixels);
+}
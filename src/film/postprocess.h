@@ -0,0 +1,61 @@
+#pragma once
+
+#include "framebuffer.h"
+#include <config.h>
+
+namespace pbr
+{
+    /** Curve that maps linear radiance into the displayable [0, 1]. */
+    enum class Tonemap : uint8_t
+    {
+        /** Clip at 1 */
+        Clamp,
+
+        /** Hable's filmic curve from Uncharted 2, white at 11.2 */
+        Filmic,
+
+        /** Narkowicz's fit of the ACES reference rendering transform */
+        ACES,
+    };
+
+    /** sRGB transfer function of a linear value, clamped to [0, 1]. A polynomial fit, as PostProcess uses. */
+    float encode_srgb(float linear);
+
+    /*!
+    * @brief Turns a linear float image into 8-bit sRGB for display
+    *
+    * Exposure, then the tonemap, then the sRGB transfer function, then quantization, dithered by
+    * a tile of noise so that smooth gradients do not band. Rows are split between threads, and
+    * each block of a row is converted to float and taken through one step at a time, in branchless
+    * loops the compiler turns into SIMD.
+    */
+    class PostProcess
+    {
+    public:
+        /** Exposure in stops, the radiance is scaled by 2^exposure */
+        double exposure = PBR_POST_EXPOSURE;
+
+        Tonemap tonemap = PBR_POST_TONEMAP;
+
+        /** Whether to add triangular noise of up to one step before quantizing */
+        bool dither = PBR_POST_DITHER;
+
+        /*!
+        * @brief Convert an image
+        *
+        * @param linear Linear image
+        * @param out Opaque RGBA pixels (R in the low byte), linear.rows() * linear.cols() of them
+        */
+        void apply(const Framebuffer& linear, Colori* out) const;
+
+        /*!
+        * @brief Convert some rows of an image, the same as converting the whole image
+        *
+        * @param linear Linear image
+        * @param first_row First row to convert
+        * @param row_count Rows to convert
+        * @param out Pixels of the rows, row_count * linear.cols() of them
+        */
+        void apply(const Framebuffer& linear, int first_row, int row_count, Colori* out) const;
+    };
+}
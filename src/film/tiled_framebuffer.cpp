@@ -0,0 +1,123 @@
+#include "tiled_framebuffer.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace pbr
+{
+    TiledFramebuffer::TiledFramebuffer(int rows, int cols, int tile_size, TileOrder order)
+        : _rows(rows), _cols(cols), _tile_size(tile_size), _tile_shift(0), _order(order)
+    {
+        if (tile_size <= 0 || tile_size > 4096 || (tile_size & (tile_size - 1)) != 0)
+        {
+            throw std::runtime_error("The tile size must be a power of two");
+        }
+        while ((1 << _tile_shift) < tile_size) ++_tile_shift;
+
+        _tiles_x = (cols + tile_size - 1) / tile_size;
+        _tiles_y = (rows + tile_size - 1) / tile_size;
+        _data.resize(tiles() * tile_size * tile_size);
+    }
+
+    void TiledFramebuffer::clear()
+    {
+        std::fill(_data.begin(), _data.end(), Colorf {});
+    }
+
+    void TiledFramebuffer::to_linear(int first, int count, Framebuffer& out, double scale) const
+    {
+        if (out.rows() != _rows || out.cols() != _cols) throw std::runtime_error("Tiled and linear framebuffers differ in size");
+
+        // In both orders the offset of a pixel is that of its column plus that of its row
+        std::vector<uint32_t> x_offsets(_tile_size);
+        for (int x = 0; x < _tile_size; ++x) x_offsets[x] = offset(x, 0);
+
+        for (int row = first; row < first + count; ++row)
+        {
+            const int tile_y = row >> _tile_shift;
+            const uint32_t y_offset = offset(0, row & (_tile_size - 1));
+            Colorf* line = &out[(size_t) row * _cols];
+            for (int tile_x = 0; tile_x < _tiles_x; ++tile_x)
+            {
+                const Colorf* tile = _data.data() + ((size_t) tile_y * _tiles_x + tile_x) * _tile_size * _tile_size + y_offset;
+                const int col = tile_x * _tile_size, cols = std::min(_tile_size, _cols - col);
+                for (int x = 0; x < cols; ++x) line[col + x] = tile[x_offsets[x]] * scale;
+            }
+        }
+    }
+
+    void TiledFramebuffer::from_linear(const Framebuffer& in)
+    {
+        if (in.rows() != _rows || in.cols() != _cols) throw std::runtime_error("Tiled and linear framebuffers differ in size");
+
+        for (size_t t = 0; t < tiles(); ++t)
+        {
+            Tile tile = this->tile(t);
+            for (int y = 0; y < tile.rows; ++y)
+            {
+                const Colorf* line = &in[(size_t) (tile.row + y) * _cols + tile.col];
+                for (int x = 0; x < tile.cols; ++x) tile.pixels[offset(x, y)] = line[x];
+            }
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("film::TiledFramebuffer")
+    {
+        // Edge tiles are cut to the image, and both orders map every pixel of a tile once
+        for (TileOrder order : { TileOrder::Rows, TileOrder::Morton })
+        {
+            TiledFramebuffer tiled(37, 70, 16, order);
+            CHECK(tiled.tiles_x() == 5);
+            CHECK(tiled.tiles_y() == 3);
+
+            std::vector<int> seen(16 * 16);
+            for (uint32_t i = 0; i < 16 * 16; ++i)
+            {
+                int x, y;
+                tiled.position(i, x, y);
+                REQUIRE(x < 16);
+                REQUIRE(y < 16);
+                CHECK(tiled.offset(x, y) == i);
+                ++seen[y * 16 + x];
+            }
+            CHECK(std::count(seen.begin(), seen.end(), 1) == 16 * 16);
+
+            TiledFramebuffer::Tile corner = tiled.tile(tiled.tiles() - 1);
+            CHECK(corner.col == 64);
+            CHECK(corner.row == 32);
+            CHECK(corner.cols == 6);
+            CHECK(corner.rows == 5);
+
+            for (size_t t = 0; t < tiled.tiles(); ++t)
+            {
+                TiledFramebuffer::Tile tile = tiled.tile(t);
+                for (int y = 0; y < tile.rows; ++y)
+                {
+                    for (int x = 0; x < tile.cols; ++x)
+                    {
+                        tile.pixels[tiled.offset(x, y)] = Colorf { double(tile.col + x), double(tile.row + y), 2 };
+                    }
+                }
+            }
+
+            Framebuffer linear(37, 70);
+            tiled.to_linear(0, 37, linear, 0.5);
+            bool same = true;
+            for (int row = 0; row < 37; ++row)
+            {
+                for (int col = 0; col < 70; ++col)
+                {
+                    const Colorf& c = linear[row * 70 + col];
+                    same = same && c.x == col * 0.5 && c.y == row * 0.5 && c.z == 1;
+                }
+            }
+            CHECK(same);
+        }
+
+        CHECK_THROWS(TiledFramebuffer(8, 8, 12));
+    }
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "framebuffer.h"
+#include <config.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace pbr
+{
+    /** Order of the pixels inside a tile of a TiledFramebuffer. */
+    enum class TileOrder
+    {
+        /** Rows of the tile, bottom to top */
+        Rows,
+
+        /** Along a Morton (Z-order) curve, so 2x2, 4x4... blocks of pixels are contiguous */
+        Morton,
+    };
+
+    /*!
+    * @brief Linear RGB image stored tile by tile, for rendering into
+    *
+    * The image is cut into square tiles whose side is a power of two, stored one after the other
+    * in rows of tiles. Each tile is contiguous and padded to its full size at the right and top
+    * edges, so a thread that renders a tile only touches its own cache lines, and the pixels
+    * around a pixel are close in memory instead of a row of the image apart. Tiles are handed out
+    * as unchecked spans, and the image goes back to rows (a Framebuffer) only for output.
+    */
+    class TiledFramebuffer
+    {
+    public:
+        /** The pixels of one tile, and where it lies in the image. */
+        struct Tile
+        {
+            Colorf* pixels;
+
+            /** Lower left pixel of the tile in the image */
+            int col;
+            int row;
+
+            /** Pixels of the tile inside the image, fewer than the tile size at the right and top edges */
+            int cols;
+            int rows;
+        };
+
+        /*!
+        * @brief Zero image, throws if the tile size is not a power of two
+        *
+        * @param rows Rows of the image
+        * @param cols Columns of the image
+        * @param tile_size Pixels across a tile
+        * @param order Order of the pixels inside a tile
+        */
+        TiledFramebuffer(int rows, int cols, int tile_size = PBR_TILE_SIZE, TileOrder order = PBR_TILE_ORDER);
+
+        int rows() const { return _rows; }
+        int cols() const { return _cols; }
+        int tile_size() const { return _tile_size; }
+
+        /** Tiles across and up the image */
+        int tiles_x() const { return _tiles_x; }
+        int tiles_y() const { return _tiles_y; }
+        size_t tiles() const { return (size_t) _tiles_x * _tiles_y; }
+
+        /** A tile by index, in rows of tiles from the bottom left */
+        Tile tile(size_t index)
+        {
+            int x = static_cast<int>(index % _tiles_x), y = static_cast<int>(index / _tiles_x);
+            int col = x * _tile_size, row = y * _tile_size;
+            return { _data.data() + index * _tile_size * _tile_size, col, row, std::min(_tile_size, _cols - col),
+                std::min(_tile_size, _rows - row) };
+        }
+
+        /** Index of the pixel at (x, y) from the lower left of its tile, in the tile's pixels */
+        uint32_t offset(int x, int y) const
+        {
+            return _order == TileOrder::Morton ? spread_bits(x) | (spread_bits(y) << 1) : y * _tile_size + x;
+        }
+
+        /** Column and row in its tile of the pixel at an offset, the inverse of offset() */
+        void position(uint32_t offset, int& x, int& y) const
+        {
+            if (_order == TileOrder::Morton)
+            {
+                x = static_cast<int>(compact_bits(offset));
+                y = static_cast<int>(compact_bits(offset >> 1));
+            }
+            else
+            {
+                x = static_cast<int>(offset & (_tile_size - 1));
+                y = static_cast<int>(offset >> _tile_shift);
+            }
+        }
+
+        /** Set every pixel to 0. */
+        void clear();
+
+        /*!
+        * @brief Copy rows of the image to a framebuffer of the same size, in rows
+        *
+        * @param first First row to copy
+        * @param count Rows to copy
+        * @param out Framebuffer to write the rows into
+        * @param scale Factor for the pixels, to average sums of samples on the way
+        */
+        void to_linear(int first, int count, Framebuffer& out, double scale = 1) const;
+
+        /** Copy a framebuffer of the same size into the tiles, the inverse of to_linear(). */
+        void from_linear(const Framebuffer& in);
+
+    private:
+        int _rows;
+        int _cols;
+        int _tile_size;
+        int _tile_shift;
+        int _tiles_x;
+        int _tiles_y;
+        TileOrder _order;
+        std::vector<Colorf> _data;
+
+        /** Put the bits of v at the even bits of the result, 16 bits at most. */
+        static uint32_t spread_bits(uint32_t v)
+        {
+            v = (v | (v << 8)) & 0x00ff00ffu;
+            v = (v | (v << 4)) & 0x0f0f0f0fu;
+            v = (v | (v << 2)) & 0x33333333u;
+            v = (v | (v << 1)) & 0x55555555u;
+            return v;
+        }
+
+        /** Gather the even bits of v, the inverse of spread_bits. */
+        static uint32_t compact_bits(uint32_t v)
+        {
+            v &= 0x55555555u;
+            v = (v | (v >> 1)) & 0x33333333u;
+            v = (v | (v >> 2)) & 0x0f0f0f0fu;
+            v = (v | (v >> 4)) & 0x00ff00ffu;
+            v = (v | (v >> 8)) & 0x0000ffffu;
+            return v;
+        }
+    };
+}
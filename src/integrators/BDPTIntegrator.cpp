@@ -0,0 +1,492 @@
+#include "BDPTIntegrator.h"
+#include "PathIntegrator.h"
+
+#include <lights/light.h>
+
+#include <cstring>
+
+namespace pbr
+{
+    void BDPTIntegrator::set_scene(const Scene* scene)
+    {
+        p_scene = scene;
+
+        std::vector<double> powers;
+        for (size_t light : scene->lights) powers.push_back(emitted_power(*scene, light));
+        light_table.build(powers);
+
+        light_pmf.assign(scene->geometry.size(), 0);
+        for (size_t i = 0; i < powers.size() && !light_table.empty(); ++i)
+        {
+            light_pmf[scene->lights[i]] = light_table.pmf(i);
+        }
+    }
+
+    void BDPTIntegrator::render_pass(const Camera& camera, int pass, int cols, int rows, std::vector<Colorf>& accumulation)
+    {
+        p_camera = &camera;
+        splats.assign(accumulation.size(), {});
+        int depth = std::min(max_depth, MAX_DEPTH);
+
+        // Each row draws from its own sequence of the seed
+#if PBR_USE_THREADS
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int row = 0; row < rows; ++row)
+        {
+            UniformRNG rng(stream_seed(seed, (uint64_t) pass * rows + row));
+
+            Vertex camera_path[MAX_DEPTH + 1];
+            Vertex light_path[MAX_DEPTH];
+
+            for (int col = 0; col < cols; ++col)
+            {
+                Ray ray = pixel_ray(camera, col, row, cols, rows, pass, rng);
+                Direction direction = normalize(ray.direction);
+
+                Vertex& eye = camera_path[0];
+                eye.type = Vertex::Type::Camera;
+                eye.hit.point = camera.position;
+                eye.beta = PBR_COLOR_WHITE;
+
+                // The environment is only found here, see the class comment
+                Radiance radiance;
+                int camera_vertices = 1 + random_walk({ camera.position, direction }, PBR_COLOR_WHITE,
+                    camera.direction_pdf(direction), camera_path, depth, false, rng, &radiance);
+                int light_vertices = trace_light_path(light_path, rng);
+
+                for (int t = 1; t <= camera_vertices; ++t)
+                {
+                    for (int s = 0; s <= light_vertices; ++s)
+                    {
+                        // Surface vertices of the path, a light seen by the camera is only found by the camera subpath
+                        int vertices = s + t - 1;
+                        if (vertices < 1 || vertices > depth || (s == 1 && t == 1)) continue;
+
+                        Point2D raster;
+                        Radiance contribution = connect(light_path, s, camera_path, t, rng, cols, rows, raster);
+                        if (is_black(contribution)) continue;
+
+                        if (t > 1) radiance = radiance + contribution;
+                        else splat(contribution, raster, pass, cols, rows);
+                    }
+                }
+
+                size_t i = (size_t) row * cols + col;
+                accumulation[i] = accumulation[i] + radiance;
+            }
+        }
+
+        // Every pixel traced one light subpath, so together they estimate one sample per pixel
+        for (size_t i = 0; i < accumulation.size(); ++i) accumulation[i] = accumulation[i] + splats[i];
+    }
+
+    void BDPTIntegrator::splat(const Radiance& contribution, const Point2D& raster, int pass, int cols, int rows)
+    {
+        // Pixels whose samples reach a point are at most one pixel away
+        int col0 = static_cast<int>(std::floor(raster.x)), row0 = static_cast<int>(std::floor(raster.y));
+        for (int row = std::max(row0 - 1, 0); row <= std::min(row0 + 2, rows - 1); ++row)
+        {
+            for (int col = std::max(col0 - 1, 0); col <= std::min(col0 + 2, cols - 1); ++col)
+            {
+                double filter = pixel_filter(raster.x - col, raster.y - row, pass);
+                if (filter == 0) continue;
+
+                Colorf& pixel = splats[(size_t) row * cols + col];
+#if PBR_USE_THREADS
+#pragma omp atomic
+#endif
+                pixel.x += contribution.x * filter;
+#if PBR_USE_THREADS
+#pragma omp atomic
+#endif
+                pixel.y += contribution.y * filter;
+#if PBR_USE_THREADS
+#pragma omp atomic
+#endif
+                pixel.z += contribution.z * filter;
+            }
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // Subpaths
+    ///////////////////////////////////////////////////////////////////////////////
+
+    double BDPTIntegrator::to_area(double pdf, const Vertex& from, const Vertex& to)
+    {
+        Vec offset = to.point() - from.point();
+        double dist2 = offset.sqlen();
+        if (dist2 == 0) return 0;
+
+        if (to.type != Vertex::Type::Camera) pdf *= std::abs(dot(to.normal(), offset)) / std::sqrt(dist2);
+        return pdf / dist2;
+    }
+
+    int BDPTIntegrator::random_walk(Ray ray, Colorf beta, double pdf, Vertex* path, int max_vertices, bool from_light,
+        UniformRNG& rng, Radiance* out_escaped) const
+    {
+        int count = 0;
+        while (count < max_vertices)
+        {
+            HitResult hit;
+            if (!p_scene->intersect(ray, hit))
+            {
+                if (out_escaped) *out_escaped = beta * p_scene->environment.eval(ray.direction);
+                break;
+            }
+
+            Vertex& prev = path[count];
+            Vertex& vertex = path[++count];
+            vertex.type = Vertex::Type::Surface;
+            vertex.hit = hit;
+            vertex.material = p_scene->material(hit);
+            vertex.beta = beta;
+            vertex.pdf_fwd = to_area(pdf, prev, vertex);
+            vertex.pdf_rev = 0;
+            vertex.delta = false;
+            if (count == max_vertices) break;
+
+            BRDFSample sample = sample_brdf(vertex.material, ray, hit, rng);
+            if (is_black(sample.weight)) break;
+
+            Direction direction = normalize(sample.ray.direction);
+            Colorf weight = sample.weight;
+            if (from_light) weight = weight * importance_scale(vertex.material, ray.direction, hit.normal, direction);
+
+            // Pdf of the walk in the other direction, towards the previous vertex
+            double pdf_rev = 0;
+            if (!sample.delta) pdf_rev = pdf_brdf(vertex.material, { hit.point, direction * -1 }, hit, ray.direction * -1);
+
+            vertex.delta = sample.delta;
+            prev.pdf_rev = to_area(pdf_rev, vertex, prev);
+            pdf = sample.delta ? 0 : sample.pdf;
+            beta = beta * weight;
+            ray = { hit.point, direction };
+        }
+        return count;
+    }
+
+    int BDPTIntegrator::trace_light_path(Vertex* path, UniformRNG& rng) const
+    {
+        int depth = std::min(max_depth, MAX_DEPTH);
+        if (light_table.empty() || depth < 1) return 0;
+
+        double pmf;
+        size_t light = p_scene->lights[light_table.sample(rng.sample(), pmf)];
+        const SphereGeometry& sphere = p_scene->geometry[light];
+
+        // Uniform point on the light
+        double z = 1 - 2 * rng.sample();
+        double r = std::sqrt(std::max(0., 1 - z * z));
+        double phi = 2 * PBR_PI * rng.sample();
+        Direction normal { r * std::cos(phi), r * std::sin(phi), z };
+
+        Vertex& origin = path[0];
+        origin.type = Vertex::Type::Light;
+        origin.hit.point = sphere.center + normal * sphere.radius;
+        origin.hit.normal = normal;
+        origin.hit.primitive = light;
+        origin.hit.material = p_scene->material_ids[light];
+        origin.material = p_scene->materials[origin.hit.material];
+        origin.pdf_fwd = pdf_light_origin(origin);
+        origin.pdf_rev = 0;
+        origin.delta = false;
+        origin.beta = origin.material.emission / origin.pdf_fwd;
+
+        // Cos-weighted direction about the normal, so cos / pdf is pi
+        Vec local = brdf::sample_cosine_hemisphere(rng);
+        if (local.z <= 0) return 1;
+
+        Ray ray { origin.point(), to_world(make_basis(normal), local) };
+        return 1 + random_walk(ray, origin.beta * PBR_PI, local.z / PBR_PI, path, depth - 1, true, rng, nullptr);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // Connections
+    ///////////////////////////////////////////////////////////////////////////////
+
+    Radiance BDPTIntegrator::connect(const Vertex* light, int s, const Vertex* camera, int t, UniformRNG& rng,
+        int cols, int rows, Point2D& out_raster) const
+    {
+        Vertex sampled;
+        Radiance contribution;
+
+        if (s == 0)
+        {
+            // The camera subpath found a light by itself
+            const Vertex& pt = camera[t - 1];
+            contribution = pt.beta * emitted(pt, camera[t - 2].point() - pt.point());
+        }
+        else if (t == 1)
+        {
+            // Light tracing: connect to the camera and find where it lands on the image
+            const Vertex& qs = light[s - 1];
+            if (!qs.connectible()) return {};
+
+            Vec to_camera = p_camera->position - qs.point();
+            double x, y;
+            if (!p_camera->project(to_camera * -1, x, y)) return {};
+
+            // Samples of the edge pixels reach up to a pixel beyond the image
+            out_raster = { (x + 1) / 2 * cols, (y + 1) / 2 * rows };
+            if (out_raster.x <= -1 || out_raster.x >= cols + 1 || out_raster.y <= -1 || out_raster.y >= rows + 1) return {};
+
+            sampled.type = Vertex::Type::Camera;
+            sampled.hit.point = p_camera->position;
+
+            // Importance of the pinhole (1 / (image area * cos^4)) times the geometry term
+            double dist2 = to_camera.sqlen();
+            Direction direction = to_camera / std::sqrt(dist2);
+            double importance = p_camera->direction_pdf(direction * -1) * std::abs(dot(qs.normal(), direction)) / dist2;
+
+            contribution = qs.beta * vertex_brdf(qs, direction, light[s - 2].point() - qs.point(), true) * importance;
+            if (is_black(contribution) || !visible(qs, sampled)) return {};
+        }
+        else if (s == 1)
+        {
+            // Sample a point on a light, like next event estimation
+            const Vertex& pt = camera[t - 1];
+            if (!pt.connectible() || light_table.empty()) return {};
+
+            double pmf;
+            size_t light_actor = p_scene->lights[light_table.sample(rng.sample(), pmf)];
+            LightSample ls;
+            if (!sample_sphere_light(p_scene->geometry[light_actor], pt.point(), rng.sample(), rng.sample(), ls)) return {};
+
+            HitResult hit;
+            if (!p_scene->intersect({ pt.point(), ls.direction }, hit) || hit.primitive != light_actor) return {};
+
+            sampled.type = Vertex::Type::Light;
+            sampled.hit = hit;
+            sampled.material = p_scene->materials[hit.material];
+            sampled.beta = emitted(sampled, ls.direction * -1) / (pmf * ls.pdf);
+
+            // Weighted as if the light subpath had started there
+            sampled.pdf_fwd = pdf_light_origin(sampled);
+
+            contribution = pt.beta * vertex_brdf(pt, camera[t - 2].point() - pt.point(), ls.direction, false)
+                * sampled.beta * std::abs(dot(pt.normal(), ls.direction));
+        }
+        else
+        {
+            const Vertex& qs = light[s - 1];
+            const Vertex& pt = camera[t - 1];
+            if (!qs.connectible() || !pt.connectible()) return {};
+
+            Vec offset = pt.point() - qs.point();
+            double dist2 = offset.sqlen();
+            Direction direction = offset / std::sqrt(dist2);
+            double geometry = std::abs(dot(qs.normal(), direction)) * std::abs(dot(pt.normal(), direction)) / dist2;
+
+            contribution = qs.beta * vertex_brdf(qs, direction, light[s - 2].point() - qs.point(), true)
+                * vertex_brdf(pt, camera[t - 2].point() - pt.point(), direction * -1, false) * pt.beta * geometry;
+            if (is_black(contribution) || !visible(qs, pt)) return {};
+        }
+
+        if (is_black(contribution)) return {};
+        return contribution * mis_weight(light, s, camera, t, sampled);
+    }
+
+    double BDPTIntegrator::mis_weight(const Vertex* light, int s, const Vertex* camera, int t, const Vertex& sampled) const
+    {
+        if (s + t == 2) return 1;
+
+        // The connection's endpoints, and the vertices before them
+        const Vertex* qs = s == 1 ? &sampled : s > 1 ? &light[s - 1] : nullptr;
+        const Vertex* pt = t == 1 ? &sampled : &camera[t - 1];
+        const Vertex* qs_minus = s > 1 ? &light[s - 2] : nullptr;
+        const Vertex* pt_minus = t > 1 ? &camera[t - 2] : nullptr;
+
+        // Pdfs with which the other subpath would have sampled them through this connection
+        double pt_rev = qs ? pdf(*qs, qs_minus, *pt) : pdf_light_origin(*pt);
+        double pt_minus_rev = 0;
+        if (pt_minus) pt_minus_rev = qs ? pdf(*pt, qs, *pt_minus) : pdf_light(*pt, *pt_minus);
+        double qs_rev = qs ? pdf(*pt, pt_minus, *qs) : 0;
+        double qs_minus_rev = qs_minus ? pdf(*qs, pt, *qs_minus) : 0;
+
+        // Strategy s = 1 samples the cone that the light subtends from its neighbour instead of the
+        // light's surface, which all other strategies start from. Its ratio is scaled by the two pdfs.
+        const Vertex& emitter = s == 0 ? *pt : s == 1 ? sampled : light[0];
+        const Vertex& neighbour = s == 0 ? *pt_minus : s == 1 ? *pt : light[1];
+        double cone = cone_factor(emitter, neighbour);
+        double scale = s == 1 ? 1 / cone : 1;
+
+        // Delta vertices have no pdf, they cancel out of the ratios
+        auto remap = [](double pdf) { return pdf != 0 ? pdf : 1; };
+        auto heuristic = [](double ratio) {
+#if PBR_MIS_POWER_HEURISTIC
+            return ratio * ratio;
+#else
+            return ratio;
+#endif
+        };
+
+        // Ratios of the pdf of every other strategy to this one's, walking the connection along both subpaths
+        double sum = 0;
+        double ratio = 1;
+        for (int i = t - 1; i > 0; --i)
+        {
+            double rev = i == t - 1 ? pt_rev : i == t - 2 ? pt_minus_rev : camera[i].pdf_rev;
+            double fwd = i == t - 1 ? pt->pdf_fwd : camera[i].pdf_fwd;
+            bool delta = i == t - 1 ? false : camera[i].delta;
+
+            ratio *= remap(rev) / remap(fwd);
+            double strategy = s + t - i == 1 ? cone : scale;
+            if (!delta && !camera[i - 1].delta) sum += heuristic(ratio * strategy);
+        }
+
+        ratio = 1;
+        for (int i = s - 1; i >= 0; --i)
+        {
+            double rev = i == s - 1 ? qs_rev : i == s - 2 ? qs_minus_rev : light[i].pdf_rev;
+            double fwd = i == s - 1 ? qs->pdf_fwd : light[i].pdf_fwd;
+            bool delta = i == s - 1 ? false : light[i].delta;
+
+            ratio *= remap(rev) / remap(fwd);
+            double strategy = i == 1 ? cone : scale;
+            if (!delta && !(i > 0 && light[i - 1].delta)) sum += heuristic(ratio * strategy);
+        }
+
+        return 1 / (1 + sum);
+    }
+
+    double BDPTIntegrator::pdf(const Vertex& vertex, const Vertex* prev, const Vertex& next) const
+    {
+        if (vertex.type == Vertex::Type::Light) return pdf_light(vertex, next);
+
+        Vec to_next = next.point() - vertex.point();
+        double pdf;
+        if (vertex.type == Vertex::Type::Camera) pdf = p_camera->direction_pdf(to_next);
+        else pdf = pdf_brdf(vertex.material, { prev->point(), vertex.point() - prev->point() }, vertex.hit, to_next);
+        return to_area(pdf, vertex, next);
+    }
+
+    double BDPTIntegrator::pdf_light(const Vertex& vertex, const Vertex& next) const
+    {
+        Vec offset = next.point() - vertex.point();
+        double cos = dot(vertex.normal(), offset) / offset.len();
+        if (!(cos > 0)) return 0;
+
+        return to_area(cos / PBR_PI, vertex, next);
+    }
+
+    double BDPTIntegrator::pdf_light_origin(const Vertex& vertex) const
+    {
+        double radius = p_scene->geometry[vertex.hit.primitive].radius;
+        return light_pmf[vertex.hit.primitive] / (4 * PBR_PI * radius * radius);
+    }
+
+    double BDPTIntegrator::cone_factor(const Vertex& light, const Vertex& next) const
+    {
+        const SphereGeometry& sphere = p_scene->geometry[light.hit.primitive];
+        Vec offset = next.point() - light.point();
+        double dist2 = offset.sqlen();
+        double cos = std::abs(dot(light.normal(), offset)) / std::sqrt(dist2);
+
+        // Solid angle pdf of the cone converted to area, over the uniform area pdf
+        return pdf_sphere_light(sphere, next.point()) * cos / dist2 * (4 * PBR_PI * sphere.radius * sphere.radius);
+    }
+
+    Radiance BDPTIntegrator::emitted(const Vertex& vertex, const Vec& direction) const
+    {
+        if (vertex.type == Vertex::Type::Camera || dot(vertex.normal(), direction) <= 0) return {};
+        return vertex.material.emission;
+    }
+
+    Colorf BDPTIntegrator::vertex_brdf(const Vertex& vertex, const Vec& to_camera, const Vec& to_light, bool from_light) const
+    {
+        Direction out = normalize(from_light ? to_camera : to_light);
+        Direction in = normalize(from_light ? to_light : to_camera) * -1;
+
+        double cos = std::abs(dot(vertex.normal(), out));
+        if (cos == 0) return {};
+
+        Colorf f = eval_brdf(vertex.material, { vertex.point(), in }, vertex.hit, out) / cos;
+        if (from_light) f = f * importance_scale(vertex.material, in, vertex.normal(), out);
+        return f;
+    }
+
+    bool BDPTIntegrator::visible(const Vertex& a, const Vertex& b) const
+    {
+        Vec offset = b.point() - a.point();
+        double dist = offset.len();
+
+        double t;
+        size_t index;
+        bool hit = p_scene->intersect_closest({ a.point(), offset / dist }, t, index);
+        if (b.type == Vertex::Type::Camera) return !hit || t >= dist * (1 - 1e-6);
+
+        // b must be the closest hit, and not on the other side of its own actor
+        return hit && index == b.hit.primitive && std::abs(t - dist) <= 1e-4 * std::max(1., dist);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("integrators::BDPTIntegrator")
+    {
+        // Every strategy together must converge to the path tracer's image, also through a mirror
+        Scene scene;
+        auto white = scene.add_material({ Colorf { 0.8 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+        auto mirror = scene.add_material({ PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Specular });
+        auto light = scene.add_material({ PBR_COLOR_BLACK, Colorf { 4 }, BRDFType::Diffuse });
+        scene.add_actor(white, { Vec { 0, -1000, 0 }, 1000 });
+        scene.add_actor(white, { Vec { -1, 1, 0 }, 1 });
+        scene.add_actor(mirror, { Vec { 1.5, 0.75, 0.5 }, 0.75 });
+        scene.add_actor(light, { Vec { -2, 4, 1 }, 0.5 });
+
+        Camera camera;
+        camera.position = Vec { 0, 2, 6 };
+        camera.look_at = Vec { 0, 1, 0 };
+        camera.fov = 45;
+        camera.calculate_basis(1);
+
+        // The camera maps back onto the image
+        double x, y;
+        REQUIRE(camera.project(camera.get_ray(0.25, -0.5).direction, x, y));
+        CHECK(x == doctest::Approx(0.25));
+        CHECK(y == doctest::Approx(-0.5));
+
+        const int size = 16, passes = 64;
+        auto mean = [&](const std::vector<Colorf>& image) {
+            double sum = 0;
+            for (const auto& c : image) sum += luminance(c);
+            return sum / (image.size() * passes);
+        };
+
+        PathIntegrator reference;
+        reference.max_depth = 3;
+        reference.terminal_radiance = PBR_COLOR_BLACK;
+        reference.caustic_photons = 0;
+        reference.set_scene(&scene);
+
+        std::vector<Colorf> expected(size * size);
+        UniformRNG rng(40);
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            for (int i = 0; i < size * size; ++i)
+            {
+                Ray ray = pixel_ray(camera, i % size, i / size, size, size, pass, rng);
+                expected[i] = expected[i] + reference.trace_ray(ray, 0, rng);
+            }
+        }
+
+        BDPTIntegrator bdpt;
+        bdpt.max_depth = 3;
+        bdpt.set_scene(&scene);
+
+        std::vector<Colorf> image(size * size);
+        for (int pass = 0; pass < passes; ++pass) bdpt.render_pass(camera, pass, size, size, image);
+
+        CHECK(mean(image) == doctest::Approx(mean(expected)).epsilon(0.05));
+
+        // A pass depends only on the seed
+        std::vector<Colorf> first(size * size), second(size * size);
+        bdpt.seed = 11;
+        bdpt.render_pass(camera, 0, size, size, first);
+        bdpt.render_pass(camera, 0, size, size, second);
+        CHECK(std::memcmp(first.data(), second.data(), first.size() * sizeof(Colorf)) == 0);
+    }
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <scene/scene.h>
+#include <scene/camera.h>
+#include <core/alias_table.h>
+#include <config.h>
+
+namespace pbr
+{
+    /*!
+    * @brief Bidirectional path tracing
+    *
+    * After Veach 1997, "Robust Monte Carlo methods for light transport simulation", chapter 10.
+    * Every pixel sample traces a subpath from the camera and one from a light, then connects each
+    * prefix of one to each prefix of the other. Every connection is a different strategy for
+    * sampling a path of its length, the strategies are combined with MIS weights computed from the
+    * pdfs of both subpaths (see PBR_MIS_POWER_HEURISTIC). Connections of light subpaths straight to
+    * the camera (light tracing) land on other pixels and are splatted there.
+    *
+    * Lights are the emissive actors. The environment is only found by camera subpaths that escape
+    * the scene, with weight 1 since no other strategy reaches it. Paths are cut at max_depth
+    * without a terminal radiance.
+    */
+    class BDPTIntegrator
+    {
+    public:
+        /** Most surface vertices of a path, max_depth is clamped to it */
+        static constexpr int MAX_DEPTH = 16;
+
+        /** Surface vertices per path, 2 for direct lighting only */
+        int max_depth = PBR_MAX_RECURSION_DEPTH;
+
+        /** Seed of the random numbers, the renderer sets that of the render */
+        uint64_t seed = 0;
+
+        void set_scene(const Scene* scene);
+
+        /*!
+        * @brief Render one sample per pixel and add it to a linear image
+        *
+        * @param camera Camera, with its basis calculated for the image's aspect ratio
+        * @param pass Index of the pass, picks the stratum of the pixel sample
+        * @param cols Image width in pixels
+        * @param rows Image height in pixels
+        * @param accumulation Row-major linear image, cols * rows
+        */
+        void render_pass(const Camera& camera, int pass, int cols, int rows, std::vector<Colorf>& accumulation);
+
+    private:
+        /** A vertex of a camera or light subpath */
+        struct Vertex
+        {
+            enum class Type : uint8_t
+            {
+                Camera,
+
+                /** First vertex of a light subpath, on the surface of a light */
+                Light,
+
+                Surface,
+            };
+
+            Type type = Type::Surface;
+
+            /** Surface data, only the point is set for the camera */
+            HitResult hit {};
+            Material material { {}, {}, BRDFType::Diffuse };
+
+            /** Throughput of the subpath up to and including this vertex, over its pdf */
+            Colorf beta;
+
+            /** Area pdf of this vertex when sampled by its own subpath, and by the other one */
+            double pdf_fwd = 0;
+            double pdf_rev = 0;
+
+            /** Whether the direction leaving this vertex was sampled from a delta lobe */
+            bool delta = false;
+
+            const Point& point() const { return hit.point; }
+            const Vec& normal() const { return hit.normal; }
+            bool connectible() const { return type != Type::Surface || !is_delta(material); }
+        };
+
+        const Scene* p_scene = nullptr;
+        const Camera* p_camera = nullptr;
+
+        /** Lights picked by emitted power, and the probability of picking each actor */
+        AliasTable light_table;
+        std::vector<double> light_pmf;
+
+        /** Light tracing contributions of the current pass, added to the image once it is done */
+        std::vector<Colorf> splats;
+
+        /** Add a light tracing contribution to the pixels around a point of the image, weighted by their pixel filters. */
+        void splat(const Radiance& contribution, const Point2D& raster, int pass, int cols, int rows);
+
+        /*!
+        * @brief Extend a subpath by a random walk
+        *
+        * @param ray Ray leaving the last vertex of the subpath
+        * @param beta Throughput along the ray
+        * @param pdf Solid angle pdf of the ray's direction, 0 after a delta lobe
+        * @param path Subpath, its last vertex is path[0]
+        * @param max_vertices Most vertices to add
+        * @param from_light Whether the subpath starts on a light, so it carries importance through refractions
+        * @param rng Random number generator of the calling thread
+        * @param out_escaped Radiance of the environment seen by a camera subpath that leaves the scene, or nullptr
+        * @return int Number of vertices added
+        */
+        int random_walk(Ray ray, Colorf beta, double pdf, Vertex* path, int max_vertices, bool from_light,
+            UniformRNG& rng, Radiance* out_escaped) const;
+
+        /** Trace a light subpath from a point on a light picked by power. Returns its number of vertices. */
+        int trace_light_path(Vertex* path, UniformRNG& rng) const;
+
+        /*!
+        * @brief Connect the first s vertices of a light subpath to the first t of a camera subpath
+        *
+        * @param light Light subpath
+        * @param s Light vertices used, 0 if the camera subpath found a light by itself
+        * @param camera Camera subpath
+        * @param t Camera vertices used, 1 to splat the light subpath onto the image
+        * @param rng Random number generator of the calling thread
+        * @param cols Image width in pixels
+        * @param rows Image height in pixels
+        * @param out_raster Where the path lands on the image in pixels when t is 1
+        * @return Radiance MIS weighted contribution of the path, per square pixel when t is 1
+        */
+        Radiance connect(const Vertex* light, int s, const Vertex* camera, int t, UniformRNG& rng, int cols, int rows,
+            Point2D& out_raster) const;
+
+        /** MIS weight of a connection, sampled is the vertex created by the connection when s or t is 1. */
+        double mis_weight(const Vertex* light, int s, const Vertex* camera, int t, const Vertex& sampled) const;
+
+        /** Convert a solid angle pdf of the direction from one vertex to another into an area pdf at the other. */
+        static double to_area(double pdf, const Vertex& from, const Vertex& to);
+
+        /** Area pdf with which a vertex, reached from prev, samples next. */
+        double pdf(const Vertex& vertex, const Vertex* prev, const Vertex& next) const;
+
+        /** Area pdf with which a light vertex emits towards next. */
+        double pdf_light(const Vertex& vertex, const Vertex& next) const;
+
+        /** Area pdf with which a light subpath starts at a point on a light. */
+        double pdf_light_origin(const Vertex& vertex) const;
+
+        /** Area pdf with which next event estimation from next picks a point on a light, over pdf_light_origin's without the light's pmf. */
+        double cone_factor(const Vertex& light, const Vertex& next) const;
+
+        /** Emitted radiance of a vertex towards a direction, lights only emit from their outside. */
+        Radiance emitted(const Vertex& vertex, const Vec& direction) const;
+
+        /*!
+        * @brief BRDF (without cos) at a vertex between the directions towards its neighbours
+        *
+        * Camera vertices evaluate it for radiance and light vertices for importance, which differ
+        * through refractions.
+        */
+        Colorf vertex_brdf(const Vertex& vertex, const Vec& to_camera, const Vec& to_light, bool from_light) const;
+
+        /** Whether nothing blocks the segment between two vertices. */
+        bool visible(const Vertex& a, const Vertex& b) const;
+    };
+}
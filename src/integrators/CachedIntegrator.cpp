@@ -0,0 +1,95 @@
+#include "CachedIntegrator.h"
+
+namespace pbr
+{
+    void CachedIntegrator::set_scene(const Scene* scene)
+    {
+        path.seed = seed;
+        path.set_scene(scene);
+        cache.clear();
+    }
+
+    void CachedIntegrator::render_pass(const Camera& camera, int pass, int cols, int rows, std::vector<Colorf>& accumulation)
+    {
+        // Each row draws from its own sequence of the seed
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+        for (int row = 0; row < rows; ++row)
+        {
+            UniformRNG rng(stream_seed(seed, (uint64_t) pass * rows + row));
+
+            for (int col = 0; col < cols; ++col)
+            {
+                size_t i = (size_t) row * cols + col;
+                RayDifferential differential;
+                Ray ray = pixel_ray(camera, col, row, cols, rows, pass, rng, differential);
+                accumulation[i] = accumulation[i] + path.trace_ray(ray, differential, rng);
+            }
+        }
+
+        cache.resolve();
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("integrators::CachedIntegrator")
+    {
+        // Paths ended at the cache keep the brightness of full paths, up to the cache's blur
+        Scene scene;
+        auto white = scene.add_material({ Colorf { 0.8 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+        auto light = scene.add_material({ PBR_COLOR_BLACK, Colorf { 4 }, BRDFType::Diffuse });
+        scene.add_actor(white, { Vec { 0, -1000, 0 }, 1000 });
+        scene.add_actor(white, { Vec { 0, 1004, 0 }, 1000 });
+        scene.add_actor(white, { Vec { -1, 1, 0 }, 1 });
+        scene.add_actor(light, { Vec { 1, 3, 0 }, 0.5 });
+
+        Camera camera;
+        camera.position = Vec { 0, 2, 6 };
+        camera.look_at = Vec { 0, 1, 0 };
+        camera.fov = 45;
+        camera.calculate_basis(1);
+
+        const int size = 16, passes = 32;
+        auto mean = [&](const std::vector<Colorf>& image) {
+            double sum = 0;
+            for (const auto& c : image) sum += luminance(c);
+            return sum / (image.size() * passes);
+        };
+
+        CachedIntegrator cached;
+        cached.path.max_depth = 8;
+        cached.path.terminal_radiance = PBR_COLOR_BLACK;
+        cached.path.caustic_photons = 0;
+        cached.set_scene(&scene);
+
+        std::vector<Colorf> image(size * size);
+        for (int pass = 0; pass < passes; ++pass) cached.render_pass(camera, pass, size, size, image);
+        CHECK(cached.cache.size() > 0);
+
+        PathIntegrator reference;
+        reference.max_depth = 8;
+        reference.terminal_radiance = PBR_COLOR_BLACK;
+        reference.caustic_photons = 0;
+        reference.set_scene(&scene);
+
+        std::vector<Colorf> expected(size * size);
+        UniformRNG rng;
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            for (int row = 0; row < size; ++row)
+            {
+                for (int col = 0; col < size; ++col)
+                {
+                    RayDifferential differential;
+                    Ray ray = pixel_ray(camera, col, row, size, size, pass, rng, differential);
+                    expected[row * size + col] = expected[row * size + col] + reference.trace_ray(ray, differential, rng);
+                }
+            }
+        }
+
+        CHECK(mean(image) == doctest::Approx(mean(expected)).epsilon(0.05));
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "PathIntegrator.h"
+#include "radiance_cache.h"
+#include <scene/camera.h>
+
+namespace pbr
+{
+    /*!
+    * @brief Path tracing that ends paths at a cache of the radiance scattered by diffuse surfaces
+    *
+    * Every path adds the light scattered by its diffuse vertices to the cache, and the means are
+    * updated at the end of each pass. From the next pass on, a path that reaches a cached diffuse
+    * surface at cache_query_depth or deeper stops there and takes the mean. A fraction of the
+    * paths ignores the cache and is traced in full, to keep filling it with deep light. The first
+    * pass fills the cache without using it. Later passes are biased towards the blurred means.
+    */
+    class CachedIntegrator
+    {
+    public:
+        /** Traces the paths, filling and querying the cache */
+        PathIntegrator path;
+
+        /** Radiance scattered by diffuse surfaces */
+        RadianceCache cache;
+
+        /** Seed of the random numbers, also of the caustic photons of path, the renderer sets that of the render */
+        uint64_t seed = 0;
+
+        CachedIntegrator()
+        {
+            path.radiance_cache = &cache;
+        }
+
+        CachedIntegrator(const CachedIntegrator&) = delete;
+        CachedIntegrator& operator=(const CachedIntegrator&) = delete;
+
+        /** Also empties the cache. */
+        void set_scene(const Scene* scene);
+
+        /*!
+        * @brief Render one sample per pixel and add it to a linear image
+        *
+        * @param camera Camera, with its basis calculated for the image's aspect ratio
+        * @param pass Index of the pass, picks the stratum of the pixel sample
+        * @param cols Image width in pixels
+        * @param rows Image height in pixels
+        * @param accumulation Row-major linear image, cols * rows
+        */
+        void render_pass(const Camera& camera, int pass, int cols, int rows, std::vector<Colorf>& accumulation);
+    };
+}
@@ -0,0 +1,41 @@
+#include "GuidedIntegrator.h"
+
+namespace pbr
+{
+    void GuidedIntegrator::set_scene(const Scene* scene)
+    {
+        path.seed = seed;
+        path.set_scene(scene);
+        field.clear();
+        iteration_passes = 1;
+        iteration_done = 0;
+    }
+
+    void GuidedIntegrator::render_pass(const Camera& camera, int pass, int cols, int rows, std::vector<Colorf>& accumulation)
+    {
+        // Each row draws from its own sequence of the seed
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+        for (int row = 0; row < rows; ++row)
+        {
+            UniformRNG rng(stream_seed(seed, (uint64_t) pass * rows + row));
+
+            for (int col = 0; col < cols; ++col)
+            {
+                size_t i = (size_t) row * cols + col;
+                RayDifferential differential;
+                Ray ray = pixel_ray(camera, col, row, cols, rows, pass, rng, differential);
+                accumulation[i] = accumulation[i] + path.trace_ray(ray, differential, rng);
+            }
+        }
+
+        // End of a training iteration, the next one is twice as long
+        if (++iteration_done == iteration_passes)
+        {
+            field.refine(iteration_passes);
+            iteration_passes *= 2;
+            iteration_done = 0;
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "PathIntegrator.h"
+#include "guiding.h"
+#include <scene/camera.h>
+
+namespace pbr
+{
+    /*!
+    * @brief Path tracing that learns where light comes from and samples it (path guiding)
+    *
+    * Renders in training iterations of 1, 2, 4, 8... passes. Every path records the radiance it
+    * finds into the guiding field, which is refined at the end of each iteration and sampled by
+    * the next one. Non-delta vertices pick the BRDF with probability brdf_fraction and the learned
+    * distribution otherwise, weighted by the pdf of the mixture, so every pass is unbiased and all
+    * of them are kept in the image.
+    */
+    class GuidedIntegrator
+    {
+    public:
+        /** Traces the paths, sampling and training the field */
+        PathIntegrator path;
+
+        /** Learned incident radiance */
+        GuidingField field;
+
+        /** Seed of the random numbers, also of the caustic photons of path, the renderer sets that of the render */
+        uint64_t seed = 0;
+
+        GuidedIntegrator()
+        {
+            path.guiding = &field;
+        }
+
+        GuidedIntegrator(const GuidedIntegrator&) = delete;
+        GuidedIntegrator& operator=(const GuidedIntegrator&) = delete;
+
+        /** Also forgets everything learned about the previous scene. */
+        void set_scene(const Scene* scene);
+
+        /*!
+        * @brief Render one sample per pixel and add it to a linear image
+        *
+        * @param camera Camera, with its basis calculated for the image's aspect ratio
+        * @param pass Index of the pass, picks the stratum of the pixel sample
+        * @param cols Image width in pixels
+        * @param rows Image height in pixels
+        * @param accumulation Row-major linear image, cols * rows
+        */
+        void render_pass(const Camera& camera, int pass, int cols, int rows, std::vector<Colorf>& accumulation);
+
+    private:
+        /** Passes of the current training iteration, and how many of them are done */
+        int iteration_passes = 1;
+        int iteration_done = 0;
+    };
+}
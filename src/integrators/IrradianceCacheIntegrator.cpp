@@ -0,0 +1,132 @@
+#include "IrradianceCacheIntegrator.h"
+
+namespace pbr
+{
+    /** Pixels between the primary hits that bound the octree */
+    static constexpr int BOUNDS_STRIDE = 8;
+
+    /** Padding of the bounds of the primary hits, relative to their diagonal */
+    static constexpr double BOUNDS_MARGIN = 0.1;
+
+    void IrradianceCacheIntegrator::set_scene(const Scene* scene)
+    {
+        p_scene = scene;
+        path.seed = seed;
+        path.set_scene(scene);
+        cache.reset({});
+        bounded = false;
+    }
+
+    void IrradianceCacheIntegrator::render_pass(const Camera& camera, int pass, int cols, int rows, std::vector<Colorf>& accumulation)
+    {
+        if (!bounded)
+        {
+            Bounds bounds;
+            for (int row = 0; row < rows; row += BOUNDS_STRIDE)
+            {
+                for (int col = 0; col < cols; col += BOUNDS_STRIDE)
+                {
+                    double t;
+                    size_t index;
+                    Ray ray = camera.get_ray(((col + 0.5) / cols) * 2 - 1, ((row + 0.5) / rows) * 2 - 1);
+                    if (p_scene->intersect_closest(ray, t, index)) bounds.extend(ray.origin + ray.direction * t);
+                }
+            }
+
+            // Records on the outermost surfaces reach past them, and would otherwise double the octree right away
+            if (!bounds.empty())
+            {
+                Vec margin = Vec { BOUNDS_MARGIN * bounds.diagonal().len() };
+                bounds = { bounds.min - margin, bounds.max + margin };
+            }
+            cache.reset(bounds);
+            bounded = true;
+        }
+
+        // Width of a pixel at the center of the image, at distance 1
+        path.irradiance_pixel_angle = 2 * std::tan(PBR_DEG_TO_RAD(camera.fov)) / cols;
+
+        // Each row draws from its own sequence of the seed
+#if PBR_USE_THREADS
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int row = 0; row < rows; ++row)
+        {
+            UniformRNG rng(stream_seed(seed, (uint64_t) pass * rows + row));
+
+            for (int col = 0; col < cols; ++col)
+            {
+                size_t i = (size_t) row * cols + col;
+                RayDifferential differential;
+                Ray ray = pixel_ray(camera, col, row, cols, rows, pass, rng, differential);
+                accumulation[i] = accumulation[i] + path.trace_ray(ray, differential, rng);
+            }
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("integrators::IrradianceCacheIntegrator")
+    {
+        // Interpolated indirect light keeps the brightness of full paths, from far fewer hemispheres than pixels
+        Scene scene;
+        auto white = scene.add_material({ Colorf { 0.8 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+        auto light = scene.add_material({ PBR_COLOR_BLACK, Colorf { 4 }, BRDFType::Diffuse });
+        scene.add_actor(white, { Vec { 0, -1e4, 0 }, 1e4 });
+        scene.add_actor(white, { Vec { 0, 3 + 1e4, 0 }, 1e4 });
+        scene.add_actor(white, { Vec { -2 - 1e4, 0, 0 }, 1e4 });
+        scene.add_actor(white, { Vec { 2 + 1e4, 0, 0 }, 1e4 });
+        scene.add_actor(white, { Vec { 0, 0, -2 - 1e4 }, 1e4 });
+        scene.add_actor(white, { Vec { -0.8, 0.6, -0.5 }, 0.6 });
+        scene.add_actor(light, { Vec { 0.8, 2.5, -0.5 }, 0.3 });
+
+        Camera camera;
+        camera.position = Vec { 0, 1.5, 5 };
+        camera.look_at = Vec { 0, 1.2, 0 };
+        camera.fov = 45;
+        camera.calculate_basis(1);
+
+        const int size = 64, passes = 4;
+        auto mean = [&](const std::vector<Colorf>& image) {
+            double sum = 0;
+            for (const auto& c : image) sum += luminance(c);
+            return sum / (image.size() * passes);
+        };
+
+        IrradianceCacheIntegrator cached;
+        cached.path.max_depth = 8;
+        cached.path.terminal_radiance = PBR_COLOR_BLACK;
+        cached.path.caustic_photons = 0;
+        cached.set_scene(&scene);
+
+        std::vector<Colorf> image(size * size);
+        for (int pass = 0; pass < passes; ++pass) cached.render_pass(camera, pass, size, size, image);
+        CHECK(cached.cache.size() > 0);
+        CHECK(cached.cache.size() < size * size);
+
+        PathIntegrator reference;
+        reference.max_depth = 8;
+        reference.terminal_radiance = PBR_COLOR_BLACK;
+        reference.caustic_photons = 0;
+        reference.set_scene(&scene);
+
+        std::vector<Colorf> expected(size * size);
+        UniformRNG rng;
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            for (int row = 0; row < size; ++row)
+            {
+                for (int col = 0; col < size; ++col)
+                {
+                    RayDifferential differential;
+                    Ray ray = pixel_ray(camera, col, row, size, size, pass, rng, differential);
+                    expected[row * size + col] = expected[row * size + col] + reference.trace_ray(ray, differential, rng);
+                }
+            }
+        }
+
+        CHECK(mean(image) == doctest::Approx(mean(expected)).epsilon(0.05));
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "PathIntegrator.h"
+#include "irradiance_cache.h"
+#include <scene/camera.h>
+
+namespace pbr
+{
+    /*!
+    * @brief Path tracing that interpolates the indirect light of Lambertian surfaces from an irradiance cache
+    *
+    * Paths that reach a Lambertian surface straight from the camera or through deltas sample the
+    * lights there and take the indirect irradiance from the cache, which adds a record wherever
+    * the existing ones are too far away. Most records are made during the first pass, later passes
+    * mostly only look them up. Other surfaces are path traced as usual. The octree of the cache
+    * covers the surfaces that the camera sees.
+    */
+    class IrradianceCacheIntegrator
+    {
+    public:
+        /** Traces the paths and the hemispheres of new records */
+        PathIntegrator path;
+
+        /** Indirect irradiance of Lambertian surfaces */
+        IrradianceCache cache;
+
+        /** Seed of the random numbers, also of the caustic photons of path, the renderer sets that of the render */
+        uint64_t seed = 0;
+
+        IrradianceCacheIntegrator()
+        {
+            path.irradiance_cache = &cache;
+        }
+
+        IrradianceCacheIntegrator(const IrradianceCacheIntegrator&) = delete;
+        IrradianceCacheIntegrator& operator=(const IrradianceCacheIntegrator&) = delete;
+
+        /** Also empties the cache. */
+        void set_scene(const Scene* scene);
+
+        /*!
+        * @brief Render one sample per pixel and add it to a linear image
+        *
+        * @param camera Camera, with its basis calculated for the image's aspect ratio
+        * @param pass Index of the pass, picks the stratum of the pixel sample
+        * @param cols Image width in pixels
+        * @param rows Image height in pixels
+        * @param accumulation Row-major linear image, cols * rows
+        */
+        void render_pass(const Camera& camera, int pass, int cols, int rows, std::vector<Colorf>& accumulation);
+
+    private:
+        const Scene* p_scene = nullptr;
+
+        /** Whether the octree was fitted to what the camera sees */
+        bool bounded = false;
+    };
+}
@@ -1,62 +1,501 @@
 #pragma once
 
 #include <scene/scene.h>
+#include <scene/ray_differential.h>
+#include "guiding.h"
+#include "photons.h"
+#include "radiance_cache.h"
+#include "irradiance_cache.h"
+#include <lights/light_sampler.h>
+#include <film/light_paths.h>
 #include <config.h>
 
 namespace pbr
 {
     struct PathIntegrator
     {
+        /** Sample lights directly at each bounce and weight both strategies with MIS */
+        bool light_sampling = PBR_LIGHT_SAMPLING;
+
+        /** Vertices per path, 2 for direct lighting only */
+        int max_depth = PBR_MAX_RECURSION_DEPTH;
+
+        /** Radiance returned by paths that reach max_depth */
+        Radiance terminal_radiance = PBR_TERMINAL_RADIANCE;
+
+        /** Picks the light to sample at each bounce */
+        LightSampler light_sampler;
+
+        /** Follow the footprint of camera rays that come with differentials, for texture filtering. Skipped in scenes without textures. */
+        bool ray_differentials = PBR_RAY_DIFFERENTIALS;
+
+        /** Learned incident light to sample directions from and to record paths into, nullptr to only sample BRDFs (see GuidedIntegrator) */
+        GuidingField* guiding = nullptr;
+
+        /** Probability of sampling the BRDF rather than the guiding distribution */
+        double guiding_brdf_fraction = PBR_GUIDING_BRDF_FRACTION;
+
+        /** Photons emitted by set_scene to carry caustics to the first diffuse hit of each path, 0 to leave caustics to path tracing */
+        size_t caustic_photons = PBR_CAUSTIC_PHOTONS;
+
+        /** Seed of the caustic photons, the renderer sets that of the render */
+        uint64_t seed = 0;
+
+        /** Most bytes of stored caustic photons */
+        size_t caustic_memory = size_t(PBR_CAUSTIC_MEMORY_MB) << 20;
+
+        /** Caustic photons gathered per irradiance estimate, and their largest distance */
+        int caustic_gather_count = PBR_CAUSTIC_GATHER_COUNT;
+        double caustic_gather_radius = PBR_CAUSTIC_GATHER_RADIUS;
+
+        /** Irradiance is precomputed at one in this many caustic photons */
+        int caustic_stride = PBR_CAUSTIC_IRRADIANCE_STRIDE;
+
+        /** Precomputed caustic irradiance of the current scene, nullptr if there are no caustic photons */
+        std::shared_ptr<const PhotonMap> caustics;
+
+        /** Cache of the radiance scattered by diffuse surfaces to fill and to end paths at, nullptr to trace paths in full (see CachedIntegrator) */
+        RadianceCache* radiance_cache = nullptr;
+
+        /** Depth of the first vertex that ends its path at the radiance cache, 2 after the second bounce */
+        int cache_query_depth = PBR_RADIANCE_CACHE_QUERY_DEPTH;
+
+        /** Fraction of the paths that only fill the radiance cache and are traced in full */
+        double cache_update_fraction = PBR_RADIANCE_CACHE_UPDATE_FRACTION;
+
+        /** Indirect irradiance of Lambertian surfaces, looked up at the first diffuse hit of each path and added to where it is missing, nullptr to trace paths in full (see IrradianceCacheIntegrator) */
+        IrradianceCache* irradiance_cache = nullptr;
+
+        /** Rings of the stratified hemisphere of a new irradiance record, with pi times as many sectors */
+        int irradiance_thetas = PBR_IRRADIANCE_CACHE_THETAS;
+
+        /** Smallest and largest radius of an irradiance record */
+        double irradiance_min_radius = PBR_IRRADIANCE_CACHE_MIN_RADIUS;
+        double irradiance_max_radius = PBR_IRRADIANCE_CACHE_MAX_RADIUS;
+
+        /** Angle of a pixel seen from the camera, 0 to leave the radius of irradiance records to the scene units */
+        double irradiance_pixel_angle = 0;
+
+        /** Pixels across the smallest area of validity (error * radius) of an irradiance record */
+        double irradiance_min_pixels = PBR_IRRADIANCE_CACHE_MIN_PIXELS;
+
+        /** Groups of lights to split what paths find by, into the pixel handed to trace_ray, nullptr to not split it */
+        const LightPathBuffers* light_paths = nullptr;
+
+        /** Whether differentials are followed in the current scene */
+        bool follows_differentials() const { return ray_differentials && p_scene->textures; }
+
         void set_scene(const Scene* scene)
         {
             p_scene = scene;
+            light_sampler.update(*scene);
+
+            caustics = nullptr;
+            if (caustic_photons > 0)
+            {
+                PhotonMap photons = trace_caustic_photons(*scene, caustic_photons, caustic_memory, seed);
+                if (!photons.empty())
+                {
+                    caustics = std::make_shared<const PhotonMap>(
+                        photons.precompute_irradiance(caustic_gather_count, caustic_gather_radius, caustic_stride));
+                }
+            }
+        }
+
+        Radiance trace_ray(const Ray& camera_ray, int depth, UniformRNG& rng) const
+        {
+            return trace(camera_ray, depth, {}, rng);
+        }
+
+        /** Trace a camera ray together with the rays through the neighbouring pixels. */
+        Radiance trace_ray(const Ray& camera_ray, const RayDifferential& differential, UniformRNG& rng) const
+        {
+            return trace_ray(camera_ray, differential, rng, nullptr);
         }
 
-        // TODO: Convert the following recursive function into an iterative function
-        Radiance trace_ray(const Ray& ray, int depth)
+        /** Trace a camera ray, and add what it finds to the components of its pixel in light_paths if not null. */
+        Radiance trace_ray(const Ray& camera_ray, const RayDifferential& differential, UniformRNG& rng, float* split) const
         {
-            if (depth >= PBR_MAX_RECURSION_DEPTH) return PBR_COLOR_WHITE;
+            PathState path;
+            path.differential = differential;
+            path.has_differential = follows_differentials();
+            path.split = light_paths ? split : nullptr;
+            return trace(camera_ray, 0, path, rng);
+        }
+
+        /*!
+        * @brief Trace the light that reaches a primary hit after bouncing at least once
+        *
+        * Leaves out the emission of the hit and the light that reaches it straight from an emitter,
+        * for integrators that estimate those themselves.
+        *
+        * @param ray Camera ray
+        * @param differential Its differentials, which the hit's footprint was computed from
+        * @param hit Its closest hit, on a material that is not a delta BRDF
+        * @param rng Random number generator of the calling thread
+        * @return Radiance Indirect light scattered towards the camera
+        */
+        Radiance trace_indirect(const Ray& ray, const RayDifferential& differential, const HitResult& hit, UniformRNG& rng) const
+        {
+            Material material = p_scene->material(hit);
+            BRDFSample sample = sample_brdf(material, ray, hit, rng);
+            if (is_black(sample.weight)) return {};
 
-            HitResult hit;
-            if (intersect_scene(ray, hit))
+            PathState path;
+            path.throughput = sample.weight;
+            path.count_emission = false;
+            path.diffuse_bounce = true;
+
+            Radiance caustic;
+            if (caustics)
             {
-                auto brdf = hit.actor->material->brdf;
-                Ray sampled_ray = brdf->sample(ray, hit);
-                Colorf coeff = brdf->eval(ray, hit, sampled_ray);
-                return hit.actor->material->emission + coeff * trace_ray(sampled_ray, depth + 1);
+                caustic = gather_caustics(ray, hit, material);
+                path.caustics_gathered = true;
+                path.caustic_chain = true;
             }
-            else return PBR_BACKGROUND_COLOR;
+            if (follows_differentials())
+            {
+                path.differential = scatter_differential(*p_scene, ray, differential, hit, material, sample);
+                path.has_differential = true;
+            }
+            return caustic + trace(sample.ray, 1, path, rng);
         }
 
     private:
         const Scene* p_scene;
 
-        bool intersect_scene(const Ray& ray, HitResult& out_hit) const
+        /** State carried from one path vertex to the next */
+        struct PathState
+        {
+            Colorf throughput = PBR_COLOR_WHITE;
+
+            /** Whether emission found by the next hit is added, false if the caller already accounted for it */
+            bool count_emission = true;
+
+            // Previous bounce, needed to weight emission found by BRDF sampling
+            bool specular_bounce = true;
+            double brdf_pdf = 0;
+            Point last_point;
+            Vec last_normal;
+
+            /** Whether a vertex gathered caustic photons, only the first diffuse one does */
+            bool caustics_gathered = false;
+
+            /** Whether only delta bounces followed that vertex, so emitters found now are in the photon map */
+            bool caustic_chain = false;
+
+            /** Whether the path may end at the radiance cache */
+            bool query_cache = false;
+
+            /** Whether the path left a surface that is not a delta, only hits before that use the irradiance cache */
+            bool diffuse_bounce = false;
+
+            /** Length of the path, which a pixel's footprint grows with until the first diffuse bounce */
+            double distance = 0;
+
+            /** Offset rays of the current ray, only followed when has_differential is set */
+            RayDifferential differential;
+            bool has_differential = false;
+
+            /** Components of the pixel in light_paths to add the light to, nullptr to not split it */
+            float* split = nullptr;
+        };
+
+        Radiance trace(const Ray& ray, int depth, PathState path, UniformRNG& rng) const
         {
-            bool does_hit = false;
-            HitResult closest_hit;
-            for (const auto& actor : *p_scene)
+            if (!radiance_cache) return trace(ray, depth, path, nullptr, rng);
+
+            CachePath cached;
+            path.query_cache = rng.sample() >= cache_update_fraction;
+            Radiance radiance = trace(ray, depth, path, &cached, rng);
+            radiance_cache->record(cached);
+            return radiance;
+        }
+
+        Radiance trace(const Ray& ray, int depth, const PathState& path, CachePath* cached, UniformRNG& rng) const
+        {
+            if (!guiding) return trace(ray, depth, path, nullptr, cached, rng);
+
+            GuidingPath recorded;
+            Radiance radiance = trace(ray, depth, path, &recorded, cached, rng);
+            guiding->record(recorded);
+            return radiance;
+        }
+
+        /*!
+        * @brief Trace a path
+        *
+        * @param recorded If set, records the vertices and the radiance found after each of them for path guiding
+        * @param cached If set, records the diffuse vertices and the radiance they scatter for the radiance cache
+        */
+        Radiance trace(Ray ray, int depth, PathState path, GuidingPath* recorded, CachePath* cached, UniformRNG& rng) const
+        {
+            Radiance radiance;
+            auto add_to = [&](const Radiance& contribution, size_t component) {
+                radiance = radiance + contribution;
+                if (recorded) recorded->add_radiance(contribution);
+                if (cached) cached->add_radiance(contribution);
+                if (path.split) LightPathBuffers::add(path.split, component, contribution);
+            };
+
+            // Light that is not from a single emitter goes to the residual of the split
+            auto add = [&](const Radiance& contribution) {
+                add_to(contribution, path.split ? light_paths->residual() : 0);
+            };
+
+            // Emission that reaches the camera after at most one bounce is direct
+            auto add_light = [&](const Radiance& contribution, size_t light, int bounces) {
+                add_to(contribution, path.split ? light_paths->component(light, bounces <= 1) : 0);
+            };
+
+            for (; depth < max_depth; ++depth)
             {
                 HitResult hit;
-                if (actor.intersect(ray, hit))
+                if (!p_scene->intersect(ray, hit))
                 {
-                    if (does_hit)
+                    if (!path.count_emission) return radiance;
+
+                    const EnvironmentLight& environment = p_scene->environment;
+                    double weight = 1;
+                    if (light_sampling && !path.specular_bounce && environment.emits())
                     {
-                        if (hit.param < closest_hit.param)
-                        {
-                            closest_hit = hit;
-                        }
+                        double light_pdf = light_sampler.pmf(path.last_point, path.last_normal, ENVIRONMENT_LIGHT)
+                            * environment.pdf(ray.direction);
+                        weight = mis_weight(path.brdf_pdf, light_pdf);
                     }
-                    else
+                    add_light(path.throughput * environment.eval(ray.direction) * weight, ENVIRONMENT_LIGHT, depth);
+                    return radiance;
+                }
+
+                if (path.has_differential) compute_footprint(*p_scene, path.differential, hit);
+                if (irradiance_cache) path.distance += hit.param * ray.direction.len();
+
+                const Material material = p_scene->material(hit);
+
+                if (path.count_emission && !is_black(material.emission) && !(path.caustic_chain && path.specular_bounce))
+                {
+                    double weight = 1;
+                    if (light_sampling && !path.specular_bounce)
                     {
-                        closest_hit = hit;
-                        does_hit = true;
+                        double light_pdf = light_sampler.pmf(path.last_point, path.last_normal, hit.primitive)
+                            * pdf_sphere_light(p_scene->geometry[hit.primitive], path.last_point);
+                        weight = mis_weight(path.brdf_pdf, light_pdf);
                     }
+                    add_light(path.throughput * material.emission * weight, hit.primitive, depth);
+                }
+
+                // Lambertian surface seen from the camera or through deltas: the lights are sampled alone, and
+                // the indirect light comes from the irradiance cache
+                bool lambertian = material.brdf == BRDFType::Diffuse && material.roughness == 0 && dot(ray.direction, hit.normal) < 0;
+                if (irradiance_cache && lambertian && !path.diffuse_bounce && light_sampling && depth + 1 < max_depth)
+                {
+                    Colorf irradiance;
+                    if (!irradiance_cache->interpolate(hit.point, hit.normal, irradiance))
+                    {
+                        irradiance = add_irradiance_record(hit.point, hit.normal, depth, path.distance * irradiance_pixel_angle, rng);
+                    }
+
+                    size_t light;
+                    Radiance direct = sample_direct(ray, hit, material, nullptr, rng, light, false);
+                    add_light(path.throughput * direct, light, depth + 1);
+                    if (caustics && !path.caustics_gathered) add(path.throughput * gather_caustics(ray, hit, material));
+                    add(path.throughput * material.color * irradiance / PBR_PI);
+                    return radiance;
+                }
+
+                // Diffuse light scattered from here on is the same for every path that arrives, up to the cell's blur
+                if (cached && material.brdf == BRDFType::Diffuse)
+                {
+                    Vec normal = dot(ray.direction, hit.normal) < 0 ? hit.normal : hit.normal * -1;
+                    uint32_t slot = radiance_cache->insert(hit.point, normal);
+                    if (slot != RadianceCache::NO_SLOT)
+                    {
+                        Radiance scattered;
+                        if (path.query_cache && depth >= cache_query_depth && radiance_cache->radiance(slot, scattered))
+                        {
+                            add(path.throughput * scattered);
+                            return radiance;
+                        }
+                        // A channel that no longer reaches the camera (past a pure red wall) would record no light and darken the mean
+                        const Colorf& t = path.throughput;
+                        if (t.x > 0 && t.y > 0 && t.z > 0) cached->add_vertex(slot, t);
+                    }
+                }
+
+                const DTree* guide = guiding && !is_delta(material) ? guiding->sampling_tree(hit.point) : nullptr;
+
+                // Light found by the next vertex is only counted if that vertex is within the depth limit
+                if (light_sampling && !is_delta(material) && depth + 1 < max_depth)
+                {
+                    size_t light;
+                    Radiance direct = sample_direct(ray, hit, material, guide, rng, light);
+                    add_light(path.throughput * direct, light, depth + 1);
+                }
+
+                bool gather = caustics && !path.caustics_gathered && !is_delta(material);
+                if (gather)
+                {
+                    add(path.throughput * gather_caustics(ray, hit, material));
+                    path.caustics_gathered = true;
                 }
+
+                BRDFSample sample = guide ? sample_guided(material, ray, hit, *guide, rng) : sample_brdf(material, ray, hit, rng);
+                if (is_black(sample.weight)) return radiance;
+
+                path.caustic_chain = gather || (path.caustic_chain && sample.delta);
+
+                if (path.has_differential)
+                {
+                    path.differential = scatter_differential(*p_scene, ray, path.differential, hit, material, sample);
+                }
+
+                path.throughput = path.throughput * sample.weight;
+                if (recorded && !sample.delta)
+                {
+                    recorded->add_vertex(hit.point, normalize(sample.ray.direction), sample.pdf, path.throughput);
+                }
+
+                path.specular_bounce = sample.delta;
+                path.diffuse_bounce = path.diffuse_bounce || !sample.delta;
+                path.brdf_pdf = sample.pdf;
+                path.last_point = hit.point;
+                path.last_normal = hit.normal;
+                path.count_emission = true;
+                ray = sample.ray;
             }
 
-            out_hit = closest_hit;
-            return does_hit;
+            add(path.throughput * terminal_radiance);
+            return radiance;
+        }
+
+        /** Radiance that caustic photons around a hit scatter along the ray back towards its origin. */
+        Radiance gather_caustics(const Ray& ray, const HitResult& hit, const Material& material) const
+        {
+            // The BRDF is evaluated for light arriving along the normal, exact for diffuse surfaces
+            Vec normal = dot(ray.direction, hit.normal) < 0 ? hit.normal : hit.normal * -1;
+            Colorf irradiance;
+            if (!caustics->irradiance(hit.point, normal, caustic_gather_radius, irradiance)) return {};
+            return eval_brdf(material, ray, hit, normal) * irradiance;
+        }
+
+        /*!
+        * @brief Estimate the indirect irradiance at a point from a full hemisphere of paths, and add it to the irradiance cache
+        *
+        * Light arriving straight from the lights or the environment is left out, as it is sampled at
+        * every lookup. So are caustics when the photon map covers them.
+        *
+        * @param footprint Width of a pixel at the point, 0 if unknown
+        * @return Colorf Irradiance of the new record
+        */
+        Colorf add_irradiance_record(const Point& point, const Vec& normal, int depth, double footprint, UniformRNG& rng) const
+        {
+            int thetas = irradiance_thetas;
+            int phis = static_cast<int>(std::lround(PBR_PI * thetas));
+            std::vector<Radiance> radiance(thetas * phis);
+            std::vector<double> distance(thetas * phis, PBR_INF);
+            Basis basis = make_basis(normal);
+
+            PathState path;
+            path.count_emission = false;
+            path.caustics_gathered = true;
+            path.caustic_chain = caustics != nullptr;
+            path.diffuse_bounce = true;
+
+            for (int j = 0; j < thetas; ++j)
+            {
+                for (int k = 0; k < phis; ++k)
+                {
+                    Ray ray { point, irradiance_direction(basis, j, k, thetas, phis, rng.sample(), rng.sample()) };
+                    double t;
+                    size_t index;
+                    if (!p_scene->intersect_closest(ray, t, index)) continue;
+
+                    distance[j * phis + k] = t;
+                    radiance[j * phis + k] = trace(ray, depth + 1, path, nullptr, nullptr, rng);
+                }
+            }
+
+            // Close to other surfaces the records shrink until they would be denser than the pixels
+            double min_radius = std::max(irradiance_min_radius, irradiance_min_pixels * footprint / irradiance_cache->error);
+            IrradianceRecord record = make_irradiance_record(point, normal, thetas, phis, radiance.data(), distance.data(),
+                min_radius, std::max(min_radius, irradiance_max_radius));
+            irradiance_cache->add(record);
+            return record.irradiance;
+        }
+
+        /** Pdf of scattering towards a direction, mixing the BRDF with the guiding distribution when there is one. */
+        double scatter_pdf(const Material& material, const Ray& ray, const HitResult& hit, const Direction& direction,
+            const DTree* guide) const
+        {
+            double pdf = pdf_brdf(material, ray, hit, direction);
+            if (!guide) return pdf;
+
+            return guiding_brdf_fraction * pdf + (1 - guiding_brdf_fraction) * guide->pdf(normalize(direction));
+        }
+
+        /** Sample the BRDF or the guiding distribution, weighted by the pdf of the mixture. */
+        BRDFSample sample_guided(const Material& material, const Ray& ray, const HitResult& hit, const DTree& guide,
+            UniformRNG& rng) const
+        {
+            double fraction = guiding_brdf_fraction;
+            if (rng.sample() < fraction)
+            {
+                // BRDF * cos and the BRDF's pdf follow from the sample itself
+                BRDFSample sample = sample_brdf(material, ray, hit, rng);
+                if (is_black(sample.weight)) return sample;
+
+                Colorf f = sample.weight * sample.pdf;
+                sample.pdf = fraction * sample.pdf + (1 - fraction) * guide.pdf(normalize(sample.ray.direction));
+                sample.weight = f / sample.pdf;
+                return sample;
+            }
+
+            BRDFSample sample { { hit.point, guide.sample(rng.sample(), rng.sample()) }, {}, 0, false };
+            sample.pdf = scatter_pdf(material, ray, hit, sample.ray.direction, &guide);
+            if (sample.pdf > 0) sample.weight = eval_brdf(material, ray, hit, sample.ray.direction) / sample.pdf;
+            return sample;
+        }
+
+        /*!
+        * @brief Estimate direct lighting at a hit by sampling a point on one light, or the environment
+        *
+        * @param light Set to the light sampled, or ENVIRONMENT_LIGHT, if any
+        * @param mis Whether BRDF sampling also finds the lights, false if the path ends here
+        * @return Radiance Unoccluded emission * BRDF * cos, MIS weighted against BRDF sampling
+        */
+        Radiance sample_direct(const Ray& ray, const HitResult& hit, const Material& material, const DTree* guide,
+            UniformRNG& rng, size_t& light, bool mis = true) const
+        {
+            double pmf;
+            light = ENVIRONMENT_LIGHT;
+            if (!light_sampler.sample(hit.point, hit.normal, rng.sample(), light, pmf)) return {};
+
+            LightSample ls;
+            Radiance emission;
+            if (light == ENVIRONMENT_LIGHT)
+            {
+                const EnvironmentLight& environment = p_scene->environment;
+                if (!environment.sample(rng.sample(), rng.sample(), rng.sample(), ls.direction, ls.pdf)) return {};
+                emission = environment.eval(ls.direction);
+            }
+            else
+            {
+                if (!sample_sphere_light(p_scene->geometry[light], hit.point, rng.sample(), rng.sample(), ls)) return {};
+                emission = p_scene->materials[p_scene->material_ids[light]].emission;
+            }
+
+            Colorf f = eval_brdf(material, ray, hit, ls.direction);
+            if (is_black(f) || is_black(emission)) return {};
+
+            // Shadow ray, the light must be the closest actor in that direction (or nothing for the environment)
+            double t;
+            size_t index;
+            bool occluded = p_scene->intersect_closest({ hit.point, ls.direction }, t, index);
+            if (light == ENVIRONMENT_LIGHT ? occluded : (!occluded || index != light)) return {};
+
+            double light_pdf = pmf * ls.pdf;
+            double weight = mis ? mis_weight(light_pdf, scatter_pdf(material, ray, hit, ls.direction, guide)) : 1;
+            return f * emission * (weight / light_pdf);
         }
     };
 }
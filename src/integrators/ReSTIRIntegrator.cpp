@@ -0,0 +1,326 @@
+#include "ReSTIRIntegrator.h"
+
+namespace pbr
+{
+    /** Most reservoirs merged at once: the pixel's own plus its spatial neighbours */
+    static constexpr int MAX_MERGED = 16;
+
+    void ReSTIRIntegrator::set_scene(const Scene* scene)
+    {
+        p_scene = scene;
+        path.seed = seed;
+        path.set_scene(scene);
+        candidate_sampler.update(*scene);
+        history.clear();
+    }
+
+    double ReSTIRIntegrator::target(const Surface& surface, const LightPoint& y) const
+    {
+        return luminance(contribution(surface, y));
+    }
+
+    Radiance ReSTIRIntegrator::contribution(const Surface& surface, const LightPoint& y) const
+    {
+        // Environment samples are directions, measured in solid angle
+        if (y.light == ENVIRONMENT_LIGHT)
+        {
+            Colorf f = eval_brdf(p_scene->material(surface.hit), surface.ray, surface.hit, y.point);
+            return f * p_scene->environment.eval(y.point);
+        }
+
+        Vec to_light = y.point - surface.hit.point;
+        double dist2 = to_light.sqlen();
+        if (dist2 == 0) return {};
+
+        Direction direction = to_light / std::sqrt(dist2);
+
+        // Only the side of the light that faces the surface is sampled
+        const SphereGeometry& sphere = p_scene->geometry[y.light];
+        double cos_light = -dot(sphere.normal_at(y.point), direction);
+        if (cos_light <= 0) return {};
+
+        Colorf f = eval_brdf(p_scene->material(surface.hit), surface.ray, surface.hit, direction);
+        const Colorf& emission = p_scene->materials[p_scene->material_ids[y.light]].emission;
+        return f * emission * (cos_light / dist2);
+    }
+
+    bool ReSTIRIntegrator::visible(const Surface& surface, const LightPoint& y) const
+    {
+        // Shadow ray, the light must be the closest actor in that direction (or nothing for the environment)
+        double t;
+        size_t index;
+        if (y.light == ENVIRONMENT_LIGHT) return !p_scene->intersect_closest({ surface.hit.point, y.point }, t, index);
+
+        Direction direction = normalize(y.point - surface.hit.point);
+        return p_scene->intersect_closest({ surface.hit.point, direction }, t, index) && index == y.light;
+    }
+
+    Reservoir ReSTIRIntegrator::sample_candidates(const Surface& surface, UniformRNG& rng) const
+    {
+        Reservoir reservoir;
+        reservoir.M = candidates;
+
+        const HitResult& hit = surface.hit;
+        for (int i = 0; i < candidates; ++i)
+        {
+            size_t light;
+            double pmf;
+            if (!candidate_sampler.sample(hit.point, hit.normal, rng.sample(), light, pmf)) continue;
+
+            if (light == ENVIRONMENT_LIGHT)
+            {
+                LightPoint y { light, {} };
+                double pdf;
+                if (!p_scene->environment.sample(rng.sample(), rng.sample(), rng.sample(), y.point, pdf)) continue;
+
+                reservoir.update(y, target(surface, y) / (pmf * pdf * candidates), rng.sample());
+                continue;
+            }
+
+            const SphereGeometry& sphere = p_scene->geometry[light];
+            LightSample ls;
+            if (!sample_sphere_light(sphere, hit.point, rng.sample(), rng.sample(), ls)) continue;
+
+            double t = sphere.intersect({ hit.point, ls.direction });
+            if (t == PBR_INF) continue;
+
+            LightPoint y { light, hit.point + ls.direction * t };
+            double p_hat = target(surface, y);
+            if (p_hat == 0) continue;
+
+            // Solid angle to area pdf
+            double cos_light = -dot(sphere.normal_at(y.point), ls.direction);
+            double pdf = pmf * ls.pdf * cos_light / (t * t);
+
+            reservoir.update(y, p_hat / (pdf * candidates), rng.sample());
+        }
+
+        if (reservoir.weight_sum > 0)
+        {
+            reservoir.W = reservoir.weight_sum / target(surface, reservoir.sample);
+        }
+        return reservoir;
+    }
+
+    Reservoir ReSTIRIntegrator::merge(const Surface* const* surfaces, const Reservoir* const* inputs, int count, UniformRNG& rng) const
+    {
+        Reservoir out;
+        double out_target = 0;
+
+        for (int i = 0; i < count; ++i)
+        {
+            const Reservoir& input = *inputs[i];
+            out.M += input.M;
+            if (input.W == 0) continue;
+
+            double p_hat = target(*surfaces[0], input.sample);
+            if (p_hat == 0) continue;
+
+            // Generalized balance heuristic, weighted by the number of candidates behind each input
+            double numerator = 0, denominator = 0;
+            for (int j = 0; j < count; ++j)
+            {
+                double m = inputs[j]->M * (j == 0 ? p_hat : target(*surfaces[j], input.sample));
+                if (j == i) numerator = m;
+                denominator += m;
+            }
+            if (numerator == 0) continue;
+
+            if (out.update(input.sample, numerator / denominator * p_hat * input.W, rng.sample()))
+            {
+                out_target = p_hat;
+            }
+        }
+
+        if (out.weight_sum > 0) out.W = out.weight_sum / out_target;
+        return out;
+    }
+
+    void ReSTIRIntegrator::render_pass(const Camera& camera, int pass, int cols, int rows, std::vector<Colorf>& accumulation)
+    {
+        size_t count = (size_t) cols * rows;
+
+        // History is only valid for the same image and the same scene
+        bool has_history = temporal_reuse && history.size() == count && history_cols == cols && history_rows == rows
+            && scene_revision == p_scene->revision;
+
+        surfaces.assign(count, {});
+        reservoirs.assign(count, {});
+
+        bool resample_direct = path.light_sampling && path.max_depth > 1;
+
+        // Each row of each of the three steps below draws from its own sequence of the seed
+        auto row_rng = [&](int step, int row) { return UniformRNG(stream_seed(seed, ((uint64_t) pass * 3 + step) * rows + row)); };
+
+        // Primary hits, candidates and everything but the direct light at primary hits
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+        for (int row = 0; row < rows; ++row)
+        {
+            UniformRNG rng = row_rng(0, row);
+            for (int col = 0; col < cols; ++col)
+            {
+                size_t i = (size_t) row * cols + col;
+                RayDifferential differential;
+                Ray ray = pixel_ray(camera, col, row, cols, rows, pass, rng, differential);
+
+                HitResult hit;
+                bool found = resample_direct && p_scene->intersect(ray, hit);
+                if (found && path.follows_differentials()) compute_footprint(*p_scene, differential, hit);
+
+                Radiance color;
+                if (!found || is_delta(p_scene->material(hit)))
+                {
+                    color = path.trace_ray(ray, differential, rng);
+                }
+                else
+                {
+                    surfaces[i] = { ray, hit, true };
+                    reservoirs[i] = sample_candidates(surfaces[i], rng);
+                    color = p_scene->material(hit).emission + path.trace_indirect(ray, differential, hit, rng);
+                }
+                accumulation[i] = accumulation[i] + color;
+            }
+        }
+
+        // Temporal reuse, the previous pass' reservoir of the pixel is resampled for the new hit
+        if (has_history)
+        {
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+            for (int row = 0; row < rows; ++row)
+            {
+                UniformRNG rng = row_rng(1, row);
+                for (int col = 0; col < cols; ++col)
+                {
+                    size_t i = (size_t) row * cols + col;
+                    if (!surfaces[i].valid || !history_surfaces[i].valid) continue;
+
+                    Reservoir previous = history[i];
+                    previous.M = std::min(previous.M, history_limit * candidates);
+
+                    const Surface* merged_surfaces[] = { &surfaces[i], &history_surfaces[i] };
+                    const Reservoir* merged[] = { &reservoirs[i], &previous };
+                    reservoirs[i] = merge(merged_surfaces, merged, 2, rng);
+                }
+            }
+        }
+
+        // Spatial reuse, reading the reservoirs of this pass and writing the next history
+        history.assign(count, {});
+        int neighbours = std::min(spatial_neighbours, MAX_MERGED - 1);
+
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+        for (int row = 0; row < rows; ++row)
+        {
+            UniformRNG rng = row_rng(2, row);
+            for (int col = 0; col < cols; ++col)
+            {
+                size_t i = (size_t) row * cols + col;
+                const Surface& surface = surfaces[i];
+                if (!surface.valid) continue;
+
+                const Surface* merged_surfaces[MAX_MERGED] = { &surface };
+                const Reservoir* merged[MAX_MERGED] = { &reservoirs[i] };
+                int merged_count = 1;
+
+                for (int n = 0; n < neighbours; ++n)
+                {
+                    auto offset = rng.sample_disk();
+                    int x = col + (int) std::lround(offset.x * spatial_radius);
+                    int y = row + (int) std::lround(offset.y * spatial_radius);
+                    if (x < 0 || y < 0 || x >= cols || y >= rows || (x == col && y == row)) continue;
+
+                    // Skip neighbours on a different surface, their samples rarely help here
+                    const Surface& other = surfaces[(size_t) y * cols + x];
+                    if (!other.valid || dot(other.hit.normal, surface.hit.normal) < 0.9) continue;
+                    if (std::abs(other.hit.param - surface.hit.param) > 0.1 * surface.hit.param) continue;
+
+                    merged_surfaces[merged_count] = &other;
+                    merged[merged_count] = &reservoirs[(size_t) y * cols + x];
+                    ++merged_count;
+                }
+
+                Reservoir reservoir = merged_count > 1 ? merge(merged_surfaces, merged, merged_count, rng) : reservoirs[i];
+                history[i] = reservoir;
+                if (reservoir.W == 0) continue;
+
+                const LightPoint& y = reservoir.sample;
+                if (!visible(surface, y)) continue;
+
+                accumulation[i] = accumulation[i] + contribution(surface, y) * reservoir.W;
+            }
+        }
+
+        std::swap(surfaces, history_surfaces);
+        history_cols = cols;
+        history_rows = rows;
+        scene_revision = p_scene->revision;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("integrators::ReSTIRIntegrator")
+    {
+        // Direct light resampled with and without reuse must converge to the path tracer's image
+        Scene scene;
+        auto white = scene.add_material({ Colorf { 0.8 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+        auto light = scene.add_material({ PBR_COLOR_BLACK, Colorf { 4 }, BRDFType::Diffuse });
+        scene.add_actor(white, { Vec { 0, -1000, 0 }, 1000 });
+        scene.add_actor(white, { Vec { 0, 1, 0 }, 1 });
+        scene.add_actor(light, { Vec { -3, 4, 1 }, 0.5 });
+        scene.add_actor(light, { Vec { 3, 3, -1 }, 0.25 });
+
+        Camera camera;
+        camera.position = Vec { 0, 2, 6 };
+        camera.look_at = Vec { 0, 1, 0 };
+        camera.fov = 45;
+        camera.calculate_basis(1);
+
+        const int size = 16, passes = 64;
+        auto mean = [&](auto&& render_pass) {
+            std::vector<Colorf> image(size * size);
+            for (int pass = 0; pass < passes; ++pass) render_pass(pass, image);
+
+            double sum = 0;
+            for (const auto& c : image) sum += luminance(c);
+            return sum / (image.size() * passes);
+        };
+
+        PathIntegrator reference;
+        reference.terminal_radiance = PBR_COLOR_BLACK;
+        reference.set_scene(&scene);
+        double expected = mean([&](int pass, std::vector<Colorf>& image) {
+            UniformRNG rng(stream_seed(1, pass));
+            for (int row = 0; row < size; ++row)
+            {
+                for (int col = 0; col < size; ++col)
+                {
+                    Ray ray = pixel_ray(camera, col, row, size, size, pass, rng);
+                    image[row * size + col] = image[row * size + col] + reference.trace_ray(ray, 0, rng);
+                }
+            }
+        });
+
+        for (bool reuse : { false, true })
+        {
+            ReSTIRIntegrator restir;
+            restir.path.terminal_radiance = PBR_COLOR_BLACK;
+            restir.temporal_reuse = reuse;
+            restir.spatial_neighbours = reuse ? 4 : 0;
+            restir.spatial_radius = 4;
+            restir.set_scene(&scene);
+
+            double actual = mean([&](int pass, std::vector<Colorf>& image) {
+                restir.render_pass(camera, pass, size, size, image);
+            });
+            CHECK(actual == doctest::Approx(expected).epsilon(0.03));
+        }
+    }
+}
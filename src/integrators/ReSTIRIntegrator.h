@@ -0,0 +1,146 @@
+#pragma once
+
+#include "PathIntegrator.h"
+#include <scene/camera.h>
+
+namespace pbr
+{
+    /** A point on the surface of a light, the sample that reservoirs resample. */
+    struct LightPoint
+    {
+        /** Actor index, or ENVIRONMENT_LIGHT */
+        size_t light = 0;
+
+        /** Point on the light, or the unit direction towards the environment */
+        Point point;
+    };
+
+    /*!
+    * @brief Weighted reservoir over light points
+    *
+    * Streams candidates and keeps one with probability proportional to its resampling weight.
+    * W is the unbiased contribution weight of the kept sample, so f(y) * W estimates the integral
+    * of f. M is the number of candidates behind it, which weights the reservoir when it is merged
+    * with others.
+    */
+    struct Reservoir
+    {
+        LightPoint sample;
+        double weight_sum = 0;
+        double M = 0;
+        double W = 0;
+
+        /** Stream a candidate, u is a uniform random number in [0, 1). Returns true if it was kept. */
+        bool update(const LightPoint& candidate, double weight, double u)
+        {
+            if (!(weight > 0)) return false;
+
+            weight_sum += weight;
+            if (u * weight_sum >= weight) return false;
+
+            sample = candidate;
+            return true;
+        }
+    };
+
+    /*!
+    * @brief Direct lighting at primary hits with reservoir resampling (ReSTIR DI)
+    *
+    * After Bitterli et al. 2020, "Spatiotemporal reservoir resampling for real-time ray tracing
+    * with dynamic direct lighting", with the generalized balance heuristic of Lin et al. 2022 to
+    * keep reuse unbiased. Each pass:
+    *   1. Traces the primary hit of every pixel and streams PBR_RESTIR_CANDIDATES light samples
+    *      into its reservoir. The target function is the unshadowed contribution of the light
+    *      point, so cheap candidates (power selection) are enough.
+    *   2. Merges the pixel's reservoir from the previous pass (temporal reuse).
+    *   3. Merges the reservoirs of a few random neighbouring pixels (spatial reuse).
+    *   4. Shades with one shadow ray to the kept light point.
+    *
+    * Everything but the direct light at primary hits (emission seen by the camera, indirect
+    * light, delta surfaces) comes from the PathIntegrator.
+    */
+    class ReSTIRIntegrator
+    {
+    public:
+        /** Traces everything that is not direct light at a primary hit */
+        PathIntegrator path;
+
+        /** Picks the candidate lights */
+        LightSampler candidate_sampler;
+
+        /** Light samples streamed into each pixel's reservoir per pass */
+        int candidates = PBR_RESTIR_CANDIDATES;
+
+        /** Merge the reservoir of the same pixel from the previous pass */
+        bool temporal_reuse = PBR_RESTIR_TEMPORAL_REUSE;
+
+        /** Cap on the M of the previous pass' reservoir, as a multiple of candidates */
+        double history_limit = PBR_RESTIR_HISTORY_LIMIT;
+
+        /** Neighbouring pixels whose reservoirs are merged per pass */
+        int spatial_neighbours = PBR_RESTIR_SPATIAL_NEIGHBOURS;
+
+        /** Radius in pixels in which neighbours are picked */
+        double spatial_radius = PBR_RESTIR_SPATIAL_RADIUS;
+
+        /** Seed of the random numbers, also of the caustic photons of path, the renderer sets that of the render */
+        uint64_t seed = 0;
+
+        ReSTIRIntegrator()
+        {
+            candidate_sampler.selection = PBR_RESTIR_CANDIDATE_SELECTION;
+        }
+
+        void set_scene(const Scene* scene);
+
+        /*!
+        * @brief Render one sample per pixel and add it to a linear image
+        *
+        * Reservoirs are kept from one pass to the next while the image size and the scene's
+        * revision stay the same.
+        *
+        * @param camera Camera, with its basis calculated for the image's aspect ratio
+        * @param pass Index of the pass, picks the stratum of the pixel sample
+        * @param cols Image width in pixels
+        * @param rows Image height in pixels
+        * @param accumulation Row-major linear image, cols * rows
+        */
+        void render_pass(const Camera& camera, int pass, int cols, int rows, std::vector<Colorf>& accumulation);
+
+    private:
+        /** Primary hit of a pixel, only valid where direct light is resampled */
+        struct Surface
+        {
+            Ray ray;
+            HitResult hit;
+            bool valid = false;
+        };
+
+        const Scene* p_scene = nullptr;
+        size_t scene_revision = 0;
+        int history_cols = 0;
+        int history_rows = 0;
+
+        std::vector<Surface> surfaces, history_surfaces;
+        std::vector<Reservoir> reservoirs, history;
+
+        /** Luminance of the unshadowed contribution of a light point to a surface, 0 where it cannot contribute. */
+        double target(const Surface& surface, const LightPoint& y) const;
+
+        /** Emission * BRDF * cos * geometry term of a light point, without visibility. */
+        Radiance contribution(const Surface& surface, const LightPoint& y) const;
+
+        /** Whether nothing blocks the segment from the surface to the light point. */
+        bool visible(const Surface& surface, const LightPoint& y) const;
+
+        Reservoir sample_candidates(const Surface& surface, UniformRNG& rng) const;
+
+        /*!
+        * @brief Merge reservoirs into one for the first surface
+        *
+        * Each input's sample is resampled with the generalized balance heuristic over the
+        * targets of all inputs, so the result stays unbiased with any mix of surfaces.
+        */
+        Reservoir merge(const Surface* const* surfaces, const Reservoir* const* inputs, int count, UniformRNG& rng) const;
+    };
+}
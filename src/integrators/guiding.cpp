@@ -0,0 +1,400 @@
+#include "guiding.h"
+
+#include <algorithm>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Directional quadtree
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Area-preserving map from the sphere to the unit square: ((cos(theta) + 1) / 2, phi / 2 pi). */
+    static Point2D to_square(const Direction& direction)
+    {
+        double phi = std::atan2(direction.y, direction.x);
+        if (phi < 0) phi += 2 * PBR_PI;
+        return { clamp((direction.z + 1) / 2, 0, 1), clamp(phi / (2 * PBR_PI), 0, 1) };
+    }
+
+    static Direction from_square(const Point2D& p)
+    {
+        double cos_theta = 2 * p.x - 1;
+        double sin_theta = std::sqrt(std::max(0., 1 - cos_theta * cos_theta));
+        double phi = 2 * PBR_PI * p.y;
+        return { sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta };
+    }
+
+    /** Quadrant of a point in the unit square, then the point rescaled to the quadrant. */
+    static int descend(Point2D& p)
+    {
+        int qx = p.x >= 0.5, qy = p.y >= 0.5;
+        p.x = std::min(1., p.x * 2 - qx);
+        p.y = std::min(1., p.y * 2 - qy);
+        return qx | (qy << 1);
+    }
+
+    void DTree::record(const Direction& direction, double energy)
+    {
+        Point2D p = to_square(direction);
+        float value = static_cast<float>(energy);
+
+        uint32_t index = 0;
+        while (true)
+        {
+            int q = descend(p);
+#if PBR_USE_THREADS
+#pragma omp atomic
+#endif
+            nodes[index].sum[q] += value;
+
+            if (!nodes[index].child[q]) return;
+            index = nodes[index].child[q];
+        }
+    }
+
+    void DTree::count_sample()
+    {
+#if PBR_USE_THREADS
+#pragma omp atomic
+#endif
+        sample_count += 1;
+    }
+
+    Direction DTree::sample(double u1, double u2) const
+    {
+        Point2D origin { 0, 0 };
+        double size = 1;
+
+        uint32_t index = 0;
+        while (true)
+        {
+            const float* sum = nodes[index].sum;
+
+            // Pick the row by its energy, then the column within the row, reusing the random numbers
+            double top = sum[0] + sum[1], bottom = sum[2] + sum[3];
+            int qy = 0;
+            double p_top = top / (top + bottom);
+            if (u2 < p_top) u2 /= p_top;
+            else
+            {
+                u2 = std::min((u2 - p_top) / (1 - p_top), 0.999999);
+                qy = 1;
+            }
+
+            double left = sum[qy * 2], right = sum[qy * 2 + 1];
+            int qx = 0;
+            double p_left = left / (left + right);
+            if (u1 < p_left) u1 /= p_left;
+            else
+            {
+                u1 = std::min((u1 - p_left) / (1 - p_left), 0.999999);
+                qx = 1;
+            }
+
+            size /= 2;
+            origin.x += qx * size;
+            origin.y += qy * size;
+
+            int q = qx | (qy << 1);
+            if (!nodes[index].child[q]) break;
+            index = nodes[index].child[q];
+        }
+
+        return from_square({ origin.x + u1 * size, origin.y + u2 * size });
+    }
+
+    double DTree::pdf(const Direction& direction) const
+    {
+        Point2D p = to_square(direction);
+
+        // Density on the unit square, each level scales it by 4 * the quadrant's share
+        double density = 1;
+        uint32_t index = 0;
+        while (true)
+        {
+            const float* sum = nodes[index].sum;
+            double total = sum[0] + sum[1] + sum[2] + sum[3];
+            if (total <= 0) return 0;
+
+            int q = descend(p);
+            density *= 4 * sum[q] / total;
+
+            if (!nodes[index].child[q] || density == 0) break;
+            index = nodes[index].child[q];
+        }
+
+        return density / (4 * PBR_PI);
+    }
+
+    DTree DTree::refined(double threshold, int max_depth) const
+    {
+        DTree out;
+        double total = energy();
+        if (!(total > 0)) return out;
+
+        struct Item
+        {
+            uint32_t node;
+
+            /** Node of this tree covering the same region, -1 if this tree is coarser there */
+            int64_t old_node;
+
+            /** Energy of the region, spread evenly where this tree has no node */
+            double energy;
+
+            int depth;
+        };
+
+        std::vector<Item> stack { { 0, 0, total, 1 } };
+        while (!stack.empty())
+        {
+            Item item = stack.back();
+            stack.pop_back();
+
+            for (int q = 0; q < 4; ++q)
+            {
+                double e = item.old_node >= 0 ? nodes[item.old_node].sum[q] : item.energy / 4;
+                out.nodes[item.node].sum[q] = static_cast<float>(e);
+
+                if (item.depth >= max_depth || e <= threshold * total) continue;
+
+                uint32_t child = static_cast<uint32_t>(out.nodes.size());
+                out.nodes.emplace_back();
+                out.nodes[item.node].child[q] = child;
+
+                int64_t old_child = -1;
+                if (item.old_node >= 0 && nodes[item.old_node].child[q]) old_child = nodes[item.old_node].child[q];
+                stack.push_back({ child, old_child, e, item.depth + 1 });
+            }
+        }
+
+        out.sample_count = sample_count;
+        return out;
+    }
+
+    void DTree::reset()
+    {
+        for (auto& node : nodes)
+        {
+            for (float& s : node.sum) s = 0;
+        }
+        sample_count = 0;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // Spatial tree
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Vertices of the first iteration kept to place the tree */
+    static constexpr size_t BOUNDS_RESERVOIR_SIZE = 1 << 16;
+
+    /** Share of the kept vertices on either side of each axis that may fall outside the tree */
+    static constexpr double BOUNDS_OUTLIERS = 0.01;
+
+    void GuidingField::clear()
+    {
+        nodes.clear();
+        trees.clear();
+        bounds_reservoir.clear();
+        bounds_seen = 0;
+    }
+
+    uint32_t GuidingField::leaf(const Point& point) const
+    {
+        Vec extent = bounds_max - bounds_min;
+        double p[3] = {
+            clamp((point.x - bounds_min.x) / extent.x),
+            clamp((point.y - bounds_min.y) / extent.y),
+            clamp((point.z - bounds_min.z) / extent.z),
+        };
+
+        uint32_t index = 0;
+        while (nodes[index].child)
+        {
+            double& v = p[nodes[index].axis];
+            if (v < 0.5)
+            {
+                index = nodes[index].child;
+                v *= 2;
+            }
+            else
+            {
+                index = nodes[index].child + 1;
+                v = v * 2 - 1;
+            }
+        }
+        return nodes[index].trees;
+    }
+
+    const DTree* GuidingField::sampling_tree(const Point& point) const
+    {
+        if (trees.empty()) return nullptr;
+
+        const DTree& tree = trees[leaf(point)].sampling;
+        return tree.energy() > 0 ? &tree : nullptr;
+    }
+
+    void GuidingField::record(const GuidingPath& path)
+    {
+        if (trees.empty())
+        {
+            if (path.size == 0) return;
+
+            // First iteration, only keep a reservoir of the vertices to place the tree
+#if PBR_USE_THREADS
+#pragma omp critical(pbr_guiding_bounds)
+#endif
+            for (int i = 0; i < path.size; ++i)
+            {
+                uint64_t seen = bounds_seen++;
+                if (seen < BOUNDS_RESERVOIR_SIZE)
+                {
+                    bounds_reservoir.push_back(path.vertices[i].point);
+                    continue;
+                }
+
+                // splitmix64 of the count, in place of a random number generator shared by the threads
+                uint64_t z = (seen + 1) * 0x9e3779b97f4a7c15ull;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                z ^= z >> 31;
+                if (z % (seen + 1) < BOUNDS_RESERVOIR_SIZE) bounds_reservoir[z % BOUNDS_RESERVOIR_SIZE] = path.vertices[i].point;
+            }
+            return;
+        }
+
+        for (int i = 0; i < path.size; ++i)
+        {
+            const GuidingPath::Vertex& v = path.vertices[i];
+            DTree& tree = trees[leaf(v.point)].building;
+            tree.count_sample();
+
+            // Monte Carlo estimate of the radiance integrated over the direction's quadrant
+            double energy = luminance(v.radiance) / v.pdf;
+            if (energy > 0 && std::isfinite(energy)) tree.record(v.direction, energy);
+        }
+    }
+
+    void GuidingField::split(uint32_t node, double threshold)
+    {
+        std::vector<uint32_t> stack { node };
+        while (!stack.empty())
+        {
+            uint32_t index = stack.back();
+            stack.pop_back();
+
+            if (nodes[index].child)
+            {
+                stack.push_back(nodes[index].child);
+                stack.push_back(nodes[index].child + 1);
+                continue;
+            }
+
+            uint32_t leaf_trees = nodes[index].trees;
+            if (trees[leaf_trees].building.samples() <= threshold) continue;
+
+            // Both halves start from the parent's trees, with half of its samples each
+            trees[leaf_trees].building.halve_samples();
+            trees.push_back(trees[leaf_trees]);
+
+            uint8_t axis = (nodes[index].axis + 1) % 3;
+            uint32_t child = static_cast<uint32_t>(nodes.size());
+            nodes.push_back({ 0, leaf_trees, axis });
+            nodes.push_back({ 0, static_cast<uint32_t>(trees.size() - 1), axis });
+            nodes[index].child = child;
+
+            stack.push_back(child);
+            stack.push_back(child + 1);
+        }
+    }
+
+    void GuidingField::refine(int samples_per_pixel)
+    {
+        if (trees.empty())
+        {
+            if (bounds_reservoir.empty()) return;
+
+            // Bounds of the bulk of the kept vertices, per axis
+            size_t count = bounds_reservoir.size();
+            size_t lo = static_cast<size_t>(BOUNDS_OUTLIERS * count), hi = count - 1 - lo;
+            std::vector<double> values(count);
+            double* mins[3] = { &bounds_min.x, &bounds_min.y, &bounds_min.z };
+            double* maxs[3] = { &bounds_max.x, &bounds_max.y, &bounds_max.z };
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                for (size_t i = 0; i < count; ++i)
+                {
+                    const Point& p = bounds_reservoir[i];
+                    values[i] = axis == 0 ? p.x : axis == 1 ? p.y : p.z;
+                }
+                std::nth_element(values.begin(), values.begin() + lo, values.end());
+                *mins[axis] = values[lo];
+                std::nth_element(values.begin(), values.begin() + hi, values.end());
+                *maxs[axis] = values[hi];
+            }
+            bounds_reservoir = {};
+
+            // A cube around them, slightly enlarged
+            Vec extent = bounds_max - bounds_min;
+            double size = std::max(std::max(extent.x, extent.y), extent.z) * 1.02 + PBR_EPSILON;
+            Point center = (bounds_min + bounds_max) / 2;
+            bounds_min = center - Vec { size / 2 };
+            bounds_max = center + Vec { size / 2 };
+
+            nodes.assign(1, {});
+            trees.assign(1, {});
+            return;
+        }
+
+        for (auto& t : trees) t.sampling = t.building.refined(directional_threshold, directional_depth);
+
+        split(0, spatial_threshold * std::sqrt(double(samples_per_pixel)));
+
+        for (auto& t : trees)
+        {
+            t.building = t.sampling;
+            t.building.reset();
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("guiding::DTree")
+    {
+        // Learn a distribution concentrated in a cone around +x
+        DTree tree;
+        UniformRNG rng;
+        Direction target = normalize(Vec { 1, 0.2, 0.3 });
+        for (int iteration = 0; iteration < 3; ++iteration)
+        {
+            for (int i = 0; i < 20000; ++i)
+            {
+                Direction d = normalize(rng.sample_hemisphere() - Vec { 0, 0, 0.5 } + target);
+                tree.record(d, dot(d, target) > 0.95 ? 1.0 : 0.01);
+            }
+            tree = tree.refined(0.01, 20);
+        }
+        REQUIRE(tree.energy() > 0);
+        CHECK(tree.size() > 1);
+
+        // The pdf integrates to one and matches the sampled directions, which favour the cone
+        constexpr int N = 20000;
+        double integral = 0;
+        int in_cone = 0, pdf_mismatches = 0;
+        for (int i = 0; i < N; ++i)
+        {
+            Direction uniform = rng.sample_hemisphere();
+            if (rng.sample() < 0.5) uniform.z = -uniform.z;
+            integral += tree.pdf(uniform) * 4 * PBR_PI;
+
+            Direction d = tree.sample(rng.sample(), rng.sample());
+            if (dot(d, target) > 0.95) ++in_cone;
+            if (!(tree.pdf(d) > 0)) ++pdf_mismatches;
+        }
+        CHECK(integral / N == doctest::Approx(1).epsilon(0.05));
+        CHECK(pdf_mismatches == 0);
+        CHECK(in_cone > N / 2);
+    }
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <core/math_definitions.h>
+#include <materials/radiometry.h>
+#include <config.h>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Path guiding
+    //   Müller et al. 2017, "Practical path guiding for efficient light-transport simulation"
+    //
+    // A binary tree over space whose leaves each hold a quadtree over directions.
+    // Paths record the radiance they find into the quadtree of every vertex they
+    // leave, and after each training iteration the quadtrees are refined where
+    // they collected the most energy, then used to sample the next iteration.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /*!
+    * @brief Quadtree over the sphere of directions, mapped to the unit square by (cos(theta), phi)
+    *
+    * The mapping preserves area, so a direction's solid angle pdf is its density on the square
+    * over 4 pi. Every node keeps the energy of its four quadrants, deeper nodes split the
+    * quadrants that received more of it.
+    */
+    class DTree
+    {
+    public:
+        DTree() : nodes(1) {}
+
+        /** Add energy around a direction. Thread-safe. */
+        void record(const Direction& direction, double energy);
+
+        /** Count a recorded sample, also for samples that found no energy. Thread-safe. */
+        void count_sample();
+
+        /*!
+        * @brief Sample a direction in proportion to the energy
+        *
+        * @param u1 Uniform random number in [0, 1)
+        * @param u2 Uniform random number in [0, 1)
+        * @return Direction Unit direction
+        */
+        Direction sample(double u1, double u2) const;
+
+        /** Solid angle pdf with which sample() picks a direction. */
+        double pdf(const Direction& direction) const;
+
+        /** Total energy, 0 until something was recorded. */
+        double energy() const { return nodes[0].sum[0] + nodes[0].sum[1] + nodes[0].sum[2] + nodes[0].sum[3]; }
+
+        double samples() const { return sample_count; }
+        size_t size() const { return nodes.size(); }
+
+        /*!
+        * @brief Rebuild the structure from the recorded energy
+        *
+        * @param threshold Fraction of the total energy above which a quadrant is split
+        * @param max_depth Deepest level of the new tree
+        * @return DTree Tree with the new structure, holding the energy of this one
+        */
+        DTree refined(double threshold, int max_depth) const;
+
+        /** Zero the energy and the sample count, keeping the structure. */
+        void reset();
+
+        /** Halve the sample count, for the two halves of a split region. */
+        void halve_samples() { sample_count /= 2; }
+
+    private:
+        struct Node
+        {
+            float sum[4] = {};
+
+            /** Index of each quadrant's node, 0 for leaves */
+            uint32_t child[4] = {};
+        };
+
+        std::vector<Node> nodes;
+        double sample_count = 0;
+    };
+
+    /** Up to PBR_GUIDING_MAX_VERTICES vertices of a path, with the radiance later found along each of their scattered rays. */
+    struct GuidingPath
+    {
+        struct Vertex
+        {
+            Point point;
+            Direction direction;
+
+            /** Pdf of the scattered direction */
+            double pdf;
+
+            /** Path throughput including the vertex's scattering weight */
+            Colorf throughput;
+
+            /** Radiance arriving at the vertex along the direction */
+            Radiance radiance;
+        };
+
+        Vertex vertices[PBR_GUIDING_MAX_VERTICES];
+        int size = 0;
+
+        void add_vertex(const Point& point, const Direction& direction, double pdf, const Colorf& throughput)
+        {
+            if (size < PBR_GUIDING_MAX_VERTICES) vertices[size++] = { point, direction, pdf, throughput, {} };
+        }
+
+        /** Credit a contribution to the camera (throughput * radiance) to every vertex before it. */
+        void add_radiance(const Radiance& contribution)
+        {
+            for (int i = 0; i < size; ++i)
+            {
+                const Colorf& t = vertices[i].throughput;
+                Radiance& r = vertices[i].radiance;
+                if (t.x > 0) r.x += contribution.x / t.x;
+                if (t.y > 0) r.y += contribution.y / t.y;
+                if (t.z > 0) r.z += contribution.z / t.z;
+            }
+        }
+    };
+
+    /*!
+    * @brief Spatial binary tree of directional quadtrees (SD-tree)
+    *
+    * Each leaf holds the quadtree that is sampled this iteration and the one that records it for
+    * the next. The first iteration only finds the bounds of the path vertices, from a random subset
+    * of them so the few that land far away on huge actors do not stretch the tree over empty space.
+    */
+    class GuidingField
+    {
+    public:
+        /** A leaf is split in two once it records more than this many times sqrt(samples per pixel of the iteration) */
+        double spatial_threshold = PBR_GUIDING_SPATIAL_THRESHOLD;
+
+        /** Fraction of a quadtree's energy above which a quadrant is split */
+        double directional_threshold = PBR_GUIDING_DIRECTIONAL_THRESHOLD;
+
+        /** Deepest level of the quadtrees */
+        int directional_depth = 20;
+
+        /** Forget everything learned. */
+        void clear();
+
+        /** Quadtree to sample around a point, nullptr until one has learned anything there. */
+        const DTree* sampling_tree(const Point& point) const;
+
+        /** Record the radiance found by a path into the quadtrees of its vertices. Thread-safe. */
+        void record(const GuidingPath& path);
+
+        /*!
+        * @brief End a training iteration: split busy regions, refine the quadtrees and sample them next
+        *
+        * @param samples_per_pixel Samples per pixel that the iteration rendered
+        */
+        void refine(int samples_per_pixel);
+
+        /** Number of spatial leaves, 0 before the first refinement. */
+        size_t leaves() const { return trees.size(); }
+
+    private:
+        struct Node
+        {
+            /** Index of the first of the two children, 0 for leaves */
+            uint32_t child = 0;
+
+            /** Index of the leaf's trees */
+            uint32_t trees = 0;
+
+            uint8_t axis = 0;
+        };
+
+        struct Trees
+        {
+            DTree sampling;
+            DTree building;
+        };
+
+        std::vector<Node> nodes;
+        std::vector<Trees> trees;
+
+        /** Bounds of the tree, points outside are clamped in */
+        Point bounds_min;
+        Point bounds_max;
+
+        /** Uniform random subset of the vertices of the first iteration, and how many there were */
+        std::vector<Point> bounds_reservoir;
+        uint64_t bounds_seen = 0;
+
+        /** Leaf that contains a point, clamped into the bounds. */
+        uint32_t leaf(const Point& point) const;
+
+        void split(uint32_t node, double threshold);
+    };
+}
@@ -0,0 +1,282 @@
+#include "irradiance_cache.h"
+
+#include <mutex>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Records
+    ///////////////////////////////////////////////////////////////////////////////
+
+    IrradianceRecord make_irradiance_record(const Point& point, const Vec& normal, int thetas, int phis,
+        const Radiance* radiance, const double* distance, double min_radius, double max_radius)
+    {
+        Basis basis = make_basis(normal);
+        auto L = [&](int j, int k) { return radiance[j * phis + k]; };
+        auto r = [&](int j, int k) { return distance[j * phis + k]; };
+
+        IrradianceRecord record { point, normal };
+
+        Radiance sum;
+        double inverse_distance = 0;
+        for (int i = 0; i < thetas * phis; ++i)
+        {
+            sum = sum + radiance[i];
+            inverse_distance += 1 / distance[i];
+        }
+        record.irradiance = sum * (PBR_PI / (thetas * phis));
+
+        for (int k = 0; k < phis; ++k)
+        {
+            double phi = 2 * PBR_PI * (k + 0.5) / phis;
+            Vec u = to_world(basis, { std::cos(phi), std::sin(phi), 0 });
+            Vec v = to_world(basis, { -std::sin(phi), std::cos(phi), 0 });
+
+            // Sector boundary shared with the previous sector, and the direction across it
+            double phi_minus = 2 * PBR_PI * k / phis;
+            Vec v_minus = to_world(basis, { -std::sin(phi_minus), std::cos(phi_minus), 0 });
+            int previous = (k + phis - 1) % phis;
+
+            Radiance tilted;
+            for (int j = 0; j < thetas; ++j)
+            {
+                double sin2_minus = double(j) / thetas, sin2_plus = double(j + 1) / thetas;
+                double sin_minus = std::sqrt(sin2_minus), sin_plus = std::sqrt(sin2_plus);
+                double cos_minus = std::sqrt(1 - sin2_minus), cos_plus = std::sqrt(1 - sin2_plus);
+
+                // Tilting the normal towards the sector weights its cosine-distributed cells by tan(theta),
+                // averaged over the ring since it grows without bound towards the horizon
+                double tan_mean = (std::asin(sin_plus) - sin_plus * cos_plus - std::asin(sin_minus) + sin_minus * cos_minus)
+                    / (sin2_plus - sin2_minus);
+                tilted = tilted + L(j, k) * tan_mean;
+
+                // Moving the point shifts the boundaries between cells by their distance, closer surfaces faster
+                Radiance change;
+                if (j > 0)
+                {
+                    double weight = 2 * PBR_PI / phis * sin_minus * cos_minus * cos_minus / std::min(r(j, k), r(j - 1, k));
+                    change = (L(j, k) - L(j - 1, k)) * weight;
+                    for (int c = 0; c < 3; ++c) record.translation_gradient[c] = record.translation_gradient[c] + u * change[c];
+                }
+                double weight = (sin_plus - sin_minus) / std::min(r(j, k), r(j, previous));
+                change = (L(j, k) - L(j, previous)) * weight;
+                for (int c = 0; c < 3; ++c) record.translation_gradient[c] = record.translation_gradient[c] + v_minus * change[c];
+            }
+            for (int c = 0; c < 3; ++c) record.rotation_gradient[c] = record.rotation_gradient[c] + v * tilted[c];
+        }
+        for (auto& gradient : record.rotation_gradient) gradient = gradient * (PBR_PI / (thetas * phis));
+
+        // Valid up to the harmonic mean distance to the surfaces around
+        double radius = inverse_distance > 0 ? thetas * phis / inverse_distance : max_radius;
+        record.radius = clamp(radius, min_radius, max_radius);
+        return record;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // Octree
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static bool inside(const Vec& point, const Bounds& bounds)
+    {
+        return point.x >= bounds.min.x && point.y >= bounds.min.y && point.z >= bounds.min.z
+            && point.x <= bounds.max.x && point.y <= bounds.max.y && point.z <= bounds.max.z;
+    }
+
+    static bool overlaps(const Bounds& a, const Bounds& b)
+    {
+        return a.min.x <= b.max.x && a.min.y <= b.max.y && a.min.z <= b.max.z
+            && b.min.x <= a.max.x && b.min.y <= a.max.y && b.min.z <= a.max.z;
+    }
+
+    static Bounds octant(const Bounds& bounds, int child)
+    {
+        Vec mid = bounds.center();
+        return {
+            { child & 1 ? mid.x : bounds.min.x, child & 2 ? mid.y : bounds.min.y, child & 4 ? mid.z : bounds.min.z },
+            { child & 1 ? bounds.max.x : mid.x, child & 2 ? bounds.max.y : mid.y, child & 4 ? bounds.max.z : mid.z },
+        };
+    }
+
+    void IrradianceCache::reset(const Bounds& bounds_)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        records.clear();
+        nodes.assign(1, Node {});
+        bounds = bounds_;
+    }
+
+    void IrradianceCache::add(const IrradianceRecord& record)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto index = static_cast<uint32_t>(records.size());
+        records.push_back(record);
+
+        Bounds area = Bounds::around_sphere(record.point, error * record.radius);
+        if (bounds.empty()) bounds = area;
+        while (!inside(area.min, bounds) || !inside(area.max, bounds)) grow(area);
+        insert(0, bounds, 0, index, area);
+    }
+
+    void IrradianceCache::grow(const Bounds& area)
+    {
+        // Double the bounds towards the area, the old root becomes the octant on the other side
+        bool below_x = area.min.x < bounds.min.x, below_y = area.min.y < bounds.min.y, below_z = area.min.z < bounds.min.z;
+        Vec d = bounds.diagonal();
+        bounds = {
+            { below_x ? bounds.min.x - d.x : bounds.min.x, below_y ? bounds.min.y - d.y : bounds.min.y, below_z ? bounds.min.z - d.z : bounds.min.z },
+            { below_x ? bounds.max.x : bounds.max.x + d.x, below_y ? bounds.max.y : bounds.max.y + d.y, below_z ? bounds.max.z : bounds.max.z + d.z },
+        };
+
+        nodes.push_back(std::move(nodes[0]));
+        nodes[0] = Node {};
+        nodes[0].child[below_x | (below_y << 1) | (below_z << 2)] = static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+    void IrradianceCache::insert(uint32_t node, const Bounds& node_bounds, int depth, uint32_t record, const Bounds& area)
+    {
+        if (depth == max_depth || node_bounds.diagonal().sqlen() < area.diagonal().sqlen())
+        {
+            nodes[node].records.push_back(record);
+            return;
+        }
+
+        for (int c = 0; c < 8; ++c)
+        {
+            Bounds child_bounds = octant(node_bounds, c);
+            if (!overlaps(child_bounds, area)) continue;
+
+            if (!nodes[node].child[c])
+            {
+                nodes[node].child[c] = static_cast<uint32_t>(nodes.size());
+                nodes.emplace_back();
+            }
+            insert(nodes[node].child[c], child_bounds, depth + 1, record, area);
+        }
+    }
+
+    bool IrradianceCache::interpolate(const Point& point, const Vec& normal, Colorf& out) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+
+        Colorf sum;
+        double total = 0;
+        auto visit = [&](const Node& node) {
+            for (uint32_t index : node.records)
+            {
+                const IrradianceRecord& record = records[index];
+                Vec offset = point - record.point;
+
+                // A record in front of the point sees surfaces that the point does not
+                if (dot(offset, normal + record.normal) * 0.5 < -0.05 * record.radius) continue;
+
+                // Ward's error, weighted so records fade out where it reaches the limit
+                double e = offset.len() / record.radius + std::sqrt(std::max(0., 1 - dot(normal, record.normal)));
+                if (e >= error) continue;
+                double weight = 1 / std::max(e, 1e-6) - 1 / error;
+
+                Vec axis = cross(record.normal, normal);
+                const Vec* rotation = record.rotation_gradient;
+                const Vec* translation = record.translation_gradient;
+                Colorf irradiance = record.irradiance
+                    + Colorf { dot(axis, rotation[0]), dot(axis, rotation[1]), dot(axis, rotation[2]) }
+                    + Colorf { dot(offset, translation[0]), dot(offset, translation[1]), dot(offset, translation[2]) };
+                sum = sum + vmax(irradiance, Colorf { 0 }) * weight;
+                total += weight;
+            }
+        };
+
+        // Every area of validity is inside the bounds
+        if (!bounds.empty() && inside(point, bounds))
+        {
+            uint32_t node = 0;
+            visit(nodes[0]);
+            Bounds node_bounds = bounds;
+            while (true)
+            {
+                Vec mid = node_bounds.center();
+                int c = (point.x >= mid.x) | ((point.y >= mid.y) << 1) | ((point.z >= mid.z) << 2);
+                if (!nodes[node].child[c]) break;
+
+                node = nodes[node].child[c];
+                node_bounds = octant(node_bounds, c);
+                visit(nodes[node]);
+            }
+        }
+
+        if (total <= 0) return false;
+        out = sum / total;
+        return true;
+    }
+
+    size_t IrradianceCache::size() const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return records.size();
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("integrators::IrradianceCache")
+    {
+        const Vec up { 0, 0, 1 };
+        Basis basis = make_basis(up);
+
+        // Radiance over the hemisphere of a point on the z = 0 floor, at the centers of the cells
+        auto record_of = [&](int thetas, int phis, auto&& incident) {
+            std::vector<Radiance> radiance(thetas * phis);
+            std::vector<double> distance(thetas * phis);
+            for (int j = 0; j < thetas; ++j)
+            {
+                for (int k = 0; k < phis; ++k)
+                {
+                    Direction d = irradiance_direction(basis, j, k, thetas, phis, 0.5, 0.5);
+                    incident(d, radiance[j * phis + k], distance[j * phis + k]);
+                }
+            }
+            return make_irradiance_record({}, up, thetas, phis, radiance.data(), distance.data(), 1e-3, 1e3);
+        };
+
+        // A sky of radiance 1 + x: E(n) = pi + 2 pi / 3 n.x, which grows when the normal turns about y towards x
+        auto sky = record_of(32, 100, [](const Direction& d, Radiance& L, double& r) { L = Colorf { 1 + d.x }; r = PBR_INF; });
+        CHECK(sky.irradiance.x == doctest::Approx(PBR_PI).epsilon(0.01));
+        CHECK(sky.rotation_gradient[0].y == doctest::Approx(2 * PBR_PI / 3).epsilon(0.05));
+        CHECK(std::abs(sky.rotation_gradient[0].x) < 0.01);
+        CHECK(sky.radius == doctest::Approx(1e3));
+
+        // A wall of radiance 1 and height 1 at x = distance: the translation gradient matches finite differences
+        auto wall = [&](double distance) {
+            return record_of(128, 400, [&](const Direction& d, Radiance& L, double& r) {
+                double t = d.x > 0 ? distance / d.x : PBR_INF;
+                bool hit = d.x > 0 && t * d.z < 1;
+                L = hit ? Colorf { 1 } : Colorf { 0 };
+                r = hit ? t : PBR_INF;
+            });
+        };
+        double h = 0.05;
+        double expected = -(wall(1 + h).irradiance.x - wall(1 - h).irradiance.x) / (2 * h);
+        IrradianceRecord record = wall(1);
+        CHECK(expected > 0);
+        CHECK(record.translation_gradient[0].x == doctest::Approx(expected).epsilon(0.1));
+        CHECK(std::abs(record.translation_gradient[0].y) < 0.05 * expected);
+
+        // Lookups find the records within error * radius that face the same way, also where the octree grew to
+        IrradianceCache cache;
+        cache.error = 0.2;
+        cache.reset({ Vec { -10 }, Vec { 10 } });
+        IrradianceRecord flat { {}, up, Colorf { 2 } };
+        flat.radius = 1;
+        cache.add(flat);
+        flat.point = Vec { 100, 0, 0 };
+        cache.add(flat);
+        REQUIRE(cache.size() == 2);
+
+        Colorf irradiance;
+        REQUIRE(cache.interpolate({ 0.05, 0, 0 }, up, irradiance));
+        CHECK(irradiance.x == doctest::Approx(2));
+        CHECK_FALSE(cache.interpolate({ 0.5, 0, 0 }, up, irradiance));
+        CHECK_FALSE(cache.interpolate({ 0.05, 0, 0 }, up * -1, irradiance));
+        CHECK(cache.interpolate({ 100, 0.1, 0 }, up, irradiance));
+    }
+}
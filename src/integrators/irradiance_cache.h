@@ -0,0 +1,136 @@
+#pragma once
+
+#include <core/math_definitions.h>
+#include <materials/radiometry.h>
+#include <config.h>
+
+#include <shared_mutex>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Irradiance cache
+    //   Ward et al. 1988, "A ray tracing solution for diffuse interreflection"
+    //   Ward and Heckbert 1992, "Irradiance gradients"
+    //
+    // Indirect irradiance on Lambertian surfaces changes slowly, except close to
+    // other surfaces. It is estimated from a full hemisphere of rays at a sparse
+    // set of records and interpolated between them, each record valid over a
+    // radius set by the distance to the surfaces around it. The error estimate
+    // of the existing records decides where a new one is needed. Gradients of
+    // the irradiance along the surface and under rotation of the normal,
+    // estimated from the same rays, extrapolate each record to the lookup point.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Indirect irradiance estimated at a point, with its gradients. */
+    struct IrradianceRecord
+    {
+        Point point {};
+        Vec normal {};
+        Colorf irradiance {};
+
+        /** Change of each channel per unit of distance along the surface */
+        Vec translation_gradient[3] {};
+
+        /** Change of each channel per radian of rotation of the normal, about the axis of the rotation */
+        Vec rotation_gradient[3] {};
+
+        /** Harmonic mean distance to the surfaces around, clamped. The record is valid up to error * radius away. */
+        double radius = 0;
+    };
+
+    /*!
+    * @brief Cosine-weighted direction of a cell of the stratified hemisphere
+    *
+    * The hemisphere is split into thetas rings of equal projected area and phis sectors.
+    *
+    * @param basis Basis with w along the normal
+    * @param j Ring, 0 around the normal
+    * @param k Sector
+    * @param u1 Uniform random number in [0, 1) placing the direction in the ring
+    * @param u2 Uniform random number in [0, 1) placing the direction in the sector
+    */
+    inline Direction irradiance_direction(const Basis& basis, int j, int k, int thetas, int phis, double u1, double u2)
+    {
+        double sin2 = (j + u1) / thetas;
+        double sin_theta = std::sqrt(sin2);
+        double phi = 2 * PBR_PI * (k + u2) / phis;
+        return to_world(basis, { sin_theta * std::cos(phi), sin_theta * std::sin(phi), std::sqrt(std::max(0., 1 - sin2)) });
+    }
+
+    /*!
+    * @brief Estimate a record from the incident radiance of the cells of the stratified hemisphere
+    *
+    * @param point Point of the record
+    * @param normal Unit normal, the basis of the directions is make_basis(normal)
+    * @param thetas Rings of the hemisphere
+    * @param phis Sectors of the hemisphere
+    * @param radiance Radiance arriving through each cell, ring-major (j * phis + k)
+    * @param distance Distance to the surface seen through each cell, PBR_INF if none
+    * @param min_radius Smallest radius of the record
+    * @param max_radius Largest radius of the record
+    * @return IrradianceRecord Irradiance, gradients and radius
+    */
+    IrradianceRecord make_irradiance_record(const Point& point, const Vec& normal, int thetas, int phis,
+        const Radiance* radiance, const double* distance, double min_radius, double max_radius);
+
+    /*!
+    * @brief Irradiance records in an octree over their areas of validity
+    *
+    * A record is stored in every node that its area of validity overlaps, from the depth where
+    * the nodes are about as large as that area, so a lookup only visits the nodes along the path
+    * to the leaf of its point. A record that reaches outside the bounds of the tree doubles them
+    * until it fits, under a new root. Records are added while the image renders, lookups share a
+    * lock that adding takes exclusively.
+    */
+    class IrradianceCache
+    {
+    public:
+        /** Largest error of a record that is still used (Ward's a), which also spaces the records */
+        double error = PBR_IRRADIANCE_CACHE_ERROR;
+
+        /** Deepest level of the octree */
+        int max_depth = 16;
+
+        IrradianceCache() { reset({}); }
+
+        IrradianceCache(const IrradianceCache&) = delete;
+        IrradianceCache& operator=(const IrradianceCache&) = delete;
+
+        /** Remove all records and start the octree at the bounds, empty bounds start it at the first record. */
+        void reset(const Bounds& bounds);
+
+        /** Add a record. Thread-safe. */
+        void add(const IrradianceRecord& record);
+
+        /*!
+        * @brief Interpolate the irradiance at a point from the records whose error there is below error. Thread-safe.
+        *
+        * @param point Lookup point
+        * @param normal Unit surface normal on the side of the lookup
+        * @param out Weighted mean of the records, each extrapolated along its gradients
+        * @return bool False if no record is close enough, and a new one is needed
+        */
+        bool interpolate(const Point& point, const Vec& normal, Colorf& out) const;
+
+        size_t size() const;
+
+    private:
+        struct Node
+        {
+            /** Index of each octant's node, 0 for none */
+            uint32_t child[8] = {};
+
+            std::vector<uint32_t> records;
+        };
+
+        std::vector<IrradianceRecord> records;
+        std::vector<Node> nodes;
+        Bounds bounds;
+
+        mutable std::shared_mutex mutex;
+
+        void insert(uint32_t node, const Bounds& node_bounds, int depth, uint32_t record, const Bounds& area);
+        void grow(const Bounds& area);
+    };
+}
@@ -0,0 +1,334 @@
+#include "photons.h"
+
+#include <core/alias_table.h>
+#include <lights/light.h>
+#include <debug.h>
+
+#include <algorithm>
+
+namespace pbr
+{
+    /** Delta bounces a photon follows before it is dropped */
+    static constexpr int MAX_PHOTON_BOUNCES = 8;
+
+    /** Photons traced from one random sequence, and chunks of them traced in parallel before the budget is checked */
+    static constexpr int64_t PHOTON_CHUNK = 4096;
+    static constexpr int64_t PHOTON_BATCH = 64;
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // kd-tree
+    ///////////////////////////////////////////////////////////////////////////////
+
+    PhotonMap::PhotonMap(std::vector<Photon> photons_)
+        : photons(std::move(photons_))
+    {
+        build(0, photons.size());
+    }
+
+    void PhotonMap::build(size_t begin, size_t end)
+    {
+        if (end - begin <= 1)
+        {
+            if (begin < end) photons[begin].axis = 0;
+            return;
+        }
+
+        float lo[3] = { PBR_INF, PBR_INF, PBR_INF }, hi[3] = { -PBR_INF, -PBR_INF, -PBR_INF };
+        for (size_t i = begin; i < end; ++i)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                lo[a] = std::min(lo[a], photons[i].position[a]);
+                hi[a] = std::max(hi[a], photons[i].position[a]);
+            }
+        }
+        uint8_t axis = 0;
+        if (hi[1] - lo[1] > hi[axis] - lo[axis]) axis = 1;
+        if (hi[2] - lo[2] > hi[axis] - lo[axis]) axis = 2;
+
+        size_t mid = begin + (end - begin) / 2;
+        std::nth_element(photons.begin() + begin, photons.begin() + mid, photons.begin() + end,
+            [axis](const Photon& a, const Photon& b) { return a.position[axis] < b.position[axis]; });
+        photons[mid].axis = axis;
+
+        build(begin, mid);
+        build(mid + 1, end);
+    }
+
+    void PhotonMap::nearest(const Point& point, const Vec& normal, int count, double max_radius, Neighbours& out) const
+    {
+        count = std::min(count, MAX_GATHER);
+        out.size = 0;
+        out.radius2 = max_radius * max_radius;
+        if (photons.empty() || count <= 0) return;
+
+        // Max-heap on distance while fewer than count are found, then the farthest is replaced
+        double radius2 = out.radius2;
+        double max_offset = 0.25 * max_radius;
+
+        // Ranges keep the squared distance to their splitting plane, so those that the shrinking
+        // radius has left behind are skipped when they come off the stack
+        struct Range
+        {
+            size_t begin;
+            size_t end;
+            double plane2;
+        };
+        Range stack[64];
+        int top = 0;
+        stack[top++] = { 0, photons.size(), 0 };
+
+        while (top > 0)
+        {
+            Range range = stack[--top];
+            if (range.begin >= range.end || range.plane2 >= radius2) continue;
+
+            size_t mid = range.begin + (range.end - range.begin) / 2;
+            const Photon& photon = photons[mid];
+
+            Vec offset { photon.position[0] - point.x, photon.position[1] - point.y, photon.position[2] - point.z };
+            double dist2 = offset.sqlen();
+            bool facing = photon.normal[0] * normal.x + photon.normal[1] * normal.y + photon.normal[2] * normal.z > 0;
+            if (dist2 < radius2 && facing && std::abs(dot(offset, normal)) <= max_offset)
+            {
+                Neighbour neighbour { static_cast<float>(dist2), static_cast<uint32_t>(mid) };
+                if (out.size < count)
+                {
+                    out.found[out.size++] = neighbour;
+                    std::push_heap(out.found.begin(), out.found.begin() + out.size);
+                }
+                else
+                {
+                    std::pop_heap(out.found.begin(), out.found.begin() + out.size);
+                    out.found[out.size - 1] = neighbour;
+                    std::push_heap(out.found.begin(), out.found.begin() + out.size);
+                }
+                if (out.size == count) radius2 = out.found[0].dist2;
+            }
+
+            // Near side last, so it is visited first
+            double d = -offset[photon.axis];
+            Range left { range.begin, mid, 0 }, right { mid + 1, range.end, 0 };
+            Range& near = d < 0 ? left : right;
+            Range& far = d < 0 ? right : left;
+            far.plane2 = d * d;
+            if (far.plane2 < radius2) stack[top++] = far;
+            stack[top++] = near;
+        }
+
+        if (out.size == count) out.radius2 = radius2;
+    }
+
+    PhotonMap PhotonMap::precompute_irradiance(int count, double max_radius, int stride) const
+    {
+        std::vector<Photon> kept((photons.size() + stride - 1) / stride);
+
+#if PBR_USE_THREADS
+#pragma omp parallel for schedule(dynamic, 256)
+#endif
+        for (int64_t i = 0; i < static_cast<int64_t>(kept.size()); ++i)
+        {
+            Photon photon = photons[i * stride];
+            Point point { photon.position[0], photon.position[1], photon.position[2] };
+            Vec normal { photon.normal[0], photon.normal[1], photon.normal[2] };
+
+            Colorf irradiance = estimate(point, normal, count, max_radius, [](const Direction&) { return PBR_COLOR_WHITE; });
+            for (int a = 0; a < 3; ++a) photon.power[a] = static_cast<float>(irradiance[a]);
+            kept[i] = photon;
+        }
+
+        return PhotonMap(std::move(kept));
+    }
+
+    bool PhotonMap::irradiance(const Point& point, const Vec& normal, double max_radius, Colorf& out) const
+    {
+        Neighbours neighbours;
+        nearest(point, normal, 1, max_radius, neighbours);
+        if (neighbours.size == 0) return false;
+
+        const float* power = photons[neighbours.found[0].index].power;
+        out = { power[0], power[1], power[2] };
+        return true;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // Photon tracing
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Emit one photon and follow it through delta bounces. Returns false if it lands nowhere useful. */
+    static bool trace_photon(const Scene& scene, const AliasTable& light_table, const std::vector<size_t>& targets,
+        UniformRNG& rng, Photon& out)
+    {
+        double light_pmf;
+        size_t light = scene.lights[light_table.sample(rng.sample(), light_pmf)];
+        const SphereGeometry& sphere = scene.geometry[light];
+
+        // Uniform point on the light
+        double z = 1 - 2 * rng.sample();
+        double r = std::sqrt(std::max(0., 1 - z * z));
+        double phi = 2 * PBR_PI * rng.sample();
+        Direction light_normal { r * std::cos(phi), r * std::sin(phi), z };
+        Point origin = sphere.center + light_normal * sphere.radius;
+        double area = 4 * PBR_PI * sphere.radius * sphere.radius;
+
+        // Towards a delta actor
+        size_t target = targets[std::min(targets.size() - 1, static_cast<size_t>(rng.sample() * targets.size()))];
+        LightSample towards;
+        if (!sample_sphere_light(scene.geometry[target], origin, rng.sample(), rng.sample(), towards)) return false;
+
+        double cos_light = dot(light_normal, towards.direction);
+        if (cos_light <= 0) return false;
+
+        Colorf power = scene.materials[scene.material_ids[light]].emission
+            * (cos_light * area * targets.size() / (light_pmf * towards.pdf));
+
+        Ray ray { origin, towards.direction };
+        HitResult hit;
+        if (!scene.intersect(ray, hit) || hit.primitive != target) return false;
+
+        for (int bounce = 0; bounce < MAX_PHOTON_BOUNCES; ++bounce)
+        {
+            const Material material = scene.material(hit);
+            if (!is_delta(material))
+            {
+                Vec normal = dot(ray.direction, hit.normal) < 0 ? hit.normal : hit.normal * -1;
+                out = {
+                    { float(hit.point.x), float(hit.point.y), float(hit.point.z) },
+                    { float(ray.direction.x), float(ray.direction.y), float(ray.direction.z) },
+                    { float(power.x), float(power.y), float(power.z) },
+                    { float(normal.x), float(normal.y), float(normal.z) },
+                    0,
+                };
+                return true;
+            }
+
+            BRDFSample sample = sample_brdf(material, ray, hit, rng);
+            if (is_black(sample.weight)) return false;
+
+            power = power * sample.weight * importance_scale(material, ray.direction, hit.normal, sample.ray.direction);
+            ray = { sample.ray.origin, normalize(sample.ray.direction) };
+            if (!scene.intersect(ray, hit)) return false;
+        }
+        return false;
+    }
+
+    PhotonMap trace_caustic_photons(const Scene& scene, size_t emitted, size_t memory_budget, uint64_t seed)
+    {
+        std::vector<size_t> targets;
+        for (size_t i = 0; i < scene.geometry.size(); ++i)
+        {
+            const Material& material = scene.materials[scene.material_ids[i]];
+            if (is_delta(material) && is_black(material.emission)) targets.push_back(i);
+        }
+
+        std::vector<double> powers;
+        for (size_t light : scene.lights) powers.push_back(emitted_power(scene, light));
+        AliasTable light_table(powers);
+
+        if (targets.empty() || light_table.empty() || emitted == 0) return {};
+
+        // Every emitted photon is stored at most once
+        size_t capacity = std::min(emitted, memory_budget / sizeof(Photon));
+        std::vector<Photon> photons;
+        photons.reserve(capacity);
+        int64_t traced = 0;
+
+        // Chunks of photons draw from their own sequences and are kept in order, a batch of them at
+        // a time, so the map is the same whichever thread traces what
+        const int64_t chunks = (static_cast<int64_t>(emitted) + PHOTON_CHUNK - 1) / PHOTON_CHUNK;
+        std::vector<std::vector<Photon>> found(PHOTON_BATCH);
+        std::vector<std::vector<int64_t>> found_at(PHOTON_BATCH);
+        for (int64_t first = 0; first < chunks && photons.size() < capacity; first += PHOTON_BATCH)
+        {
+            const int64_t count = std::min(PHOTON_BATCH, chunks - first);
+#if PBR_USE_THREADS
+#pragma omp parallel for schedule(dynamic)
+#endif
+            for (int64_t c = 0; c < count; ++c)
+            {
+                found[c].clear();
+                found_at[c].clear();
+                UniformRNG rng(stream_seed(seed, first + c));
+                const int64_t begin = (first + c) * PHOTON_CHUNK, end = std::min(begin + PHOTON_CHUNK, static_cast<int64_t>(emitted));
+                for (int64_t i = begin; i < end; ++i)
+                {
+                    Photon photon;
+                    if (trace_photon(scene, light_table, targets, rng, photon))
+                    {
+                        found[c].push_back(photon);
+                        found_at[c].push_back(i);
+                    }
+                }
+            }
+
+            // Once the budget is full, the photons emitted after the last one stored are not counted
+            traced = std::min((first + count) * PHOTON_CHUNK, static_cast<int64_t>(emitted));
+            for (int64_t c = 0; c < count && photons.size() < capacity; ++c)
+            {
+                size_t take = std::min(found[c].size(), capacity - photons.size());
+                photons.insert(photons.end(), found[c].begin(), found[c].begin() + take);
+                if (photons.size() == capacity) traced = found_at[c][take - 1] + 1;
+            }
+        }
+
+        photons.shrink_to_fit();
+        for (auto& photon : photons)
+        {
+            for (float& p : photon.power) p /= traced;
+        }
+
+        LOG_DEBUG("Caustic photons: %zu stored of %lld emitted", photons.size(), static_cast<long long>(traced));
+        return PhotonMap(std::move(photons));
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("photons::PhotonMap")
+    {
+        // Photons spread uniformly over the unit square of the z = 0 plane, total power 1
+        UniformRNG rng;
+        constexpr int N = 20000;
+        std::vector<Photon> photons(N);
+        for (auto& p : photons)
+        {
+            p = { { float(rng.sample()), float(rng.sample()), 0 }, { 0, 0, -1 }, { 1.f / N, 1.f / N, 1.f / N }, { 0, 0, 1 }, 0 };
+        }
+        std::vector<Photon> copy = photons;
+        PhotonMap map(std::move(photons));
+        REQUIRE(map.size() == N);
+
+        // Nearest photons match a brute force search
+        Point point { 0.3, 0.6, 0 };
+        Vec normal { 0, 0, 1 };
+        PhotonMap::Neighbours neighbours;
+        map.nearest(point, normal, 32, 0.2, neighbours);
+        REQUIRE(neighbours.size == 32);
+
+        std::vector<double> distances;
+        for (const auto& p : copy)
+        {
+            distances.push_back((Point { p.position[0], p.position[1], p.position[2] } - point).sqlen());
+        }
+        std::nth_element(distances.begin(), distances.begin() + 31, distances.end());
+        CHECK(neighbours.radius2 == doctest::Approx(distances[31]).epsilon(1e-5));
+
+        // A white diffuse surface reflects the irradiance (power / area) over pi
+        Radiance radiance = map.estimate(point, normal, 64, 0.2, [](const Direction&) { return Colorf { 1 / PBR_PI }; });
+        CHECK(radiance.x == doctest::Approx(1 / PBR_PI).epsilon(0.2));
+
+        // Precomputed irradiance is power / area
+        PhotonMap irradiance = map.precompute_irradiance(64, 0.2, 4);
+        CHECK(irradiance.size() == N / 4);
+        Colorf e;
+        REQUIRE(irradiance.irradiance(point, normal, 0.2, e));
+        CHECK(e.x == doctest::Approx(1).epsilon(0.2));
+
+        // Photons off the tangent plane or on the back of the surface are skipped
+        map.nearest(Point { 0.3, 0.6, 0.1 }, normal, 32, 0.2, neighbours);
+        CHECK(neighbours.size == 0);
+        map.nearest(point, normal * -1, 32, 0.2, neighbours);
+        CHECK(neighbours.size == 0);
+    }
+}
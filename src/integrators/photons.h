@@ -0,0 +1,171 @@
+#pragma once
+
+#include <scene/scene.h>
+#include <config.h>
+
+#include <array>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Caustic photon map
+    //   Jensen 1996, "Global illumination using photon maps"
+    //
+    // Light that reaches a diffuse surface through mirrors or clear glass (a
+    // caustic) is nearly impossible to find from the camera: the diffuse bounce
+    // would have to pick the one direction that a delta surface turns towards a
+    // light. Photons traced from the lights find these paths instead, and the
+    // density of the photons around a point estimates the light they carry.
+    // Density estimates over many photons are too slow to run at every camera
+    // path, so they are precomputed at a subset of the photons (Christensen
+    // 1999, "Faster photon map global illumination") and a camera path only
+    // looks up the nearest of those.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Light that arrived at a diffuse surface through at least one delta bounce. */
+    struct Photon
+    {
+        float position[3];
+
+        /** Unit direction of travel */
+        float direction[3];
+
+        /** Flux, or irradiance in a map of precomputed irradiance */
+        float power[3];
+
+        /** Normal of the surface on the side the photon arrived from */
+        float normal[3];
+
+        /** Split axis of the photon's kd-tree node */
+        uint8_t axis;
+    };
+
+    /*!
+    * @brief Photons in a balanced kd-tree, stored in a flat array
+    *
+    * The median photon of a range splits it along the axis of its largest extent, the photons
+    * before it form the left subtree and those after it the right one. No child pointers are kept,
+    * so a photon costs 52 bytes and nearby photons lie close together in memory.
+    */
+    class PhotonMap
+    {
+    public:
+        /** Most photons gathered by one lookup */
+        static constexpr int MAX_GATHER = 256;
+
+        /** A photon found by a lookup. */
+        struct Neighbour
+        {
+            float dist2;
+            uint32_t index;
+
+            bool operator<(const Neighbour& other) const { return dist2 < other.dist2; }
+        };
+
+        /** Up to MAX_GATHER photons, and the radius that encloses them. */
+        struct Neighbours
+        {
+            std::array<Neighbour, MAX_GATHER> found;
+            int size = 0;
+            double radius2 = 0;
+        };
+
+        PhotonMap() = default;
+
+        /** Build the tree, reordering the photons in place. */
+        explicit PhotonMap(std::vector<Photon> photons);
+
+        size_t size() const { return photons.size(); }
+        bool empty() const { return photons.empty(); }
+        size_t memory() const { return photons.capacity() * sizeof(Photon); }
+        const Photon& operator[](size_t index) const { return photons[index]; }
+
+        /*!
+        * @brief Find the photons nearest to a point on a surface
+        *
+        * @param point Lookup point
+        * @param normal Surface normal on the side of the lookup. Photons that arrived on a surface facing
+        *               away from it, or further than a quarter of max_radius off its tangent plane, are skipped.
+        * @param count Most photons to find, clamped to MAX_GATHER
+        * @param max_radius Largest distance of a photon
+        * @param out The photons, in no particular order. radius2 is the squared distance of the farthest
+        *            one if count were found, max_radius squared otherwise.
+        */
+        void nearest(const Point& point, const Vec& normal, int count, double max_radius, Neighbours& out) const;
+
+        /*!
+        * @brief Radiance carried by the photons around a point (density estimation)
+        *
+        * @param point Lookup point
+        * @param normal Surface normal on the side of the lookup
+        * @param count Most photons to gather
+        * @param max_radius Largest distance of a gathered photon
+        * @param brdf Callable returning the BRDF (without cos) for the unit direction towards where a photon came from
+        * @return Radiance Sum of BRDF * flux over the area of the disc enclosing the photons
+        */
+        template <class BRDF>
+        Radiance estimate(const Point& point, const Vec& normal, int count, double max_radius, const BRDF& brdf) const
+        {
+            Neighbours neighbours;
+            nearest(point, normal, count, max_radius, neighbours);
+            if (neighbours.size == 0) return {};
+
+            Radiance sum;
+            for (int i = 0; i < neighbours.size; ++i)
+            {
+                const Photon& photon = photons[neighbours.found[i].index];
+                Direction to_source { -photon.direction[0], -photon.direction[1], -photon.direction[2] };
+                sum = sum + brdf(to_source) * Colorf { photon.power[0], photon.power[1], photon.power[2] };
+            }
+            return sum / (PBR_PI * neighbours.radius2);
+        }
+
+        /*!
+        * @brief Estimate the irradiance at every stride-th photon from its neighbours
+        *
+        * @param count Photons gathered per estimate
+        * @param max_radius Largest distance of a gathered photon
+        * @param stride Keep one photon in stride
+        * @return PhotonMap The kept photons, with their irradiance in place of their power
+        */
+        PhotonMap precompute_irradiance(int count, double max_radius, int stride) const;
+
+        /*!
+        * @brief Look up a map of precomputed irradiance
+        *
+        * @param point Lookup point
+        * @param normal Surface normal on the side of the lookup
+        * @param max_radius Largest distance of the photon used
+        * @param out Irradiance of the nearest photon
+        * @return bool False if no photon is close enough
+        */
+        bool irradiance(const Point& point, const Vec& normal, double max_radius, Colorf& out) const;
+
+    private:
+        std::vector<Photon> photons;
+
+        void build(size_t begin, size_t end);
+    };
+
+    /*!
+    * @brief Trace photons from the lights through delta actors and keep them where they land on another surface
+    *
+    * Each photon leaves a light picked by power, from a uniform point on it, towards a delta actor
+    * (mirror or clear glass) picked uniformly, inside the cone that actor subtends. It is only kept
+    * if that actor is the first thing it hits, so every direction is counted by one actor. Delta
+    * bounces then carry it on until it lands on a surface that is not a delta. Photons are traced in
+    * parallel until all are emitted or the memory budget is full, their power is divided by the
+    * number emitted until then. Each chunk of them draws from its own sequence, so the same seed
+    * gives the same map on any number of threads.
+    *
+    * The budget covers the traced photons, a map of precomputed irradiance built from them takes
+    * another 1 / stride of it.
+    *
+    * @param scene Scene to trace, its lights must be up to date
+    * @param emitted Photons to emit
+    * @param memory_budget Most bytes of stored photons
+    * @param seed Seed of the random numbers, the same seed traces the same photons
+    * @return PhotonMap The stored photons, empty if the scene has no lights or no delta actors
+    */
+    PhotonMap trace_caustic_photons(const Scene& scene, size_t emitted, size_t memory_budget, uint64_t seed);
+}
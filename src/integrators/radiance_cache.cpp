@@ -0,0 +1,167 @@
+#include "radiance_cache.h"
+
+#include <algorithm>
+
+namespace pbr
+{
+    /** Slots tried after the one a key hashes to */
+    static constexpr int MAX_PROBES = 8;
+
+    /** Bits of each coordinate of a cell in a key, cells this many apart share keys */
+    static constexpr int CELL_BITS = 18;
+
+    /** Pack a cell and the largest axis of a normal, with its sign, into a non-zero key. */
+    static uint64_t cache_key(const Point& point, const Vec& normal, double cell_size)
+    {
+        constexpr uint64_t cell_mask = (uint64_t(1) << CELL_BITS) - 1;
+
+        uint64_t key = uint64_t(1) << 63;
+        for (int a = 0; a < 3; ++a)
+        {
+            auto cell = static_cast<int64_t>(std::floor(point[a] / cell_size));
+            key |= (static_cast<uint64_t>(cell) & cell_mask) << (a * CELL_BITS);
+        }
+
+        int axis = 0;
+        if (std::abs(normal.y) > std::abs(normal[axis])) axis = 1;
+        if (std::abs(normal.z) > std::abs(normal[axis])) axis = 2;
+        uint64_t side = axis * 2 + (normal[axis] < 0);
+        return key | (side << (3 * CELL_BITS));
+    }
+
+    /** Finalizer of splitmix64, spreads neighbouring cells over the table. */
+    static uint64_t mix(uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    static void atomic_add(std::atomic<float>& target, float value)
+    {
+        float current = target.load(std::memory_order_relaxed);
+        while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {}
+    }
+
+    RadianceCache::RadianceCache(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity) size *= 2;
+        entries = std::vector<Entry>(size);
+        mask = size - 1;
+    }
+
+    uint32_t RadianceCache::insert(const Point& point, const Vec& normal)
+    {
+        uint64_t key = cache_key(point, normal, cell_size);
+        uint64_t hash = mix(key);
+
+        for (int probe = 0; probe < MAX_PROBES; ++probe)
+        {
+            auto slot = static_cast<uint32_t>((hash + probe) & mask);
+            std::atomic<uint64_t>& slot_key = entries[slot].key;
+
+            uint64_t found = slot_key.load(std::memory_order_relaxed);
+            if (found == key) return slot;
+
+            // Another path may claim the slot first, for this key or another
+            if (found == 0 && (slot_key.compare_exchange_strong(found, key, std::memory_order_relaxed) || found == key))
+            {
+                return slot;
+            }
+        }
+        return NO_SLOT;
+    }
+
+    void RadianceCache::record(const CachePath& path)
+    {
+        for (int i = 0; i < path.size; ++i)
+        {
+            const CachePath::Vertex& vertex = path.vertices[i];
+            Entry& entry = entries[vertex.slot];
+            for (int c = 0; c < 3; ++c) atomic_add(entry.sum[c], static_cast<float>(vertex.radiance[c]));
+            entry.count.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void RadianceCache::resolve()
+    {
+#if PBR_USE_THREADS
+#pragma omp parallel for schedule(static, 4096)
+#endif
+        for (int64_t i = 0; i < static_cast<int64_t>(entries.size()); ++i)
+        {
+            Entry& entry = entries[i];
+            uint32_t count = entry.count.exchange(0, std::memory_order_relaxed);
+            if (count == 0) continue;
+
+            double weight = std::min(entry.samples, history);
+            for (int c = 0; c < 3; ++c)
+            {
+                double sum = entry.sum[c].exchange(0, std::memory_order_relaxed);
+                entry.mean[c] = static_cast<float>((entry.mean[c] * weight + sum) / (weight + count));
+            }
+            entry.samples += count;
+        }
+    }
+
+    void RadianceCache::clear()
+    {
+        for (Entry& entry : entries)
+        {
+            entry.key.store(0, std::memory_order_relaxed);
+            for (auto& sum : entry.sum) sum.store(0, std::memory_order_relaxed);
+            entry.count.store(0, std::memory_order_relaxed);
+            std::fill(entry.mean, entry.mean + 3, 0.f);
+            entry.samples = 0;
+        }
+    }
+
+    size_t RadianceCache::size() const
+    {
+        return std::count_if(entries.begin(), entries.end(),
+            [](const Entry& entry) { return entry.key.load(std::memory_order_relaxed) != 0; });
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("integrators::RadianceCache")
+    {
+        RadianceCache cache(1000);
+        REQUIRE(cache.capacity() == 1024);
+        cache.cell_size = 0.5;
+        cache.min_samples = 2;
+
+        // Points of one cell share a slot, the other side of the surface and other cells do not
+        Vec up { 0, 1, 0 };
+        uint32_t slot = cache.insert(Point { 0.1, 0.1, 0.1 }, up);
+        REQUIRE(slot != RadianceCache::NO_SLOT);
+        CHECK(cache.insert(Point { 0.4, 0.2, 0.3 }, Vec { 0.3, 0.9, 0 }) == slot);
+        CHECK(cache.insert(Point { 0.1, 0.1, 0.1 }, up * -1) != slot);
+        CHECK(cache.insert(Point { -0.1, 0.1, 0.1 }, up) != slot);
+        CHECK(cache.size() == 3);
+
+        // Radiance scattered by a vertex is a contribution over the throughput reaching it
+        CachePath path;
+        path.add_vertex(slot, Colorf { 0.5 });
+        path.add_radiance(Colorf { 1 });
+        CHECK(path.vertices[0].radiance.x == doctest::Approx(2));
+
+        Radiance radiance;
+        cache.record(path);
+        cache.resolve();
+        CHECK_FALSE(cache.radiance(slot, radiance));
+
+        path.vertices[0].radiance = Colorf { 4 };
+        cache.record(path);
+        cache.resolve();
+        REQUIRE(cache.radiance(slot, radiance));
+        CHECK(radiance.x == doctest::Approx(3));
+
+        cache.clear();
+        CHECK(cache.size() == 0);
+        CHECK_FALSE(cache.radiance(slot, radiance));
+    }
+}
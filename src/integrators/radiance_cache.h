@@ -0,0 +1,142 @@
+#pragma once
+
+#include <core/math_definitions.h>
+#include <materials/radiometry.h>
+#include <config.h>
+
+#include <atomic>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Hashed radiance cache
+    //   Müller et al. 2021, "Real-time neural radiance caching for path tracing",
+    //   in the hashed-grid form of NVIDIA's SHaRC
+    //
+    // Space is cut into cells of a fixed size, and a hash of a cell together with
+    // the axis of a surface normal picks a slot of a fixed table. Paths add the
+    // radiance their vertices scatter into the slots of those vertices, and at
+    // the end of each pass the sums are folded into a mean per slot. Later paths
+    // stop at a slot that has a mean and take it as the light scattered there.
+    // The cell size trades noise for blur. Deep light is only reached through
+    // the means, which keeps it but blurs it further.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Up to MAX_VERTICES cached vertices of a path, with the radiance later scattered by each of them. */
+    struct CachePath
+    {
+        static constexpr int MAX_VERTICES = 16;
+
+        struct Vertex
+        {
+            uint32_t slot;
+
+            /** Path throughput arriving at the vertex */
+            Colorf throughput;
+
+            /** Radiance the vertex scatters back along the path */
+            Radiance radiance;
+        };
+
+        Vertex vertices[MAX_VERTICES];
+        int size = 0;
+
+        void add_vertex(uint32_t slot, const Colorf& throughput)
+        {
+            if (size < MAX_VERTICES) vertices[size++] = { slot, throughput, {} };
+        }
+
+        /** Credit a contribution to the camera (throughput * radiance) to every vertex before it. */
+        void add_radiance(const Radiance& contribution)
+        {
+            for (int i = 0; i < size; ++i)
+            {
+                const Colorf& t = vertices[i].throughput;
+                Radiance& r = vertices[i].radiance;
+                if (t.x > 0) r.x += contribution.x / t.x;
+                if (t.y > 0) r.y += contribution.y / t.y;
+                if (t.z > 0) r.z += contribution.z / t.z;
+            }
+        }
+    };
+
+    /*!
+    * @brief Radiance scattered by surfaces, averaged over cells of a world-space grid
+    *
+    * A fixed table of slots, open addressed with a short linear probe. A slot is claimed by
+    * swapping its key in atomically and paths add to it with atomic float adds, so paths fill it
+    * in parallel without locks. A full neighbourhood drops the vertex. The means that paths read
+    * are only written by resolve(), between passes.
+    */
+    class RadianceCache
+    {
+    public:
+        /** Returned by insert() when no slot is free */
+        static constexpr uint32_t NO_SLOT = ~0u;
+
+        /** Side of a cell */
+        double cell_size = PBR_RADIANCE_CACHE_CELL_SIZE;
+
+        /** Samples a slot needs before its mean is used */
+        uint32_t min_samples = PBR_RADIANCE_CACHE_MIN_SAMPLES;
+
+        /** Most samples the mean keeps its weight for, so it follows the values found later */
+        uint32_t history = PBR_RADIANCE_CACHE_HISTORY;
+
+        /** Table of capacity slots, rounded up to a power of 2 */
+        explicit RadianceCache(size_t capacity = PBR_RADIANCE_CACHE_ENTRIES);
+
+        RadianceCache(const RadianceCache&) = delete;
+        RadianceCache& operator=(const RadianceCache&) = delete;
+
+        /*!
+        * @brief Find or claim the slot of a surface point. Thread-safe.
+        *
+        * @param point Point on the surface
+        * @param normal Surface normal on the side the path arrived from
+        * @return uint32_t Index of the slot, NO_SLOT if its neighbourhood of the table is full
+        */
+        uint32_t insert(const Point& point, const Vec& normal);
+
+        /** Mean radiance of a slot, false until it has min_samples. */
+        bool radiance(uint32_t slot, Radiance& out) const
+        {
+            const Entry& entry = entries[slot];
+            if (entry.samples < min_samples) return false;
+            out = { entry.mean[0], entry.mean[1], entry.mean[2] };
+            return true;
+        }
+
+        /** Add the radiance scattered by the vertices of a path to their slots. Thread-safe. */
+        void record(const CachePath& path);
+
+        /** Fold the sums added since the last call into the means. */
+        void resolve();
+
+        /** Forget everything. */
+        void clear();
+
+        /** Number of claimed slots. */
+        size_t size() const;
+
+        size_t capacity() const { return entries.size(); }
+        size_t memory() const { return entries.size() * sizeof(Entry); }
+
+    private:
+        struct Entry
+        {
+            /** Cell and normal axis, 0 for a free slot */
+            std::atomic<uint64_t> key { 0 };
+
+            /** Radiance added since the last resolve, and the number of samples it sums */
+            std::atomic<float> sum[3] = {};
+            std::atomic<uint32_t> count { 0 };
+
+            float mean[3] = {};
+            uint32_t samples = 0;
+        };
+
+        std::vector<Entry> entries;
+        uint64_t mask;
+    };
+}
@@ -0,0 +1,259 @@
+#include "environment.h"
+
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+namespace pbr
+{
+    EnvironmentLight::EnvironmentLight(int width, int height, std::vector<Colorf> pixels)
+        : _width(width), _height(height), pixels(std::move(pixels))
+    {
+        assert(this->pixels.size() == (size_t) width * height);
+        build_distribution();
+    }
+
+    void EnvironmentLight::build_distribution(bool importance_sampling)
+    {
+        importance = importance_sampling;
+
+        // Weight each texel by its luminance times its solid angle
+        std::vector<double> weights(pixels.size());
+        bool black = true;
+        for (int row = 0; row < _height; ++row)
+        {
+            double solid_angle = std::cos(PBR_PI * row / _height) - std::cos(PBR_PI * (row + 1) / _height);
+            for (int col = 0; col < _width; ++col)
+            {
+                const Colorf& radiance = pixels[(size_t) row * _width + col];
+                black = black && is_black(radiance);
+                weights[(size_t) row * _width + col] = importance ? luminance(radiance) * solid_angle : solid_angle;
+            }
+        }
+
+        table = {};
+        if (!black) table.build(weights);
+    }
+
+    size_t EnvironmentLight::texel(const Direction& direction) const
+    {
+        double u = (std::atan2(-direction.z, direction.x) + PBR_PI) / (2 * PBR_PI);
+        double v = std::acos(clamp(direction.y, -1, 1)) / PBR_PI;
+        int col = std::min(static_cast<int>(u * _width), _width - 1);
+        int row = std::min(static_cast<int>(v * _height), _height - 1);
+        return (size_t) row * _width + col;
+    }
+
+    bool EnvironmentLight::sample(double u1, double u2, double u3, Direction& out_direction, double& out_pdf) const
+    {
+        if (table.empty()) return false;
+
+        if (!importance)
+        {
+            double y = 1 - 2 * u2;
+            double r = std::sqrt(std::max(0., 1 - y * y));
+            double phi = 2 * PBR_PI * u3;
+            out_direction = { r * std::cos(phi), y, r * std::sin(phi) };
+            out_pdf = 1 / (4 * PBR_PI);
+            return true;
+        }
+
+        // Pick a texel, then a point inside it uniformly in (u, v)
+        double pmf;
+        size_t index = table.sample(u1, pmf);
+        double u = (index % _width + u2) / _width;
+        double v = (index / _width + u3) / _height;
+
+        double theta = PBR_PI * v;
+        double sin_theta = std::sin(theta);
+        if (sin_theta <= 0) return false;
+
+        double phi = 2 * PBR_PI * u - PBR_PI;
+        out_direction = { sin_theta * std::cos(phi), std::cos(theta), -sin_theta * std::sin(phi) };
+        out_pdf = pmf * _width * _height / (2 * PBR_PI * PBR_PI * sin_theta);
+        return true;
+    }
+
+    double EnvironmentLight::pdf(const Direction& direction) const
+    {
+        if (table.empty()) return 0;
+        if (!importance) return 1 / (4 * PBR_PI);
+
+        Direction d = normalize(direction);
+        double sin_theta = std::sqrt(std::max(0., 1 - d.y * d.y));
+        if (sin_theta <= 0) return 0;
+
+        return table.pmf(texel(d)) * _width * _height / (2 * PBR_PI * PBR_PI * sin_theta);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // Radiance RGBE (.hdr) files
+    //   https://paulbourke.net/dataformats/pic/
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static Colorf rgbe_to_color(const uint8_t* rgbe)
+    {
+        if (rgbe[3] == 0) return {};
+        double f = std::ldexp(1.0, rgbe[3] - (128 + 8));
+        return { (rgbe[0] + 0.5) * f, (rgbe[1] + 0.5) * f, (rgbe[2] + 0.5) * f };
+    }
+
+    /** Read one scanline of RGBE values, flat or run-length encoded per channel. */
+    static bool read_scanline(std::istream& in, int width, std::vector<uint8_t>& out)
+    {
+        uint8_t head[4];
+        if (!in.read(reinterpret_cast<char*>(head), 4)) return false;
+
+        bool rle = width >= 8 && width < 32768 && head[0] == 2 && head[1] == 2 && !(head[2] & 0x80);
+        if (!rle)
+        {
+            // Flat pixels, the first one is already read
+            std::copy(head, head + 4, out.begin());
+            return bool(in.read(reinterpret_cast<char*>(out.data() + 4), (width - 1) * 4));
+        }
+
+        if (((head[2] << 8) | head[3]) != width) return false;
+
+        // Each channel is stored separately as runs and literals
+        for (int channel = 0; channel < 4; ++channel)
+        {
+            int x = 0;
+            while (x < width)
+            {
+                int count = in.get();
+                if (count == EOF) return false;
+
+                if (count > 128)
+                {
+                    count -= 128;
+                    int value = in.get();
+                    if (value == EOF || x + count > width) return false;
+                    for (int i = 0; i < count; ++i) out[(x++) * 4 + channel] = static_cast<uint8_t>(value);
+                }
+                else
+                {
+                    if (count == 0 || x + count > width) return false;
+                    for (int i = 0; i < count; ++i)
+                    {
+                        int value = in.get();
+                        if (value == EOF) return false;
+                        out[(x++) * 4 + channel] = static_cast<uint8_t>(value);
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    EnvironmentLight EnvironmentLight::load_hdr(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) throw std::runtime_error("Cannot open environment map " + path);
+
+        // Header lines up to an empty line, then the resolution
+        std::string line;
+        std::getline(in, line);
+        if (line.rfind("#?", 0) != 0) throw std::runtime_error(path + " is not a Radiance HDR file");
+
+        while (std::getline(in, line) && !line.empty())
+        {
+            if (line.rfind("FORMAT=", 0) == 0 && line != "FORMAT=32-bit_rle_rgbe")
+            {
+                throw std::runtime_error(path + ": unsupported " + line);
+            }
+        }
+
+        int width = 0, height = 0;
+        char y_axis[3] = {}, x_axis[3] = {};
+        if (!std::getline(in, line) || std::sscanf(line.c_str(), "%2s %d %2s %d", y_axis, &height, x_axis, &width) != 4
+            || std::string(y_axis) != "-Y" || std::string(x_axis) != "+X" || width <= 0 || height <= 0)
+        {
+            throw std::runtime_error(path + ": unsupported resolution line '" + line + "'");
+        }
+
+        std::vector<Colorf> pixels((size_t) width * height);
+        std::vector<uint8_t> scanline((size_t) width * 4);
+        for (int row = 0; row < height; ++row)
+        {
+            if (!read_scanline(in, width, scanline)) throw std::runtime_error(path + ": truncated pixel data");
+
+            for (int col = 0; col < width; ++col)
+            {
+                pixels[(size_t) row * width + col] = rgbe_to_color(&scanline[col * 4]);
+            }
+        }
+
+        return { width, height, std::move(pixels) };
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("light::EnvironmentLight")
+    {
+        // A dim sky with a bright patch
+        constexpr int W = 32, H = 16;
+        std::vector<Colorf> pixels(W * H, Colorf { 0.1 });
+        pixels[3 * W + 20] = Colorf { 500.0 };
+        EnvironmentLight env(W, H, pixels);
+
+        // Estimate the integral of the radiance over the sphere by importance sampling
+        // and compare it with the sum over texels
+        double expected = 0;
+        for (int row = 0; row < H; ++row)
+        {
+            double solid_angle = 2 * PBR_PI * (std::cos(PBR_PI * row / H) - std::cos(PBR_PI * (row + 1) / H)) / W;
+            for (int col = 0; col < W; ++col) expected += luminance(pixels[row * W + col]) * solid_angle;
+        }
+
+        // A fixed seed, so the tolerances below hold on every run
+        UniformRNG rng(34);
+        constexpr int N = 20000;
+        double estimate = 0;
+        int pdf_mismatches = 0, bright = 0;
+        for (int i = 0; i < N; ++i)
+        {
+            Direction d;
+            double pdf;
+            if (!env.sample(rng.sample(), rng.sample(), rng.sample(), d, pdf)) continue;
+            if (std::abs(pdf - env.pdf(d)) > 1e-6 * pdf) ++pdf_mismatches;
+            estimate += luminance(env.eval(d)) / pdf;
+            if (luminance(env.eval(d)) > 1) ++bright;
+        }
+        CHECK(pdf_mismatches == 0);
+        CHECK(estimate / N == doctest::Approx(expected).epsilon(0.01));
+
+        // The bright patch carries about 90% of the power
+        CHECK(bright / double(N) == doctest::Approx(0.9).epsilon(0.05));
+
+        CHECK(!EnvironmentLight(PBR_COLOR_BLACK).emits());
+        CHECK(EnvironmentLight(Colorf { 1 }).pdf(Vec { 0, 1, 0.5 }) == doctest::Approx(1 / (4 * PBR_PI)).epsilon(0.05));
+    }
+
+    TEST_CASE("light::EnvironmentLight::load_hdr")
+    {
+        // Two rows of 8: the first run-length encoded, the second flat
+        const std::string path = (std::filesystem::temp_directory_path() / "pbr_test_environment.hdr").string();
+        {
+            std::ofstream out(path, std::ios::binary);
+            out << "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y 2 +X 8\n";
+            const uint8_t rle[] = { 2, 2, 0, 8, 136, 128, 136, 64, 136, 32, 136, 129 };
+            out.write(reinterpret_cast<const char*>(rle), sizeof rle);
+            for (int i = 0; i < 8; ++i) out.write("\x80\x80\x80\x81", 4);
+        }
+
+        EnvironmentLight env = EnvironmentLight::load_hdr(path);
+        std::remove(path.c_str());
+
+        CHECK(env.width() == 8);
+        CHECK(env.height() == 2);
+        Colorf top = env.eval(Vec { 1, 1, 0 });
+        CHECK(top.x == doctest::Approx(1.0).epsilon(0.01));
+        CHECK(top.y == doctest::Approx(0.5).epsilon(0.01));
+        CHECK(top.z == doctest::Approx(0.25).epsilon(0.02));
+        CHECK(env.eval(Vec { 1, -1, 0 }).x == doctest::Approx(1.0).epsilon(0.01));
+
+        CHECK_THROWS(EnvironmentLight::load_hdr("does_not_exist.hdr"));
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <core/alias_table.h>
+#include <core/math_definitions.h>
+#include <materials/radiometry.h>
+#include <config.h>
+
+namespace pbr
+{
+    /*!
+    * @brief Light arriving from infinitely far away, stored as a lat-long (equirectangular) image
+    *
+    * Rows go from +y (top) to -y, columns follow SphereGeometry::uv_at. Radiance is constant over
+    * each texel. Texels are picked from an alias table weighted by luminance * solid angle, then a
+    * direction is picked uniformly in (u, v) inside the texel.
+    */
+    class EnvironmentLight
+    {
+    public:
+        /** Constant radiance from every direction. */
+        explicit EnvironmentLight(const Colorf& radiance = PBR_BACKGROUND_COLOR)
+            : EnvironmentLight(1, 1, { radiance })
+        {
+        }
+
+        /** Lat-long image, row-major from the top row. */
+        EnvironmentLight(int width, int height, std::vector<Colorf> pixels);
+
+        /** Load a Radiance RGBE (.hdr) lat-long image. Throws std::runtime_error if it cannot be read. */
+        static EnvironmentLight load_hdr(const std::string& path);
+
+        /*!
+        * @brief Rebuild the sampling distribution
+        *
+        * @param importance True to sample in proportion to the radiance, false to sample the sphere
+        *        uniformly (for comparisons)
+        */
+        void build_distribution(bool importance_sampling = true);
+
+        /** Radiance arriving from a direction, which does not need to be normalized. */
+        Radiance eval(const Direction& direction) const
+        {
+            return pixels[texel(normalize(direction))];
+        }
+
+        /*!
+        * @brief Sample a direction towards the environment
+        *
+        * @param u1 Uniform random number in [0, 1), picks the texel
+        * @param u2 Uniform random number in [0, 1)
+        * @param u3 Uniform random number in [0, 1)
+        * @param out_direction Unit direction
+        * @param out_pdf Solid angle pdf of the direction
+        * @return bool False if the environment is black
+        */
+        bool sample(double u1, double u2, double u3, Direction& out_direction, double& out_pdf) const;
+
+        /** Solid angle pdf with which sample() picks a direction. */
+        double pdf(const Direction& direction) const;
+
+        /** Whether the environment emits any light and can be sampled. */
+        bool emits() const { return !table.empty(); }
+
+        int width() const { return _width; }
+        int height() const { return _height; }
+
+    private:
+        int _width;
+        int _height;
+        std::vector<Colorf> pixels;
+        AliasTable table;
+        bool importance = true;
+
+        size_t texel(const Direction& direction) const;
+    };
+}
@@ -0,0 +1,118 @@
+#include "light.h"
+#include "light_sampler.h"
+
+namespace pbr
+{
+    void LightSampler::update(const Scene& scene)
+    {
+        if (p_scene == &scene && revision == scene.revision && built_selection == selection) return;
+
+        p_scene = &scene;
+        revision = scene.revision;
+        built_selection = selection;
+
+        table = {};
+        bvh = {};
+
+        if (selection == LightSelection::BVH)
+        {
+            std::vector<LightBounds> bounds;
+            bounds.reserve(scene.lights.size());
+            for (size_t actor : scene.lights)
+            {
+                bounds.push_back(LightBounds::of_sphere(scene.geometry[actor], emitted_power(scene, actor)));
+            }
+            bvh.build(bounds);
+        }
+        else
+        {
+            std::vector<double> weights;
+            weights.reserve(scene.lights.size());
+            for (size_t actor : scene.lights)
+            {
+                weights.push_back(selection == LightSelection::Power ? emitted_power(scene, actor) : 1.0);
+            }
+            table.build(weights);
+        }
+
+        slots.assign(scene.size(), NO_SLOT);
+        for (size_t i = 0; i < scene.lights.size(); ++i)
+        {
+            slots[scene.lights[i]] = static_cast<uint32_t>(i);
+        }
+
+        environment_probability = 0;
+        if (scene.environment.emits())
+        {
+            environment_probability = scene.lights.empty() ? 1 : PBR_ENVIRONMENT_LIGHT_PROBABILITY;
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("light::sample_sphere_light")
+    {
+        SphereGeometry sphere { Vec { 0, 5, 0 }, 1 };
+        Point point { 0, 0, 0 };
+
+        UniformRNG rng;
+        for (int i = 0; i < 100; ++i)
+        {
+            LightSample s;
+            REQUIRE(sample_sphere_light(sphere, point, rng.sample(), rng.sample(), s));
+            CHECK(sphere.intersect({ point, s.direction }) < PBR_INF);
+            CHECK(s.pdf == doctest::Approx(pdf_sphere_light(sphere, point)));
+        }
+
+        // Cone solid angle 2 pi (1 - cos theta_max)
+        double cos_max = std::sqrt(1 - 1. / 25.);
+        CHECK(1 / pdf_sphere_light(sphere, point) == doctest::Approx(2 * PBR_PI * (1 - cos_max)));
+
+        LightSample s;
+        CHECK_FALSE(sample_sphere_light(sphere, sphere.center, 0.5, 0.5, s));
+    }
+
+    TEST_CASE("light::LightSampler")
+    {
+        Scene scene;
+        auto dim = scene.add_material({ PBR_COLOR_WHITE, Colorf { 1.0 }, BRDFType::Diffuse });
+        auto bright = scene.add_material({ PBR_COLOR_WHITE, Colorf { 4.0 }, BRDFType::Diffuse });
+        auto dark = scene.add_material({ PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Diffuse });
+        scene.add_actor(dim, { Vec { 0, 0, 0 }, 1 });
+        scene.add_actor(dark, { Vec { 3, 0, 0 }, 1 });
+        scene.add_actor(bright, { Vec { 6, 0, 0 }, 1 });
+
+        Point p { 0, 5, 0 };
+        Vec n { 0, -1, 0 };
+
+        LightSampler sampler;
+        sampler.selection = LightSelection::Power;
+        sampler.update(scene);
+        CHECK(sampler.pmf(p, n, 0) == doctest::Approx(0.2));
+        CHECK(sampler.pmf(p, n, 1) == 0);
+        CHECK(sampler.pmf(p, n, 2) == doctest::Approx(0.8));
+
+        size_t actor = 0;
+        double pmf = 0;
+        REQUIRE(sampler.sample(p, n, 0.99, actor, pmf));
+        CHECK(pmf == sampler.pmf(p, n, actor));
+
+        // Adding a light changes the revision, which triggers a rebuild
+        scene.add_actor(bright, { Vec { 9, 0, 0 }, 2 });
+        sampler.update(scene);
+        CHECK(sampler.pmf(p, n, 3) == doctest::Approx(16. / 21.));
+
+        sampler.selection = LightSelection::Uniform;
+        sampler.update(scene);
+        CHECK(sampler.pmf(p, n, 0) == doctest::Approx(1. / 3.));
+
+        sampler.selection = LightSelection::BVH;
+        sampler.update(scene);
+        CHECK(sampler.pmf(p, n, 1) == 0);
+        CHECK(sampler.pmf(p, n, 0) + sampler.pmf(p, n, 2) + sampler.pmf(p, n, 3) == doctest::Approx(1));
+        REQUIRE(sampler.sample(p, n, 0.5, actor, pmf));
+        CHECK(pmf == doctest::Approx(sampler.pmf(p, n, actor)));
+    }
+}
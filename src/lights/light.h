@@ -0,0 +1,92 @@
+#pragma once
+
+#include <scene/scene.h>
+#include <config.h>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Light sampling
+    // Every actor whose material has a non-black emission is a spherical area light.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Used in place of an actor index for the scene's environment light. */
+    constexpr size_t ENVIRONMENT_LIGHT = ~size_t(0);
+
+    /** A direction towards a light, sampled from a shading point. */
+    struct LightSample
+    {
+        /** Unit direction from the shading point towards the light */
+        Direction direction;
+
+        /** Solid angle pdf of the direction, not including the probability of picking the light */
+        double pdf;
+    };
+
+    /*!
+    * @brief Sample a direction uniformly inside the cone that a sphere subtends from a point
+    *
+    * @param sphere Light geometry
+    * @param point Shading point, must lie outside the sphere
+    * @param u1 Uniform random number in [0, 1)
+    * @param u2 Uniform random number in [0, 1)
+    * @param out Sampled direction and its pdf
+    * @return bool False if the point is inside the sphere, where the cone is undefined
+    */
+    inline bool sample_sphere_light(const SphereGeometry& sphere, const Point& point, double u1, double u2, LightSample& out)
+    {
+        Vec to_center = sphere.center - point;
+        double dist2 = to_center.sqlen();
+        double r2 = sphere.radius * sphere.radius;
+        if (dist2 <= r2 * (1 + 1e-6)) return false;
+
+        // 1 - cos(theta_max) written to avoid cancellation for small or distant lights
+        double sin2_max = r2 / dist2;
+        double cos_max = std::sqrt(1 - sin2_max);
+        double one_minus_cos_max = sin2_max / (1 + cos_max);
+
+        double cos_theta = 1 - u1 * one_minus_cos_max;
+        double sin_theta = std::sqrt(std::max(0., 1 - cos_theta * cos_theta));
+        double phi = 2 * PBR_PI * u2;
+
+        Basis basis = make_basis(to_center / std::sqrt(dist2));
+        out.direction = to_world(basis, Vec { sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta });
+        out.pdf = 1 / (2 * PBR_PI * one_minus_cos_max);
+        return true;
+    }
+
+    /** Solid angle pdf with which sample_sphere_light picks any direction that hits the sphere. */
+    inline double pdf_sphere_light(const SphereGeometry& sphere, const Point& point)
+    {
+        double dist2 = (sphere.center - point).sqlen();
+        double r2 = sphere.radius * sphere.radius;
+        if (dist2 <= r2 * (1 + 1e-6)) return 0;
+
+        double sin2_max = r2 / dist2;
+        double one_minus_cos_max = sin2_max / (1 + std::sqrt(1 - sin2_max));
+        return 1 / (2 * PBR_PI * one_minus_cos_max);
+    }
+
+    /** Power emitted by a spherical light, up to a constant factor: luminance * area. */
+    inline double emitted_power(const Scene& scene, size_t actor)
+    {
+        double radius = scene.geometry[actor].radius;
+        return luminance(scene.materials[scene.material_ids[actor]].emission) * 4 * PBR_PI * radius * radius;
+    }
+
+    /*!
+    * @brief Multiple importance sampling weight for a sample drawn from one of two strategies
+    *
+    * @param pdf Pdf of the strategy that produced the sample
+    * @param other_pdf Pdf of the other strategy for the same sample
+    * @return double Balance or power heuristic weight, see PBR_MIS_POWER_HEURISTIC
+    */
+    inline double mis_weight(double pdf, double other_pdf)
+    {
+#if PBR_MIS_POWER_HEURISTIC
+        pdf *= pdf;
+        other_pdf *= other_pdf;
+#endif
+        return pdf / (pdf + other_pdf);
+    }
+}
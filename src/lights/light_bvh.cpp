@@ -0,0 +1,359 @@
+#include "light_bvh.h"
+
+#include <algorithm>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Bounds
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static double safe_sqrt(double x) { return std::sqrt(std::max(0., x)); }
+    static double safe_acos(double x) { return std::acos(clamp(x, -1, 1)); }
+
+    /** cos(max(0, a - b)) from the sines and cosines of a and b */
+    static double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b)
+    {
+        if (cos_a > cos_b) return 1;
+        return cos_a * cos_b + sin_a * sin_b;
+    }
+
+    /** sin(max(0, a - b)) from the sines and cosines of a and b */
+    static double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b)
+    {
+        if (cos_a > cos_b) return 0;
+        return sin_a * cos_b - cos_a * sin_b;
+    }
+
+    /** Rotate v by an angle around a unit axis (Rodrigues' formula). */
+    static Vec rotate(const Vec& v, const Vec& axis, double angle)
+    {
+        double c = std::cos(angle);
+        double s = std::sin(angle);
+        return v * c + cross(axis, v) * s + axis * (dot(axis, v) * (1 - c));
+    }
+
+    DirectionCone cone_union(const DirectionCone& a, const DirectionCone& b)
+    {
+        if (a.empty()) return b;
+        if (b.empty()) return a;
+
+        // If one cone is inside the other, return the larger one
+        double theta_a = safe_acos(a.cos_theta);
+        double theta_b = safe_acos(b.cos_theta);
+        double theta_d = safe_acos(dot(a.w, b.w));
+        if (std::min(theta_d + theta_b, PBR_PI) <= theta_a) return a;
+        if (std::min(theta_d + theta_a, PBR_PI) <= theta_b) return b;
+
+        // Otherwise rotate a's axis towards b's so that the new cone just spans both
+        double theta_o = (theta_a + theta_d + theta_b) / 2;
+        if (theta_o >= PBR_PI) return DirectionCone::entire_sphere();
+
+        Vec axis = cross(a.w, b.w);
+        if (axis.sqlen() == 0) return DirectionCone::entire_sphere();
+
+        return { rotate(a.w, normalize(axis), theta_o - theta_a), std::cos(theta_o) };
+    }
+
+    LightBounds bounds_union(const LightBounds& a, const LightBounds& b)
+    {
+        if (a.phi == 0) return b;
+        if (b.phi == 0) return a;
+
+        LightBounds result;
+        result.bounds = a.bounds;
+        result.bounds.extend(b.bounds);
+        result.cone = cone_union(a.cone, b.cone);
+        result.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+        result.phi = a.phi + b.phi;
+        return result;
+    }
+
+    LightBounds LightBounds::of_sphere(const SphereGeometry& sphere, double phi)
+    {
+        LightBounds result;
+        result.bounds = Bounds::around_sphere(sphere.center, sphere.radius);
+        result.cone = DirectionCone::entire_sphere();
+        result.cos_theta_e = 0; // cos(pi / 2)
+        result.phi = phi;
+        return result;
+    }
+
+    double LightBounds::importance(const Point& point, const Vec& normal) const
+    {
+        if (phi == 0) return 0;
+
+        // Distance to the center, clamped so that points inside the bounds do not blow up
+        Point center = bounds.center();
+        double dist2 = (point - center).sqlen();
+        dist2 = std::max(dist2, bounds.diagonal().len() / 2);
+
+        // Angle between the cone axis and the direction from the bounds to the point
+        Vec wi = normalize(point - center);
+        double cos_w = dot(cone.w, wi);
+        double sin_w = safe_sqrt(1 - cos_w * cos_w);
+
+        // Angle subtended by the bounds as seen from the point
+        double radius2 = bounds.diagonal().sqlen() / 4;
+        double cos_b = (point - center).sqlen() < radius2 ? -1 : safe_sqrt(1 - radius2 / (point - center).sqlen());
+        double sin_b = safe_sqrt(1 - cos_b * cos_b);
+
+        // Minimum angle between the emission cone and the point, beyond which no light arrives
+        double cos_o = cone.cos_theta;
+        double sin_o = safe_sqrt(1 - cos_o * cos_o);
+        double cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+        double sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+        double cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+        if (cos_p <= cos_theta_e) return 0;
+
+        double importance = phi * cos_p / dist2;
+
+        // Incident angle at the surface, with the same bound. Both sides count since a BSDF may transmit.
+        if (!(normal == Vec { 0 }))
+        {
+            double cos_i = std::abs(dot(wi, normal));
+            double sin_i = safe_sqrt(1 - cos_i * cos_i);
+            importance *= cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+        }
+
+        return std::max(importance, 0.);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // Hierarchy
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Cost of a cluster for the split heuristic: power * solid angle term * surface area (PBRT-v4). */
+    static double evaluate_cost(const LightBounds& b, const Bounds& parent, int axis)
+    {
+        double theta_o = safe_acos(b.cone.cos_theta);
+        double theta_e = safe_acos(b.cos_theta_e);
+        double theta_w = std::min(theta_o + theta_e, PBR_PI);
+        double sin_o = std::sin(theta_o);
+        double m_omega = 2 * PBR_PI * (1 - b.cone.cos_theta)
+            + PBR_PI / 2 * (2 * theta_w * sin_o - std::cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_o + b.cone.cos_theta);
+
+        // Penalize thin slabs along the split axis
+        Vec d = parent.diagonal();
+        double kr = std::max(d.x, std::max(d.y, d.z)) / d[axis];
+
+        return b.phi * m_omega * kr * b.bounds.surface_area();
+    }
+
+    void LightBVH::build(const std::vector<LightBounds>& lights)
+    {
+        nodes.clear();
+        trails.assign(lights.size(), 0);
+        if (lights.empty()) return;
+
+        std::vector<std::pair<size_t, LightBounds>> items;
+        items.reserve(lights.size());
+        for (size_t i = 0; i < lights.size(); ++i)
+        {
+            items.emplace_back(i, lights[i]);
+        }
+
+        nodes.reserve(2 * lights.size() - 1);
+        build(items, 0, items.size(), 0, 0);
+    }
+
+    size_t LightBVH::build(std::vector<std::pair<size_t, LightBounds>>& lights, size_t begin, size_t end, uint64_t trail, int depth)
+    {
+        size_t index = nodes.size();
+        nodes.push_back({});
+
+        if (end - begin == 1)
+        {
+            nodes[index] = { lights[begin].second, static_cast<uint32_t>(lights[begin].first), true };
+            trails[lights[begin].first] = trail;
+            return index;
+        }
+
+        Bounds bounds, centroids;
+        for (size_t i = begin; i < end; ++i)
+        {
+            bounds.extend(lights[i].second.bounds);
+            centroids.extend(lights[i].second.bounds.center());
+        }
+
+        // Bucketed split along the axis and position of lowest cost
+        constexpr int BUCKETS = 12;
+        double best_cost = PBR_INF;
+        int best_axis = -1, best_bucket = -1;
+
+        auto bucket_of = [&](const LightBounds& b, int axis) {
+            double t = (b.bounds.center()[axis] - centroids.min[axis]) / (centroids.max[axis] - centroids.min[axis]);
+            return std::min(static_cast<int>(t * BUCKETS), BUCKETS - 1);
+        };
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (centroids.max[axis] == centroids.min[axis]) continue;
+
+            LightBounds buckets[BUCKETS];
+            for (size_t i = begin; i < end; ++i)
+            {
+                int b = bucket_of(lights[i].second, axis);
+                buckets[b] = bounds_union(buckets[b], lights[i].second);
+            }
+
+            for (int split = 0; split < BUCKETS - 1; ++split)
+            {
+                LightBounds below, above;
+                for (int b = 0; b <= split; ++b) below = bounds_union(below, buckets[b]);
+                for (int b = split + 1; b < BUCKETS; ++b) above = bounds_union(above, buckets[b]);
+
+                double cost = evaluate_cost(below, bounds, axis) + evaluate_cost(above, bounds, axis);
+                if (cost > 0 && cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bucket = split;
+                }
+            }
+        }
+
+        size_t mid = begin + (end - begin) / 2;
+        if (best_axis >= 0)
+        {
+            auto it = std::partition(lights.begin() + begin, lights.begin() + end, [&](const auto& light) {
+                return bucket_of(light.second, best_axis) <= best_bucket;
+            });
+            size_t split = it - lights.begin();
+            if (split != begin && split != end) mid = split;
+        }
+
+        // Depth is bounded by the 64 bits of a trail
+        assert(depth < 64);
+
+        build(lights, begin, mid, trail, depth + 1);
+        size_t second = build(lights, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+
+        nodes[index].bounds = bounds_union(nodes[index + 1].bounds, nodes[second].bounds);
+        nodes[index].index = static_cast<uint32_t>(second);
+        nodes[index].leaf = false;
+        return index;
+    }
+
+    bool LightBVH::sample(const Point& point, const Vec& normal, double u, size_t& out_light, double& out_pmf) const
+    {
+        if (nodes.empty()) return false;
+
+        size_t index = 0;
+        double pmf = 1;
+        while (!nodes[index].leaf)
+        {
+            const Node& node = nodes[index];
+            double left = nodes[index + 1].bounds.importance(point, normal);
+            double right = nodes[node.index].bounds.importance(point, normal);
+            if (left == 0 && right == 0) return false;
+
+            // Choose a child and rescale u so it can be reused further down
+            double p = left / (left + right);
+            if (u < p)
+            {
+                index = index + 1;
+                u = std::min(u / p, 1 - 1e-12);
+                pmf *= p;
+            }
+            else
+            {
+                index = node.index;
+                u = std::min((u - p) / (1 - p), 1 - 1e-12);
+                pmf *= 1 - p;
+            }
+        }
+
+        // A single light at the root has not been checked yet
+        if (index == 0 && nodes[0].bounds.importance(point, normal) == 0) return false;
+
+        out_light = nodes[index].index;
+        out_pmf = pmf;
+        return true;
+    }
+
+    double LightBVH::pmf(const Point& point, const Vec& normal, size_t light) const
+    {
+        if (nodes.empty() || light >= trails.size()) return 0;
+
+        uint64_t trail = trails[light];
+        size_t index = 0;
+        double pmf = 1;
+        while (!nodes[index].leaf)
+        {
+            const Node& node = nodes[index];
+            double left = nodes[index + 1].bounds.importance(point, normal);
+            double right = nodes[node.index].bounds.importance(point, normal);
+            if (left == 0 && right == 0) return 0;
+
+            bool second = trail & 1;
+            pmf *= (second ? right : left) / (left + right);
+            index = second ? node.index : index + 1;
+            trail >>= 1;
+        }
+
+        if (index == 0 && nodes[0].bounds.importance(point, normal) == 0) return 0;
+        return pmf;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("light::cone_union")
+    {
+        DirectionCone a { Vec { 0, 0, 1 }, std::cos(0.1) };
+        DirectionCone b { Vec { 1, 0, 0 }, std::cos(0.1) };
+        DirectionCone u = cone_union(a, b);
+
+        // Spans both: half angle (0.1 + pi/2 + 0.1) / 2 around the bisector
+        CHECK(u.cos_theta == doctest::Approx(std::cos((0.2 + PBR_PI / 2) / 2)));
+        CHECK(u.w.x == doctest::Approx(std::sqrt(0.5)));
+        CHECK(u.w.z == doctest::Approx(std::sqrt(0.5)));
+
+        CHECK(cone_union(a, DirectionCone {}).cos_theta == a.cos_theta);
+        CHECK(cone_union(a, DirectionCone::entire_sphere()).cos_theta == -1);
+    }
+
+    TEST_CASE("light::LightBVH")
+    {
+        std::mt19937 gen(3);
+        std::uniform_real_distribution<> dist(0.0, 1.0);
+
+        std::vector<LightBounds> lights;
+        for (int i = 0; i < 37; ++i)
+        {
+            SphereGeometry sphere { Vec { dist(gen) * 10, dist(gen) * 10, dist(gen) * 10 }, 0.1 };
+            lights.push_back(LightBounds::of_sphere(sphere, 0.1 + dist(gen)));
+        }
+
+        LightBVH bvh;
+        bvh.build(lights);
+
+        Point point { 5, -1, 5 };
+        Vec normal { 0, 1, 0 };
+
+        // Probabilities of all lights sum to one and match what sample() reports
+        double total = 0;
+        for (size_t i = 0; i < lights.size(); ++i) total += bvh.pmf(point, normal, i);
+        CHECK(total == doctest::Approx(1));
+
+        int mismatches = 0;
+        for (int i = 0; i < 1000; ++i)
+        {
+            size_t light = 0;
+            double pmf = 0;
+            REQUIRE(bvh.sample(point, normal, (i + 0.5) / 1000, light, pmf));
+            if (std::abs(pmf - bvh.pmf(point, normal, light)) > 1e-9) ++mismatches;
+        }
+        CHECK(mismatches == 0);
+
+        // Nearby lights are preferred over distant ones of the same power
+        std::vector<LightBounds> pair {
+            LightBounds::of_sphere({ Vec { 0, 1, 0 }, 0.1 }, 1),
+            LightBounds::of_sphere({ Vec { 0, 20, 0 }, 0.1 }, 1),
+        };
+        bvh.build(pair);
+        CHECK(bvh.pmf(Point { 0, 0, 0 }, normal, 0) > 0.9);
+    }
+}
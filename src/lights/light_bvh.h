@@ -0,0 +1,100 @@
+#pragma once
+
+#include "light.h"
+
+namespace pbr
+{
+    /** Cone of directions around an axis w, with half angle acos(cos_theta). */
+    struct DirectionCone
+    {
+        Vec w { 0, 0, 1 };
+        double cos_theta = PBR_INF;
+
+        bool empty() const { return cos_theta == PBR_INF; }
+
+        static DirectionCone entire_sphere() { return { Vec { 0, 0, 1 }, -1 }; }
+    };
+
+    /** Smallest cone that contains two cones. */
+    DirectionCone cone_union(const DirectionCone& a, const DirectionCone& b);
+
+    /*!
+    * @brief Spatial and directional bounds of one light or a cluster of lights
+    *
+    * Emission leaves the bounds in directions within theta_o of w, spreading at most theta_e
+    * beyond that. A sphere emits in every direction, so theta_o = pi and theta_e = pi / 2.
+    */
+    struct LightBounds
+    {
+        Bounds bounds;
+        DirectionCone cone;
+
+        /** cos(theta_e) */
+        double cos_theta_e = 1;
+
+        /** Emitted power, up to the constant of emitted_power */
+        double phi = 0;
+
+        /*!
+        * @brief Upper bound of the contribution of the lights inside to a shading point
+        *
+        * @param point Shading point
+        * @param normal Surface normal at the point, a zero vector to ignore the surface orientation
+        * @return double Importance, 0 if none of the lights can reach the point
+        */
+        double importance(const Point& point, const Vec& normal) const;
+
+        static LightBounds of_sphere(const SphereGeometry& sphere, double phi);
+    };
+
+    LightBounds bounds_union(const LightBounds& a, const LightBounds& b);
+
+    /*!
+    * @brief Light hierarchy for spatially aware light selection (after PBRT-v4's BVHLightSampler)
+    *
+    * Each node bounds the position, emission directions and total power of the lights below it.
+    * A light is picked by walking down from the root, choosing each child with probability
+    * proportional to its importance for the shading point, so nearby and well oriented lights are
+    * preferred over distant or back facing ones.
+    */
+    class LightBVH
+    {
+    public:
+        /** Build over a list of lights. Lights with zero power are never picked. */
+        void build(const std::vector<LightBounds>& lights);
+
+        /*!
+        * @brief Pick a light for a shading point
+        *
+        * @param point Shading point
+        * @param normal Surface normal at the point
+        * @param u Uniform random number in [0, 1)
+        * @param out_light Index of the picked light in the list given to build()
+        * @param out_pmf Probability of having picked it
+        * @return bool False if no light can contribute to the point
+        */
+        bool sample(const Point& point, const Vec& normal, double u, size_t& out_light, double& out_pmf) const;
+
+        /** Probability that sample() picks a light for a shading point. */
+        double pmf(const Point& point, const Vec& normal, size_t light) const;
+
+        bool empty() const { return nodes.empty(); }
+
+    private:
+        struct Node
+        {
+            LightBounds bounds;
+
+            /** Leaf: index of the light. Interior: index of the second child, the first one follows the node. */
+            uint32_t index;
+            bool leaf;
+        };
+
+        std::vector<Node> nodes;
+
+        /** Path from the root to each light, one bit per level (1 = second child) */
+        std::vector<uint64_t> trails;
+
+        size_t build(std::vector<std::pair<size_t, LightBounds>>& lights, size_t begin, size_t end, uint64_t trail, int depth);
+    };
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "light.h"
+#include "light_bvh.h"
+#include <core/alias_table.h>
+
+namespace pbr
+{
+    /** Strategy used to pick which light to sample at a shading point. */
+    enum class LightSelection : uint8_t
+    {
+        /** Every light with the same probability */
+        Uniform,
+
+        /** Proportional to emitted power (emission luminance * surface area) */
+        Power,
+
+        /** Light hierarchy, proportional to the estimated contribution to the shading point */
+        BVH,
+    };
+
+    /*!
+    * @brief Picks one of the scene's lights for next-event estimation
+    *
+    * Uniform and power selection use an alias table over the scene's lights, so picking a light is
+    * O(1) for any number of emitters and ignores the shading point. BVH selection walks a LightBVH.
+    * Both are rebuilt by update() when the scene's revision changes.
+    *
+    * An emitting environment is picked as ENVIRONMENT_LIGHT with a fixed probability,
+    * PBR_ENVIRONMENT_LIGHT_PROBABILITY, or always if the scene has no other lights.
+    */
+    class LightSampler
+    {
+    public:
+        LightSelection selection = PBR_LIGHT_SELECTION;
+
+        /** Rebuild the distribution if the scene or the selection strategy changed since the last call. */
+        void update(const Scene& scene);
+
+        /*!
+        * @brief Pick a light for a shading point
+        *
+        * @param point Shading point
+        * @param normal Surface normal at the shading point
+        * @param u Uniform random number in [0, 1)
+        * @param out_actor Index of the picked actor
+        * @param out_pmf Probability of having picked it
+        * @return bool False if no light can be picked
+        */
+        bool sample(const Point& point, const Vec& normal, double u, size_t& out_actor, double& out_pmf) const
+        {
+            if (u < environment_probability)
+            {
+                out_actor = ENVIRONMENT_LIGHT;
+                out_pmf = environment_probability;
+                return true;
+            }
+            u = (u - environment_probability) / (1 - environment_probability);
+
+            size_t slot;
+            if (built_selection == LightSelection::BVH)
+            {
+                if (!bvh.sample(point, normal, u, slot, out_pmf)) return false;
+            }
+            else
+            {
+                if (table.empty()) return false;
+                slot = table.sample(u, out_pmf);
+            }
+
+            out_actor = p_scene->lights[slot];
+            out_pmf *= 1 - environment_probability;
+            return true;
+        }
+
+        /** Probability that sample() picks an actor (or ENVIRONMENT_LIGHT) for a shading point, 0 if it is not a light. For MIS. */
+        double pmf(const Point& point, const Vec& normal, size_t actor) const
+        {
+            if (actor == ENVIRONMENT_LIGHT) return environment_probability;
+
+            uint32_t slot = actor < slots.size() ? slots[actor] : NO_SLOT;
+            if (slot == NO_SLOT) return 0;
+
+            double pmf = built_selection == LightSelection::BVH ? bvh.pmf(point, normal, slot) : table.pmf(slot);
+            return pmf * (1 - environment_probability);
+        }
+
+    private:
+        static constexpr uint32_t NO_SLOT = ~0u;
+
+        const Scene* p_scene = nullptr;
+        size_t revision = 0;
+        LightSelection built_selection = LightSelection::Uniform;
+
+        AliasTable table;
+        LightBVH bvh;
+        double environment_probability = 0;
+
+        /** Position of each actor in scene.lights, NO_SLOT for actors that do not emit */
+        std::vector<uint32_t> slots;
+    };
+}
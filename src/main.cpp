@@ -1,7 +1,13 @@
 #include "pbr.h"
 #include "debug.h"
 
-void entry()
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+void entry(bool resume)
 {
     using namespace pbr;
     
@@ -12,25 +18,111 @@ void entry()
     camera.fov = PBR_CAMERA_FOV_DEG;
     camera.calculate_basis((double) PBR_OUTPUT_IMAGE_COLUMNS / PBR_OUTPUT_IMAGE_ROWS);
 
-    // Output image buffer
-    Image image { PBR_OUTPUT_IMAGE_ROWS, PBR_OUTPUT_IMAGE_COLUMNS };
+    // Output image buffer, linear radiance, or the earlier render to update when regions of it are rendered again
+    Framebuffer image { PBR_OUTPUT_IMAGE_ROWS, PBR_OUTPUT_IMAGE_COLUMNS };
+    const std::vector<PixelRect> regions = PBR_CROP_REGIONS;
+    if (!regions.empty())
+    {
+        if (std::string(PBR_OUTPUT_HDR_NAME) == "") throw std::runtime_error("Regions are rendered into the HDR output, which is not set");
+        if (resume) throw std::runtime_error("Regions are rendered without checkpoints, there is nothing to resume");
+        image = Framebuffer::read(PBR_OUTPUT_HDR_NAME);
+        if (image.rows() != PBR_OUTPUT_IMAGE_ROWS || image.cols() != PBR_OUTPUT_IMAGE_COLUMNS)
+        {
+            throw std::runtime_error("The earlier render is of another size");
+        }
+    }
+
+    // Scene, lit by an environment map if one is configured
+    Scene scene = PBR_ACTIVE_SCENE;
+    if (std::string(PBR_ENVIRONMENT_MAP) != "")
+    {
+        scene.set_environment(EnvironmentLight::load_hdr(PBR_ENVIRONMENT_MAP));
+    }
+
+    // Tonemapped image for viewing, encoded as the rows are finished
+    std::unique_ptr<PngWriter> png;
+    if (regions.empty() && std::string(PBR_OUTPUT_IMAGE_NAME) != "")
+    {
+        png = std::make_unique<PngWriter>(PBR_OUTPUT_IMAGE_NAME, image.rows(), image.cols());
+    }
+    PostProcess post;
+
+    // Render scene to image, and split by light group to relight it later
+    Renderer<PBR_ACTIVE_INTEGRATOR> renderer;
+    std::unique_ptr<LightPathBuffers> light_paths;
+    if (regions.empty() && std::string(PBR_OUTPUT_LIGHT_PATHS_NAME) != "")
+    {
+        light_paths = std::make_unique<LightPathBuffers>(scene, image.rows(), image.cols());
+        renderer.light_paths = light_paths.get();
+    }
+
+    // Save the render between passes, to continue it with --resume if it is stopped
+    const std::string checkpoint = PBR_CHECKPOINT_NAME;
+    if (!renders_passes<PBR_ACTIVE_INTEGRATOR>::value && !light_paths && regions.empty()) renderer.checkpoint_path = checkpoint;
+    if (resume && renderer.checkpoint_path.empty())
+    {
+        throw std::runtime_error("Cannot resume: no checkpoint is configured, or the integrator or light paths do not support it");
+    }
+    renderer.resume = resume;
+#if PBR_DENOISE
+    std::vector<float> variance;
+    renderer.variance = &variance;
+#endif
+    if (!regions.empty())
+    {
+        renderer.render_regions(&scene, camera, image, regions);
+    }
+    else
+    {
+        renderer.render(&scene, camera, image, [&](int first, int count) {
+            if (!png) return;
+            std::vector<Colori> pixels((size_t) count * image.cols());
+            post.apply(image, first, count, pixels.data());
+            png->write_rows(first, count, pixels.data());
+        });
+    }
+
+
+    if (scene.textures)
+    {
+        TextureCacheStats stats = scene.textures->stats();
+        LOG_INFO("Texture cache: %.2f%% hits, %.1f MB read from disk, %llu evictions", stats.hit_rate() * 100,
+            stats.bytes_read / 1048576.0, (unsigned long long) stats.evictions);
+    }
 
-    // Render scene to image
-    Renderer<PathIntegrator> renderer;
-    renderer.render(&PBR_ACTIVE_SCENE, camera, image);
+    // Write the image losslessly, and end the tonemapped one
+    if (std::string(PBR_OUTPUT_HDR_NAME) != "") image.write(PBR_OUTPUT_HDR_NAME);
+    if (light_paths) light_paths->write(PBR_OUTPUT_LIGHT_PATHS_NAME);
+    if (png) png->finish();
+    else if (std::string(PBR_OUTPUT_IMAGE_NAME) != "") Image(image, post).write(PBR_OUTPUT_IMAGE_NAME);
+    if (!renderer.checkpoint_path.empty()) std::remove(renderer.checkpoint_path.c_str());
 
-    // Write image to file
-    image.write(PBR_OUTPUT_IMAGE_NAME);
+#if PBR_DENOISE
+    // Denoise a copy, the render above stays as it was estimated
+    FeatureBuffers features { image.rows(), image.cols() };
+    render_features(scene, camera, features);
+    features.variance = std::move(variance);
+    Framebuffer denoised = image;
+    Denoiser().apply(denoised, features);
+    if (std::string(PBR_OUTPUT_DENOISED_HDR_NAME) != "") denoised.write(PBR_OUTPUT_DENOISED_HDR_NAME);
+    if (std::string(PBR_OUTPUT_DENOISED_IMAGE_NAME) != "") Image(denoised, post).write(PBR_OUTPUT_DENOISED_IMAGE_NAME);
+#endif
 
     // Completed successfully! :)
     LOG_INFO("All ok!");
 }
 
-int main()
+int main(int argc, char** argv)
 {
     try
     {
-        entry();
+        bool resume = false;
+        for (int i = 1; i < argc; ++i)
+        {
+            if (std::string(argv[i]) == "--resume") resume = true;
+            else throw std::runtime_error(std::string("Unknown argument ") + argv[i] + ", expected --resume");
+        }
+        entry(resume);
     }
     catch (const std::exception& e)
     {
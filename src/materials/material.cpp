@@ -1,89 +1,278 @@
 #include "material.h"
 
-#include <scene/scene.h>
 #include <config.h>
 
-namespace pbr
+namespace pbr::brdf
 {
-    Basis BaseBRDF::get_basis(const HitResult& hit) const
+    Colorf oren_nayar(const Material& material, const Vec& wo, const Vec& wi)
     {
-        Vec w = hit.normal;
-        Vec u = normalize(cross(w, Vec { 0, 1, 0 }));
-        Vec v = normalize(cross(u, w));
-        return { u, v, w };
+        // Oren-Nayar model
+        //   https://en.wikipedia.org/wiki/Oren%E2%80%93Nayar_reflectance_model
+
+        double roughness = material.roughness;
+        Colorf albedo = material.color;
+
+        double sin_in = std::sqrt(std::max(0., 1 - wo.z * wo.z));
+        double sin_out = std::sqrt(std::max(0., 1 - wi.z * wi.z));
+
+        // cos(phi_in - phi_out) from the tangent plane components
+        double cos_phi = 0;
+        if (sin_in > 1e-6 && sin_out > 1e-6)
+        {
+            cos_phi = (wo.x * wi.x + wo.y * wi.y) / (sin_in * sin_out);
+        }
+
+        double theta_in = std::acos(clamp(wo.z));
+        double theta_out = std::acos(clamp(wi.z));
+        double alpha = std::max(theta_in, theta_out);
+        double beta = std::min(theta_in, theta_out);
+
+        double sq_rough = roughness * roughness;
+        double A = 1 - (0.5 * sq_rough) / (sq_rough + 0.33);
+        double B = (0.45 * sq_rough) / (sq_rough + 0.09);
+
+        B = B * std::max(0., cos_phi) * std::sin(alpha) * std::tan(beta);
+        return albedo * (A + B);
     }
 
-    Ray BaseBRDF::sample(const Ray& in, const HitResult& hit)
+    ///////////////////////////////////////////////////////////////////////////////
+    // Dielectric
+    //   Walter et al. 2007, "Microfacet models for refraction through rough surfaces"
+    //
+    // The frame is mirrored so that wo.z > 0 on whichever side the ray arrives,
+    // eta is then the index of refraction of the other side over this side.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static Vec flip(const Vec& v)
     {
-        auto s = rng.sample_hemisphere();
-        auto b = get_basis(hit);
-        auto dir = normalize(b.u * s.x + b.v * s.y + b.w * s.z);
-        return { hit.point, dir };
+        return { v.x, v.y, -v.z };
     }
 
-    Colorf BaseBRDF::eval(const Ray& in, const HitResult& hit, const Ray& out)
+    /** Generalized half vector of a refraction, facing wo. Returns false if wo and wi are on the same side of it. */
+    static bool refraction_half_vector(const Vec& wo, const Vec& wi, double eta, Vec& out_h)
     {
-        // Returns hit.material.color by default
-        return hit.actor->material->color;
+        Vec h = wo + wi * eta;
+        if (h.sqlen() == 0) return false;
+
+        h = normalize(h);
+        if (h.z < 0) h = h * -1;
+        out_h = h;
+        return dot(wo, h) > 0 && dot(wi, h) < 0;
     }
 
-    Ray DiffuseBRDF::sample(const Ray& in, const HitResult& hit)
+    BRDFSample sample_dielectric(const Material& material, const Frame& frame, const Point& point, UniformRNG& rng)
     {
-        // Cos-weighted sampling the hemisphere
-        double u1 = rng.sample();
-        double u2 = rng.sample();
+        bool entering = frame.wo.z > 0;
+        Vec wo = entering ? frame.wo : flip(frame.wo);
+        double eta = entering ? material.ior : 1 / material.ior;
+
+        BRDFSample sample { { point, {} }, {}, 0, material.roughness == 0 };
+        if (wo.z <= 0) return sample;
 
-        double theta = std::acos(1 - 2 * u1) / 2;
-        double phi = 2 * PBR_PI * u2;
+        double alpha = ggx::alpha(material.roughness);
+        Vec h = sample.delta ? Vec { 0, 0, 1 } : ggx::sample_visible_normal(wo, alpha, rng.sample(), rng.sample());
+        double F = ggx::fresnel_dielectric(dot(wo, h), eta);
 
-        double x = std::sin(theta) * std::cos(phi);
-        double y = std::sin(theta) * std::sin(phi);
-        double z = std::cos(theta);
+        Vec wi;
+        bool reflection = rng.sample() < F;
+        if (reflection) wi = h * (2 * dot(wo, h)) - wo;
+        else if (!ggx::refract(wo, h, eta, wi)) return sample;
 
-        auto b = get_basis(hit);
-        auto dir = normalize(b.u * x + b.v * y + b.w * z);
+        // Reflection must stay above the surface and refraction must cross it
+        if (reflection ? wi.z <= 0 : wi.z >= 0) return sample;
+
+        sample.ray.direction = to_world(frame.basis, entering ? wi : flip(wi));
+        Colorf tint = reflection ? PBR_COLOR_WHITE : material.color / (eta * eta);
+
+        if (sample.delta)
+        {
+            // Fresnel cancels with the probability of the lobe
+            sample.pdf = reflection ? F : 1 - F;
+            sample.weight = tint;
+            return sample;
+        }
 
-        return { hit.point, dir };
+        // G2 / G1: D, the visible normal pdf, Fresnel and the Jacobians cancel
+        sample.pdf = pdf_dielectric(material, frame.wo, to_local(frame.basis, sample.ray.direction));
+        sample.weight = tint * (ggx::G2(wo, wi, alpha) / ggx::G1(wo, alpha));
+        return sample;
     }
 
-    Colorf DiffuseBRDF::eval(const Ray& in, const HitResult& hit, const Ray& out)
+    Colorf eval_dielectric(const Material& material, const Vec& wo_, const Vec& wi_)
     {
-        // Cos-weighted, so cos/pi has already been cancelled
-        double roughness = hit.actor->material->roughness;
-        Colorf albedo = hit.actor->material->color;
-        if (roughness == 0)
+        if (material.roughness == 0 || wo_.z == 0) return {};
+
+        bool entering = wo_.z > 0;
+        Vec wo = entering ? wo_ : flip(wo_);
+        Vec wi = entering ? wi_ : flip(wi_);
+        double eta = entering ? material.ior : 1 / material.ior;
+        double alpha = ggx::alpha(material.roughness);
+
+        if (wi.z > 0)
         {
-            // Return Lambertian diffuse
-            return albedo;
+            Vec h = normalize(wo + wi);
+            double F = ggx::fresnel_dielectric(dot(wo, h), eta);
+            return Colorf { F * ggx::D(h, alpha) * ggx::G2(wo, wi, alpha) / (4 * wo.z) };
         }
 
-        // Oren-Nayar model
-        //   https://en.wikipedia.org/wiki/Oren%E2%80%93Nayar_reflectance_model
+        Vec h;
+        if (wi.z == 0 || !refraction_half_vector(wo, wi, eta, h)) return {};
 
-        auto [theta_in, phi_in] = to_polar_hemisphere(in.direction * -1, hit.normal);
-        auto [theta_out, phi_out] = to_polar_hemisphere(out.direction, hit.normal);
+        double F = ggx::fresnel_dielectric(dot(wo, h), eta);
+        double denom = dot(wi, h) + dot(wo, h) / eta;
+        double f = (1 - F) * ggx::D(h, alpha) * ggx::G2(wo, wi, alpha) * std::abs(dot(wi, h)) * dot(wo, h)
+            / (wo.z * denom * denom);
+        return material.color * (f / (eta * eta));
+    }
 
-        double alpha = std::max(theta_in, theta_out);
-        double beta = std::min(theta_in, theta_out);
+    double pdf_dielectric(const Material& material, const Vec& wo_, const Vec& wi_)
+    {
+        if (material.roughness == 0 || wo_.z == 0) return 0;
 
-        double sq_rough = roughness * roughness;
-        double A = 1 - (0.5 * sq_rough) / (sq_rough + 0.33);
-        double B = (0.45 * sq_rough) / (sq_rough + 0.09);
+        bool entering = wo_.z > 0;
+        Vec wo = entering ? wo_ : flip(wo_);
+        Vec wi = entering ? wi_ : flip(wi_);
+        double eta = entering ? material.ior : 1 / material.ior;
+        double alpha = ggx::alpha(material.roughness);
 
-        B = B * std::max(0., std::cos(phi_in - phi_out)) * std::sin(alpha) * std::tan(beta);
-        return albedo * (A + B);
+        if (wi.z > 0)
+        {
+            Vec h = normalize(wo + wi);
+            return ggx::fresnel_dielectric(dot(wo, h), eta) * ggx::pdf_reflection(wo, h, alpha);
+        }
+
+        Vec h;
+        if (wi.z == 0 || !refraction_half_vector(wo, wi, eta, h)) return 0;
+
+        // Visible normal pdf times the Jacobian of the refraction
+        double F = ggx::fresnel_dielectric(dot(wo, h), eta);
+        double denom = dot(wi, h) + dot(wo, h) / eta;
+        double visible = ggx::G1(wo, alpha) * ggx::D(h, alpha) * dot(wo, h) / wo.z;
+        return (1 - F) * visible * std::abs(dot(wi, h)) / (denom * denom);
     }
+}
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
 
-    Ray SpecularBRDF::sample(const Ray& in, const HitResult& hit)
+    TEST_CASE("material::energy_conservation")
     {
-        Ray refl;
-        refl.direction = reflect(in.direction, hit.normal);
-        refl.origin = hit.point;
-        return refl;
+        // White furnace: the directional albedo of a white material must not exceed 1, and
+        // importance sampling must agree with uniform hemisphere sampling of eval_brdf.
+        const Material materials[] = {
+            { PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Diffuse },
+            { PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Diffuse, 0.3 },
+            { PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Conductor, 0.2 },
+            { PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Conductor, 0.6 },
+            { PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Conductor, 1.0 },
+            { PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Plastic, 0.2 },
+            { PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Plastic, 0.7 },
+        };
+
+        constexpr int N = 40000, STRATA = 500;
+        UniformRNG rng(29);
+
+        HitResult hit {};
+        hit.normal = { 0, 0, 1 };
+
+        for (const auto& material : materials)
+        {
+            for (double theta_deg : { 0., 45., 80. })
+            {
+                double theta = PBR_DEG_TO_RAD(theta_deg);
+                Ray in { Vec { 0, 0, 0 }, Vec { -std::sin(theta), 0, -std::cos(theta) } };
+
+                double importance = 0, uniform = 0;
+                int pdf_mismatches = 0;
+                for (int i = 0; i < N; ++i)
+                {
+                    BRDFSample s = sample_brdf(material, in, hit, rng);
+                    importance += s.weight.y;
+
+                    // The pdf must match the one reported for the same direction
+                    double pdf = pdf_brdf(material, in, hit, s.ray.direction);
+                    if (!is_black(s.weight) && std::abs(pdf - s.pdf) > 1e-6 * s.pdf) ++pdf_mismatches;
+                }
+
+                // Uniform directions, one in each cell of a grid over (cos theta, phi) fine enough for
+                // the sharp lobes at grazing angles
+                for (int j = 0; j < STRATA; ++j)
+                {
+                    for (int k = 0; k < STRATA; ++k)
+                    {
+                        double cos_theta = (j + rng.sample()) / STRATA, phi = 2 * PBR_PI * (k + rng.sample()) / STRATA;
+                        double sin_theta = std::sqrt(1 - cos_theta * cos_theta);
+                        Vec wi { sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta };
+                        uniform += eval_brdf(material, in, hit, wi).y * (2 * PBR_PI);
+                    }
+                }
+                importance /= N;
+                uniform /= STRATA * STRATA;
+
+                INFO("brdf ", (int) material.brdf, " roughness ", material.roughness, " theta ", theta_deg);
+                CHECK(pdf_mismatches == 0);
+                CHECK(importance <= 1.01);
+                CHECK(importance == doctest::Approx(uniform).epsilon(0.05));
+            }
+        }
     }
 
-    Colorf SpecularBRDF::eval(const Ray& in, const HitResult& hit, const Ray& out)
+    TEST_CASE("material::dielectric")
     {
-        return PBR_COLOR_WHITE;
+        // Rays arrive from outside (wo.z > 0) and from inside (wo.z < 0) of a glass surface
+        constexpr int N = 40000;
+        UniformRNG rng(35);
+
+        HitResult hit {};
+        hit.normal = { 0, 0, 1 };
+
+        for (double side : { 1., -1. })
+        {
+            for (double theta_deg : { 0., 30., 60. })
+            {
+                double theta = PBR_DEG_TO_RAD(theta_deg);
+                Ray in { Vec { 0, 0, 0 }, Vec { -std::sin(theta), 0, -side * std::cos(theta) } };
+                double eta = side > 0 ? 1.5 : 1 / 1.5;
+
+                // Smooth: reflection is picked with the Fresnel reflectance
+                Material smooth { PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Dielectric };
+                int reflected = 0;
+                for (int i = 0; i < N; ++i)
+                {
+                    BRDFSample s = sample_brdf(smooth, in, hit, rng);
+                    if (s.delta && s.ray.direction.z * side > 0) ++reflected;
+                }
+                INFO("side ", side, " theta ", theta_deg);
+                CHECK(reflected / double(N) == doctest::Approx(ggx::fresnel_dielectric(std::cos(theta), eta)).epsilon(0.1));
+
+                // Rough: importance sampling must agree with uniform sampling of the sphere
+                Material rough { PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Dielectric, 0.4 };
+                double importance = 0, uniform = 0, uniform_sq = 0;
+                int pdf_mismatches = 0;
+                for (int i = 0; i < N; ++i)
+                {
+                    BRDFSample s = sample_brdf(rough, in, hit, rng);
+                    importance += s.weight.y;
+
+                    double pdf = pdf_brdf(rough, in, hit, s.ray.direction);
+                    if (!is_black(s.weight) && std::abs(pdf - s.pdf) > 1e-6 * s.pdf) ++pdf_mismatches;
+
+                    Vec wi = rng.sample_hemisphere();
+                    if (rng.sample() < 0.5) wi.z = -wi.z;
+                    double u = eval_brdf(rough, in, hit, wi).y * (4 * PBR_PI);
+                    uniform += u;
+                    uniform_sq += u * u;
+                }
+                importance /= N;
+                uniform /= N;
+
+                double standard_error = std::sqrt(std::max(0., uniform_sq / N - uniform * uniform) / N);
+                CHECK(pdf_mismatches == 0);
+                CHECK(std::abs(importance - uniform) <= 5 * standard_error + 0.01);
+            }
+        }
     }
 }
@@ -1,37 +1,37 @@
 #pragma once
 
 #include "radiometry.h"
-
-#define PBR_DECLARE_MATERIAL(NAME) \
-    struct NAME##BRDF : public BaseBRDF { \
-        virtual Ray sample(const Ray& in, const HitResult& hit) override; \
-        virtual Colorf eval(const Ray& in, const HitResult& hit, const Ray& out) override; \
-    };
+#include "microfacet.h"
+#include <scene/hit.h>
+#include <textures/texture.h>
+#include <config.h>
 
 namespace pbr
 {
-    struct HitResult;
-
     ///////////////////////////////////////////////////////////////////////////////
-    // BRDFs
-    // NOTE: in is w.r.t. rays from the camera
+    // Materials
     ///////////////////////////////////////////////////////////////////////////////
 
-    struct BaseBRDF
+    /** Tag that selects the BRDF of a material. */
+    enum class BRDFType : uint8_t
     {
-        virtual Ray sample(const Ray& in, const HitResult& hit) = 0;
-        virtual Colorf eval(const Ray& in, const HitResult& hit, const Ray& out) = 0;
+        /** Lambertian diffuse (Oren-Nayar when rough) with cos-weighted hemisphere sampling */
+        Diffuse,
 
-    protected:
-        UniformRNG rng;
-        Basis get_basis(const HitResult& hit) const;
-    };
+        /** Perfect mirror */
+        Specular,
+
+        /** Rough metal: GGX microfacet reflection with a Schlick Fresnel tinted by the color */
+        Conductor,
 
-    /*! @brief Lambertian diffuse BRDF (constant) with cos-weighted hemisphere sampling */
-    PBR_DECLARE_MATERIAL(Diffuse);
-    PBR_DECLARE_MATERIAL(Specular);
+        /** Rough plastic: GGX dielectric coat (IOR 1.5) over a diffuse base of the color */
+        Plastic,
+
+        /** Glass: reflects or refracts by Fresnel, smooth at roughness 0 and GGX otherwise. Transmission is tinted by the color */
+        Dielectric,
+    };
 
-    /** Structure that represents the surface material. */
+    /** Structure that represents the surface material. Parameters of every BRDF are packed together. */
     struct Material
     {
         /** Color of the surface */
@@ -40,14 +40,305 @@ namespace pbr
         /** Color of the light that this surface emits */
         Colorf emission;
 
+        /** Oren-Nayar sigma for diffuse, perceptual GGX roughness for conductor, plastic and dielectric */
+        double roughness;
+
+        /** Index of refraction of the inside of a dielectric */
+        double ior;
+
         /** Behaviour of the surface */
-        BaseBRDF* brdf;
+        BRDFType brdf;
 
-        double roughness;
+        /** Texture multiplying the color at the hit's uv, or NO_TEXTURE */
+        TextureId color_texture = NO_TEXTURE;
+
+        /** Texture whose red channel multiplies the roughness at the hit's uv, or NO_TEXTURE */
+        TextureId roughness_texture = NO_TEXTURE;
 
-        Material(Colorf color_, Colorf emission_, BaseBRDF* brdf_, double roughness_ = 0.0)
-            : color(color_), emission(emission_), brdf(brdf_), roughness(roughness_) {}
+        bool textured() const { return color_texture != NO_TEXTURE || roughness_texture != NO_TEXTURE; }
 
-        ~Material() { delete brdf; }
+        Material(Colorf color_, Colorf emission_, BRDFType brdf_, double roughness_ = 0.0, double ior_ = 1.5)
+            : color(color_), emission(emission_), roughness(roughness_), ior(ior_), brdf(brdf_) {}
     };
+
+    /** Flat array of all materials in a scene, indexed by MaterialId. */
+    using MaterialTable = std::vector<Material>;
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // BRDFs
+    // NOTE: in is w.r.t. rays from the camera
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Result of sampling a BRDF. */
+    struct BRDFSample
+    {
+        /** Sampled outgoing ray, starting at the hit point */
+        Ray ray;
+
+        /** BRDF * cos / pdf, i.e. the throughput weight of the sampled ray. Black if sampling failed. */
+        Colorf weight;
+
+        /** Solid angle pdf of the sampled direction, 1 for delta lobes */
+        double pdf;
+
+        /** Set for perfectly specular lobes, which cannot be evaluated for arbitrary directions */
+        bool delta;
+    };
+
+    namespace brdf
+    {
+        /** Fresnel reflectance at normal incidence of the dielectric coat of plastic (IOR 1.5). */
+        constexpr double PLASTIC_F0 = 0.04;
+
+        /** Shading frame at a hit point. wo points away from the surface, towards where the ray came from. */
+        struct Frame
+        {
+            Basis basis;
+            Vec wo;
+        };
+
+        inline Frame make_frame(const Ray& in, const HitResult& hit)
+        {
+            Basis basis = make_basis(hit.normal);
+            return { basis, to_local(basis, normalize(in.direction * -1)) };
+        }
+
+        /** Oren-Nayar factor (A + B max(0, cos(phi_i - phi_o)) sin(alpha) tan(beta)), in the local frame. */
+        Colorf oren_nayar(const Material& material, const Vec& wo, const Vec& wi);
+
+        inline Vec sample_cosine_hemisphere(UniformRNG& rng)
+        {
+            // Cos-weighted sampling the hemisphere
+            double u1 = rng.sample();
+            double u2 = rng.sample();
+
+            double theta = std::acos(1 - 2 * u1) / 2;
+            double phi = 2 * PBR_PI * u2;
+
+            return {
+                std::sin(theta) * std::cos(phi),
+                std::sin(theta) * std::sin(phi),
+                std::cos(theta)
+            };
+        }
+
+        // Each lobe below works in the local frame and returns BRDF * cos(theta_i) from eval
+
+        inline Colorf eval_diffuse(const Material& material, const Vec& wo, const Vec& wi)
+        {
+            if (wi.z <= 0 || wo.z <= 0) return {};
+
+            Colorf reflectance = material.roughness == 0 ? material.color : oren_nayar(material, wo, wi);
+            return reflectance * (wi.z / PBR_PI);
+        }
+
+        inline double pdf_diffuse(const Vec& /* wo */, const Vec& wi)
+        {
+            return wi.z > 0 ? wi.z / PBR_PI : 0;
+        }
+
+        inline Colorf eval_conductor(const Material& material, const Vec& wo, const Vec& wi)
+        {
+            if (wi.z <= 0 || wo.z <= 0) return {};
+
+            double alpha = ggx::alpha(material.roughness);
+            Vec h = normalize(wo + wi);
+            Colorf F = ggx::schlick(material.color, dot(wo, h));
+            return F * (ggx::D(h, alpha) * ggx::G2(wo, wi, alpha) / (4 * wo.z));
+        }
+
+        inline double pdf_conductor(const Material& material, const Vec& wo, const Vec& wi)
+        {
+            if (wi.z <= 0 || wo.z <= 0) return 0;
+            return ggx::pdf_reflection(wo, normalize(wo + wi), ggx::alpha(material.roughness));
+        }
+
+        /** Probability of sampling the specular coat of plastic, given the view direction. */
+        inline double plastic_specular_probability(const Material& material, const Vec& wo)
+        {
+            double specular = ggx::schlick(PLASTIC_F0, wo.z).x;
+            double diffuse = (1 - specular) * luminance(material.color);
+            return clamp(specular / (specular + diffuse), 0.1, 0.9);
+        }
+
+        inline Colorf eval_plastic(const Material& material, const Vec& wo, const Vec& wi)
+        {
+            if (wi.z <= 0 || wo.z <= 0) return {};
+
+            // Specular coat
+            double alpha = ggx::alpha(material.roughness);
+            Vec h = normalize(wo + wi);
+            double F = ggx::schlick(PLASTIC_F0, dot(wo, h)).x;
+            double specular = F * ggx::D(h, alpha) * ggx::G2(wo, wi, alpha) / (4 * wo.z);
+
+            // Diffuse base, seen through the coat on the way in and out
+            double transmitted = (1 - ggx::schlick(PLASTIC_F0, wo.z).x) * (1 - ggx::schlick(PLASTIC_F0, wi.z).x);
+            return material.color * (transmitted * wi.z / PBR_PI) + Colorf { specular };
+        }
+
+        inline double pdf_plastic(const Material& material, const Vec& wo, const Vec& wi)
+        {
+            if (wi.z <= 0 || wo.z <= 0) return 0;
+
+            double p = plastic_specular_probability(material, wo);
+            double alpha = ggx::alpha(material.roughness);
+            return p * ggx::pdf_reflection(wo, normalize(wo + wi), alpha) + (1 - p) * pdf_diffuse(wo, wi);
+        }
+
+        // Dielectrics are hit from both sides: wo.z < 0 when a ray leaves the inside of an actor.
+        // Transmission divides by eta^2 since radiance is carried along camera paths.
+
+        /** Pick reflection or refraction by Fresnel, sampling a visible microfacet normal when rough. */
+        BRDFSample sample_dielectric(const Material& material, const Frame& frame, const Point& point, UniformRNG& rng);
+
+        Colorf eval_dielectric(const Material& material, const Vec& wo, const Vec& wi);
+
+        double pdf_dielectric(const Material& material, const Vec& wo, const Vec& wi);
+    }
+
+    /*!
+    * @brief Sample an outgoing ray from the BRDF of a material
+    *
+    * @param material Material at the hit point
+    * @param in Incoming ray
+    * @param hit Surface data of the hit
+    * @param rng Random number generator of the calling thread
+    * @return BRDFSample Sampled outgoing ray, its weight and pdf
+    */
+    inline BRDFSample sample_brdf(const Material& material, const Ray& in, const HitResult& hit, UniformRNG& rng)
+    {
+        if (material.brdf == BRDFType::Specular)
+        {
+            return { { hit.point, reflect(in.direction, hit.normal) }, PBR_COLOR_WHITE, 1, true };
+        }
+
+        auto frame = brdf::make_frame(in, hit);
+        const Vec& wo = frame.wo;
+
+        if (material.brdf == BRDFType::Dielectric) return brdf::sample_dielectric(material, frame, hit.point, rng);
+
+        Vec wi;
+        switch (material.brdf)
+        {
+        case BRDFType::Conductor:
+        {
+            double u1 = rng.sample();
+            double u2 = rng.sample();
+            Vec h = ggx::sample_visible_normal(wo, ggx::alpha(material.roughness), u1, u2);
+            wi = h * (2 * dot(wo, h)) - wo;
+            break;
+        }
+        case BRDFType::Plastic:
+        {
+            if (rng.sample() < brdf::plastic_specular_probability(material, wo))
+            {
+                double u1 = rng.sample();
+                double u2 = rng.sample();
+                Vec h = ggx::sample_visible_normal(wo, ggx::alpha(material.roughness), u1, u2);
+                wi = h * (2 * dot(wo, h)) - wo;
+            }
+            else wi = brdf::sample_cosine_hemisphere(rng);
+            break;
+        }
+        default:
+            wi = brdf::sample_cosine_hemisphere(rng);
+            break;
+        }
+
+        BRDFSample sample { { hit.point, to_world(frame.basis, wi) }, {}, 0, false };
+        if (wo.z <= 0 || wi.z <= 0) return sample;
+
+        switch (material.brdf)
+        {
+        case BRDFType::Conductor:
+        {
+            // F * G2 / G1: D and the visible normal pdf cancel
+            double alpha = ggx::alpha(material.roughness);
+            Vec h = normalize(wo + wi);
+            sample.pdf = ggx::pdf_reflection(wo, h, alpha);
+            sample.weight = ggx::schlick(material.color, dot(wo, h)) * (ggx::G2(wo, wi, alpha) / ggx::G1(wo, alpha));
+            break;
+        }
+        case BRDFType::Plastic:
+            sample.pdf = brdf::pdf_plastic(material, wo, wi);
+            sample.weight = brdf::eval_plastic(material, wo, wi) / sample.pdf;
+            break;
+        default:
+            // Cos-weighted, so cos/pi cancels
+            sample.pdf = brdf::pdf_diffuse(wo, wi);
+            sample.weight = material.roughness == 0 ? material.color : brdf::oren_nayar(material, wo, wi);
+            break;
+        }
+
+        return sample;
+    }
+
+    /*!
+    * @brief Evaluate the BRDF of a material for an arbitrary pair of directions
+    *
+    * @param material Material at the hit point
+    * @param in Incoming ray
+    * @param hit Surface data of the hit
+    * @param out Outgoing direction, leaving the surface
+    * @return Colorf BRDF * cos(theta_out), black for delta lobes
+    */
+    inline Colorf eval_brdf(const Material& material, const Ray& in, const HitResult& hit, const Direction& out)
+    {
+        auto frame = brdf::make_frame(in, hit);
+        Vec wi = to_local(frame.basis, normalize(out));
+
+        switch (material.brdf)
+        {
+        case BRDFType::Diffuse: return brdf::eval_diffuse(material, frame.wo, wi);
+        case BRDFType::Specular: return {};
+        case BRDFType::Conductor: return brdf::eval_conductor(material, frame.wo, wi);
+        case BRDFType::Plastic: return brdf::eval_plastic(material, frame.wo, wi);
+        case BRDFType::Dielectric: return brdf::eval_dielectric(material, frame.wo, wi);
+        }
+        return {};
+    }
+
+    /** Solid angle pdf with which sample_brdf would return the direction out, 0 for delta lobes. */
+    inline double pdf_brdf(const Material& material, const Ray& in, const HitResult& hit, const Direction& out)
+    {
+        auto frame = brdf::make_frame(in, hit);
+        Vec wi = to_local(frame.basis, normalize(out));
+
+        switch (material.brdf)
+        {
+        case BRDFType::Diffuse: return brdf::pdf_diffuse(frame.wo, wi);
+        case BRDFType::Specular: return 0;
+        case BRDFType::Conductor: return brdf::pdf_conductor(material, frame.wo, wi);
+        case BRDFType::Plastic: return brdf::pdf_plastic(material, frame.wo, wi);
+        case BRDFType::Dielectric: return brdf::pdf_dielectric(material, frame.wo, wi);
+        }
+        return 0;
+    }
+
+    /** Whether the BRDF of a material only scatters in discrete directions. */
+    inline bool is_delta(const Material& material)
+    {
+        return material.brdf == BRDFType::Specular || (material.brdf == BRDFType::Dielectric && material.roughness == 0);
+    }
+
+    /*!
+    * @brief Factor that turns a BRDF evaluated for radiance into one for light traced from the lights
+    *
+    * Refraction squeezes radiance into a smaller solid angle, so the BRDFs scale transmission by
+    * 1 / eta^2, but the flux (or importance) that light paths carry is not scaled.
+    *
+    * @param material Material at the hit point
+    * @param in Direction of travel of the ray arriving at the hit
+    * @param normal Surface normal at the hit
+    * @param out Direction leaving the surface
+    * @return double eta^2 for transmission through a dielectric, 1 otherwise
+    */
+    inline double importance_scale(const Material& material, const Vec& in, const Vec& normal, const Vec& out)
+    {
+        double cos_in = dot(in, normal);
+        if (material.brdf != BRDFType::Dielectric || cos_in * dot(out, normal) <= 0) return 1;
+
+        double eta = cos_in < 0 ? material.ior : 1 / material.ior;
+        return eta * eta;
+    }
 }
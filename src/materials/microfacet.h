@@ -0,0 +1,144 @@
+#pragma once
+
+#include "radiometry.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// GGX (Trowbridge-Reitz) microfacet distribution
+//   https://jcgt.org/published/0007/04/01/ (Heitz 2018, visible normal sampling)
+//
+// All directions are unit vectors in the local shading frame, where the
+// surface normal is +z.
+///////////////////////////////////////////////////////////////////////////////
+
+namespace pbr::ggx
+{
+    /** Map perceptual roughness in [0, 1] to the GGX alpha, clamped to keep the lobe finite. */
+    inline double alpha(double roughness)
+    {
+        return std::max(1e-3, roughness * roughness);
+    }
+
+    /** Normal distribution function D(h). */
+    inline double D(const Vec& h, double alpha)
+    {
+        if (h.z <= 0) return 0;
+
+        double a2 = alpha * alpha;
+        double d = h.z * h.z * (a2 - 1) + 1;
+        return a2 / (PBR_PI * d * d);
+    }
+
+    /** Smith auxiliary function Lambda(v). */
+    inline double lambda(const Vec& v, double alpha)
+    {
+        double cos2 = v.z * v.z;
+        if (cos2 >= 1) return 0;
+
+        double tan2 = (1 - cos2) / cos2;
+        return (std::sqrt(1 + alpha * alpha * tan2) - 1) / 2;
+    }
+
+    /** Smith masking term for one direction. */
+    inline double G1(const Vec& v, double alpha)
+    {
+        return 1 / (1 + lambda(v, alpha));
+    }
+
+    /** Height-correlated masking-shadowing term. */
+    inline double G2(const Vec& wo, const Vec& wi, double alpha)
+    {
+        return 1 / (1 + lambda(wo, alpha) + lambda(wi, alpha));
+    }
+
+    /*!
+    * @brief Sample a microfacet normal from the distribution of normals visible from wo
+    *
+    * @param wo Outgoing (view) direction, must be in the upper hemisphere
+    * @param alpha GGX alpha
+    * @param u1 Uniform random number in [0, 1)
+    * @param u2 Uniform random number in [0, 1)
+    * @return Vec Sampled microfacet normal
+    */
+    inline Vec sample_visible_normal(const Vec& wo, double alpha, double u1, double u2)
+    {
+        // Stretch the view direction to the hemisphere configuration
+        Vec vh = normalize(Vec { alpha * wo.x, alpha * wo.y, wo.z });
+
+        // Orthonormal basis around it
+        double lensq = vh.x * vh.x + vh.y * vh.y;
+        Vec t1 = lensq > 0 ? Vec { -vh.y, vh.x, 0 } / std::sqrt(lensq) : Vec { 1, 0, 0 };
+        Vec t2 = cross(vh, t1);
+
+        // Uniform point on the projected half disk
+        double r = std::sqrt(u1);
+        double phi = 2 * PBR_PI * u2;
+        double p1 = r * std::cos(phi);
+        double p2 = r * std::sin(phi);
+        double s = (1 + vh.z) / 2;
+        p2 = (1 - s) * std::sqrt(1 - p1 * p1) + s * p2;
+
+        // Reproject onto the hemisphere and unstretch
+        Vec nh = t1 * p1 + t2 * p2 + vh * std::sqrt(std::max(0., 1 - p1 * p1 - p2 * p2));
+        return normalize(Vec { alpha * nh.x, alpha * nh.y, std::max(1e-6, nh.z) });
+    }
+
+    /** Solid angle pdf of sampling wi = reflect(-wo, h) with sample_visible_normal. */
+    inline double pdf_reflection(const Vec& wo, const Vec& h, double alpha)
+    {
+        if (wo.z <= 0) return 0;
+        return G1(wo, alpha) * D(h, alpha) / (4 * wo.z);
+    }
+
+    /*!
+    * @brief Exact Fresnel reflectance of an interface between two dielectrics (unpolarized light)
+    *
+    * @param cos_i Cosine between the incident direction and the normal, negative from the inside
+    * @param eta Index of refraction of the inside over the outside
+    * @return double Reflected fraction, 1 for total internal reflection
+    */
+    inline double fresnel_dielectric(double cos_i, double eta)
+    {
+        cos_i = clamp(cos_i, -1, 1);
+        if (cos_i < 0)
+        {
+            eta = 1 / eta;
+            cos_i = -cos_i;
+        }
+
+        double sin2_t = (1 - cos_i * cos_i) / (eta * eta);
+        if (sin2_t >= 1) return 1;
+
+        double cos_t = std::sqrt(1 - sin2_t);
+        double r_parallel = (eta * cos_i - cos_t) / (eta * cos_i + cos_t);
+        double r_perpendicular = (cos_i - eta * cos_t) / (cos_i + eta * cos_t);
+        return (r_parallel * r_parallel + r_perpendicular * r_perpendicular) / 2;
+    }
+
+    /*!
+    * @brief Refract a direction through an interface
+    *
+    * @param wo Direction away from the interface on the incident side, with dot(wo, n) > 0
+    * @param n Normal (or microfacet normal) on the incident side
+    * @param eta Index of refraction of the transmitted side over the incident side
+    * @param out_wi Refracted direction, away from the interface on the other side
+    * @return bool False for total internal reflection
+    */
+    inline bool refract(const Vec& wo, const Vec& n, double eta, Vec& out_wi)
+    {
+        double cos_i = dot(wo, n);
+        double sin2_t = std::max(0., 1 - cos_i * cos_i) / (eta * eta);
+        if (sin2_t >= 1) return false;
+
+        double cos_t = std::sqrt(1 - sin2_t);
+        out_wi = wo * (-1 / eta) + n * (cos_i / eta - cos_t);
+        return true;
+    }
+
+    /** Schlick's approximation of the Fresnel reflectance. */
+    inline Colorf schlick(const Colorf& f0, double cos_theta)
+    {
+        double m = clamp(1 - cos_theta);
+        double m5 = (m * m) * (m * m) * m;
+        return f0 + (Colorf { 1.0 } - f0) * m5;
+    }
+}
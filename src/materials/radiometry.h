@@ -12,21 +12,16 @@ namespace pbr
     /** A 4-byte representation of color. R, G, B and A each are 1-byte integers (between 0 and 255). */
     using Colori = uint32_t;
 
-    inline Colori to_colori(const Colorf& color)
+    /** Relative luminance of a linear color (Rec. 709 weights). */
+    inline double luminance(const Colorf& color)
     {
-        // Gamma correction
-        double gamma = 1 / 2.2;
-        double gx = std::pow(clamp(color.x), gamma);
-        double gy = std::pow(clamp(color.y), gamma);
-        double gz = std::pow(clamp(color.z), gamma);
-
-        // Convert a valid Colorf to Colori
-        return (255 << 24)
-        | ((int) std::floor(gz * 255) << 16)
-        | ((int) std::floor(gy * 255) << 8)
-        | (int) std::floor(gx * 255);
+        return 0.2126 * color.x + 0.7152 * color.y + 0.0722 * color.z;
     }
 
+    inline bool is_black(const Colorf& color)
+    {
+        return color.x == 0 && color.y == 0 && color.z == 0;
+    }
 
     using Radiance = Colorf;
 }
@@ -9,9 +9,22 @@
 #include "materials/radiometry.h"
 #include "materials/material.h"
 
+#include "film/framebuffer.h"
+#include "film/tiled_framebuffer.h"
+#include "film/postprocess.h"
+#include "film/png.h"
+#include "film/denoiser.h"
+#include "film/light_paths.h"
+#include "film/checkpoint.h"
+
 #include "scene/camera.h"
 #include "scene/scene.h"
 
 #include "integrators/PathIntegrator.h"
+#include "integrators/ReSTIRIntegrator.h"
+#include "integrators/GuidedIntegrator.h"
+#include "integrators/BDPTIntegrator.h"
+#include "integrators/CachedIntegrator.h"
+#include "integrators/IrradianceCacheIntegrator.h"
 
 #include "renderer.h"
@@ -0,0 +1,234 @@
+#include "renderer.h"
+#include <integrators/PathIntegrator.h>
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("Renderer::resume")
+    {
+        Scene scene;
+        auto white = scene.add_material({ Colorf { 0.8 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+        auto light = scene.add_material({ PBR_COLOR_BLACK, Colorf { 4 }, BRDFType::Diffuse });
+        scene.add_actor(white, { Vec { 0, -1000, 0 }, 1000 });
+        scene.add_actor(white, { Vec { 0, 1, 0 }, 1 });
+        scene.add_actor(light, { Vec { 2, 3, 0 }, 0.5 });
+
+        Camera camera;
+        camera.position = Vec { 0, 2, 6 };
+        camera.look_at = Vec { 0, 1, 0 };
+        camera.fov = 60;
+        camera.calculate_basis(12. / 10);
+
+        // A render continued from the checkpoint of the pass before the last, in tiles and in rows,
+        // ends the same as one that went on
+        const std::string path = (std::filesystem::temp_directory_path() / "pbr_test_checkpoint.ckpt").string();
+        for (int tile_size : { 4, 0 })
+        {
+            Renderer<PathIntegrator> renderer;
+            renderer.tile_size = tile_size;
+            renderer.seed = 7;
+            renderer.checkpoint_path = path;
+            renderer.checkpoint_interval = 0;
+            Framebuffer image(10, 12);
+            renderer.render(&scene, camera, image);
+
+            Checkpoint saved = Checkpoint::read(path);
+            CHECK(saved.passes == PBR_SAMPLES_PER_PIXEL - 1);
+            CHECK(saved.seed == 7);
+            CHECK(saved.tile_size == tile_size);
+            CHECK(saved.counts[17] == PBR_SAMPLES_PER_PIXEL - 1);
+
+            Renderer<PathIntegrator> resumed;
+            resumed.tile_size = tile_size;
+            resumed.checkpoint_path = path;
+            resumed.resume = true;
+            Framebuffer continued(10, 12);
+            resumed.render(&scene, camera, continued);
+            CHECK(std::memcmp(image.pixels().data(), continued.pixels().data(), image.pixels().size() * sizeof(Colorf)) == 0);
+
+            // The layout of the accumulation has to match
+            resumed.tile_size = tile_size ? 0 : 4;
+            CHECK_THROWS(resumed.render(&scene, camera, continued));
+            std::remove(path.c_str());
+        }
+
+        CHECK_THROWS(Checkpoint::read(path));
+        std::remove((path + ".tmp").c_str());
+    }
+
+    /** Returns the direction of each camera ray, so an image holds where its pixels look. */
+    struct DirectionIntegrator
+    {
+        void set_scene(const Scene*) {}
+
+        Radiance trace_ray(const Ray& ray, const RayDifferential&, UniformRNG&) const { return Colorf { ray.direction }; }
+    };
+
+    TEST_CASE("Renderer::render_regions")
+    {
+        // Rectangles rendered into an image look where the whole image does there, and the rest is kept
+        Scene scene;
+        Camera camera;
+        camera.position = Vec { 0, 0, 5 };
+        camera.look_at = Vec { 0, 0, 0 };
+        camera.fov = 60;
+        camera.calculate_basis(24. / 16);
+
+        Framebuffer image(16, 24);
+        for (auto& color : image.pixels()) color = Colorf { 7 };
+
+        for (int tile_size : { 4, 0 })
+        {
+            Renderer<DirectionIntegrator> renderer;
+            renderer.tile_size = tile_size;
+            renderer.render_regions(&scene, camera, image, { { 5, 3, 6, 4 }, { 20, 12, 10, 10 }, { -3, 40, 4, 4 } });
+
+            bool kept = true, mapped = true;
+            for (int row = 0; row < 16; ++row)
+            {
+                for (int col = 0; col < 24; ++col)
+                {
+                    const Colorf& color = image[(size_t) row * 24 + col];
+                    bool inside = (col >= 5 && col < 11 && row >= 3 && row < 7) || (col >= 20 && row >= 12);
+                    if (!inside)
+                    {
+                        kept = kept && color.x == 7;
+                        continue;
+                    }
+
+                    // The mean of the samples is within a pixel of its own
+                    double x = 0, y = 0;
+                    REQUIRE(camera.project(color, x, y));
+                    mapped = mapped && std::abs((x + 1) / 2 * 24 - col) < 1 && std::abs((y + 1) / 2 * 16 - row) < 1;
+                }
+            }
+            CHECK(kept);
+            CHECK(mapped);
+        }
+    }
+
+    TEST_CASE("Renderer::light_paths")
+    {
+        // A floor and a ceiling lit by two lights of the same material
+        Scene scene;
+        auto white = scene.add_material({ Colorf { 0.8 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+        auto light = scene.add_material({ PBR_COLOR_BLACK, Colorf { 4 }, BRDFType::Diffuse });
+        scene.add_actor(white, { Vec { 0, -1000, 0 }, 1000 });
+        scene.add_actor(white, { Vec { 0, 1004, 0 }, 1000 });
+        scene.add_actor(white, { Vec { 0, 1, 0 }, 1 });
+        scene.add_actor(light, { Vec { -2, 3, 0 }, 0.5 });
+        scene.add_actor(light, { Vec { 2, 3, 0 }, 0.5 });
+
+        Camera camera;
+        camera.position = Vec { 0, 2, 6 };
+        camera.look_at = Vec { 0, 1, 0 };
+        camera.fov = 60;
+        camera.calculate_basis(1);
+
+        LightPathBuffers buffers(scene, 8, 8);
+        Renderer<PathIntegrator> renderer;
+        renderer.light_paths = &buffers;
+        renderer.seed = 47;
+        Framebuffer image(8, 8);
+        renderer.render(&scene, camera, image);
+
+        // The buffers sum to the image, split into direct and indirect light
+        Framebuffer combined(8, 8), direct(8, 8), indirect(8, 8);
+        buffers.combine({ PBR_COLOR_WHITE, PBR_COLOR_WHITE }, combined);
+        buffers.combine({ PBR_COLOR_WHITE, PBR_COLOR_WHITE }, direct, true, false);
+        buffers.combine({ PBR_COLOR_WHITE, PBR_COLOR_WHITE }, indirect, false, true);
+        double total = 0, total_direct = 0, total_indirect = 0;
+        for (int i = 0; i < 64; ++i)
+        {
+            for (int c = 0; c < 3; ++c) CHECK(combined[i][c] == doctest::Approx(image[i][c]).epsilon(1e-4));
+            total += luminance(combined[i]);
+            total_direct += luminance(direct[i]);
+            total_indirect += luminance(indirect[i]);
+        }
+        CHECK(total_direct > 0);
+        CHECK(total_indirect > 0);
+        CHECK(total_direct + total_indirect == doctest::Approx(total).epsilon(1e-4));
+
+        // Turning off one light leaves the other, doubling one doubles its part
+        Framebuffer left(8, 8), right(8, 8), none(8, 8);
+        buffers.combine({ PBR_COLOR_WHITE, PBR_COLOR_BLACK }, left);
+        buffers.combine({ PBR_COLOR_BLACK, Colorf { 2 } }, right);
+        buffers.combine({ PBR_COLOR_BLACK, PBR_COLOR_BLACK }, none);
+        double total_left = 0, total_right = 0, total_none = 0;
+        for (int i = 0; i < 64; ++i)
+        {
+            total_left += luminance(left[i]);
+            total_right += luminance(right[i]);
+            total_none += luminance(none[i]);
+        }
+        CHECK(total_left > total_none);
+        CHECK(total_left < total);
+        CHECK(total_left + (total_right - total_none) / 2 == doctest::Approx(total).epsilon(1e-4));
+    }
+
+    /** Returns a uniform random gray, of variance 1/12. */
+    struct UniformIntegrator
+    {
+        void set_scene(const Scene*) {}
+
+        Radiance trace_ray(const Ray&, const RayDifferential&, UniformRNG& rng) const { return Colorf { rng.sample() }; }
+    };
+
+    /** Adds white to the whole image every other pass. */
+    struct AlternatingIntegrator
+    {
+        void set_scene(const Scene*) {}
+
+        void render_pass(const Camera&, int pass, int, int, std::vector<Colorf>& accumulation) const
+        {
+            for (auto& color : accumulation) color = color + Colorf { pass % 2 ? 1. : 0. };
+        }
+    };
+
+    TEST_CASE("Renderer::variance")
+    {
+        Scene scene;
+        Camera camera;
+        camera.position = Vec { 0, 0, 5 };
+        camera.look_at = Vec { 0, 0, 0 };
+        camera.fov = 60;
+        camera.calculate_basis(24. / 16);
+
+        // The variance of the mean of the samples, 1/12 over the samples per pixel, on average over the pixels
+        std::vector<float> variance;
+        for (int tile_size : { 4, 0 })
+        {
+            Renderer<UniformIntegrator> renderer;
+            renderer.tile_size = tile_size;
+            renderer.seed = 46;
+            renderer.variance = &variance;
+            Framebuffer image(16, 24);
+            renderer.render(&scene, camera, image);
+
+            REQUIRE(variance.size() == image.pixels().size());
+            double mean = 0;
+            for (float v : variance) mean += v;
+            mean /= variance.size();
+            CHECK(mean == doctest::Approx(1. / 12 / PBR_SAMPLES_PER_PIXEL).epsilon(0.1));
+        }
+
+        // Passes of render_pass() are told apart by how they change the sums
+        Renderer<AlternatingIntegrator> renderer;
+        renderer.variance = &variance;
+        Framebuffer image(16, 24);
+        renderer.render(&scene, camera, image);
+
+        const int half = PBR_SAMPLES_PER_PIXEL / 2;
+        const double sample_variance = 0.25 * PBR_SAMPLES_PER_PIXEL / (PBR_SAMPLES_PER_PIXEL - 1);
+        REQUIRE(variance.size() == image.pixels().size());
+        CHECK(image[100].x == doctest::Approx(static_cast<double>(half) / PBR_SAMPLES_PER_PIXEL));
+        CHECK(variance[100] == doctest::Approx(sample_variance / PBR_SAMPLES_PER_PIXEL));
+    }
+}
@@ -1,7 +1,21 @@
 #pragma once
 
-#include <stb_image_write.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
 #include "materials/radiometry.h"
+#include "film/postprocess.h"
+#include "film/png.h"
+#include "film/denoiser.h"
+#include "film/light_paths.h"
+#include "film/checkpoint.h"
+#include "film/tiled_framebuffer.h"
+#include "scene/scene.h"
 #include "scene/camera.h"
 #include "config.h"
 #include "debug.h"
@@ -17,18 +31,24 @@ namespace pbr
             _data.resize(rows * cols);
         }
 
+        /** Tonemap a linear image for display, see PostProcess. */
+        explicit Image(const Framebuffer& linear, const PostProcess& post = {})
+            : Image(linear.rows(), linear.cols())
+        {
+            post.apply(linear, _data.data());
+        }
+
         // Write to file as RGBA
         void write(const std::string& name)
         {
-            stbi_flip_vertically_on_write(true);
-            stbi_write_png(name.c_str(), _cols, _rows, 4, _data.data(), _cols * sizeof (Colori));
+            write_png(name, _rows, _cols, _data.data());
         }
 
         int rows() { return _rows; }
         int cols() { return _cols; }
 
-        Colori& operator[](size_t index) { return _data.at(index); }
-        const Colori& operator[](size_t index) const { return _data.at(index); }
+        Colori& operator[](size_t index) { return _data[index]; }
+        const Colori& operator[](size_t index) const { return _data[index]; }
 
     private:
         std::vector<Colori> _data;
@@ -36,61 +56,486 @@ namespace pbr
         const unsigned int _cols;
     };
 
+    /*!
+    * @brief Collect the feature buffers that guide the Denoiser
+    *
+    * Traces camera rays through random points of each pixel, like the render's, and averages what
+    * they hit first. Rays go on through mirrors and smooth glass, so that what is seen in them
+    * keeps its edges, with the albedo tinted by them.
+    *
+    * @param scene Scene
+    * @param camera Camera
+    * @param out Feature buffers, the size of the image
+    * @param samples Rays per pixel
+    */
+    inline void render_features(const Scene& scene, const Camera& camera, FeatureBuffers& out, int samples = PBR_DENOISE_FEATURE_SAMPLES)
+    {
+        constexpr int MAX_DELTA_BOUNCES = 4;
+
+        int cols = out.albedo.cols();
+        int rows = out.albedo.rows();
+
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+        for (int row = 0; row < rows; ++row)
+        {
+            // A fixed sequence per row, so the features of a seeded render are the same every time
+            UniformRNG rng(stream_seed(0, row));
+            for (int col = 0; col < cols; ++col)
+            {
+                Colorf albedo;
+                Vec normal;
+                double depth = 0;
+                for (int sample = 0; sample < samples; ++sample)
+                {
+                    Ray ray = pixel_ray(camera, col, row, cols, rows, sample, rng);
+                    Colorf tint = PBR_COLOR_WHITE;
+                    double distance = 0;
+                    for (int bounce = 0;; ++bounce)
+                    {
+                        HitResult hit;
+                        if (!scene.intersect(ray, hit))
+                        {
+                            albedo = albedo + tint;
+                            normal = normal - normalize(ray.direction);
+                            break;
+                        }
+
+                        Material material = scene.material(hit);
+                        distance += hit.param * ray.direction.len();
+                        if (is_delta(material) && is_black(material.emission) && bounce < MAX_DELTA_BOUNCES)
+                        {
+                            BRDFSample next = sample_brdf(material, ray, hit, rng);
+                            if (!is_black(next.weight))
+                            {
+                                tint = tint * next.weight;
+                                ray = next.ray;
+                                continue;
+                            }
+                        }
+
+                        albedo = albedo + tint * (is_black(material.emission) ? material.color : PBR_COLOR_WHITE);
+                        normal = normal + (dot(hit.normal, ray.direction) > 0 ? hit.normal * -1 : hit.normal);
+                        depth += distance;
+                        break;
+                    }
+                }
+
+                size_t i = (size_t) row * cols + col;
+                out.albedo[i] = albedo / samples;
+                out.normal[i] = normal.len() > 0 ? normalize(normal) : normal;
+                out.depth[i] = depth / samples;
+            }
+        }
+    }
+
+    /** True for integrators that render a whole pass at once, to share work between pixels, instead of tracing rays one by one. */
+    template <class Integrator, class = void>
+    struct renders_passes : std::false_type {};
+
+    template <class Integrator>
+    struct renders_passes<Integrator, std::void_t<decltype(&Integrator::render_pass)>> : std::true_type {};
+
+    /** True for integrators that can split the light of each pixel by light group (see LightPathBuffers). */
+    template <class Integrator, class = void>
+    struct splits_light_paths : std::false_type {};
+
+    template <class Integrator>
+    struct splits_light_paths<Integrator, std::void_t<decltype(&Integrator::light_paths)>> : std::true_type {};
+
+    /** True for integrators that draw random numbers of their own when given a scene, from a seed member. */
+    template <class Integrator, class = void>
+    struct takes_seed : std::false_type {};
+
+    template <class Integrator>
+    struct takes_seed<Integrator, std::void_t<decltype(&Integrator::seed)>> : std::true_type {};
+
     template <class Integrator>
     class Renderer
     {
     public:
-        void render(const Scene* scene, const Camera& camera, Image& outImage)
+        /** Buffers to also split the light of each pixel into, by light group, nullptr to not split it. Needs an integrator that traces rays one by one. */
+        LightPathBuffers* light_paths = nullptr;
+
+        /** Pixels across the tiles that rays traced one by one are accumulated in, 0 to accumulate in rows (see TiledFramebuffer) */
+        int tile_size = PBR_TILE_SIZE;
+        TileOrder tile_order = PBR_TILE_ORDER;
+
+        /** Seed of the random numbers, 0 for a new one each render. Each tile (or row) of each pass draws from its own sequence of it. */
+        uint64_t seed = PBR_SEED;
+
+        /** File to save the state of the render to between passes, at most every checkpoint_interval seconds, empty to not save it (see Checkpoint). Needs an integrator that traces rays one by one, and no light_paths. */
+        std::string checkpoint_path;
+        double checkpoint_interval = PBR_CHECKPOINT_INTERVAL_SECONDS;
+
+        /** Continue from the checkpoint at checkpoint_path if there is one, with its seed, instead of from the first pass */
+        bool resume = false;
+
+        /** Variance of the mean luminance of each pixel, estimated from its samples, for the Denoiser, nullptr to not estimate it. Filled by render() from the passes it traces, left empty if they are fewer than 2. */
+        std::vector<float>* variance = nullptr;
+
+        /*!
+        * @brief Render a scene progressively, one sample per pixel per pass
+        *
+        * Radiance is accumulated in linear floating point, and the image holds its mean over the
+        * passes. Integrators with a render_pass(camera, pass, cols, rows, accumulation) method are
+        * handed each pass, the others are called with trace_ray(ray, differential, rng) for every
+        * pixel.
+        */
+        void render(const Scene* scene, const Camera& camera, Framebuffer& out_image)
         {
+            render(scene, camera, out_image, [](int, int) {});
+        }
+
+        /*!
+        * @brief Render a scene, handing over rows as soon as they are final
+        *
+        * @param rows_done Called with (first, count) for rows that hold their mean, from the threads
+        * that render them. With trace_ray() the rows of the last pass are handed over as they are
+        * traced, a band of tiles at a time, with render_pass() all rows once the last pass is done.
+        */
+        template <class RowsDone>
+        void render(const Scene* scene, const Camera& camera, Framebuffer& out_image, RowsDone&& rows_done)
+        {
+            if constexpr (splits_light_paths<Integrator>::value && !renders_passes<Integrator>::value)
+            {
+                integrator.light_paths = light_paths;
+                if (light_paths) light_paths->clear();
+            }
+            else if (light_paths)
+            {
+                throw std::runtime_error("The integrator cannot split the light by light group");
+            }
+            if (!checkpoint_path.empty() && (renders_passes<Integrator>::value || light_paths))
+            {
+                throw std::runtime_error("Checkpoints need an integrator that traces rays one by one, without light paths");
+            }
+
+            int cols = out_image.cols();
+            int rows = out_image.rows();
+            std::vector<Colorf>& accumulation = out_image.pixels();
+            std::fill(accumulation.begin(), accumulation.end(), Colorf {});
+
+            // Tiles to accumulate in, copied to the image band by band as the last pass finishes them
+            std::optional<TiledFramebuffer> tiles;
+            if (!renders_passes<Integrator>::value && tile_size > 0) tiles.emplace(rows, cols, tile_size, tile_order);
+            std::vector<std::atomic<int>> finished(tiles ? tiles->tiles_y() : 0);
+
+            int first_pass = 0;
+            render_seed = seed;
+            if (resume && !checkpoint_path.empty() && std::ifstream(checkpoint_path))
+            {
+                first_pass = restore(Checkpoint::read(checkpoint_path), out_image, tiles);
+                LOG_INFO("Resuming at pass %d of %d from %s", first_pass, PBR_SAMPLES_PER_PIXEL, checkpoint_path.c_str());
+            }
+            if (render_seed == 0) render_seed = new_seed();
+
+            if constexpr (takes_seed<Integrator>::value) integrator.seed = render_seed;
             integrator.set_scene(scene);
+            origin_col = origin_row = 0;
+            frame_cols = cols;
+            frame_rows = rows;
 
-            UniformRNG rng;
+            // Sums of the luminance of the samples of each pixel and of its square, for the variance
+            const size_t moments = variance && PBR_SAMPLES_PER_PIXEL - first_pass > 1 ? (size_t) rows * cols : 0;
+            luminance_sums.assign(moments, 0.);
+            luminance_squares.assign(moments, 0.);
 
-            // Iterate over all rows
+            auto saved = std::chrono::steady_clock::now();
+            for (int pass = first_pass; pass < PBR_SAMPLES_PER_PIXEL; ++pass)
+            {
+                LOG_TRACE("Pass %d", pass);
+
+                if constexpr (renders_passes<Integrator>::value)
+                {
+                    integrator.render_pass(camera, pass, cols, rows, accumulation);
+                    if (!luminance_sums.empty()) add_pass_luminance(accumulation);
+                }
+                else if (tiles)
+                {
+                    trace_tiles(camera, pass, *tiles, finished, out_image, rows_done);
+                }
+                else
+                {
+                    trace_pass(camera, pass, cols, rows, accumulation, rows_done);
+                }
+
+                // The last pass averages the sums, so the state after it is not saved
+                auto now = std::chrono::steady_clock::now();
+                if (!checkpoint_path.empty() && pass + 1 < PBR_SAMPLES_PER_PIXEL
+                    && std::chrono::duration<double>(now - saved).count() >= checkpoint_interval)
+                {
+                    save(pass + 1, out_image, tiles);
+                    saved = now;
+                }
+            }
+
+            if constexpr (renders_passes<Integrator>::value)
+            {
 #if PBR_USE_THREADS
-#pragma omp parallel for private(rng)
+#pragma omp parallel for schedule(dynamic)
 #endif
-            for (int row = 0; row < outImage.rows(); ++row)
+                for (int row = 0; row < rows; ++row)
+                {
+                    average_row(row, cols, accumulation);
+                    rows_done(row, 1);
+                }
+            }
+
+            if (light_paths) light_paths->average(PBR_SAMPLES_PER_PIXEL);
+            if (variance) estimate_variance(PBR_SAMPLES_PER_PIXEL - first_pass);
+        }
+
+        /*!
+        * @brief Render rectangles of an image again, and leave the rest of it as it is
+        *
+        * Pixels are mapped to the camera as in a render of the whole image, so the rectangles
+        * splice into an earlier render with the same camera and settings. Each rectangle is
+        * accumulated on its own, with random sequences of its own, and its rows replace those of
+        * the image as they are final. Rectangles are cut to the image, and where they overlap the
+        * later one is kept. Needs an integrator that traces rays one by one, and no light_paths or
+        * checkpoint_path.
+        *
+        * @param image Render of the whole image to update
+        * @param regions Rectangles of pixels to render
+        */
+        void render_regions(const Scene* scene, const Camera& camera, Framebuffer& image, const std::vector<PixelRect>& regions)
+        {
+            if constexpr (renders_passes<Integrator>::value)
             {
+                throw std::runtime_error("Regions need an integrator that traces rays one by one");
+            }
+            else
+            {
+                if (light_paths || !checkpoint_path.empty())
+                {
+                    throw std::runtime_error("Regions are rendered without light paths or checkpoints");
+                }
+                if constexpr (splits_light_paths<Integrator>::value) integrator.light_paths = nullptr;
+                luminance_sums.clear();
+                luminance_squares.clear();
 
-                LOG_DEBUG("Row %d", row);
+                const uint64_t base_seed = seed ? seed : new_seed();
+                if constexpr (takes_seed<Integrator>::value) integrator.seed = base_seed;
+                integrator.set_scene(scene);
+                frame_cols = image.cols();
+                frame_rows = image.rows();
 
-                // Iterate over all cols
-                for (int col = 0; col < outImage.cols(); ++col)
+                for (size_t i = 0; i < regions.size(); ++i)
                 {
-                    Colorf color;
-                    for (int i = 0; i < PBR_SAMPLES_PER_PIXEL; ++i)
-                    {
-                        auto sample = rng.sample_disk();
-
-#if PBR_STRATIFIED_SAMPLE
-                        // Split the pixel into four quadrants for stratified sampling
-                        // Modulo operations to choose these quadrants
-                        double center_x = (1. / 2.) * ((i % 2) * 2 - 1);
-                        double center_y = (1. / 2.) * (((i % 4) < 2) ? 1 : -1);
-                        double deviation_x = sample.x / 2.;
-                        double deviation_y = sample.y / 2.;
-#else
-                        double center_x = 0;
-                        double center_y = 0;
-                        double deviation_x = sample.x;
-                        double deviation_y = sample.y;
+                    const PixelRect& region = regions[i];
+                    origin_col = std::max(region.col, 0);
+                    origin_row = std::max(region.row, 0);
+                    const int cols = std::min(region.col + region.cols, frame_cols) - origin_col;
+                    const int rows = std::min(region.row + region.rows, frame_rows) - origin_row;
+                    if (cols <= 0 || rows <= 0) continue;
 
-#endif
+                    render_seed = stream_seed(base_seed, ~uint64_t(i));
+                    Framebuffer part(rows, cols);
+                    auto splice = [&](int first, int count) {
+                        for (int row = first; row < first + count; ++row)
+                        {
+                            std::copy_n(&part[(size_t) row * cols], cols, &image[(size_t) (origin_row + row) * frame_cols + origin_col]);
+                        }
+                    };
 
-                        // Normalize (row + deviation, col + deviation) to (x, y) where x and y are between -1 and 1.
-                        double x = ((col + center_x + deviation_x) / PBR_OUTPUT_IMAGE_COLUMNS) * 2 - 1;
-                        double y = ((row + center_y + deviation_y) / PBR_OUTPUT_IMAGE_ROWS) * 2 - 1;
-                        Ray ray = camera.get_ray(x, y);
-                        color = color + integrator.trace_ray(ray, 0) / (PBR_SAMPLES_PER_PIXEL);
+                    std::optional<TiledFramebuffer> tiles;
+                    if (tile_size > 0) tiles.emplace(rows, cols, tile_size, tile_order);
+                    std::vector<std::atomic<int>> finished(tiles ? tiles->tiles_y() : 0);
+                    for (int pass = 0; pass < PBR_SAMPLES_PER_PIXEL; ++pass)
+                    {
+                        if (tiles) trace_tiles(camera, pass, *tiles, finished, part, splice);
+                        else trace_pass(camera, pass, cols, rows, part.pixels(), splice);
                     }
-
-                    outImage[row * PBR_OUTPUT_IMAGE_COLUMNS + col] = to_colori(color);
                 }
             }
         }
 
     private:
         Integrator integrator {};
+
+        /** Seed of the current render, or of the current rectangle of it */
+        uint64_t render_seed = 0;
+
+        /** Sums of the luminance of the samples of each pixel and of its square, empty if the variance is not estimated */
+        std::vector<double> luminance_sums;
+        std::vector<double> luminance_squares;
+
+        /** Lower left pixel of the part of the image being rendered, and the size of the whole image, that camera rays are mapped over */
+        int origin_col = 0;
+        int origin_row = 0;
+        int frame_cols = 0;
+        int frame_rows = 0;
+
+        static uint64_t new_seed()
+        {
+            std::random_device device;
+            return (uint64_t(device()) << 32) | device();
+        }
+
+        /** Write a checkpoint of the sums after some passes. */
+        void save(int passes, const Framebuffer& accumulation, const std::optional<TiledFramebuffer>& tiles) const
+        {
+            Checkpoint checkpoint(accumulation.rows(), accumulation.cols());
+            if (tiles) tiles->to_linear(0, accumulation.rows(), checkpoint.sums);
+            else checkpoint.sums.pixels() = accumulation.pixels();
+            std::fill(checkpoint.counts.begin(), checkpoint.counts.end(), static_cast<uint32_t>(passes));
+            checkpoint.tile_size = tiles ? tiles->tile_size() : 0;
+            checkpoint.tile_order = tile_order;
+            checkpoint.seed = render_seed;
+            checkpoint.passes = passes;
+            checkpoint.write(checkpoint_path);
+            LOG_TRACE("Checkpoint after pass %d", passes - 1);
+        }
+
+        /** Load the sums and the seed of a checkpoint, throws if it does not fit this render. Returns the first pass left. */
+        int restore(const Checkpoint& checkpoint, Framebuffer& accumulation, std::optional<TiledFramebuffer>& tiles)
+        {
+            if (checkpoint.sums.rows() != accumulation.rows() || checkpoint.sums.cols() != accumulation.cols())
+            {
+                throw std::runtime_error("The checkpoint is of an image of another size");
+            }
+            if (checkpoint.tile_size != (tiles ? tiles->tile_size() : 0) || (tiles && checkpoint.tile_order != tile_order))
+            {
+                throw std::runtime_error("The checkpoint was accumulated in other tiles");
+            }
+            if (checkpoint.passes > PBR_SAMPLES_PER_PIXEL
+                || std::any_of(checkpoint.counts.begin(), checkpoint.counts.end(), [&](uint32_t count) { return count != (uint32_t) checkpoint.passes; }))
+            {
+                throw std::runtime_error("The checkpoint has samples this render does not take");
+            }
+
+            if (tiles) tiles->from_linear(checkpoint.sums);
+            else accumulation.pixels() = checkpoint.sums.pixels();
+            render_seed = checkpoint.seed;
+            return checkpoint.passes;
+        }
+
+        /** Add the luminance of a sample of a pixel to its sums. Threads must add to different pixels. */
+        void add_luminance(size_t pixel, const Radiance& sample)
+        {
+            double y = luminance(sample);
+            luminance_sums[pixel] += y;
+            luminance_squares[pixel] += y * y;
+        }
+
+        /** Add the luminance of the samples of a pass of render_pass(), the change of each pixel's sum. */
+        void add_pass_luminance(const std::vector<Colorf>& accumulation)
+        {
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+            for (int64_t i = 0; i < (int64_t) accumulation.size(); ++i)
+            {
+                double y = luminance(accumulation[i]) - luminance_sums[i];
+                luminance_sums[i] += y;
+                luminance_squares[i] += y * y;
+            }
+        }
+
+        /** Fill variance from the sums of the passes traced, the variance of a sample over the passes of the image. */
+        void estimate_variance(int passes)
+        {
+            variance->assign(luminance_sums.size(), 0.f);
+            for (size_t i = 0; i < luminance_sums.size(); ++i)
+            {
+                double mean = luminance_sums[i] / passes;
+                double sample_variance = std::max(luminance_squares[i] / passes - mean * mean, 0.) * passes / (passes - 1);
+                (*variance)[i] = static_cast<float>(sample_variance / PBR_SAMPLES_PER_PIXEL);
+            }
+        }
+
+        /** Divide the sums of a row by the passes. */
+        static void average_row(int row, int cols, std::vector<Colorf>& accumulation)
+        {
+            for (int col = 0; col < cols; ++col)
+            {
+                Colorf& color = accumulation[row * cols + col];
+                color = color / PBR_SAMPLES_PER_PIXEL;
+            }
+        }
+
+        /** Add one sample per pixel to the accumulation buffer, and after the last pass hand over each row. */
+        template <class RowsDone>
+        void trace_pass(const Camera& camera, int pass, int cols, int rows, std::vector<Colorf>& accumulation, RowsDone& rows_done)
+        {
+            const bool last = pass == PBR_SAMPLES_PER_PIXEL - 1;
+
+            // Iterate over all rows
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+            for (int row = 0; row < rows; ++row)
+            {
+                UniformRNG rng(stream_seed(render_seed, (uint64_t) pass * rows + row));
+
+                // Iterate over all cols
+                for (int col = 0; col < cols; ++col)
+                {
+                    Radiance sample = trace_pixel(camera, col, row, cols, pass, rng);
+                    accumulation[row * cols + col] = accumulation[row * cols + col] + sample;
+                    if (!luminance_sums.empty()) add_luminance((size_t) row * cols + col, sample);
+                }
+
+                if (last)
+                {
+                    average_row(row, cols, accumulation);
+                    rows_done(row, 1);
+                }
+            }
+        }
+
+        /** Add one sample per pixel to the tiles, and after the last pass copy each band of tiles to the image once it is finished and hand it over. */
+        template <class RowsDone>
+        void trace_tiles(const Camera& camera, int pass, TiledFramebuffer& tiles, std::vector<std::atomic<int>>& finished,
+            Framebuffer& out_image, RowsDone& rows_done)
+        {
+            const bool last = pass == PBR_SAMPLES_PER_PIXEL - 1;
+            const int cols = out_image.cols();
+            const auto pixels = static_cast<uint32_t>(tiles.tile_size() * tiles.tile_size());
+
+#if PBR_USE_THREADS
+#pragma omp parallel for schedule(dynamic)
+#endif
+            for (int64_t t = 0; t < (int64_t) tiles.tiles(); ++t)
+            {
+                UniformRNG rng(stream_seed(render_seed, (uint64_t) pass * tiles.tiles() + t));
+
+                // Pixels in the order they are stored, skipping those past the edges of the image
+                TiledFramebuffer::Tile tile = tiles.tile(t);
+                for (uint32_t i = 0; i < pixels; ++i)
+                {
+                    int x, y;
+                    tiles.position(i, x, y);
+                    if (x >= tile.cols || y >= tile.rows) continue;
+                    Radiance sample = trace_pixel(camera, tile.col + x, tile.row + y, cols, pass, rng);
+                    tile.pixels[i] = tile.pixels[i] + sample;
+                    if (!luminance_sums.empty()) add_luminance((size_t) (tile.row + y) * cols + tile.col + x, sample);
+                }
+
+                if (last && ++finished[t / tiles.tiles_x()] == tiles.tiles_x())
+                {
+                    tiles.to_linear(tile.row, tile.rows, out_image, 1. / PBR_SAMPLES_PER_PIXEL);
+                    rows_done(tile.row, tile.rows);
+                }
+            }
+        }
+
+        /** Trace one sample of a pixel of the part being rendered, cols wide, split into light_paths if set. */
+        Radiance trace_pixel(const Camera& camera, int col, int row, int cols, int pass, UniformRNG& rng) const
+        {
+            RayDifferential differential;
+            Ray ray = pixel_ray(camera, origin_col + col, origin_row + row, frame_cols, frame_rows, pass, rng, differential);
+            if constexpr (splits_light_paths<Integrator>::value)
+            {
+                float* split = light_paths ? light_paths->pixel((size_t) row * cols + col) : nullptr;
+                return integrator.trace_ray(ray, differential, rng, split);
+            }
+            else
+            {
+                return integrator.trace_ray(ray, differential, rng);
+            }
+        }
     };
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <core/math_definitions.h>
+#include <config.h>
 
 namespace pbr
 {
@@ -31,6 +32,54 @@ namespace pbr
             };
         }
 
+        /*!
+        * @brief Get a ray together with the rays through the neighbouring pixels
+        *
+        * @param x X-coordinate, between -1 and 1
+        * @param y Y-coordinate, between -1 and 1
+        * @param dx Distance in x to the next pixel
+        * @param dy Distance in y to the next pixel
+        * @param out_differential Rays offset by dx and dy
+        * @return Ray
+        */
+        Ray get_ray(double x, double y, double dx, double dy, RayDifferential& out_differential) const
+        {
+            Ray ray = get_ray(x, y);
+            out_differential = { position, position, ray.direction + u * dx, ray.direction + v * dy };
+            return ray;
+        }
+
+        /*!
+        * @brief Inverse of get_ray: the point of the far plane that a direction from the camera passes through
+        *
+        * @param direction Direction from the camera position, need not be normalized
+        * @param out_x X-coordinate, between -1 and 1 if the direction is inside the image
+        * @param out_y Y-coordinate, between -1 and 1 if the direction is inside the image
+        * @return bool False if the direction points away from the far plane
+        */
+        bool project(const Vec& direction, double& out_x, double& out_y) const
+        {
+            double forward = dot(direction, w);
+            if (forward <= 0) return false;
+
+            // Scaled to reach the far plane, where it is w + u * x + v * y
+            double scale = w.sqlen() / forward;
+            out_x = dot(direction, u) * scale / u.sqlen();
+            out_y = dot(direction, v) * scale / v.sqlen();
+            return true;
+        }
+
+        /** Solid angle pdf of the ray through a uniform point of the whole image in a direction, 0 away from the far plane. */
+        double direction_pdf(const Vec& direction) const
+        {
+            double cos = dot(normalize(direction), w) / w.len();
+            if (cos <= 0) return 0;
+
+            // Area of the image on the plane at distance 1
+            double area = 4 * u.len() * v.len() / w.sqlen();
+            return 1 / (area * cos * cos * cos);
+        }
+
         /*!
         * @brief Calculate a basis for the look at plane
         * 
@@ -49,4 +98,74 @@ namespace pbr
     private:
         Vec u, v, w;
     };
+
+    /** Random point of a pixel in the (-1, 1) coordinates of Camera::get_ray, see pixel_ray. */
+    inline Point2D pixel_sample(int col, int row, int cols, int rows, int sample, UniformRNG& rng)
+    {
+        auto disk = rng.sample_disk();
+
+#if PBR_STRATIFIED_SAMPLE
+        // Split the pixel into four quadrants for stratified sampling
+        // Modulo operations to choose these quadrants
+        double center_x = (1. / 2.) * ((sample % 2) * 2 - 1);
+        double center_y = (1. / 2.) * (((sample % 4) < 2) ? 1 : -1);
+        double deviation_x = disk.x / 2.;
+        double deviation_y = disk.y / 2.;
+#else
+        double center_x = 0;
+        double center_y = 0;
+        double deviation_x = disk.x;
+        double deviation_y = disk.y;
+#endif
+
+        // Normalize (row + deviation, col + deviation) to (x, y) where x and y are between -1 and 1.
+        double x = ((col + center_x + deviation_x) / cols) * 2 - 1;
+        double y = ((row + center_y + deviation_y) / rows) * 2 - 1;
+        return { x, y };
+    }
+
+    /*!
+    * @brief Density of the points that pixel_sample picks for a pixel, to splat onto the pixels around a point
+    *
+    * @param dx Offset in pixels from the pixel's position (col, row) on the image
+    * @param dy Offset in pixels from the pixel's position
+    * @param sample Index of the sample in the pixel
+    * @return double Density per square pixel
+    */
+    inline double pixel_filter(double dx, double dy, int sample)
+    {
+#if PBR_STRATIFIED_SAMPLE
+        dx -= (1. / 2.) * ((sample % 2) * 2 - 1);
+        dy -= (1. / 2.) * (((sample % 4) < 2) ? 1 : -1);
+        return dx * dx + dy * dy < 1. / 4. ? 4 / PBR_PI : 0;
+#else
+        return dx * dx + dy * dy < 1 ? 1 / PBR_PI : 0;
+#endif
+    }
+
+    /*!
+    * @brief Get a camera ray through a random point of a pixel
+    *
+    * @param camera Camera, with its basis calculated for the image's aspect ratio
+    * @param col Pixel column
+    * @param row Pixel row
+    * @param cols Image width in pixels
+    * @param rows Image height in pixels
+    * @param sample Index of the sample in the pixel, picks a quadrant when PBR_STRATIFIED_SAMPLE is set
+    * @param rng Random number generator of the calling thread
+    * @return Ray
+    */
+    inline Ray pixel_ray(const Camera& camera, int col, int row, int cols, int rows, int sample, UniformRNG& rng)
+    {
+        Point2D p = pixel_sample(col, row, cols, rows, sample, rng);
+        return camera.get_ray(p.x, p.y);
+    }
+
+    /** Camera ray through a random point of a pixel, with the rays through the same point of the next pixels. */
+    inline Ray pixel_ray(const Camera& camera, int col, int row, int cols, int rows, int sample, UniformRNG& rng,
+        RayDifferential& out_differential)
+    {
+        Point2D p = pixel_sample(col, row, cols, rows, sample, rng);
+        return camera.get_ray(p.x, p.y, 2. / cols, 2. / rows, out_differential);
+    }
 }
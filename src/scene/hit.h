@@ -0,0 +1,30 @@
+#pragma once
+
+#include <core/math_definitions.h>
+
+namespace pbr
+{
+    /** Index of a material in the scene's material table. */
+    using MaterialId = uint32_t;
+
+    /** Information required from each intersection. */
+    struct HitResult
+    {
+        double param;
+        Vec point;
+        Vec normal;
+        Point2D uv;
+
+        /** Offsets to where the ray differentials meet the tangent plane, zero when the ray carries none */
+        Vec dpdx, dpdy;
+
+        /** Matching offsets in uv, which size texture lookups */
+        Point2D duvdx, duvdy;
+
+        /** Index of the actor that was hit */
+        size_t primitive;
+
+        /** Material of the actor that was hit */
+        MaterialId material;
+    };
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "scene.h"
+#include <config.h>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Ray differentials
+    //   Igehy 1999, "Tracing ray differentials"
+    //
+    // Camera rays carry the rays through the next pixel in x and y. Where those
+    // meet the tangent plane of a hit is the footprint of the pixel on the
+    // surface, and its size in uv picks the mip level of texture lookups.
+    // Perfect reflection and refraction bend the offset rays like the ray itself,
+    // other lobes replace them with a cone around the sampled direction.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /*!
+    * @brief Intersect the offset rays with the tangent plane of a hit
+    *
+    * @param scene Scene that was hit
+    * @param differential Offset rays of the ray that found the hit
+    * @param hit Hit to fill dpdx, dpdy, duvdx and duvdy of, left at zero for offsets that miss the plane
+    */
+    inline void compute_footprint(const Scene& scene, const RayDifferential& differential, HitResult& hit)
+    {
+        const SphereGeometry& sphere = scene.geometry[hit.primitive];
+        double plane = dot(hit.normal, hit.point);
+
+        auto offset = [&](const Point& origin, const Direction& direction, Vec& out_dp, Point2D& out_duv) {
+            double cos = dot(hit.normal, direction);
+            double t = cos != 0 ? (plane - dot(hit.normal, origin)) / cos : -1;
+            if (!(t > 0)) return;
+
+            out_dp = origin + direction * t - hit.point;
+
+            // uv of the offset point projected back onto the sphere, u wraps around
+            Point2D uv = sphere.uv_at(normalize(hit.point + out_dp - sphere.center));
+            double du = uv.x - hit.uv.x;
+            out_duv = { du - std::round(du), uv.y - hit.uv.y };
+        };
+
+        offset(differential.rx_origin, differential.rx_direction, hit.dpdx, hit.duvdx);
+        offset(differential.ry_origin, differential.ry_direction, hit.dpdy, hit.duvdy);
+    }
+
+    /** Angle by which a lobe that is not a delta widens the footprint of the rays it scatters. */
+    inline double lobe_spread(const Material& material)
+    {
+        switch (material.brdf)
+        {
+        case BRDFType::Conductor:
+        case BRDFType::Dielectric: return ggx::alpha(material.roughness);
+        default: return PBR_DIFFUSE_CONE_SPREAD;
+        }
+    }
+
+    /*!
+    * @brief Offset rays of a ray scattered at a hit
+    *
+    * @param scene Scene that was hit
+    * @param ray Incoming ray
+    * @param differential Its offset rays, the hit's footprint must already be computed from them
+    * @param hit Surface data of the hit
+    * @param material Material at the hit
+    * @param sample Scattered ray
+    * @return RayDifferential Offset rays of the scattered ray
+    */
+    inline RayDifferential scatter_differential(const Scene& scene, const Ray& ray, const RayDifferential& differential,
+        const HitResult& hit, const Material& material, const BRDFSample& sample)
+    {
+        RayDifferential out { hit.point + hit.dpdx, hit.point + hit.dpdy, {}, {} };
+        Direction wo = normalize(ray.direction) * -1;
+        Direction wi = normalize(sample.ray.direction);
+
+        if (!sample.delta)
+        {
+            // Cone around the sampled direction, at least as wide as the incoming one
+            double spread_x = std::acos(clamp(cosv(ray.direction, differential.rx_direction), -1, 1));
+            double spread_y = std::acos(clamp(cosv(ray.direction, differential.ry_direction), -1, 1));
+            double spread = std::min(1., std::max(std::max(spread_x, spread_y), lobe_spread(material)));
+
+            Basis basis = make_basis(wi);
+            out.rx_direction = wi + basis.u * std::tan(spread);
+            out.ry_direction = wi + basis.v * std::tan(spread);
+            return out;
+        }
+
+        // Normal on the side of wo and its derivatives, the sphere's normal moves with the point
+        double radius = scene.geometry[hit.primitive].radius;
+        bool entering = dot(wo, hit.normal) > 0;
+        double side = entering ? 1 : -1;
+        Vec n = hit.normal * side;
+        Vec dndx = hit.dpdx * (side / radius);
+        Vec dndy = hit.dpdy * (side / radius);
+
+        Vec dwodx = normalize(differential.rx_direction) * -1 - wo;
+        Vec dwody = normalize(differential.ry_direction) * -1 - wo;
+        double cos_o = dot(wo, n);
+        double dcosdx = dot(dwodx, n) + dot(wo, dndx);
+        double dcosdy = dot(dwody, n) + dot(wo, dndy);
+
+        if (dot(wi, n) > 0)
+        {
+            // wi = -wo + 2 (wo.n) n
+            out.rx_direction = wi - dwodx + (dndx * cos_o + n * dcosdx) * 2;
+            out.ry_direction = wi - dwody + (dndy * cos_o + n * dcosdy) * 2;
+            return out;
+        }
+
+        // wi = -eta wo + mu n with mu = eta (wo.n) - cos_t, eta is incident over transmitted here
+        double eta = entering ? 1 / material.ior : material.ior;
+        double cos_t = std::max(1e-6, -dot(wi, n));
+        double mu = eta * cos_o - cos_t;
+        double dmu = eta - eta * eta * cos_o / cos_t;
+        out.rx_direction = wi - dwodx * eta + dndx * mu + n * (dmu * dcosdx);
+        out.ry_direction = wi - dwody * eta + dndy * mu + n * (dmu * dcosdy);
+        return out;
+    }
+}
@@ -1,4 +1,5 @@
 #include "scene.h"
+#include "ray_differential.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 // Scene description.
@@ -12,190 +13,233 @@
 
 namespace pbr
 {
-    Scene PBR_SCENE_RTWEEKEND = {
+    static Scene make_rtweekend_scene()
+    {
+        Scene scene;
+
+        auto red = scene.add_material({
+            Colorf { 1.0, 0.1, 0.1 }, // Color
+            Colorf { 0.0, 0.0, 0.0 }, // Emission
+            BRDFType::Diffuse
+        });
+        auto light = scene.add_material({
+            Colorf { 1.0, 1.0, 1.0 }, // Color
+            Colorf { 6.0, 6.0, 6.0 }, // Emission
+            BRDFType::Diffuse
+        });
+        auto mirror = scene.add_material({
+            Colorf { 1.0, 1.0, 1.0 }, // Color
+            Colorf { 0.0, 0.0, 0.0 }, // Emission
+            BRDFType::Specular
+        });
+        auto green = scene.add_material({
+            Colorf { 0.1, 1.0, 0.1 }, // Color
+            Colorf { 0.0, 0.0, 0.0 }, // Emission
+            BRDFType::Diffuse
+        });
+
         // Red ball
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 1.0, 0.1, 0.1 }, // Color
-                Colorf { 0.0, 0.0, 0.0 },  // Emission
-                new DiffuseBRDF
-            ),
-            SphereGeometry {
-                Vec { 1.5, 1.0, 0.0 },   // Position
-                1.0                      // Radius
-            }
-        },
+        scene.add_actor(red, SphereGeometry {
+            Vec { 1.5, 1.0, 0.0 },   // Position
+            1.0                      // Radius
+        });
 
         // Light 1
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 1.0, 1.0, 1.0 }, // Color
-                Colorf { 6.0, 6.0, 6.0 },  // Emission
-                new DiffuseBRDF
-            ),
-            SphereGeometry {
-                Vec { 6.0, 4.5, -4.0 },   // Position
-                3.0                      // Radius
-            }
-        },
+        scene.add_actor(light, SphereGeometry {
+            Vec { 6.0, 4.5, -4.0 },  // Position
+            3.0                      // Radius
+        });
 
         // Light 2
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 1.0, 1.0, 1.0 }, // Color
-                Colorf { 6.0, 6.0, 6.0 },  // Emission
-                new DiffuseBRDF
-            ),
-            SphereGeometry {
-                Vec { -6.0, 4.5, -4.0 },   // Position
-                3.0                      // Radius
-            }
-        },
+        scene.add_actor(light, SphereGeometry {
+            Vec { -6.0, 4.5, -4.0 }, // Position
+            3.0                      // Radius
+        });
 
         // Mirror
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 1.0, 1.0, 1.0 }, // Color
-                Colorf { 0.0, 0.0, 0.0 },  // Emission
-                new SpecularBRDF
-            ),
-            SphereGeometry {
-                Vec { -1.5, 1.0, 0.0 },   // Position
-                1.0                      // Radius
-            }
-        },
+        scene.add_actor(mirror, SphereGeometry {
+            Vec { -1.5, 1.0, 0.0 },  // Position
+            1.0                      // Radius
+        });
 
         // Floor
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 0.1, 1.0, 0.1 }, // Color
-                Colorf { 0.0, 0.0, 0.0 },  // Emission
-                new DiffuseBRDF
-            ),
-            SphereGeometry {
-                Vec { 0.0, -1e5, 0.0 },  // Position
-                1e5                      // Radius
-            }
-        }
-    };
+        scene.add_actor(green, SphereGeometry {
+            Vec { 0.0, -1e5, 0.0 },  // Position
+            1e5                      // Radius
+        });
+
+        return scene;
+    }
+
+    static Scene make_cornell_scene()
+    {
+        Scene scene;
+
+        auto light = scene.add_material({
+            Colorf { 1.0, 1.0, 1.0 }, // Color
+            Colorf { 3.0, 3.0, 3.0 }, // Emission
+            BRDFType::Diffuse
+        });
+        auto rough_red = scene.add_material({
+            Colorf { 1.0, 0.0, 0.0 }, // Color
+            Colorf { 0.0, 0.0, 0.0 }, // Emission
+            BRDFType::Diffuse,
+            0.3                       // Roughness
+        });
+        auto mirror = scene.add_material({
+            Colorf { 1.0, 1.0, 1.0 }, // Color
+            Colorf { 0.0, 0.0, 0.0 }, // Emission
+            BRDFType::Specular
+        });
+        auto white = scene.add_material({
+            Colorf { 1.0, 1.0, 1.0 }, // Color
+            Colorf { 0.0, 0.0, 0.0 }, // Emission
+            BRDFType::Diffuse
+        });
+        auto red = scene.add_material({
+            Colorf { 1.0, 0.0, 0.0 }, // Color
+            Colorf { 0.0, 0.0, 0.0 }, // Emission
+            BRDFType::Diffuse
+        });
+        auto green = scene.add_material({
+            Colorf { 0.0, 1.0, 0.0 }, // Color
+            Colorf { 0.0, 0.0, 0.0 }, // Emission
+            BRDFType::Diffuse
+        });
 
-    Scene PBR_SCENE_CORNELL = {
         // Light 1
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 1.0, 1.0, 1.0 }, // Color
-                Colorf { 3.0, 3.0, 3.0 },  // Emission
-                new DiffuseBRDF
-            ),
-            SphereGeometry {
-                Vec { 0.0, 5.0, -0.5 },   // Position
-                1.0                      // Radius
-            }
-        },
+        scene.add_actor(light, SphereGeometry {
+            Vec { 0.0, 5.0, -0.5 },  // Position
+            1.0                      // Radius
+        });
 
         // Red ball
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 1.0, 0.0, 0.0 }, // Color
-                Colorf { 0.0, 0.0, 0.0 },  // Emission
-                new DiffuseBRDF,
-                0.3
-            ),
-            SphereGeometry {
-                Vec { 1.5, 1.0, 0.0 },   // Position
-                1.0                      // Radius
-            }
-        },
+        scene.add_actor(rough_red, SphereGeometry {
+            Vec { 1.5, 1.0, 0.0 },   // Position
+            1.0                      // Radius
+        });
 
         // // Purple ball
-        // Actor {
-        //     std::make_shared<Material>(
-        //         Colorf { 1.0, 0.0, 1.0 }, // Color
-        //         Colorf { 0.0, 0.0, 0.0 },  // Emission
-        //         new DiffuseBRDF
-        //     ),
-        //     SphereGeometry {
-        //         Vec { 0.0, 1.0, 0.0 },   // Position
-        //         1.0                      // Radius
-        //     }
-        // },
+        // auto purple = scene.add_material({
+        //     Colorf { 1.0, 0.0, 1.0 }, // Color
+        //     Colorf { 0.0, 0.0, 0.0 }, // Emission
+        //     BRDFType::Diffuse
+        // });
+        // scene.add_actor(purple, SphereGeometry {
+        //     Vec { 0.0, 1.0, 0.0 },   // Position
+        //     1.0                      // Radius
+        // });
 
         // Mirror
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 1.0, 1.0, 1.0 }, // Color
-                Colorf { 0.0, 0.0, 0.0 },  // Emission
-                new SpecularBRDF
-            ),
-            SphereGeometry {
-                Vec { -1.5, 1.0, 0.0 },   // Position
-                1.0                      // Radius
-            }
-        },
+        scene.add_actor(mirror, SphereGeometry {
+            Vec { -1.5, 1.0, 0.0 },  // Position
+            1.0                      // Radius
+        });
 
         // Floor
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 1.0, 1.0, 1.0 }, // Color
-                Colorf { 0.0, 0.0, 0.0 },  // Emission
-                new DiffuseBRDF
-            ),
-            SphereGeometry {
-                Vec { 0.0, -1e5, 0.0 },  // Position
-                1e5                      // Radius
-            }
-        },
+        scene.add_actor(white, SphereGeometry {
+            Vec { 0.0, -1e5, 0.0 },  // Position
+            1e5                      // Radius
+        });
 
         // Back
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 1.0, 1.0, 1.0 }, // Color
-                Colorf { 0.0, 0.0, 0.0 },  // Emission
-                new DiffuseBRDF
-            ),
-            SphereGeometry {
-                Vec { 0.0, 0.0, -1e5 - 1.5 },  // Position
-                1e5                      // Radius
-            }
-        },
+        scene.add_actor(white, SphereGeometry {
+            Vec { 0.0, 0.0, -1e5 - 1.5 }, // Position
+            1e5                           // Radius
+        });
 
         // Left wall
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 1.0, 0.0, 0.0 }, // Color
-                Colorf { 0.0, 0.0, 0.0 },  // Emission
-                new DiffuseBRDF
-            ),
-            SphereGeometry {
-                Vec { -1e5 - 5, 0.0, 0.0 },  // Position
-                1e5                      // Radius
-            }
-        },
+        scene.add_actor(red, SphereGeometry {
+            Vec { -1e5 - 5, 0.0, 0.0 },   // Position
+            1e5                           // Radius
+        });
 
         // Right wall
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 0.0, 1.0, 0.0 }, // Color
-                Colorf { 0.0, 0.0, 0.0 },  // Emission
-                new DiffuseBRDF
-            ),
-            SphereGeometry {
-                Vec { 1e5 + 5, 0.0, 0.0 },  // Position
-                1e5                      // Radius
-            }
-        },
+        scene.add_actor(green, SphereGeometry {
+            Vec { 1e5 + 5, 0.0, 0.0 },    // Position
+            1e5                           // Radius
+        });
 
         // Roof
-        Actor {
-            std::make_shared<Material>(
-                Colorf { 1.0, 1.0, 1.0 }, // Color
-                Colorf { 0.0, 0.0, 0.0 },  // Emission
-                new DiffuseBRDF
-            ),
-            SphereGeometry {
-                Vec { 0.0, 1e5 + 5, 0.0 },  // Position
-                1e5                      // Radius
+        scene.add_actor(white, SphereGeometry {
+            Vec { 0.0, 1e5 + 5, 0.0 },    // Position
+            1e5                           // Radius
+        });
+
+        return scene;
+    }
+
+    Scene PBR_SCENE_RTWEEKEND = make_rtweekend_scene();
+    Scene PBR_SCENE_CORNELL = make_cornell_scene();
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("scene::Scene::intersect")
+    {
+        Ray ray { Vec { 0, 2.5, 6 }, Vec { 0, 0, -2 } };
+
+        double t;
+        size_t index;
+        REQUIRE(PBR_SCENE_CORNELL.intersect_closest(ray, t, index));
+        CHECK(index == 4); // Back wall
+
+        HitResult hit;
+        REQUIRE(PBR_SCENE_CORNELL.intersect(ray, hit));
+        CHECK(hit.param == doctest::Approx(3.75).epsilon(1e-3));
+        CHECK(hit.point.z == doctest::Approx(-1.5).epsilon(1e-3));
+        CHECK(hit.normal.z == doctest::Approx(1.0));
+        CHECK(hit.primitive == 4);
+        CHECK(hit.material == PBR_SCENE_CORNELL.material_ids[4]);
+
+        Ray miss { Vec { 0, 2.5, 6 }, Vec { 0, 0, 1 } };
+        CHECK_FALSE(PBR_SCENE_CORNELL.intersect(miss, hit));
+    }
+
+    TEST_CASE("scene::ray_differentials")
+    {
+        // Propagated offset rays must match tracing the offset ray itself, to first order
+        Scene scene;
+        auto mirror = scene.add_material({ PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Specular });
+        auto glass = scene.add_material({ PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Dielectric });
+        scene.add_actor(mirror, { Vec { -1.5, 0, 0 }, 1 });
+        scene.add_actor(glass, { Vec { 1.5, 0, 0 }, 1 });
+
+        UniformRNG rng;
+        for (double x : { -1.2, 1.8 })
+        {
+            Ray ray { Vec { x, 0.3, 5 }, Vec { 0, 0, -1 } };
+            RayDifferential differential { ray.origin, ray.origin, Vec { 1e-3, 0, -1 }, Vec { 0, 1e-3, -1 } };
+
+            HitResult hit;
+            REQUIRE(scene.intersect(ray, hit));
+            compute_footprint(scene, differential, hit);
+
+            HitResult hit_x;
+            REQUIRE(scene.intersect({ differential.rx_origin, differential.rx_direction }, hit_x));
+            CHECK((hit.point + hit.dpdx - hit_x.point).len() < 0.01 * hit.dpdx.len());
+            CHECK(hit.duvdx.x == doctest::Approx(hit_x.uv.x - hit.uv.x).epsilon(0.01));
+
+            // Sample until the glass refracts, the mirror always reflects
+            Material material = scene.material(hit);
+            BRDFSample sample = sample_brdf(material, ray, hit, rng);
+            while (dot(sample.ray.direction, hit.normal) > 0 && material.brdf == BRDFType::Dielectric)
+            {
+                sample = sample_brdf(material, ray, hit, rng);
             }
+            REQUIRE(sample.delta);
+
+            RayDifferential scattered = scatter_differential(scene, ray, differential, hit, material, sample);
+
+            Ray in_x { differential.rx_origin, differential.rx_direction };
+            Direction expected;
+            if (material.brdf == BRDFType::Specular) expected = normalize(reflect(in_x.direction, hit_x.normal));
+            else REQUIRE(ggx::refract(normalize(in_x.direction) * -1, hit_x.normal, material.ior, expected));
+
+            Direction wi = normalize(sample.ray.direction);
+            INFO("brdf ", (int) material.brdf);
+            CHECK((normalize(scattered.rx_direction) - expected).len() < 0.01 * (expected - wi).len());
         }
-    };
+    }
 }
@@ -2,6 +2,7 @@
 
 #include <core/math_definitions.h>
 #include <materials/material.h>
+#include <lights/environment.h>
 
 namespace pbr
 {
@@ -11,7 +12,13 @@ namespace pbr
         Vec center;
         double radius;
 
-        bool intersect(const Ray& ray, Vec& point) const
+        /*!
+        * @brief Calculate the ray parameter of the nearest intersection in front of the ray origin
+        *
+        * @param ray Ray that will intersect this sphere
+        * @return double Ray parameter t of the hit, or PBR_INF if there is no hit
+        */
+        double intersect(const Ray& ray) const
         {
             // For intersection, solve
             // |(o + t*dir) - position| = radius
@@ -25,74 +32,199 @@ namespace pbr
             double C = op.sqlen() - radius * radius;
 
             double D = B * B - 4 * A * C;
-            if (D < 0) return false; // no solution
+            if (D < 0) return PBR_INF; // no solution
             else D = std::sqrt(D);
 
             double t1 = (-1 * B + D) / (2 * A);
             double t2 = (-1 * B - D) / (2 * A);
 
-            // returns distance, 0 if nohit
-            if (t1 > PBR_EPSILON && t1 < t2)
+            // Nearest root in front of the origin, the far one when the ray starts inside
+            if (t2 > PBR_EPSILON) return t2;
+            else if (t1 > PBR_EPSILON) return t1;
+            else return PBR_INF;
+        }
+
+        /** Outward unit normal at a point on the surface. Dividing by the radius avoids a square root. */
+        Vec normal_at(const Point& point) const
+        {
+            return (point - center) / radius;
+        }
+
+        /** Spherical (u, v) coordinates, both between 0 and 1, of a unit normal on this sphere. */
+        Point2D uv_at(const Vec& normal) const
+        {
+            double phi = std::atan2(-normal.z, normal.x) + PBR_PI;
+            double theta = std::acos(clamp(normal.y, -1, 1));
+            return { phi / (2 * PBR_PI), theta / PBR_PI };
+        }
+    };
+
+    /*!
+    * @brief A list of actors together with the table of materials they use.
+    *
+    * Actors are stored as parallel arrays: the geometry, which every ray tests, is packed on its own
+    * so that the intersection loop only streams 32 bytes per actor. Material ids are only read for
+    * the closest hit.
+    */
+    struct Scene
+    {
+        MaterialTable materials;
+
+        /** Geometry of each actor (hot, read by every intersection test) */
+        std::vector<SphereGeometry> geometry;
+
+        /** Material of each actor, parallel to geometry (cold, read once per closest hit) */
+        std::vector<MaterialId> material_ids;
+
+        /** Indices of the actors with an emissive material */
+        std::vector<size_t> lights;
+
+        /** Light from directions that hit no actor */
+        EnvironmentLight environment;
+
+        /** Textures of the materials and their tile cache, shared by copies of the scene. Null until a texture is added. */
+        std::shared_ptr<TextureCache> textures;
+
+        /** Incremented whenever actors or lights change, so derived data knows when to rebuild */
+        size_t revision = 0;
+
+        /** Append a material to the table and return its id. */
+        MaterialId add_material(const Material& material)
+        {
+            materials.push_back(material);
+            ++revision;
+            return static_cast<MaterialId>(materials.size() - 1);
+        }
+
+        /** Add a spherical actor that uses a material from the table. */
+        void add_actor(MaterialId material, const SphereGeometry& sphere)
+        {
+            assert(material < materials.size());
+            if (!is_black(materials[material].emission)) lights.push_back(geometry.size());
+            geometry.push_back(sphere);
+            material_ids.push_back(material);
+            ++revision;
+        }
+
+        /** Open a tiled texture file (see write_tiled_texture) for materials to reference. */
+        TextureId add_texture(const std::string& path)
+        {
+            if (!textures) textures = std::make_shared<TextureCache>();
+            return textures->add(path);
+        }
+
+        /** Replace the environment light. */
+        void set_environment(EnvironmentLight light)
+        {
+            environment = std::move(light);
+            ++revision;
+        }
+
+        /** Rebuild the list of lights, needed after changing the emission of a material. */
+        void update_lights()
+        {
+            lights.clear();
+            for (size_t i = 0; i < size(); ++i)
             {
-                point = ray.origin + ray.direction * t1;
-                return true;
+                if (!is_black(materials[material_ids[i]].emission)) lights.push_back(i);
             }
-            else if (t2 > PBR_EPSILON)
+            ++revision;
+        }
+
+        /** Reserve storage for a number of actors. */
+        void reserve(size_t actors)
+        {
+            geometry.reserve(actors);
+            material_ids.reserve(actors);
+        }
+
+        /** Material at a hit, with its textures filtered over the hit's footprint. */
+        Material material(const HitResult& hit) const
+        {
+            const Material& material = materials[hit.material];
+            if (!material.textured()) return material;
+
+            Material textured = material;
+            if (material.color_texture != NO_TEXTURE)
             {
-                point = ray.origin + ray.direction * t2;
-                return true;
+                textured.color = textured.color * textures->lookup(material.color_texture, hit.uv, hit.duvdx, hit.duvdy);
             }
-            else
+            if (material.roughness_texture != NO_TEXTURE)
             {
-                return false;
+                textured.roughness *= textures->lookup(material.roughness_texture, hit.uv, hit.duvdx, hit.duvdy).x;
             }
+            return textured;
         }
-    };
 
-    struct Actor;
+        size_t size() const { return geometry.size(); }
 
-    /** Information required from each intersection. */
-    struct HitResult
-    {
-        double param;
-        Vec point;
-        Vec normal;
-        const Actor* actor;
-    };
+        /*!
+        * @brief Find the closest actor along a ray. Only the ray parameter and actor index are tracked
+        *        so that losing candidates cost a single geometry test each.
+        *
+        * @param ray Ray to trace
+        * @param out_t Ray parameter of the closest hit
+        * @param out_index Index of the closest actor in the scene
+        * @return bool Indicates if the ray hits anything
+        */
+        bool intersect_closest(const Ray& ray, double& out_t, size_t& out_index) const
+        {
+            double closest = PBR_INF;
+            size_t index = 0;
+            const SphereGeometry* spheres = geometry.data();
+            for (size_t i = 0, n = geometry.size(); i < n; ++i)
+            {
+                double t = spheres[i].intersect(ray);
+                if (t < closest)
+                {
+                    closest = t;
+                    index = i;
+                }
+            }
 
-    /** An object that can be placed in the scene. Contains material and geometry for the object. */
-    struct Actor
-    {
-        std::shared_ptr<Material> material;
-        SphereGeometry geometry;
+            out_t = closest;
+            out_index = index;
+            return closest < PBR_INF;
+        }
 
         /*!
-        * @brief Calculate ray intersection with the geometry for this actor
-        * 
-        * @param ray Ray that will intersect this object
+        * @brief Build the surface data for a hit on an actor. Only called for the closest hit.
+        *
+        * @param ray Ray that intersected the actor
+        * @param t Ray parameter returned by the geometry test
+        * @param index Index of the actor
         * @param hit Output hit data
-        * @return bool Indicates if the ray intersects with this actor
         */
-        bool intersect(const Ray& ray, HitResult& hit) const
+        void fill_hit(const Ray& ray, double t, size_t index, HitResult& hit) const
         {
-            Vec point;
-            if (geometry.intersect(ray, point))
-            {
-                hit.param = (point - ray.origin).len() / ray.direction.len();
-                hit.point = point;
-                hit.actor = this;
-                hit.normal = normalize(hit.point - geometry.center);
-                return true;
-            }
-            else
-            {
-                return false;
-            }
+            const SphereGeometry& sphere = geometry[index];
+            hit.param = t;
+            hit.point = ray.origin + ray.direction * t;
+            hit.normal = sphere.normal_at(hit.point);
+            hit.uv = sphere.uv_at(hit.normal);
+            hit.dpdx = hit.dpdy = {};
+            hit.duvdx = hit.duvdy = {};
+            hit.primitive = index;
+            hit.material = material_ids[index];
         }
-    };
 
-    /** Scene alias for convenience. */
-    using Scene = std::vector<Actor>;
+        /*!
+        * @brief Find the closest hit along a ray and build its surface data
+        *
+        * @param ray Ray to trace
+        * @param out_hit Output hit data, only written if there is a hit
+        * @return bool Indicates if the ray hits anything
+        */
+        bool intersect(const Ray& ray, HitResult& out_hit) const
+        {
+            double t;
+            size_t index;
+            if (!intersect_closest(ray, t, index)) return false;
+
+            fill_hit(ray, t, index, out_hit);
+            return true;
+        }
+    };
 
     //// These are externs and defined in scene.cpp because we're going to pass pointers and such
     //// So I don't want this to be defined in each translation unit separately.
@@ -0,0 +1,373 @@
+#include "texture.h"
+
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Tiled texture files (.ttx)
+    //   8 byte magic, then width, height, tile size and number of levels as
+    //   32-bit integers, then the tiles of each level from level 0, row-major.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    static constexpr char TTX_MAGIC[8] = { 'P', 'B', 'R', 'T', 'T', 'X', '1', '\n' };
+    static constexpr size_t TTX_HEADER_SIZE = sizeof(TTX_MAGIC) + 4 * sizeof(int32_t);
+
+    static int tiles_along(int size, int tile_size)
+    {
+        return (size + tile_size - 1) / tile_size;
+    }
+
+    static int count_levels(int width, int height)
+    {
+        int levels = 1;
+        while ((width >> levels) > 0 || (height >> levels) > 0) ++levels;
+        return levels;
+    }
+
+    void write_tiled_texture(const std::string& path, int width, int height, const std::vector<Colorf>& pixels, int tile_size)
+    {
+        assert(pixels.size() == (size_t) width * height);
+
+        std::ofstream out(path, std::ios::binary);
+        if (!out) throw std::runtime_error("Cannot write texture " + path);
+
+        int32_t header[4] = { width, height, tile_size, count_levels(width, height) };
+        out.write(TTX_MAGIC, sizeof(TTX_MAGIC));
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+        std::vector<Colorf> level = pixels;
+        std::vector<float> tile((size_t) tile_size * tile_size * 3);
+        int w = width, h = height;
+        for (int l = 0; l < header[3]; ++l)
+        {
+            for (int ty = 0; ty < tiles_along(h, tile_size); ++ty)
+            {
+                for (int tx = 0; tx < tiles_along(w, tile_size); ++tx)
+                {
+                    float* texel = tile.data();
+                    for (int y = 0; y < tile_size; ++y)
+                    {
+                        int sy = std::min(ty * tile_size + y, h - 1);
+                        for (int x = 0; x < tile_size; ++x)
+                        {
+                            int sx = std::min(tx * tile_size + x, w - 1);
+                            const Colorf& c = level[(size_t) sy * w + sx];
+                            *texel++ = static_cast<float>(c.x);
+                            *texel++ = static_cast<float>(c.y);
+                            *texel++ = static_cast<float>(c.z);
+                        }
+                    }
+                    out.write(reinterpret_cast<const char*>(tile.data()), tile.size() * sizeof(float));
+                }
+            }
+
+            // Box filter down to the next level, the last texel of an odd size is folded into the last of the next
+            int next_w = std::max(1, w / 2), next_h = std::max(1, h / 2);
+            std::vector<Colorf> next((size_t) next_w * next_h);
+            for (int y = 0; y < next_h; ++y)
+            {
+                int y0 = 2 * y, y1 = y == next_h - 1 ? h : 2 * y + 2;
+                for (int x = 0; x < next_w; ++x)
+                {
+                    int x0 = 2 * x, x1 = x == next_w - 1 ? w : 2 * x + 2;
+                    Colorf sum;
+                    for (int sy = y0; sy < y1; ++sy)
+                    {
+                        for (int sx = x0; sx < x1; ++sx) sum = sum + level[(size_t) sy * w + sx];
+                    }
+                    next[(size_t) y * next_w + x] = sum / ((y1 - y0) * (x1 - x0));
+                }
+            }
+            level = std::move(next);
+            w = next_w;
+            h = next_h;
+        }
+
+        if (!out) throw std::runtime_error("Cannot write texture " + path);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // Cache
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TextureCache::TextureCache(size_t capacity_bytes, int shard_count)
+    {
+        shard_count = std::max(1, shard_count);
+        shard_capacity = capacity_bytes / shard_count;
+        for (int i = 0; i < shard_count; ++i) shards.push_back(std::make_unique<Shard>());
+    }
+
+    TextureId TextureCache::add(const std::string& path)
+    {
+        auto texture = std::make_unique<TextureFile>();
+        texture->path = path;
+        texture->file.open(path, std::ios::binary);
+        if (!texture->file) throw std::runtime_error("Cannot open texture " + path);
+
+        char magic[sizeof(TTX_MAGIC)];
+        int32_t header[4];
+        if (!texture->file.read(magic, sizeof(magic)) || std::memcmp(magic, TTX_MAGIC, sizeof(magic)) != 0
+            || !texture->file.read(reinterpret_cast<char*>(header), sizeof(header)))
+        {
+            throw std::runtime_error(path + " is not a tiled texture");
+        }
+
+        texture->width = header[0];
+        texture->height = header[1];
+        texture->tile_size = header[2];
+        texture->levels = header[3];
+        if (texture->width <= 0 || texture->height <= 0 || texture->tile_size <= 0 || texture->tile_size > 1024
+            || texture->levels != count_levels(texture->width, texture->height))
+        {
+            throw std::runtime_error(path + ": invalid texture header");
+        }
+
+        // Every tile has the same size, so the levels follow each other at known offsets
+        uint64_t tile_bytes = (uint64_t) texture->tile_size * texture->tile_size * 3 * sizeof(float);
+        uint64_t offset = TTX_HEADER_SIZE;
+        for (int level = 0; level < texture->levels; ++level)
+        {
+            texture->level_offsets.push_back(offset);
+            offset += tile_bytes * tiles_along(level_size(texture->width, level), texture->tile_size)
+                * tiles_along(level_size(texture->height, level), texture->tile_size);
+        }
+
+        texture->file.seekg(0, std::ios::end);
+        if ((uint64_t) texture->file.tellg() < offset) throw std::runtime_error(path + ": truncated texture");
+
+        textures.push_back(std::move(texture));
+        return static_cast<TextureId>(textures.size() - 1);
+    }
+
+    TextureCache::TilePtr TextureCache::load(const TextureFile& texture, int level, int tile_x, int tile_y) const
+    {
+        auto tile = std::make_shared<Tile>();
+        tile->texels.resize((size_t) texture.tile_size * texture.tile_size * 3);
+
+        size_t bytes = tile->texels.size() * sizeof(float);
+        int tiles_x = tiles_along(level_size(texture.width, level), texture.tile_size);
+        uint64_t offset = texture.level_offsets[level] + bytes * ((uint64_t) tile_y * tiles_x + tile_x);
+
+        std::lock_guard<std::mutex> guard(texture.file_lock);
+        texture.file.clear();
+        texture.file.seekg(offset);
+
+        // The size was checked when the texture was added, a failed read leaves the tile black
+        if (!texture.file.read(reinterpret_cast<char*>(tile->texels.data()), bytes))
+        {
+            std::fill(tile->texels.begin(), tile->texels.end(), 0.f);
+        }
+        return tile;
+    }
+
+    TextureCache::TilePtr TextureCache::tile(TextureId texture, int level, int tile_x, int tile_y) const
+    {
+        uint64_t key = tile_key(texture, level, tile_x, tile_y);
+
+        // Mix the bits so that neighbouring tiles land in different shards
+        uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+        Shard& shard = *shards[(hash >> 32) % shards.size()];
+
+        {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            auto it = shard.index.find(key);
+            if (it != shard.index.end())
+            {
+                ++shard.hits;
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                return it->second->tile;
+            }
+            ++shard.misses;
+        }
+
+        // Read without holding the shard, other threads keep looking up resident tiles
+        TilePtr loaded = load(*textures[texture], level, tile_x, tile_y);
+        size_t bytes = loaded->texels.size() * sizeof(float);
+
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.bytes_read += bytes;
+
+        // Another thread may have loaded the same tile in the meantime
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) return it->second->tile;
+
+        shard.lru.push_front({ key, loaded });
+        shard.index[key] = shard.lru.begin();
+        shard.bytes += bytes;
+
+        while (shard.bytes > shard_capacity && shard.lru.size() > 1)
+        {
+            const Entry& victim = shard.lru.back();
+            shard.bytes -= victim.tile->texels.size() * sizeof(float);
+            shard.index.erase(victim.key);
+            shard.lru.pop_back();
+            ++shard.evictions;
+        }
+        return loaded;
+    }
+
+    Colorf TextureCache::texel(TextureId texture, int level, int x, int y) const
+    {
+        const TextureFile& file = *textures[texture];
+        int w = level_size(file.width, level), h = level_size(file.height, level);
+        x = ((x % w) + w) % w;
+        y = ((y % h) + h) % h;
+
+        TilePtr t = tile(texture, level, x / file.tile_size, y / file.tile_size);
+        const float* c = &t->texels[((size_t) (y % file.tile_size) * file.tile_size + x % file.tile_size) * 3];
+        return { c[0], c[1], c[2] };
+    }
+
+    Colorf TextureCache::bilinear(TextureId texture, int level, const Point2D& uv) const
+    {
+        const TextureFile& file = *textures[texture];
+        int w = level_size(file.width, level), h = level_size(file.height, level);
+
+        // Texel centers are at half-integer coordinates
+        double x = uv.x * w - 0.5, y = uv.y * h - 0.5;
+        double fx = std::floor(x), fy = std::floor(y);
+        double dx = x - fx, dy = y - fy;
+
+        // The four texels usually share a tile, which is then looked up once
+        int tile_size = file.tile_size;
+        uint64_t cached_key = ~uint64_t(0);
+        TilePtr cached;
+        auto fetch = [&](int tx, int ty) -> Colorf {
+            tx = ((tx % w) + w) % w;
+            ty = ((ty % h) + h) % h;
+            uint64_t key = tile_key(texture, level, tx / tile_size, ty / tile_size);
+            if (key != cached_key)
+            {
+                cached = tile(texture, level, tx / tile_size, ty / tile_size);
+                cached_key = key;
+            }
+            const float* c = &cached->texels[((size_t) (ty % tile_size) * tile_size + tx % tile_size) * 3];
+            return { c[0], c[1], c[2] };
+        };
+
+        int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+        return fetch(x0, y0) * ((1 - dx) * (1 - dy)) + fetch(x0 + 1, y0) * (dx * (1 - dy))
+            + fetch(x0, y0 + 1) * ((1 - dx) * dy) + fetch(x0 + 1, y0 + 1) * (dx * dy);
+    }
+
+    Colorf TextureCache::lookup(TextureId texture, const Point2D& uv, double lod) const
+    {
+        int last = textures[texture]->levels - 1;
+        lod = clamp(lod, 0, last);
+
+        int level = static_cast<int>(lod);
+        double t = lod - level;
+        if (t == 0 || level == last) return bilinear(texture, level, uv);
+
+        return bilinear(texture, level, uv) * (1 - t) + bilinear(texture, level + 1, uv) * t;
+    }
+
+    Colorf TextureCache::lookup(TextureId texture, const Point2D& uv, const Point2D& duvdx, const Point2D& duvdy) const
+    {
+        // Footprint in texels of level 0, each level halves it
+        const TextureFile& file = *textures[texture];
+        double x = std::hypot(duvdx.x * file.width, duvdx.y * file.height);
+        double y = std::hypot(duvdy.x * file.width, duvdy.y * file.height);
+        double width = std::max(x, y);
+        return lookup(texture, uv, width > 1 ? std::log2(width) : 0);
+    }
+
+    TextureCacheStats TextureCache::stats() const
+    {
+        TextureCacheStats stats;
+        for (const auto& shard : shards)
+        {
+            std::lock_guard<std::mutex> guard(shard->lock);
+            stats.hits += shard->hits;
+            stats.misses += shard->misses;
+            stats.evictions += shard->evictions;
+            stats.bytes_read += shard->bytes_read;
+            stats.resident_bytes += shard->bytes;
+        }
+        return stats;
+    }
+
+    void TextureCache::reset_stats()
+    {
+        for (const auto& shard : shards)
+        {
+            std::lock_guard<std::mutex> guard(shard->lock);
+            shard->hits = shard->misses = shard->evictions = shard->bytes_read = 0;
+        }
+    }
+
+    void TextureCache::clear()
+    {
+        for (const auto& shard : shards)
+        {
+            std::lock_guard<std::mutex> guard(shard->lock);
+            shard->lru.clear();
+            shard->index.clear();
+            shard->bytes = 0;
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////
+    // TESTS
+    ///////////////////////////////////////////////////////////////////////////////
+
+    TEST_CASE("texture::TextureCache")
+    {
+        // A 100x60 gradient over tiles of 16 texels, so edge tiles are padded
+        constexpr int W = 100, H = 60;
+        std::vector<Colorf> pixels(W * H);
+        for (int y = 0; y < H; ++y)
+        {
+            for (int x = 0; x < W; ++x) pixels[y * W + x] = Colorf { double(x), double(y), 1.0 };
+        }
+
+        const std::string path = (std::filesystem::temp_directory_path() / "pbr_test_texture.ttx").string();
+        write_tiled_texture(path, W, H, pixels, 16);
+
+        // Room for 4 tiles of 16 * 16 * 12 bytes in a single shard
+        TextureCache cache(4 * 16 * 16 * 12, 1);
+        TextureId id = cache.add(path);
+        std::remove(path.c_str());
+
+        CHECK(cache.levels(id) == 7);
+        CHECK(cache.width(id, 1) == 50);
+        CHECK(cache.height(id, 6) == 1);
+
+        CHECK(cache.texel(id, 0, 37, 51).x == 37);
+        CHECK(cache.texel(id, 0, 37, 51).y == 51);
+        CHECK(cache.texel(id, 0, -1, 0).x == W - 1);
+        CHECK(cache.texel(id, 1, 3, 2).x == doctest::Approx(6.5));
+
+        // The 25 columns of level 2, at 4x + 1.5, leave their last one to the last of the 12 of level 3
+        CHECK(cache.texel(id, 3, 11, 0).x == doctest::Approx(93.5));
+
+        // Bilinear between texel centers, and the coarsest level is the mean
+        Colorf c = cache.lookup(id, Point2D { 10.0 / W, 20.0 / H });
+        CHECK(c.x == doctest::Approx(9.5));
+        CHECK(c.y == doctest::Approx(19.5));
+        CHECK(cache.lookup(id, Point2D { 0.3, 0.3 }, 100).z == doctest::Approx(1.0));
+
+        // A footprint 4 texels wide reads level 2
+        Point2D uv { 0.5, 0.5 }, four_texels { 4.0 / W, 0 };
+        CHECK(cache.lookup(id, uv, four_texels, Point2D {}).x == doctest::Approx(cache.lookup(id, uv, 2).x));
+
+        // Repeated lookups in one tile hit after the first, sweeping more tiles than fit evicts
+        cache.clear();
+        cache.reset_stats();
+        for (int i = 0; i < 10; ++i) cache.texel(id, 0, 1, 1);
+        TextureCacheStats stats = cache.stats();
+        CHECK(stats.misses == 1);
+        CHECK(stats.hits == 9);
+
+        for (int x = 0; x < W; x += 16) cache.texel(id, 0, x, 40);
+        stats = cache.stats();
+        CHECK(stats.evictions > 0);
+        CHECK(stats.resident_bytes <= cache.capacity());
+        CHECK(stats.hit_rate() < 1);
+
+        CHECK_THROWS(cache.add("does_not_exist.ttx"));
+    }
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <materials/radiometry.h>
+#include <config.h>
+
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace pbr
+{
+    ///////////////////////////////////////////////////////////////////////////////
+    // Textures
+    //
+    // Textures live on disk as tiled mip pyramids and are paged in one tile at a
+    // time through a fixed-size cache, so only the tiles that rays actually touch
+    // are ever resident.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    /** Index of a texture in a TextureCache. */
+    using TextureId = uint32_t;
+
+    /** Used in place of a TextureId by materials without a texture. */
+    constexpr TextureId NO_TEXTURE = ~TextureId(0);
+
+    /*!
+    * @brief Write an image as a tiled, mip-mapped texture file
+    *
+    * Level 0 is the image, each following level halves both sides with a box filter down to 1x1.
+    * Every level is cut into square tiles of tile_size texels, stored as 32-bit float RGB. Tiles on
+    * the right and bottom edges are padded by repeating the last texel, so all tiles have the same
+    * size and their offset in the file follows from their index.
+    *
+    * @param path Output file, conventionally with the .ttx extension
+    * @param width Image width in texels
+    * @param height Image height in texels
+    * @param pixels Row-major linear image, width * height
+    * @param tile_size Side of a tile in texels
+    */
+    void write_tiled_texture(const std::string& path, int width, int height, const std::vector<Colorf>& pixels,
+        int tile_size = PBR_TEXTURE_TILE_SIZE);
+
+    /** Counters of a TextureCache, summed over its shards. */
+    struct TextureCacheStats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+
+        /** Bytes of tile data read from disk */
+        uint64_t bytes_read = 0;
+
+        /** Bytes of tile data currently held */
+        size_t resident_bytes = 0;
+
+        double hit_rate() const
+        {
+            uint64_t lookups = hits + misses;
+            return lookups ? double(hits) / lookups : 0;
+        }
+    };
+
+    /*!
+    * @brief Tiled textures and a bounded LRU cache of their tiles, shared by all render threads
+    *
+    * Tiles are spread over shards by the hash of their key, each shard with its own lock, LRU list
+    * and an equal share of the capacity, so threads looking up different tiles rarely wait on each
+    * other. Tiles are loaded outside of the shard lock. Lookups hand out shared pointers, so a tile
+    * that is evicted while a thread is still filtering it stays valid until that thread drops it.
+    *
+    * Textures must be added before rendering starts, lookups are thread-safe.
+    */
+    class TextureCache
+    {
+    public:
+        /** One tile of one mip level, tile_size * tile_size float RGB texels. */
+        struct Tile
+        {
+            std::vector<float> texels;
+        };
+
+        /*!
+        * @param capacity_bytes Most bytes of tile data held at once
+        * @param shards Number of independently locked parts of the cache
+        */
+        explicit TextureCache(size_t capacity_bytes = size_t(PBR_TEXTURE_CACHE_SIZE_MB) << 20,
+            int shards = PBR_TEXTURE_CACHE_SHARDS);
+
+        /** Open a file written by write_tiled_texture. Only its header is read. Throws std::runtime_error if it cannot be read. */
+        TextureId add(const std::string& path);
+
+        size_t size() const { return textures.size(); }
+        int width(TextureId texture, int level = 0) const { return level_size(textures[texture]->width, level); }
+        int height(TextureId texture, int level = 0) const { return level_size(textures[texture]->height, level); }
+        int levels(TextureId texture) const { return textures[texture]->levels; }
+
+        /** Texel of a mip level, wrapping around in both directions. */
+        Colorf texel(TextureId texture, int level, int x, int y) const;
+
+        /*!
+        * @brief Filtered lookup with wrapping texture coordinates
+        *
+        * @param texture Texture to read
+        * @param uv Texture coordinates, (0, 0) is the top left corner of the image
+        * @param lod Mip level, fractional values blend the two closest levels. Clamped to the existing levels.
+        * @return Colorf Bilinear (trilinear between levels) average of the texels around uv
+        */
+        Colorf lookup(TextureId texture, const Point2D& uv, double lod = 0) const;
+
+        /** Filtered lookup over a footprint, the longer of its offsets in uv picks the mip level. */
+        Colorf lookup(TextureId texture, const Point2D& uv, const Point2D& duvdx, const Point2D& duvdy) const;
+
+        TextureCacheStats stats() const;
+
+        void reset_stats();
+
+        /** Drop every resident tile. */
+        void clear();
+
+        size_t capacity() const { return shard_capacity * shards.size(); }
+
+    private:
+        using TilePtr = std::shared_ptr<const Tile>;
+
+        struct TextureFile
+        {
+            std::string path;
+            int width = 0;
+            int height = 0;
+            int tile_size = 0;
+            int levels = 0;
+
+            /** Offset of the first tile of each level in the file */
+            std::vector<uint64_t> level_offsets;
+
+            /** Kept open, reads are serialized by the lock */
+            mutable std::ifstream file;
+            mutable std::mutex file_lock;
+        };
+
+        struct Entry
+        {
+            uint64_t key;
+            TilePtr tile;
+        };
+
+        struct Shard
+        {
+            std::mutex lock;
+
+            /** Most recently used first */
+            std::list<Entry> lru;
+            std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+            size_t bytes = 0;
+
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t evictions = 0;
+            uint64_t bytes_read = 0;
+        };
+
+        std::vector<std::unique_ptr<TextureFile>> textures;
+        mutable std::vector<std::unique_ptr<Shard>> shards;
+        size_t shard_capacity;
+
+        static int level_size(int size, int level) { return std::max(1, size >> level); }
+
+        static uint64_t tile_key(TextureId texture, int level, int tile_x, int tile_y)
+        {
+            return (uint64_t(texture) << 40) | (uint64_t(level) << 32) | (uint64_t(tile_y) << 16) | uint64_t(tile_x);
+        }
+
+        /** Find a tile in the cache, loading it from disk on a miss. */
+        TilePtr tile(TextureId texture, int level, int tile_x, int tile_y) const;
+
+        TilePtr load(const TextureFile& file, int level, int tile_x, int tile_y) const;
+
+        /** Bilinear lookup within a single level. */
+        Colorf bilinear(TextureId texture, int level, const Point2D& uv) const;
+    };
+}
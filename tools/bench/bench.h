@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Minimal timing helpers shared by the benchmarks in main.cpp.
+
+namespace bench
+{
+    using Clock = std::chrono::steady_clock;
+
+    /** Seconds elapsed since start. */
+    inline double seconds_since(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    /*!
+     * Run fn `repeats` times and return the best wall-clock time in seconds.
+     * Taking the minimum filters out scheduler noise on shared machines.
+     */
+    inline double best_of(int repeats, const std::function<void()>& fn)
+    {
+        double best = 1e30;
+        for (int i = 0; i < repeats; ++i)
+        {
+            auto start = Clock::now();
+            fn();
+            best = std::min(best, seconds_since(start));
+        }
+        return best;
+    }
+
+    /** Print one result row: name, time and throughput in millions of items per second. */
+    inline void report(const std::string& name, double seconds, double items)
+    {
+        std::printf("%-40s %10.3f ms %10.2f M/s\n", name.c_str(), seconds * 1e3, items / seconds * 1e-6);
+    }
+
+    /** A named benchmark that can be selected from the command line. */
+    struct Benchmark
+    {
+        const char* name;
+        void (*run)();
+    };
+}
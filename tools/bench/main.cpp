@@ -0,0 +1,1419 @@
+#include "pbr.h"
+#include "bench.h"
+
+#include <cstring>
+#include <fstream>
+#include <stb_image_write.h>
+
+// Benchmarks for the hot loops of the renderer.
+// Usage: pbr-bench [name...]  (runs every benchmark when no name is given)
+
+using namespace pbr;
+
+///////////////////////////////////////////////////////////////////////////////
+// Helpers
+///////////////////////////////////////////////////////////////////////////////
+
+/** Rays starting inside the Cornell box towards random directions. */
+static std::vector<Ray> make_rays(size_t count, unsigned seed = 7)
+{
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<> dist(-1.0, 1.0);
+
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        Point origin { dist(gen) * 4, 2.5 + dist(gen) * 2, 3 + dist(gen) };
+        Direction direction { dist(gen), dist(gen), dist(gen) };
+        rays.push_back({ origin, normalize(direction) });
+    }
+    return rays;
+}
+
+/** A box of small diffuse spheres, to see how the loop scales with the number of actors. */
+static Scene make_sphere_field(size_t count, unsigned seed = 11)
+{
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<> dist(-1.0, 1.0);
+
+    Scene scene;
+    scene.reserve(count);
+    auto material = scene.add_material({ PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Diffuse });
+    for (size_t i = 0; i < count; ++i)
+    {
+        scene.add_actor(material, SphereGeometry {
+            Vec { dist(gen) * 5, 2.5 + dist(gen) * 2.5, dist(gen) * 5 },
+            0.1
+        });
+    }
+    return scene;
+}
+
+/** Camera from config.h for an image of the given size. */
+static Camera make_camera(int cols, int rows)
+{
+    Camera camera;
+    camera.position = PBR_CAMERA_POSITION;
+    camera.look_at = PBR_CAMERA_LOOKAT;
+    camera.fov = PBR_CAMERA_FOV_DEG;
+    camera.calculate_basis((double) cols / rows);
+    return camera;
+}
+
+/** Linear radiance image, row-major. */
+using FloatImage = std::vector<Colorf>;
+
+/** Render a linear image with spp samples per pixel, placed like the renderer does, and the variance of the mean luminance of each pixel if asked for (empty below 2 samples). */
+template <class Integrator>
+static FloatImage render_linear(const Integrator& integrator, const Camera& camera, int cols, int rows, int spp,
+    std::vector<float>* variance = nullptr)
+{
+    FloatImage image(cols * rows);
+    if (variance) variance->assign(spp > 1 ? cols * rows : 0, 0.f);
+
+    UniformRNG rng;
+#if PBR_USE_THREADS
+#pragma omp parallel for private(rng)
+#endif
+    for (int row = 0; row < rows; ++row)
+    {
+        for (int col = 0; col < cols; ++col)
+        {
+            Colorf color;
+            double squares = 0;
+            for (int i = 0; i < spp; ++i)
+            {
+                RayDifferential differential;
+                Ray ray = pixel_ray(camera, col, row, cols, rows, i, rng, differential);
+                Radiance sample = integrator.trace_ray(ray, differential, rng);
+                color = color + sample;
+                squares += luminance(sample) * luminance(sample);
+            }
+            image[row * cols + col] = color / spp;
+            if (variance && !variance->empty())
+            {
+                double mean = luminance(color) / spp;
+                (*variance)[row * cols + col] = static_cast<float>(std::max(squares / spp - mean * mean, 0.) / (spp - 1));
+            }
+        }
+    }
+    return image;
+}
+
+/** Root mean squared error over all channels. */
+static double rmse(const FloatImage& image, const FloatImage& reference)
+{
+    double sum = 0;
+    for (size_t i = 0; i < image.size(); ++i)
+    {
+        Colorf d = image[i] - reference[i];
+        sum += d.sqlen();
+    }
+    return std::sqrt(sum / (3 * image.size()));
+}
+
+/** Mean of all channels, to spot bias between estimators. */
+static double mean(const FloatImage& image)
+{
+    double sum = 0;
+    for (const auto& c : image) sum += c.x + c.y + c.z;
+    return sum / (3 * image.size());
+}
+
+/** Print time, RMSE and efficiency (1 / (RMSE^2 * time)) of a render against a reference. */
+static void report_quality(const std::string& name, double seconds, const FloatImage& image, const FloatImage& reference)
+{
+    double error = rmse(image, reference);
+    std::printf("%-40s %9.3f s  RMSE %9.5f  mean %8.5f  efficiency %10.1f\n",
+        name.c_str(), seconds, error, mean(image), 1 / (error * error * seconds));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Intersection
+///////////////////////////////////////////////////////////////////////////////
+
+// The loop as it was before hit shading was deferred: every candidate actor builds
+// a full HitResult (point, distance with two square roots, normalized normal, uv).
+static bool intersect_eager(const Scene& scene, const Ray& ray, HitResult& out_hit)
+{
+    bool does_hit = false;
+    HitResult closest_hit;
+    for (size_t i = 0; i < scene.size(); ++i)
+    {
+        const SphereGeometry& sphere = scene.geometry[i];
+        double t = sphere.intersect(ray);
+        if (t == PBR_INF) continue;
+
+        HitResult hit;
+        Vec point = ray.origin + ray.direction * t;
+        hit.param = (point - ray.origin).len() / ray.direction.len();
+        hit.point = point;
+        hit.primitive = i;
+        hit.material = scene.material_ids[i];
+        hit.normal = normalize(hit.point - sphere.center);
+        hit.uv = sphere.uv_at(hit.normal);
+
+        if (!does_hit || hit.param < closest_hit.param)
+        {
+            closest_hit = hit;
+            does_hit = true;
+        }
+    }
+
+    out_hit = closest_hit;
+    return does_hit;
+}
+
+static void bench_intersect()
+{
+    const auto rays = make_rays(1 << 20);
+
+    struct Case { const char* name; const Scene* scene; };
+    Scene field = make_sphere_field(64);
+    const Case cases[] = {
+        { "cornell", &PBR_SCENE_CORNELL },
+        { "rtweekend", &PBR_SCENE_RTWEEKEND },
+        { "field64", &field },
+    };
+
+    for (const auto& c : cases)
+    {
+        double checksum_eager = 0, checksum_lazy = 0;
+
+        double eager = bench::best_of(3, [&] {
+            for (const auto& ray : rays)
+            {
+                HitResult hit;
+                if (intersect_eager(*c.scene, ray, hit)) checksum_eager += hit.param;
+            }
+        });
+
+        double lazy = bench::best_of(3, [&] {
+            for (const auto& ray : rays)
+            {
+                HitResult hit;
+                if (c.scene->intersect(ray, hit)) checksum_lazy += hit.param;
+            }
+        });
+
+        bench::report(std::string("intersect/eager/") + c.name, eager, rays.size());
+        bench::report(std::string("intersect/lazy/") + c.name, lazy, rays.size());
+
+        // Both loops must agree on the closest hit
+        if (std::abs(checksum_eager - checksum_lazy) > 1e-6 * std::abs(checksum_eager))
+        {
+            std::printf("  mismatch: %f vs %f\n", checksum_eager, checksum_lazy);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Actor layout
+///////////////////////////////////////////////////////////////////////////////
+
+// Actor as it was before geometry and materials were split into parallel arrays
+struct LegacyActor
+{
+    std::shared_ptr<Material> material;
+    SphereGeometry geometry;
+};
+
+static void bench_actors()
+{
+    constexpr size_t COUNT = 1'000'000;
+    const auto rays = make_rays(64);
+
+    Scene packed = make_sphere_field(COUNT);
+
+    auto shared_material = std::make_shared<Material>(packed.materials[0]);
+    std::vector<LegacyActor> legacy;
+    legacy.reserve(COUNT);
+    for (const auto& sphere : packed.geometry)
+    {
+        legacy.push_back({ shared_material, sphere });
+    }
+
+    size_t packed_bytes = packed.geometry.capacity() * sizeof(SphereGeometry)
+        + packed.material_ids.capacity() * sizeof(MaterialId);
+    size_t legacy_bytes = legacy.capacity() * sizeof(LegacyActor);
+
+    std::printf("%-40s %10zu bytes/actor %8.1f MB\n", "actors/shared_ptr", sizeof(LegacyActor), legacy_bytes / 1e6);
+    std::printf("%-40s %10zu bytes/actor %8.1f MB\n", "actors/packed",
+        sizeof(SphereGeometry) + sizeof(MaterialId), packed_bytes / 1e6);
+
+    // Closest-hit scan over all actors. The legacy scan keeps the material of the
+    // current closest actor alive in a local, like the old HitResult copy did.
+    double checksum_legacy = 0, checksum_packed = 0;
+    double legacy_time = bench::best_of(3, [&] {
+        for (const auto& ray : rays)
+        {
+            double closest = PBR_INF;
+            const Material* material = nullptr;
+            for (const auto& actor : legacy)
+            {
+                double t = actor.geometry.intersect(ray);
+                if (t < closest)
+                {
+                    closest = t;
+                    material = actor.material.get();
+                }
+            }
+            if (material) checksum_legacy += closest;
+        }
+    });
+
+    double packed_time = bench::best_of(3, [&] {
+        for (const auto& ray : rays)
+        {
+            HitResult hit;
+            if (packed.intersect(ray, hit)) checksum_packed += hit.param;
+        }
+    });
+
+    bench::report("actors/scan/shared_ptr", legacy_time, rays.size() * COUNT);
+    bench::report("actors/scan/packed", packed_time, rays.size() * COUNT);
+    std::printf("  (checksums %f %f)\n", checksum_legacy, checksum_packed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Shading
+///////////////////////////////////////////////////////////////////////////////
+
+// The material layout as it was before the flat material table: each actor holds a
+// shared_ptr to its material, which owns a heap-allocated BRDF with virtual sample/eval.
+namespace legacy
+{
+    struct BRDF
+    {
+        virtual ~BRDF() = default;
+        virtual BRDFSample sample(const Material& m, const Ray& in, const HitResult& hit, UniformRNG& rng) = 0;
+        virtual Colorf eval(const Material& m, const Ray& in, const HitResult& hit, const Direction& out) = 0;
+    };
+
+    struct DiffuseBRDF : BRDF
+    {
+        BRDFSample sample(const Material& m, const Ray& in, const HitResult& hit, UniformRNG& rng) override
+        {
+            auto frame = brdf::make_frame(in, hit);
+            Vec wi = brdf::sample_cosine_hemisphere(rng);
+            Colorf weight = m.roughness == 0 ? m.color : brdf::oren_nayar(m, frame.wo, wi);
+            return { { hit.point, to_world(frame.basis, wi) }, weight, brdf::pdf_diffuse(frame.wo, wi), false };
+        }
+
+        Colorf eval(const Material& m, const Ray& in, const HitResult& hit, const Direction& out) override
+        {
+            auto frame = brdf::make_frame(in, hit);
+            return brdf::eval_diffuse(m, frame.wo, to_local(frame.basis, normalize(out)));
+        }
+    };
+
+    struct SpecularBRDF : BRDF
+    {
+        BRDFSample sample(const Material& /* m */, const Ray& in, const HitResult& hit, UniformRNG& /* rng */) override
+        {
+            return { { hit.point, reflect(in.direction, hit.normal) }, PBR_COLOR_WHITE, 1, true };
+        }
+
+        Colorf eval(const Material& /* m */, const Ray& /* in */, const HitResult& /* hit */, const Direction& /* out */) override
+        {
+            return {};
+        }
+    };
+
+    struct Material
+    {
+        pbr::Material params;
+        std::unique_ptr<BRDF> brdf;
+    };
+}
+
+static void bench_shading()
+{
+    const Scene& scene = PBR_SCENE_CORNELL;
+
+    // Primary hits to shade
+    std::vector<Ray> rays;
+    std::vector<HitResult> hits;
+    for (const auto& ray : make_rays(1 << 20))
+    {
+        HitResult hit;
+        if (scene.intersect(ray, hit))
+        {
+            rays.push_back(ray);
+            hits.push_back(hit);
+        }
+    }
+
+    // One legacy material per actor, reached through a shared_ptr like Actor::material was
+    std::vector<std::shared_ptr<legacy::Material>> legacy_materials;
+    for (auto id : scene.material_ids)
+    {
+        const Material& m = scene.materials[id];
+        auto lm = std::make_shared<legacy::Material>(legacy::Material { m, nullptr });
+        if (m.brdf == BRDFType::Specular) lm->brdf = std::make_unique<legacy::SpecularBRDF>();
+        else lm->brdf = std::make_unique<legacy::DiffuseBRDF>();
+        legacy_materials.push_back(lm);
+    }
+
+    UniformRNG rng;
+    Colorf sum_virtual, sum_table;
+
+    double virt = bench::best_of(3, [&] {
+        for (size_t i = 0; i < hits.size(); ++i)
+        {
+            const auto& material = legacy_materials[hits[i].primitive];
+            BRDFSample out = material->brdf->sample(material->params, rays[i], hits[i], rng);
+            sum_virtual = sum_virtual + out.weight + material->brdf->eval(material->params, rays[i], hits[i], out.ray.direction);
+        }
+    });
+
+    double table = bench::best_of(3, [&] {
+        for (size_t i = 0; i < hits.size(); ++i)
+        {
+            const Material& material = scene.material(hits[i]);
+            BRDFSample out = sample_brdf(material, rays[i], hits[i], rng);
+            sum_table = sum_table + out.weight + eval_brdf(material, rays[i], hits[i], out.ray.direction);
+        }
+    });
+
+    bench::report("shading/virtual", virt, hits.size());
+    bench::report("shading/table", table, hits.size());
+    std::printf("  (checksums %f %f)\n", sum_virtual.x, sum_table.x);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GGX sampling
+///////////////////////////////////////////////////////////////////////////////
+
+// Radiance reflected towards wo by a surface under a sky with a bright glow near the
+// mirror direction. Compares visible normal sampling against uniform hemisphere
+// sampling at equal sample counts. Small, very bright lights are left to light sampling.
+static void bench_ggx()
+{
+    constexpr int SPP = 16;
+    constexpr int TRIALS = 20000;
+
+    HitResult hit {};
+    hit.normal = { 0, 0, 1 };
+
+    double theta = PBR_DEG_TO_RAD(40.);
+    Ray in { Vec { 0, 0, 0 }, Vec { -std::sin(theta), 0, -std::cos(theta) } };
+    Vec sun = normalize(Vec { -std::sin(theta) - 0.1, 0.05, std::cos(theta) });
+
+    auto environment = [&](const Vec& wi) {
+        double sky = 0.5 + 0.5 * wi.z;
+        double glow = std::pow(std::max(0., dot(wi, sun)), 32);
+        return sky + 20 * glow;
+    };
+
+    UniformRNG rng;
+
+    for (auto type : { BRDFType::Conductor, BRDFType::Plastic })
+    {
+        for (double roughness : { 0.1, 0.3, 0.6 })
+        {
+            Material material { Colorf { 0.9, 0.6, 0.3 }, PBR_COLOR_BLACK, type, roughness };
+
+            // Reference with many importance samples
+            double reference = 0;
+            constexpr int REFERENCE_SAMPLES = 1 << 22;
+            for (int i = 0; i < REFERENCE_SAMPLES; ++i)
+            {
+                BRDFSample s = sample_brdf(material, in, hit, rng);
+                reference += s.weight.y * environment(s.ray.direction);
+            }
+            reference /= REFERENCE_SAMPLES;
+
+            double se_vndf = 0, se_uniform = 0;
+            for (int trial = 0; trial < TRIALS; ++trial)
+            {
+                double vndf = 0, uniform = 0;
+                for (int i = 0; i < SPP; ++i)
+                {
+                    BRDFSample s = sample_brdf(material, in, hit, rng);
+                    vndf += s.weight.y * environment(s.ray.direction);
+
+                    Vec wi = rng.sample_hemisphere();
+                    uniform += eval_brdf(material, in, hit, wi).y * environment(wi) * (2 * PBR_PI);
+                }
+                se_vndf += (vndf / SPP - reference) * (vndf / SPP - reference);
+                se_uniform += (uniform / SPP - reference) * (uniform / SPP - reference);
+            }
+
+            std::printf("%-12s roughness %.1f  %d spp  RMSE uniform %8.4f  vndf %8.4f  (reference %.4f)\n",
+                type == BRDFType::Conductor ? "conductor" : "plastic", roughness, SPP,
+                std::sqrt(se_uniform / TRIALS), std::sqrt(se_vndf / TRIALS), reference);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MIS
+///////////////////////////////////////////////////////////////////////////////
+
+/** Cornell box with the mirror and red ball made glossy. */
+static Scene make_glossy_cornell()
+{
+    Scene scene = PBR_SCENE_CORNELL;
+    for (auto& material : scene.materials)
+    {
+        if (material.brdf == BRDFType::Specular)
+        {
+            material.brdf = BRDFType::Conductor;
+            material.roughness = 0.3;
+        }
+        else if (material.roughness > 0)
+        {
+            material.brdf = BRDFType::Plastic;
+            material.roughness = 0.2;
+        }
+    }
+    return scene;
+}
+
+// BRDF sampling only against NEE + MIS, at equal samples per pixel
+static void bench_mis()
+{
+    constexpr int COLS = 160, ROWS = 90;
+    constexpr int SPP = 16, REFERENCE_SPP = 1024;
+    const Camera camera = make_camera(COLS, ROWS);
+
+    Scene glossy = make_glossy_cornell();
+    struct Case { const char* name; const Scene* scene; };
+    const Case cases[] = {
+        { "cornell", &PBR_SCENE_CORNELL },
+        { "rtweekend", &PBR_SCENE_RTWEEKEND },
+        { "cornell-glossy", &glossy },
+    };
+
+    for (const auto& c : cases)
+    {
+        PathIntegrator integrator;
+        integrator.set_scene(c.scene);
+
+        integrator.light_sampling = true;
+        FloatImage reference = render_linear(integrator, camera, COLS, ROWS, REFERENCE_SPP);
+
+        for (bool light_sampling : { false, true })
+        {
+            integrator.light_sampling = light_sampling;
+            FloatImage image;
+            double seconds = bench::best_of(1, [&] { image = render_linear(integrator, camera, COLS, ROWS, SPP); });
+            report_quality(std::string("mis/") + c.name + (light_sampling ? "/nee+mis" : "/brdf"), seconds, image, reference);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Many lights
+///////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * A closed room lit only by many small emissive spheres whose emission spans three orders
+ * of magnitude, plus two diffuse balls on the floor.
+ */
+static Scene make_many_lights_scene(size_t count, unsigned seed = 5)
+{
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<> dist(0.0, 1.0);
+
+    Scene scene;
+    scene.reserve(count + 10);
+
+    auto white = scene.add_material({ Colorf { 0.8 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+    auto red = scene.add_material({ Colorf { 0.8, 0.1, 0.1 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+
+    scene.add_actor(white, { Vec { 0.0, -1e5, 0.0 }, 1e5 });          // Floor
+    scene.add_actor(white, { Vec { 0.0, 0.0, -1e5 - 1.5 }, 1e5 });    // Back
+    scene.add_actor(red, { Vec { -1e5 - 5, 0.0, 0.0 }, 1e5 });        // Left wall
+    scene.add_actor(white, { Vec { 1e5 + 5, 0.0, 0.0 }, 1e5 });       // Right wall
+    scene.add_actor(white, { Vec { 0.0, 1e5 + 5, 0.0 }, 1e5 });       // Roof
+    scene.add_actor(white, { Vec { 0.0, 0.0, 1e5 + 7 }, 1e5 });       // Front, behind the camera
+    scene.add_actor(white, { Vec { 1.5, 1.0, 0.0 }, 1.0 });
+    scene.add_actor(red, { Vec { -1.5, 1.0, 0.0 }, 1.0 });
+
+    // Emission is log-uniform in [0.05, 50], so a few lights carry most of the power
+    constexpr size_t MATERIALS = 64;
+    std::vector<MaterialId> emitters;
+    for (size_t i = 0; i < MATERIALS; ++i)
+    {
+        double emission = 0.05 * std::pow(1000.0, dist(gen));
+        Colorf tint { 0.6 + 0.4 * dist(gen), 0.6 + 0.4 * dist(gen), 0.6 + 0.4 * dist(gen) };
+        emitters.push_back(scene.add_material({ PBR_COLOR_WHITE, tint * emission, BRDFType::Diffuse }));
+    }
+
+    // Lights fill a layer under the roof; more lights get smaller so total power stays similar
+    double radius = 0.5 / std::sqrt((double) count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        Vec center { -4.8 + 9.6 * dist(gen), 3.8 + 1.1 * dist(gen), -1.3 + 6 * dist(gen) };
+        scene.add_actor(emitters[i % MATERIALS], { center, radius });
+    }
+
+    return scene;
+}
+
+// Uniform, power-weighted and light BVH selection, RMSE as samples per pixel grow
+static void bench_many_lights()
+{
+    constexpr int COLS = 64, ROWS = 36;
+    constexpr int REFERENCE_SPP = 256;
+
+    // Looking down at the floor, so the tiny emitters themselves stay out of frame
+    Camera camera;
+    camera.position = PBR_CAMERA_POSITION;
+    camera.look_at = Vec { 0, 0, 0 };
+    camera.fov = PBR_CAMERA_FOV_DEG;
+    camera.calculate_basis((double) COLS / ROWS);
+
+    for (size_t count : { 1000, 10000 })
+    {
+        Scene scene = make_many_lights_scene(count);
+
+        // Only light from the emitters, so the error measures light selection
+        PathIntegrator integrator;
+        integrator.terminal_radiance = PBR_COLOR_BLACK;
+        integrator.light_sampler.selection = LightSelection::Power;
+        integrator.set_scene(&scene);
+        FloatImage reference = render_linear(integrator, camera, COLS, ROWS, REFERENCE_SPP);
+
+        for (auto selection : { LightSelection::Uniform, LightSelection::Power, LightSelection::BVH })
+        {
+            integrator.light_sampler.selection = selection;
+            integrator.set_scene(&scene);
+
+            for (int spp : { 4, 16 })
+            {
+                FloatImage image;
+                double seconds = bench::best_of(1, [&] { image = render_linear(integrator, camera, COLS, ROWS, spp); });
+
+                char name[64];
+                const char* names[] = { "uniform", "power", "bvh" };
+                std::snprintf(name, sizeof name, "lights/%zu/%s/%dspp", count, names[(int) selection], spp);
+                report_quality(name, seconds, image, reference);
+            }
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReSTIR
+///////////////////////////////////////////////////////////////////////////////
+
+/** Render a linear image with an integrator that renders whole passes. */
+template <class Integrator>
+static FloatImage render_passes(Integrator& integrator, const Camera& camera, int cols, int rows, int passes)
+{
+    FloatImage image(cols * rows);
+    for (int pass = 0; pass < passes; ++pass)
+    {
+        integrator.render_pass(camera, pass, cols, rows, image);
+    }
+    for (auto& c : image) c = c / passes;
+    return image;
+}
+
+// Direct light only: NEE with the light BVH against reservoir resampling with and without
+// reuse (spatial radius scaled down to the small image). "frame" is a single pass after 8 warm-up passes (what reuse is for), "Nspp" the
+// average of N passes (where reused samples are correlated between passes).
+static void bench_restir()
+{
+    constexpr int COLS = 96, ROWS = 54;
+    constexpr int REFERENCE_SPP = 256;
+    constexpr int WARMUP = 8;
+
+    Camera camera;
+    camera.position = PBR_CAMERA_POSITION;
+    camera.look_at = Vec { 0, 0, 0 };
+    camera.fov = PBR_CAMERA_FOV_DEG;
+    camera.calculate_basis((double) COLS / ROWS);
+
+    Scene scene = make_many_lights_scene(1000);
+
+    PathIntegrator nee;
+    nee.max_depth = 2;
+    nee.terminal_radiance = PBR_COLOR_BLACK;
+    nee.light_sampler.selection = LightSelection::BVH;
+    nee.set_scene(&scene);
+    FloatImage reference = render_linear(nee, camera, COLS, ROWS, REFERENCE_SPP);
+
+    FloatImage image;
+    double seconds = bench::best_of(1, [&] { image = render_linear(nee, camera, COLS, ROWS, 1); });
+    report_quality("restir/nee/frame", seconds, image, reference);
+    for (int spp : { 4, 16 })
+    {
+        seconds = bench::best_of(1, [&] { image = render_linear(nee, camera, COLS, ROWS, spp); });
+        report_quality("restir/nee/" + std::to_string(spp) + "spp", seconds, image, reference);
+    }
+
+    struct Mode { const char* name; bool temporal; int neighbours; };
+    const Mode modes[] = {
+        { "restir/candidates", false, 0 },
+        { "restir/temporal", true, 0 },
+        { "restir/spatial", false, PBR_RESTIR_SPATIAL_NEIGHBOURS },
+        { "restir/spatiotemporal", true, PBR_RESTIR_SPATIAL_NEIGHBOURS },
+    };
+
+    for (const auto& mode : modes)
+    {
+        ReSTIRIntegrator restir;
+        restir.path = nee;
+        restir.spatial_radius = 4;
+        restir.temporal_reuse = mode.temporal;
+        restir.spatial_neighbours = mode.neighbours;
+        restir.set_scene(&scene);
+
+        render_passes(restir, camera, COLS, ROWS, WARMUP);
+        seconds = bench::best_of(1, [&] {
+            image.assign(COLS * ROWS, {});
+            restir.render_pass(camera, WARMUP, COLS, ROWS, image);
+        });
+        report_quality(std::string(mode.name) + "/frame", seconds, image, reference);
+
+        for (int spp : { 4, 16 })
+        {
+            restir.set_scene(&scene);
+            seconds = bench::best_of(1, [&] { image = render_passes(restir, camera, COLS, ROWS, spp); });
+            report_quality(std::string(mode.name) + "/" + std::to_string(spp) + "spp", seconds, image, reference);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Environment light
+///////////////////////////////////////////////////////////////////////////////
+
+/** Lat-long sky: a blue gradient, a dark ground and a small sun 40 degrees above the horizon. */
+static EnvironmentLight make_sky(int width = 512, int height = 256)
+{
+    Direction sun = normalize(Vec { 0.6, std::sin(PBR_DEG_TO_RAD(40)), 0.5 });
+    double cos_sun = std::cos(PBR_DEG_TO_RAD(1.5));
+
+    std::vector<Colorf> pixels((size_t) width * height);
+    for (int row = 0; row < height; ++row)
+    {
+        double theta = PBR_PI * (row + 0.5) / height;
+        for (int col = 0; col < width; ++col)
+        {
+            double phi = 2 * PBR_PI * (col + 0.5) / width - PBR_PI;
+            Direction d { std::sin(theta) * std::cos(phi), std::cos(theta), -std::sin(theta) * std::sin(phi) };
+
+            Colorf color = d.y > 0 ? Colorf { 0.3, 0.5, 1.0 } * (0.4 + 0.6 * d.y) : Colorf { 0.1, 0.08, 0.06 };
+            if (dot(d, sun) > cos_sun) color = Colorf { 20000, 18000, 15000 };
+            pixels[(size_t) row * width + col] = color;
+        }
+    }
+    return { width, height, std::move(pixels) };
+}
+
+// Importance sampled environment against uniform sphere sampling of it, both with NEE + MIS
+static void bench_environment()
+{
+    constexpr int COLS = 128, ROWS = 72;
+    constexpr int REFERENCE_SPP = 256;
+
+    Scene scene;
+    auto ground = scene.add_material({ Colorf { 0.5 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+    auto red = scene.add_material({ Colorf { 0.8, 0.2, 0.2 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+    auto gold = scene.add_material({ Colorf { 1.0, 0.8, 0.4 }, PBR_COLOR_BLACK, BRDFType::Conductor, 0.3 });
+    auto plastic = scene.add_material({ Colorf { 0.2, 0.4, 0.8 }, PBR_COLOR_BLACK, BRDFType::Plastic, 0.2 });
+    scene.add_actor(ground, { Vec { 0, -1e5, 0 }, 1e5 });
+    scene.add_actor(red, { Vec { -2.2, 1, 0 }, 1 });
+    scene.add_actor(gold, { Vec { 0, 1, -0.5 }, 1 });
+    scene.add_actor(plastic, { Vec { 2.2, 1, 0 }, 1 });
+    scene.set_environment(make_sky());
+
+    Camera camera = make_camera(COLS, ROWS);
+
+    PathIntegrator integrator;
+    integrator.terminal_radiance = PBR_COLOR_BLACK;
+    integrator.set_scene(&scene);
+    FloatImage reference = render_linear(integrator, camera, COLS, ROWS, REFERENCE_SPP);
+
+    for (bool importance : { false, true })
+    {
+        scene.environment.build_distribution(importance);
+        for (int spp : { 4, 16 })
+        {
+            FloatImage image;
+            double seconds = bench::best_of(1, [&] { image = render_linear(integrator, camera, COLS, ROWS, spp); });
+            report_quality(std::string("environment/") + (importance ? "importance/" : "uniform/") + std::to_string(spp) + "spp",
+                seconds, image, reference);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Textures
+///////////////////////////////////////////////////////////////////////////////
+
+/** Write a 4096x2048 tiled texture of a fine pattern, so neighbouring pixels read different texels. */
+static std::string make_texture_file()
+{
+    constexpr int W = 4096, H = 2048;
+    std::vector<Colorf> pixels((size_t) W * H);
+    for (int y = 0; y < H; ++y)
+    {
+        for (int x = 0; x < W; ++x)
+        {
+            bool check = ((x / 8) + (y / 8)) % 2;
+            double stripe = 0.5 + 0.5 * std::sin(x * 0.05) * std::cos(y * 0.03);
+            pixels[(size_t) y * W + x] = check ? Colorf { 0.9, 0.6 * stripe, 0.2 } : Colorf { 0.1, 0.3, 0.8 * stripe };
+        }
+    }
+
+    std::string path = "pbr_bench_texture.ttx";
+    write_tiled_texture(path, W, H, pixels);
+    return path;
+}
+
+/** A big textured sphere in front and small ones far away, all using one texture through a cache of the given size. */
+static Scene make_textured_scene(const std::string& path, size_t cache_bytes)
+{
+    Scene scene;
+    scene.textures = std::make_shared<TextureCache>(cache_bytes);
+
+    Material textured_material { PBR_COLOR_WHITE, PBR_COLOR_BLACK, BRDFType::Diffuse };
+    textured_material.color_texture = scene.add_texture(path);
+    auto textured = scene.add_material(textured_material);
+    auto ground = scene.add_material({ Colorf { 0.5 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+    auto light = scene.add_material({ PBR_COLOR_WHITE, Colorf { 8 }, BRDFType::Diffuse });
+
+    scene.add_actor(ground, { Vec { 0, -1e5, 0 }, 1e5 });
+    scene.add_actor(light, { Vec { 0, 8, 4 }, 1 });
+    scene.add_actor(textured, { Vec { -1.2, 1.2, 0 }, 1.2 });
+    for (int i = 0; i < 12; ++i)
+    {
+        scene.add_actor(textured, { Vec { -5.5 + i, 0.3, -12.0 - (i % 3) * 4 }, 0.3 });
+    }
+    return scene;
+}
+
+// Render time and tile cache behaviour for caches of increasing size, with level 0 lookups and
+// with mip levels picked from ray differentials
+static void bench_textures()
+{
+    constexpr int COLS = 256, ROWS = 144, SPP = 4;
+
+    std::string path = make_texture_file();
+    Camera camera = make_camera(COLS, ROWS);
+
+    for (bool differentials : { false, true })
+    {
+        for (int megabytes : { 2, 16, 256 })
+        {
+            Scene scene = make_textured_scene(path, size_t(megabytes) << 20);
+            PathIntegrator integrator;
+            integrator.terminal_radiance = PBR_COLOR_BLACK;
+            integrator.ray_differentials = differentials;
+            integrator.set_scene(&scene);
+
+            double seconds = bench::best_of(1, [&] { render_linear(integrator, camera, COLS, ROWS, SPP); });
+            TextureCacheStats stats = scene.textures->stats();
+            std::string name = std::string("textures/") + (differentials ? "differentials" : "level0") + "/cache "
+                + std::to_string(megabytes) + "MB";
+            std::printf("%-40s %9.3f s  hits %6.2f%%  read %8.1f MB  evictions %9llu\n", name.c_str(), seconds,
+                stats.hit_rate() * 100, stats.bytes_read / 1048576.0, (unsigned long long) stats.evictions);
+        }
+    }
+
+    std::remove(path.c_str());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Entry
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Path guiding
+///////////////////////////////////////////////////////////////////////////////
+
+// Path tracing against guided path tracing at equal samples per pixel, with black terminal
+// radiance so all light is found by the paths. The guided times include training, which renders
+// into the same image. The spatial threshold is scaled down to the small image. "brdf" turns
+// light sampling off and stops after one bounce, so the light is only found by scattering.
+static void bench_guiding()
+{
+    constexpr int COLS = 96, ROWS = 54;
+    constexpr int REFERENCE_SPP = 1024;
+    const Camera camera = make_camera(COLS, ROWS);
+
+    Scene glossy = make_glossy_cornell();
+    struct Case { const char* name; const Scene* scene; bool light_sampling; int max_depth; };
+    const Case cases[] = {
+        { "cornell", &PBR_SCENE_CORNELL, true, 8 },
+        { "cornell-glossy", &glossy, true, 8 },
+        { "cornell/brdf", &PBR_SCENE_CORNELL, false, 2 },
+        { "cornell-glossy/brdf", &glossy, false, 2 },
+    };
+
+    for (const auto& c : cases)
+    {
+        PathIntegrator path;
+        path.light_sampling = c.light_sampling;
+        path.max_depth = c.max_depth;
+        path.terminal_radiance = PBR_COLOR_BLACK;
+        path.set_scene(c.scene);
+        FloatImage reference = render_linear(path, camera, COLS, ROWS, REFERENCE_SPP);
+
+        for (int spp : { 15, 63 })
+        {
+            std::string suffix = "/" + std::to_string(spp) + "spp";
+            FloatImage image;
+            double seconds = bench::best_of(1, [&] { image = render_linear(path, camera, COLS, ROWS, spp); });
+            report_quality(std::string("guiding/") + c.name + "/path" + suffix, seconds, image, reference);
+
+            GuidedIntegrator guided;
+            guided.path.light_sampling = c.light_sampling;
+            guided.path.max_depth = c.max_depth;
+            guided.path.terminal_radiance = PBR_COLOR_BLACK;
+            guided.field.spatial_threshold = 1000;
+            guided.set_scene(c.scene);
+            seconds = bench::best_of(1, [&] { image = render_passes(guided, camera, COLS, ROWS, spp); });
+            report_quality(std::string("guiding/") + c.name + "/guided" + suffix, seconds, image, reference);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Caustics
+///////////////////////////////////////////////////////////////////////////////
+
+// Path tracing with and without the caustic photon map, against a path traced reference without
+// photons. The photon times include tracing the photons and precomputing their irradiance.
+static void bench_caustics()
+{
+    constexpr int COLS = 160, ROWS = 90;
+    constexpr int REFERENCE_SPP = 1024;
+    const Camera camera = make_camera(COLS, ROWS);
+
+    PathIntegrator reference_integrator;
+    reference_integrator.caustic_photons = 0;
+    reference_integrator.set_scene(&PBR_SCENE_CORNELL);
+    FloatImage reference = render_linear(reference_integrator, camera, COLS, ROWS, REFERENCE_SPP);
+
+    for (int spp : { 8, 32 })
+    {
+        std::string suffix = "/" + std::to_string(spp) + "spp";
+        FloatImage image;
+        double seconds = bench::best_of(1, [&] { image = render_linear(reference_integrator, camera, COLS, ROWS, spp); });
+        report_quality("caustics/path" + suffix, seconds, image, reference);
+
+        for (size_t photons : { 250000, 1000000 })
+        {
+            PathIntegrator integrator;
+            integrator.caustic_photons = photons;
+            seconds = bench::best_of(1, [&] {
+                integrator.set_scene(&PBR_SCENE_CORNELL);
+                image = render_linear(integrator, camera, COLS, ROWS, spp);
+            });
+            report_quality("caustics/photons-" + std::to_string(photons / 1000) + "k" + suffix, seconds, image, reference);
+        }
+    }
+
+    // Stored photons and the memory of their precomputed irradiance
+    PathIntegrator integrator;
+    integrator.set_scene(&PBR_SCENE_CORNELL);
+    std::printf("%-40s %9zu photons  %6.2f MB\n", "caustics/irradiance-map",
+        integrator.caustics->size(), integrator.caustics->memory() / 1048576.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BDPT
+///////////////////////////////////////////////////////////////////////////////
+
+/** Cornell box with the light shrunk by a factor, keeping its power. */
+static Scene make_small_light_cornell(double factor)
+{
+    Scene scene = PBR_SCENE_CORNELL;
+    for (size_t light : scene.lights)
+    {
+        scene.geometry[light].radius /= factor;
+        scene.materials[scene.material_ids[light]].emission = scene.materials[scene.material_ids[light]].emission * (factor * factor);
+    }
+    return scene;
+}
+
+/** Cornell box with a white ball right under the light, so the room is mostly lit through the ceiling. */
+static Scene make_hidden_light_cornell()
+{
+    Scene scene = PBR_SCENE_CORNELL;
+    const SphereGeometry& light = scene.geometry[scene.lights[0]];
+    auto white = scene.add_material({ Colorf { 0.75 }, PBR_COLOR_BLACK, BRDFType::Diffuse });
+    scene.add_actor(white, { light.center - Vec { 0, 2.2, 0 }, 1.1 });
+    return scene;
+}
+
+// Path tracing (NEE + MIS) against bidirectional path tracing, both without terminal radiance or
+// caustic photons, against a path traced reference. Time to an RMSE is read off the rows.
+static void bench_bdpt()
+{
+    constexpr int COLS = 96, ROWS = 54;
+    constexpr int MAX_DEPTH = 6, REFERENCE_SPP = 2048;
+    const Camera camera = make_camera(COLS, ROWS);
+
+    Scene small = make_small_light_cornell(5);
+    Scene hidden = make_hidden_light_cornell();
+    struct Case { const char* name; const Scene* scene; };
+    const Case cases[] = {
+        { "cornell", &PBR_SCENE_CORNELL },
+        { "cornell-small-light", &small },
+        { "cornell-hidden-light", &hidden },
+    };
+
+    for (const auto& c : cases)
+    {
+        PathIntegrator path;
+        path.max_depth = MAX_DEPTH;
+        path.terminal_radiance = PBR_COLOR_BLACK;
+        path.caustic_photons = 0;
+        path.set_scene(c.scene);
+        FloatImage reference = render_linear(path, camera, COLS, ROWS, REFERENCE_SPP);
+
+        BDPTIntegrator bdpt;
+        bdpt.max_depth = MAX_DEPTH;
+        bdpt.set_scene(c.scene);
+
+        for (int spp : { 4, 16, 64 })
+        {
+            std::string suffix = "/" + std::to_string(spp) + "spp";
+            FloatImage image;
+            double seconds = bench::best_of(1, [&] { image = render_linear(path, camera, COLS, ROWS, spp); });
+            report_quality(std::string("bdpt/") + c.name + "/path" + suffix, seconds, image, reference);
+
+            seconds = bench::best_of(1, [&] { image = render_passes(bdpt, camera, COLS, ROWS, spp); });
+            report_quality(std::string("bdpt/") + c.name + "/bdpt" + suffix, seconds, image, reference);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Radiance cache
+///////////////////////////////////////////////////////////////////////////////
+
+// Full-depth path tracing against paths ended at the radiance cache after the second bounce, both
+// without terminal radiance or caustic photons, against a full-depth reference. The bias of the
+// cache is the gap of its mean to the reference's and the RMSE it levels off at. The cached times
+// include filling the cache, which renders into the same image. The cells are scaled up to the
+// small image, to about as many pixels as the default cells cover in the default image.
+static void bench_radiance_cache()
+{
+    constexpr int COLS = 96, ROWS = 54;
+    constexpr int MAX_DEPTH = 16, REFERENCE_SPP = 1024;
+    constexpr double CELL_SIZE = 0.5;
+    const Camera camera = make_camera(COLS, ROWS);
+
+    Scene hidden = make_hidden_light_cornell();
+    struct Case { const char* name; const Scene* scene; };
+    const Case cases[] = {
+        { "cornell", &PBR_SCENE_CORNELL },
+        { "cornell-hidden-light", &hidden },
+    };
+
+    auto report_throughput = [&](const std::string& name, double seconds, int spp) {
+        std::printf("%-40s %9.3f Mpaths/s\n", name.c_str(), 1e-6 * COLS * ROWS * spp / seconds);
+    };
+
+    for (const auto& c : cases)
+    {
+        PathIntegrator path;
+        path.max_depth = MAX_DEPTH;
+        path.terminal_radiance = PBR_COLOR_BLACK;
+        path.caustic_photons = 0;
+        path.set_scene(c.scene);
+        FloatImage reference = render_linear(path, camera, COLS, ROWS, REFERENCE_SPP);
+        std::printf("%-40s %9s    mean %8.5f\n", (std::string("cache/") + c.name + "/reference").c_str(), "", mean(reference));
+
+        for (int spp : { 4, 16, 64, 256 })
+        {
+            std::string suffix = "/" + std::to_string(spp) + "spp";
+            FloatImage image;
+            double seconds = bench::best_of(1, [&] { image = render_linear(path, camera, COLS, ROWS, spp); });
+            report_quality(std::string("cache/") + c.name + "/full" + suffix, seconds, image, reference);
+            report_throughput(std::string("cache/") + c.name + "/full" + suffix, seconds, spp);
+
+            CachedIntegrator cached;
+            cached.path.max_depth = MAX_DEPTH;
+            cached.path.terminal_radiance = PBR_COLOR_BLACK;
+            cached.path.caustic_photons = 0;
+            cached.cache.cell_size = CELL_SIZE;
+            cached.set_scene(c.scene);
+            seconds = bench::best_of(1, [&] { image = render_passes(cached, camera, COLS, ROWS, spp); });
+            report_quality(std::string("cache/") + c.name + "/cached" + suffix, seconds, image, reference);
+            report_throughput(std::string("cache/") + c.name + "/cached" + suffix, seconds, spp);
+        }
+    }
+
+    CachedIntegrator cached;
+    cached.cache.cell_size = CELL_SIZE;
+    cached.set_scene(&PBR_SCENE_CORNELL);
+    FloatImage image = render_passes(cached, camera, COLS, ROWS, 16);
+    std::printf("%-40s %9zu slots  %6.2f MB\n", "cache/slots-used", cached.cache.size(), cached.cache.memory() / 1048576.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Irradiance cache
+///////////////////////////////////////////////////////////////////////////////
+
+// Path tracing against indirect light interpolated from the irradiance cache at the first
+// Lambertian hit, both without terminal radiance, against a path traced reference. Caustics stay
+// in the cached paths' photon map, without it a record's hemisphere that finds the light through
+// a mirror keeps the spike over its whole area. The cached times include the hemispheres of the
+// records, most of them traced in the first pass. The bias is the gap of the means.
+static void bench_irradiance_cache()
+{
+    constexpr int COLS = 96, ROWS = 54;
+    constexpr int MAX_DEPTH = 6, REFERENCE_SPP = 1024;
+    const Camera camera = make_camera(COLS, ROWS);
+
+    Scene hidden = make_hidden_light_cornell();
+    struct Case { const char* name; const Scene* scene; };
+    const Case cases[] = {
+        { "cornell", &PBR_SCENE_CORNELL },
+        { "cornell-hidden-light", &hidden },
+    };
+
+    for (const auto& c : cases)
+    {
+        PathIntegrator path;
+        path.max_depth = MAX_DEPTH;
+        path.terminal_radiance = PBR_COLOR_BLACK;
+        path.caustic_photons = 0;
+        path.set_scene(c.scene);
+        FloatImage reference = render_linear(path, camera, COLS, ROWS, REFERENCE_SPP);
+        std::printf("%-40s %9s    mean %8.5f\n", (std::string("irradiance/") + c.name + "/reference").c_str(), "", mean(reference));
+
+        for (int spp : { 4, 16, 64 })
+        {
+            std::string suffix = "/" + std::to_string(spp) + "spp";
+            FloatImage image;
+            double seconds = bench::best_of(1, [&] { image = render_linear(path, camera, COLS, ROWS, spp); });
+            report_quality(std::string("irradiance/") + c.name + "/path" + suffix, seconds, image, reference);
+
+            IrradianceCacheIntegrator cached;
+            cached.path.max_depth = MAX_DEPTH;
+            cached.path.terminal_radiance = PBR_COLOR_BLACK;
+            cached.set_scene(c.scene);
+            seconds = bench::best_of(1, [&] { image = render_passes(cached, camera, COLS, ROWS, spp); });
+            report_quality(std::string("irradiance/") + c.name + "/cached" + suffix, seconds, image, reference);
+            std::printf("%-40s %9zu records\n", (std::string("irradiance/") + c.name + "/cached" + suffix).c_str(),
+                cached.cache.size());
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Post-processing
+///////////////////////////////////////////////////////////////////////////////
+
+/** The conversion before PostProcess: clamp, then gamma 2.2 through std::pow. */
+static Colori pow_colori(const Colorf& color)
+{
+    double gamma = 1 / 2.2;
+    double gx = std::pow(clamp(color.x), gamma);
+    double gy = std::pow(clamp(color.y), gamma);
+    double gz = std::pow(clamp(color.z), gamma);
+    return (255u << 24) | ((int) std::floor(gz * 255) << 16) | ((int) std::floor(gy * 255) << 8) | (int) std::floor(gx * 255);
+}
+
+// An 8K frame of HDR noise through the old per-pixel std::pow conversion and through PostProcess
+// with each tonemap, against a pass that only sums the frame, which bounds what reading it costs.
+// GB/s counts the bytes read and written.
+static void bench_postprocess()
+{
+    constexpr int COLS = 7680, ROWS = 4320;
+    const double bytes = (double) COLS * ROWS * (sizeof(Colorf) + sizeof(Colori));
+
+    Framebuffer frame(ROWS, COLS);
+    std::mt19937 gen(5);
+    std::exponential_distribution<> dist(2.0);
+    for (auto& c : frame.pixels()) c = Colorf { dist(gen), dist(gen), dist(gen) };
+    std::vector<Colori> out((size_t) COLS * ROWS);
+
+    auto report_bandwidth = [&](const std::string& name, double seconds, double moved) {
+        std::printf("%-40s %10.3f ms %10.2f Mpixels/s %8.2f GB/s\n", name.c_str(), seconds * 1e3,
+            COLS * ROWS / seconds * 1e-6, moved / seconds * 1e-9);
+    };
+
+    double sum = 0;
+    double seconds = bench::best_of(3, [&] {
+        const std::vector<Colorf>& pixels = frame.pixels();
+        double s = 0;
+#if PBR_USE_THREADS
+#pragma omp parallel for reduction(+ : s)
+#endif
+        for (int64_t i = 0; i < (int64_t) pixels.size(); ++i) s += pixels[i].x + pixels[i].y + pixels[i].z;
+        sum += s;
+    });
+    report_bandwidth("post/read-only", seconds, (double) COLS * ROWS * sizeof(Colorf));
+
+    seconds = bench::best_of(3, [&] {
+        const std::vector<Colorf>& pixels = frame.pixels();
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+        for (int64_t i = 0; i < (int64_t) pixels.size(); ++i) out[i] = pow_colori(pixels[i]);
+    });
+    report_bandwidth("post/pow", seconds, bytes);
+
+    const std::pair<const char*, Tonemap> tonemaps[] = {
+        { "clamp", Tonemap::Clamp }, { "filmic", Tonemap::Filmic }, { "aces", Tonemap::ACES },
+    };
+    for (const auto& [name, tonemap] : tonemaps)
+    {
+        PostProcess post;
+        post.tonemap = tonemap;
+        seconds = bench::best_of(3, [&] { post.apply(frame, out.data()); });
+        report_bandwidth(std::string("post/") + name, seconds, bytes);
+    }
+
+    if (sum == 42) std::printf("\n");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PNG
+///////////////////////////////////////////////////////////////////////////////
+
+static size_t file_size(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    return static_cast<size_t>(in.tellg());
+}
+
+// A 4K frame like a noisy render, smooth shading with per-pixel noise, tonemapped and dithered,
+// written by stb in one go, by the strip encoder, and by the strip encoder fed a row at a time.
+static void bench_png()
+{
+    constexpr int COLS = 3840, ROWS = 2160;
+
+    Framebuffer frame(ROWS, COLS);
+    std::mt19937 gen(9);
+    std::normal_distribution<> noise(1.0, 0.1);
+    for (int r = 0; r < ROWS; ++r)
+    {
+        for (int c = 0; c < COLS; ++c)
+        {
+            double shade = 0.5 + 0.4 * std::sin(c * 0.002) * std::cos(r * 0.003);
+            frame[(size_t) r * COLS + c] = Colorf { shade * noise(gen), 0.6 * shade * noise(gen), 0.3 * noise(gen) };
+        }
+    }
+    std::vector<Colori> pixels((size_t) COLS * ROWS);
+    PostProcess().apply(frame, pixels.data());
+
+    const std::string path = "pbr_bench.png";
+    auto report_png = [&](const std::string& name, double seconds) {
+        std::printf("%-40s %10.3f ms %10.2f Mpixels/s %8.2f MB\n", name.c_str(), seconds * 1e3,
+            COLS * ROWS / seconds * 1e-6, file_size(path) / 1048576.0);
+    };
+
+    double seconds = bench::best_of(1, [&] {
+        stbi_flip_vertically_on_write(true);
+        stbi_write_png(path.c_str(), COLS, ROWS, 4, pixels.data(), COLS * sizeof(Colori));
+    });
+    report_png("png/stb", seconds);
+
+    seconds = bench::best_of(3, [&] { write_png(path, ROWS, COLS, pixels.data()); });
+    report_png("png/strips", seconds);
+
+    seconds = bench::best_of(3, [&] {
+        PngWriter writer(path, ROWS, COLS);
+#if PBR_USE_THREADS
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int r = 0; r < ROWS; ++r) writer.write_rows(r, 1, pixels.data() + (size_t) r * COLS);
+        writer.finish();
+    });
+    report_png("png/streamed", seconds);
+
+    std::remove(path.c_str());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Denoising
+///////////////////////////////////////////////////////////////////////////////
+
+static Framebuffer to_framebuffer(const FloatImage& image, int cols, int rows)
+{
+    Framebuffer frame(rows, cols);
+    frame.pixels() = image;
+    return frame;
+}
+
+// PSNR of renders at a few samples per pixel against a reference, before and after denoising with
+// the variance of their samples, and the time to denoise a 1080p frame.
+static void bench_denoise()
+{
+    constexpr int COLS = 320, ROWS = 180, REFERENCE_SPP = 512;
+    const Camera camera = make_camera(COLS, ROWS);
+
+    struct Case { const char* name; const Scene* scene; };
+    const Case cases[] = {
+        { "cornell", &PBR_SCENE_CORNELL },
+        { "rtweekend", &PBR_SCENE_RTWEEKEND },
+    };
+
+    for (const auto& c : cases)
+    {
+        PathIntegrator integrator;
+        integrator.set_scene(c.scene);
+        Framebuffer reference = to_framebuffer(render_linear(integrator, camera, COLS, ROWS, REFERENCE_SPP), COLS, ROWS);
+
+        FeatureBuffers features(ROWS, COLS);
+        render_features(*c.scene, camera, features);
+
+        for (int spp : { 1, 4, 8, 32 })
+        {
+            std::string name = std::string("denoise/") + c.name + "/" + std::to_string(spp) + "spp";
+            Framebuffer image = to_framebuffer(render_linear(integrator, camera, COLS, ROWS, spp, &features.variance), COLS, ROWS);
+            double noisy = psnr(image, reference);
+            Denoiser().apply(image, features);
+            std::printf("%-40s PSNR %6.2f dB  denoised %6.2f dB\n", name.c_str(), noisy, psnr(image, reference));
+        }
+    }
+
+    constexpr int HD_COLS = 1920, HD_ROWS = 1080;
+    const Camera hd_camera = make_camera(HD_COLS, HD_ROWS);
+    FeatureBuffers features(HD_ROWS, HD_COLS);
+    double seconds = bench::best_of(1, [&] { render_features(PBR_SCENE_CORNELL, hd_camera, features); });
+    bench::report("denoise/1080p/features", seconds, HD_COLS * HD_ROWS);
+
+    Framebuffer image(HD_ROWS, HD_COLS);
+    std::mt19937 gen(3);
+    std::exponential_distribution<> noise(1.0);
+    for (auto& color : image.pixels()) color = Colorf { noise(gen), noise(gen), noise(gen) };
+    seconds = bench::best_of(3, [&] { Denoiser().apply(image, features); });
+    bench::report("denoise/1080p/filter", seconds, HD_COLS * HD_ROWS);
+}
+
+// Writes of the accumulation into rows of the image against tiles, in rows or Morton order, at 4K
+// with a stand-in for the radiance, then whole renders. Also writes into an Image with and without
+// the bounds check it used to have.
+static void bench_framebuffer()
+{
+    constexpr int COLS = 3840, ROWS = 2160, PASSES = 8;
+    auto sample = [](int col, int row, int pass) {
+        uint32_t h = (uint32_t) col * 73856093u ^ (uint32_t) row * 19349663u ^ (uint32_t) pass * 83492791u;
+        return Colorf { (h & 0xff) / 255., ((h >> 8) & 0xff) / 255., ((h >> 16) & 0xff) / 255. };
+    };
+
+    Framebuffer linear(ROWS, COLS);
+    double seconds = bench::best_of(3, [&] {
+        std::vector<Colorf>& accumulation = linear.pixels();
+        std::fill(accumulation.begin(), accumulation.end(), Colorf {});
+        for (int pass = 0; pass < PASSES; ++pass)
+        {
+#if PBR_USE_THREADS
+#pragma omp parallel for
+#endif
+            for (int row = 0; row < ROWS; ++row)
+            {
+                for (int col = 0; col < COLS; ++col)
+                {
+                    accumulation[row * COLS + col] = accumulation[row * COLS + col] + sample(col, row, pass);
+                }
+            }
+        }
+    });
+    bench::report("framebuffer/rows", seconds, (double) COLS * ROWS * PASSES);
+
+    for (TileOrder order : { TileOrder::Rows, TileOrder::Morton })
+    {
+        std::string name = order == TileOrder::Rows ? "framebuffer/tiles16" : "framebuffer/tiles16-morton";
+        TiledFramebuffer tiles(ROWS, COLS, 16, order);
+        const uint32_t pixels = 16 * 16;
+        seconds = bench::best_of(3, [&] {
+            tiles.clear();
+            for (int pass = 0; pass < PASSES; ++pass)
+            {
+#if PBR_USE_THREADS
+#pragma omp parallel for schedule(dynamic)
+#endif
+                for (int64_t t = 0; t < (int64_t) tiles.tiles(); ++t)
+                {
+                    TiledFramebuffer::Tile tile = tiles.tile(t);
+                    for (uint32_t i = 0; i < pixels; ++i)
+                    {
+                        int x, y;
+                        tiles.position(i, x, y);
+                        if (x >= tile.cols || y >= tile.rows) continue;
+                        tile.pixels[i] = tile.pixels[i] + sample(tile.col + x, tile.row + y, pass);
+                    }
+                }
+            }
+        });
+        bench::report(name, seconds, (double) COLS * ROWS * PASSES);
+
+        seconds = bench::best_of(3, [&] { tiles.to_linear(0, ROWS, linear, 1. / PASSES); });
+        bench::report(name + "/to_linear", seconds, (double) COLS * ROWS);
+    }
+
+    // Image used to check every index with std::vector::at
+    std::vector<Colori> pixels((size_t) COLS * ROWS);
+    seconds = bench::best_of(3, [&] {
+        for (size_t i = 0; i < pixels.size(); ++i) pixels.at(i) = static_cast<Colori>(i) | 0xff000000u;
+    });
+    bench::report("framebuffer/image/at", seconds, (double) COLS * ROWS);
+    Image image(ROWS, COLS);
+    seconds = bench::best_of(3, [&] {
+        for (size_t i = 0; i < pixels.size(); ++i) image[i] = static_cast<Colori>(i) | 0xff000000u;
+    });
+    bench::report("framebuffer/image/unchecked", seconds, (double) COLS * ROWS);
+
+    // Whole renders, where tracing the rays dominates
+    constexpr int RENDER_COLS = 640, RENDER_ROWS = 360;
+    const Camera camera = make_camera(RENDER_COLS, RENDER_ROWS);
+    const Scene scene = PBR_SCENE_CORNELL;
+    struct Layout { const char* name; int tile_size; TileOrder order; };
+    for (const Layout& layout : { Layout { "rows", 0, TileOrder::Rows }, Layout { "tiles16", 16, TileOrder::Rows },
+             Layout { "tiles16-morton", 16, TileOrder::Morton } })
+    {
+        Renderer<PathIntegrator> renderer;
+        renderer.tile_size = layout.tile_size;
+        renderer.tile_order = layout.order;
+        Framebuffer out(RENDER_ROWS, RENDER_COLS);
+        seconds = bench::best_of(1, [&] { renderer.render(&scene, camera, out); });
+        bench::report(std::string("framebuffer/render/") + layout.name, seconds, (double) RENDER_COLS * RENDER_ROWS * PBR_SAMPLES_PER_PIXEL);
+    }
+}
+
+static const bench::Benchmark BENCHMARKS[] = {
+    { "intersect", bench_intersect },
+    { "actors", bench_actors },
+    { "shading", bench_shading },
+    { "ggx", bench_ggx },
+    { "mis", bench_mis },
+    { "lights", bench_many_lights },
+    { "restir", bench_restir },
+    { "environment", bench_environment },
+    { "textures", bench_textures },
+    { "guiding", bench_guiding },
+    { "caustics", bench_caustics },
+    { "bdpt", bench_bdpt },
+    { "cache", bench_radiance_cache },
+    { "irradiance", bench_irradiance_cache },
+    { "post", bench_postprocess },
+    { "png", bench_png },
+    { "denoise", bench_denoise },
+    { "framebuffer", bench_framebuffer },
+};
+
+int main(int argc, char** argv)
+{
+    for (const auto& b : BENCHMARKS)
+    {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; ++i)
+        {
+            selected = selected || std::strcmp(argv[i], b.name) == 0;
+        }
+
+        if (selected)
+        {
+            std::printf("== %s\n", b.name);
+            b.run();
+        }
+    }
+
+    return 0;
+}
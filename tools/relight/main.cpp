@@ -0,0 +1,100 @@
+#include "pbr.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Recombines the light path buffers of a render (see LightPathBuffers) with new scales for the
+// emission of each light group, without tracing any path.
+
+static void usage()
+{
+    std::printf(
+        "usage: pbr-relight <in.lpb> <out.png|.exr|.pfm> [<group>=<scale> | <group>=<r>,<g>,<b>]... [--direct | --indirect]\n"
+        "  group is a name or an index, groups not given keep their emission as rendered\n");
+}
+
+/** Index of a group from its name or its index, throws if there is none. */
+static size_t find_group(const pbr::LightPathBuffers& buffers, const std::string& key)
+{
+    for (size_t i = 0; i < buffers.groups().size(); ++i)
+    {
+        if (buffers.groups()[i].name == key || std::to_string(i) == key) return i;
+    }
+    throw std::runtime_error("No light group " + key);
+}
+
+/** A gray or RGB scale, "2" or "1,0.5,0.5". */
+static pbr::Colorf parse_scale(const std::string& text)
+{
+    double r, g, b;
+    char end;
+    if (std::sscanf(text.c_str(), "%lf,%lf,%lf%c", &r, &g, &b, &end) == 3) return pbr::Colorf { r, g, b };
+    if (std::sscanf(text.c_str(), "%lf%c", &r, &end) == 1) return pbr::Colorf { r };
+    throw std::runtime_error("Bad scale " + text);
+}
+
+static void relight(int argc, char** argv)
+{
+    using namespace pbr;
+
+    LightPathBuffers buffers = LightPathBuffers::read(argv[1]);
+    std::string out_path = argv[2];
+
+    std::vector<Colorf> scales(buffers.groups().size(), PBR_COLOR_WHITE);
+    bool direct = true, indirect = true;
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--direct") indirect = false;
+        else if (arg == "--indirect") direct = false;
+        else
+        {
+            size_t equals = arg.find('=');
+            if (equals == std::string::npos) throw std::runtime_error("Expected <group>=<scale>, got " + arg);
+            scales[find_group(buffers, arg.substr(0, equals))] = parse_scale(arg.substr(equals + 1));
+        }
+    }
+
+    for (size_t i = 0; i < buffers.groups().size(); ++i)
+    {
+        const LightGroup& group = buffers.groups()[i];
+        std::printf("%2zu %-16s emission %g %g %g  scale %g %g %g\n", i, group.name.c_str(), group.emission.x,
+            group.emission.y, group.emission.z, scales[i].x, scales[i].y, scales[i].z);
+    }
+
+    Framebuffer image(buffers.rows(), buffers.cols());
+    auto start = std::chrono::steady_clock::now();
+    buffers.combine(scales, image, direct, indirect);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::printf("Recombined %dx%d pixels from %zu buffers in %.1f ms\n", buffers.cols(), buffers.rows(), buffers.components(), ms);
+
+    auto ends_with = [&](const char* extension) {
+        size_t n = std::strlen(extension);
+        return out_path.size() >= n && out_path.compare(out_path.size() - n, n, extension) == 0;
+    };
+    if (ends_with(".png")) Image(image).write(out_path);
+    else image.write(out_path);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        relight(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        std::printf("ERROR: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}